@@ -27,29 +27,66 @@
 */
 
 #include "AntiReplayWindow.hpp"
+#include "Atomic.hpp"
 using namespace cat;
 
-void cat::antireplay_init(antireplay_state *S)
+// Clear count bits of the ring starting from the given bit position, where
+// count is less than the window size
+static void antireplay_clear(u64 *bitmap, u32 word_mask, u32 first, int count)
 {
-	S->newest_iv = 0;
+	// Bit positions before wrapping around the ring
+	const u32 last = first + count - 1;
+	const u32 first_word = first >> 6, last_word = last >> 6;
+	const u64 first_mask = ~(u64)0 << (first & 63);
+	const u64 last_mask = ~(u64)0 >> (63 - (last & 63));
 
-	CAT_OBJCLR(S->bitmap);
+	if (first_word == last_word)
+	{
+		bitmap[first_word & word_mask] &= ~(first_mask & last_mask);
+	}
+	else
+	{
+		bitmap[first_word & word_mask] &= ~first_mask;
+		for (u32 word = first_word + 1; word < last_word; ++word)
+			bitmap[word & word_mask] = 0;
+		bitmap[last_word & word_mask] &= ~last_mask;
+	}
+}
+
+bool cat::antireplay_init(antireplay_state *S, u64 *newest_iv, u64 *bitmap, int bits)
+{
+	// If window size is invalid,
+	if (bits < antireplay_state::BITMAP_BITS || bits > antireplay_state::MAX_BITS ||
+		(bits & (bits - 1)) != 0)
+	{
+		return false;
+	}
+
+	S->newest_iv = newest_iv;
+	S->bitmap = bitmap;
+	S->mask = bits - 1;
+
+	*newest_iv = 0;
+	CAT_CLR(bitmap, bits / 8);
+
+	return true;
 }
 
 bool cat::antireplay_check(antireplay_state *S, u64 remote_iv)
 {
 	// Check how far in the past this IV is
-	int delta = (int)(S->newest_iv - remote_iv);
+	int delta = (int)(*S->newest_iv - remote_iv);
 
 	// If it is in the past,
 	if (delta >= 0)
 	{
 		// Check if we have kept a record for this IV
-		if (delta >= antireplay_state::BITMAP_BITS) return false;
+		if ((u32)delta > S->mask) return false;
 
 		// If it was seen, abort
-		const u64 mask = (u64)1 << (delta & 63);
-		if (S->bitmap[delta >> 6] & mask) return false;
+		const u32 pos = (u32)remote_iv & S->mask;
+		const u64 mask = (u64)1 << (pos & 63);
+		if (S->bitmap[pos >> 6] & mask) return false;
 	}
 
 	return true;
@@ -58,59 +95,128 @@ bool cat::antireplay_check(antireplay_state *S, u64 remote_iv)
 void cat::antireplay_accept(antireplay_state *S, u64 remote_iv)
 {
 	// Check how far in the past/future this IV is
-	int delta = (int)(remote_iv - S->newest_iv);
+	int delta = (int)(remote_iv - *S->newest_iv);
 	u64 *bitmap = S->bitmap;
 
 	// If it is in the future,
 	if (delta > 0)
 	{
 		// If it would shift out everything we have seen,
-		if (delta >= antireplay_state::BITMAP_BITS)
+		if ((u32)delta > S->mask)
 		{
-			// Set low bit to 1 and all other bits to 0
-			bitmap[0] = 1;
-			CAT_CLR(&bitmap[1], sizeof(S->bitmap) - sizeof(u64));
+			CAT_CLR(bitmap, (S->mask + 1) / 8);
 		}
 		else
 		{
-			const int word_shift = delta >> 6;
-			const int bit_shift = delta & 63;
-
-			// Shift replay window
-			if (bit_shift > 0)
-			{
-				u64 last = bitmap[antireplay_state::BITMAP_WORDS - 1 - word_shift];
-				for (int ii = antireplay_state::BITMAP_WORDS - 1; ii >= word_shift + 1; --ii)
-				{
-					u64 x = bitmap[ii - word_shift - 1];
-					bitmap[ii] = (last << bit_shift) | (x >> (64 - bit_shift));
-					last = x;
-				}
-				bitmap[word_shift] = last << bit_shift;
-			}
-			else
-			{
-				for (int ii = antireplay_state::BITMAP_WORDS - 1; ii >= word_shift; --ii)
-					bitmap[ii] = bitmap[ii - word_shift];
-			}
-
-			// Zero the words we skipped
-			for (int ii = 0; ii < word_shift; ++ii)
-				bitmap[ii] = 0;
-
-			// Set low bit for this IV
-			bitmap[0] |= 1;
+			// Clear the bits for the skipped IVs and this one, which still
+			// hold IVs that have just fallen out of the window
+			const u32 first = (u32)(*S->newest_iv + 1) & S->mask;
+			antireplay_clear(bitmap, S->mask >> 6, first, delta);
 		}
 
 		// Only update the IV if the MAC was valid and the new IV is in the future
-		S->newest_iv = remote_iv;
+		*S->newest_iv = remote_iv;
+	}
+	else if ((u32)-delta > S->mask)
+	{
+		// Too old to record
+		return;
 	}
-	else // Process an out-of-order packet
+
+	// Set the bit in the bitmap for this IV
+	const u32 pos = (u32)remote_iv & S->mask;
+	bitmap[pos >> 6] |= (u64)1 << (pos & 63);
+}
+
+
+//// Concurrent window
+
+// Number of IVs tracked by each word of the concurrent ring
+static const int CONCURRENT_WORD_BITS = 32;
+
+u64 cat::antireplay_newest_concurrent(antireplay_state *S)
+{
+	return atomic_load_acquire64(S->newest_iv);
+}
+
+bool cat::antireplay_check_concurrent(antireplay_state *S, u64 remote_iv)
+{
+	// If it is older than the window,
+	const u64 newest_iv = atomic_load_acquire64(S->newest_iv);
+	const int delta = (int)(newest_iv - remote_iv);
+	if (delta >= 0 && (u32)delta > S->mask / 2)
 	{
-		delta = -delta;
+		return false;
+	}
+
+	const u64 block = remote_iv / CONCURRENT_WORD_BITS;
+	const u32 word_mask = S->mask >> 6;
+	const u64 word = atomic_load_acquire64(&S->bitmap[(u32)block & word_mask]);
 
-		// Set the bit in the bitmap for this IV
-		bitmap[delta >> 6] |= (u64)1 << (delta & 63);
+	// If the word has moved on to newer IVs,
+	const int age = (int)((u32)block - (u32)(word >> 32));
+	if (age < 0)
+	{
+		return false;
 	}
+
+	// If it was seen, abort
+	const u64 bit = (u64)1 << (remote_iv % CONCURRENT_WORD_BITS);
+	return age > 0 || !(word & bit);
 }
 
+bool cat::antireplay_accept_concurrent(antireplay_state *S, u64 remote_iv)
+{
+	// If it is older than the window,
+	u64 newest_iv = atomic_load_acquire64(S->newest_iv);
+	const int delta = (int)(newest_iv - remote_iv);
+	if (delta >= 0 && (u32)delta > S->mask / 2)
+	{
+		return false;
+	}
+
+	const u64 block = remote_iv / CONCURRENT_WORD_BITS;
+	const u32 word_mask = S->mask >> 6;
+	volatile u64 *word = &S->bitmap[(u32)block & word_mask];
+	const u64 bit = (u64)1 << (remote_iv % CONCURRENT_WORD_BITS);
+
+	// Set the bit, or take over the word if it still holds older IVs
+	for (;;)
+	{
+		const u64 old_word = atomic_load_acquire64(word);
+		const int age = (int)((u32)block - (u32)(old_word >> 32));
+		u64 new_word;
+
+		if (age > 0)
+		{
+			new_word = ((u64)(u32)block << 32) | bit;
+		}
+		else if (age < 0 || (old_word & bit))
+		{
+			// Too old to record, or accepted already
+			return false;
+		}
+		else
+		{
+			new_word = old_word | bit;
+		}
+
+		if (atomic_cas64(word, old_word, new_word))
+		{
+			break;
+		}
+	}
+
+	// Advance the newest IV if this one is newer
+	while ((s64)(remote_iv - newest_iv) > 0)
+	{
+		if (atomic_cas64(S->newest_iv, newest_iv, remote_iv))
+		{
+			break;
+		}
+
+		newest_iv = atomic_load_acquire64(S->newest_iv);
+	}
+
+	return true;
+}
@@ -34,24 +34,57 @@
 namespace cat {
 
 
+/*
+ * The window does not own its memory: it points at the newest IV and the
+ * bitmap wherever the owner keeps them, so the owner can place the IV next
+ * to the key that is read for every message, and the bitmap on its own lines
+ */
 typedef struct _antireplay_state {
-	static const int BITMAP_BITS = 1024; // Good for file transfer rates
+	static const int BITMAP_BITS = 1024; // Default window, good for file transfer rates
 	static const int BITMAP_WORDS = BITMAP_BITS / 64;
+	static const int MAX_BITS = 65536; // Largest window
 
 	// Newest IV
-	u64 newest_iv;
+	u64 *newest_iv;
+
+	// Anti-replay sliding window, as a ring indexed by IV modulo the window size
+	// Advancing the window only clears the bits that are being reused, so
+	// checking and accepting an IV take constant time
+	u64 *bitmap;
 
-	// Anti-replay sliding window
-	u64 bitmap[BITMAP_WORDS];
+	// Number of IVs in the window minus one, where the window is a power of two
+	u32 mask;
 } antireplay_state;
 
 
-void antireplay_init(antireplay_state *S);
+// Sets up the window over bits / 64 words of bitmap and clears it
+// Returns false if the window size is not a power of two between BITMAP_BITS
+// and MAX_BITS
+bool antireplay_init(antireplay_state *S, u64 *newest_iv, u64 *bitmap,
+					 int bits = antireplay_state::BITMAP_BITS);
 
 bool antireplay_check(antireplay_state *S, u64 remote_iv);
 
 void antireplay_accept(antireplay_state *S, u64 remote_iv);
 
+/*
+ * Thread-safe versions for calico_decrypt_concurrent()
+ *
+ * Each 64-bit word of the ring holds 32 bits of the bitmap along with the
+ * upper bits of the IVs it covers, so a word that is reused for newer IVs
+ * is replaced by a single compare-and-swap instead of being cleared, and no
+ * accepted bit can be lost to a concurrent clear.  This tracks half as many
+ * IVs with the same memory.  These must not be mixed with the functions
+ * above on the same window.
+ */
+
+u64 antireplay_newest_concurrent(antireplay_state *S);
+
+bool antireplay_check_concurrent(antireplay_state *S, u64 remote_iv);
+
+// Returns false if the IV was accepted already, possibly by another thread
+bool antireplay_accept_concurrent(antireplay_state *S, u64 remote_iv);
+
 
 } // namespace cat
 
@@ -0,0 +1,214 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_ATOMIC_HPP
+#define CAT_ATOMIC_HPP
+
+#include "Platform.hpp"
+
+#if defined(CAT_COMPILER_MSVC) && !defined(CAT_ATOMIC_LOCKED)
+# include <intrin.h>
+#endif
+
+/*
+ * Minimal atomic operations
+ *
+ * Only what Calico needs to share one state object between threads, since
+ * it is still built with compilers that predate C++11 atomics.
+ *
+ * Compilers other than GCC-compatible ones and MSVC use one process-wide
+ * lock around every operation instead.  That is slow but correct anywhere
+ * Thread.cpp builds.  Define CAT_ATOMIC_LOCKED to select it for any compiler.
+ */
+
+#if !defined(CAT_COMPILER_MSVC) && !defined(CAT_COMPILER_GCC)
+# define CAT_ATOMIC_LOCKED
+#endif
+
+namespace cat {
+
+
+#if defined(CAT_ATOMIC_LOCKED)
+
+// Take and release the lock that guards every atomic operation, defined in
+// Thread.cpp with the other platform locks
+void atomic_lock();
+void atomic_unlock();
+
+#elif defined(CAT_COMPILER_MSVC)
+
+// Barrier that orders all earlier memory accesses before all later ones.
+// ARM targets build with /volatile:iso by default, so their volatile
+// accesses are not ordered and need this as well
+static CAT_INLINE void msvc_barrier()
+{
+# if defined(_M_ARM64)
+	__dmb(_ARM64_BARRIER_ISH);
+# elif defined(_M_ARM)
+	__dmb(_ARM_BARRIER_ISH);
+# else
+	_mm_mfence();
+# endif
+}
+
+#endif
+
+// Read a word written by another thread, ordered before later reads
+static CAT_INLINE u32 atomic_load_acquire(const volatile u32 *p)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	const u32 x = *p;
+	atomic_unlock();
+	return x;
+#elif defined(CAT_COMPILER_MSVC)
+# if defined(_M_ARM64) || defined(_M_ARM)
+	const u32 x = *p;
+	msvc_barrier();
+	return x;
+# else
+	// Volatile reads have acquire semantics with MSVC on x86
+	return *p;
+# endif
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Publish a word to other threads, ordered after earlier writes
+static CAT_INLINE void atomic_store_release(volatile u32 *p, u32 x)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	*p = x;
+	atomic_unlock();
+#elif defined(CAT_COMPILER_MSVC)
+# if defined(_M_ARM64) || defined(_M_ARM)
+	msvc_barrier();
+# endif
+	// Volatile writes have release semantics with MSVC on x86
+	*p = x;
+#else
+	__atomic_store_n(p, x, __ATOMIC_RELEASE);
+#endif
+}
+
+// Replace a word if it still holds the expected value
+// Returns true if the word was replaced
+static CAT_INLINE bool atomic_cas(volatile u32 *p, u32 expected, u32 x)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	const bool replaced = (*p == expected);
+	if (replaced) {
+		*p = x;
+	}
+	atomic_unlock();
+	return replaced;
+#elif defined(CAT_COMPILER_MSVC)
+	return (u32)_InterlockedCompareExchange((volatile long *)p, (long)x, (long)expected) == expected;
+#else
+	return __atomic_compare_exchange_n(p, &expected, x, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// 64-bit version of atomic_load_acquire()
+static CAT_INLINE u64 atomic_load_acquire64(const volatile u64 *p)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	const u64 x = *p;
+	atomic_unlock();
+	return x;
+#elif defined(CAT_COMPILER_MSVC)
+# if defined(_M_X64)
+	return *p;
+# elif defined(_M_ARM64)
+	const u64 x = *p;
+	msvc_barrier();
+	return x;
+# else
+	// 32-bit targets only read 64 bits at once with a locked instruction
+	return (u64)_InterlockedCompareExchange64((volatile __int64 *)p, 0, 0);
+# endif
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// 64-bit version of atomic_cas()
+static CAT_INLINE bool atomic_cas64(volatile u64 *p, u64 expected, u64 x)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	const bool replaced = (*p == expected);
+	if (replaced) {
+		*p = x;
+	}
+	atomic_unlock();
+	return replaced;
+#elif defined(CAT_COMPILER_MSVC)
+	return (u64)_InterlockedCompareExchange64((volatile __int64 *)p, (__int64)x, (__int64)expected) == expected;
+#else
+	return __atomic_compare_exchange_n(p, &expected, x, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// 64-bit atomic add, returning the previous value
+static CAT_INLINE u64 atomic_fetch_add64(volatile u64 *p, u64 x)
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	atomic_lock();
+	const u64 old = *p;
+	*p = old + x;
+	atomic_unlock();
+	return old;
+#elif defined(CAT_COMPILER_MSVC)
+	return (u64)_InterlockedExchangeAdd64((volatile __int64 *)p, (__int64)x);
+#else
+	return __atomic_fetch_add(p, x, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// Keep memory accesses from moving across this point in either direction
+static CAT_INLINE void atomic_fence()
+{
+#if defined(CAT_ATOMIC_LOCKED)
+	// Taking the lock orders memory the same way for every thread that takes it
+	atomic_lock();
+	atomic_unlock();
+#elif defined(CAT_COMPILER_MSVC)
+	msvc_barrier();
+#else
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+} // namespace cat
+
+#endif // CAT_ATOMIC_HPP
@@ -0,0 +1,335 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Blake2bBlock.hpp"
+#include "EndianNeutral.hpp"
+#include "SecureErase.hpp"
+using namespace cat;
+
+#include <cstring>
+
+
+// First parameter word: 48-byte digest, no key, fanout 1, depth 1
+static const u64 BLAKE2B_48_PARAM0 = 0x01010000 | BLAKE2B_48_BYTES;
+
+/*
+ * Working state at the start of the only compression
+ *
+ * The first half is the chaining value: the IV mixed with the parameter
+ * block.  The second half is the IV mixed with the byte count of 48 and
+ * the last block flag.  The chaining value is also needed at the end, when
+ * it is folded into the output.
+ */
+static CAT_ALIGNED(32) const u64 BLAKE2B_48_STATE[16] = {
+	0x6a09e667f3bcc908ULL ^ BLAKE2B_48_PARAM0, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL ^ BLAKE2B_48_BYTES, 0x9b05688c2b3e6c1fULL,
+	~0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+/*
+ * Message word order for each round.  Rounds 10 and 11 repeat 0 and 1.
+ *
+ * The rounds are unrolled with the word indices as constants, so that the
+ * compiler can drop the ten words of zero padding from the message
+ * schedule.
+ */
+#define CAT_BLAKE2B_ROUNDS(R) \
+	R( 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15) \
+	R(14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3) \
+	R(11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4) \
+	R( 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8) \
+	R( 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13) \
+	R( 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9) \
+	R(12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11) \
+	R(13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10) \
+	R( 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5) \
+	R(10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0) \
+	R( 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15) \
+	R(14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3)
+
+// Load the input as the first six message words.  The rest of the block is
+// zero padding
+static CAT_INLINE void blake2b_48_load(const u8 *in, u64 m[16])
+{
+	for (int ii = 0; ii < 6; ++ii) {
+		u64 word;
+		memcpy(&word, in + ii * 8, 8);
+		m[ii] = getLE(word);
+	}
+
+	for (int ii = 6; ii < 16; ++ii) {
+		m[ii] = 0;
+	}
+}
+
+
+//// Portable: one 64-bit word per variable
+
+#define CAT_BLAKE2B_G(a, b, c, d, x, y) \
+	a = a + b + x; d = CAT_ROR64(d ^ a, 32); \
+	c = c + d; b = CAT_ROR64(b ^ c, 24); \
+	a = a + b + y; d = CAT_ROR64(d ^ a, 16); \
+	c = c + d; b = CAT_ROR64(b ^ c, 63);
+
+#define CAT_BLAKE2B_ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, s15) \
+	CAT_BLAKE2B_G(v[0], v[4], v[8], v[12], m[s0], m[s1]) \
+	CAT_BLAKE2B_G(v[1], v[5], v[9], v[13], m[s2], m[s3]) \
+	CAT_BLAKE2B_G(v[2], v[6], v[10], v[14], m[s4], m[s5]) \
+	CAT_BLAKE2B_G(v[3], v[7], v[11], v[15], m[s6], m[s7]) \
+	CAT_BLAKE2B_G(v[0], v[5], v[10], v[15], m[s8], m[s9]) \
+	CAT_BLAKE2B_G(v[1], v[6], v[11], v[12], m[s10], m[s11]) \
+	CAT_BLAKE2B_G(v[2], v[7], v[8], v[13], m[s12], m[s13]) \
+	CAT_BLAKE2B_G(v[3], v[4], v[9], v[14], m[s14], m[s15])
+
+static void blake2b_48_portable(const u8 *in, u8 *out)
+{
+	u64 m[16], v[16];
+
+	blake2b_48_load(in, m);
+	memcpy(v, BLAKE2B_48_STATE, sizeof(v));
+
+	CAT_BLAKE2B_ROUNDS(CAT_BLAKE2B_ROUND)
+
+	for (int ii = 0; ii < 6; ++ii) {
+		const u64 word = getLE(BLAKE2B_48_STATE[ii] ^ v[ii] ^ v[ii + 8]);
+		memcpy(out + ii * 8, &word, 8);
+	}
+
+	CAT_SECURE_OBJCLR(m);
+	CAT_SECURE_OBJCLR(v);
+}
+
+#undef CAT_BLAKE2B_ROUND
+#undef CAT_BLAKE2B_G
+
+
+#ifdef CAT_HAS_X86_DISPATCH
+
+/*
+ * The SIMD kernels keep each row of the 4x4 working state in one 256-bit
+ * register, or in two 128-bit registers, so the four column steps of a
+ * round run at once.  The rows are then rotated so that the diagonals line
+ * up as columns for the second half of the round, and rotated back.
+ *
+ * A ratchet hashes a single block, so the time taken is the length of the
+ * dependency chain rather than the instruction count.  Row b is updated
+ * last in each step, so rows a, c and d are rotated around it instead: the
+ * diagonal for lane j is then (a[j-1], b[j], c[j+1], d[j+2]), and the
+ * rotations overlap the update of b instead of following it.
+ */
+
+#define CAT_BLAKE2B_G1(vadd, vxor, ror32, ror24, a, b, c, d, mx) \
+	a = vadd(vadd(a, mx), b); d = ror32(vxor(d, a)); \
+	c = vadd(c, d); b = ror24(vxor(b, c));
+
+#define CAT_BLAKE2B_G2(vadd, vxor, ror16, ror63, a, b, c, d, my) \
+	a = vadd(vadd(a, my), b); d = ror16(vxor(d, a)); \
+	c = vadd(c, d); b = ror63(vxor(b, c));
+
+
+//// SSE4.1: Each row in two registers
+
+#define CAT_SSE_ROR32(x) _mm_shuffle_epi32(x, _MM_SHUFFLE(2,3,0,1))
+#define CAT_SSE_ROR24(x) _mm_shuffle_epi8(x, ror24)
+#define CAT_SSE_ROR16(x) _mm_shuffle_epi8(x, ror16)
+#define CAT_SSE_ROR63(x) _mm_or_si128(_mm_srli_epi64(x, 63), _mm_add_epi64(x, x))
+
+#define CAT_SSE_G1(a, b, c, d, mx) \
+	CAT_BLAKE2B_G1(_mm_add_epi64, _mm_xor_si128, CAT_SSE_ROR32, CAT_SSE_ROR24, a, b, c, d, mx)
+#define CAT_SSE_G2(a, b, c, d, my) \
+	CAT_BLAKE2B_G2(_mm_add_epi64, _mm_xor_si128, CAT_SSE_ROR16, CAT_SSE_ROR63, a, b, c, d, my)
+
+// Message words for lanes 0 and 1
+#define CAT_SSE_M(i, j) _mm_set_epi64x(m[j], m[i])
+
+#define CAT_SSE_ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, s15) { \
+	/* Columns */ \
+	CAT_SSE_G1(al, bl, cl, dl, CAT_SSE_M(s0, s2)) \
+	CAT_SSE_G1(ah, bh, ch, dh, CAT_SSE_M(s4, s6)) \
+	CAT_SSE_G2(al, bl, cl, dl, CAT_SSE_M(s1, s3)) \
+	CAT_SSE_G2(ah, bh, ch, dh, CAT_SSE_M(s5, s7)) \
+	/* Rotate row a right by one word, c left by one, d by two */ \
+	t0 = _mm_alignr_epi8(al, ah, 8); \
+	t1 = _mm_alignr_epi8(ah, al, 8); \
+	al = t0; ah = t1; \
+	t0 = _mm_alignr_epi8(ch, cl, 8); \
+	t1 = _mm_alignr_epi8(cl, ch, 8); \
+	cl = t0; ch = t1; \
+	t0 = dl; dl = dh; dh = t0; \
+	/* Diagonals */ \
+	CAT_SSE_G1(al, bl, cl, dl, CAT_SSE_M(s14, s8)) \
+	CAT_SSE_G1(ah, bh, ch, dh, CAT_SSE_M(s10, s12)) \
+	CAT_SSE_G2(al, bl, cl, dl, CAT_SSE_M(s15, s9)) \
+	CAT_SSE_G2(ah, bh, ch, dh, CAT_SSE_M(s11, s13)) \
+	/* Rotate the rows back */ \
+	t0 = _mm_alignr_epi8(ah, al, 8); \
+	t1 = _mm_alignr_epi8(al, ah, 8); \
+	al = t0; ah = t1; \
+	t0 = _mm_alignr_epi8(cl, ch, 8); \
+	t1 = _mm_alignr_epi8(ch, cl, 8); \
+	cl = t0; ch = t1; \
+	t0 = dl; dl = dh; dh = t0; }
+
+CAT_TARGET("sse4.1")
+static void blake2b_48_sse41(const u8 *in, u8 *out)
+{
+	const __m128i ror24 = _mm_setr_epi8(3,4,5,6,7,0,1,2, 11,12,13,14,15,8,9,10);
+	const __m128i ror16 = _mm_setr_epi8(2,3,4,5,6,7,0,1, 10,11,12,13,14,15,8,9);
+
+	CAT_ALIGNED(16) u64 m[16];
+	blake2b_48_load(in, m);
+
+	const __m128i *init = (const __m128i *)BLAKE2B_48_STATE;
+	__m128i al = _mm_load_si128(init), ah = _mm_load_si128(init + 1);
+	__m128i bl = _mm_load_si128(init + 2), bh = _mm_load_si128(init + 3);
+	__m128i cl = _mm_load_si128(init + 4), ch = _mm_load_si128(init + 5);
+	__m128i dl = _mm_load_si128(init + 6), dh = _mm_load_si128(init + 7);
+
+	__m128i t0, t1;
+
+	CAT_BLAKE2B_ROUNDS(CAT_SSE_ROUND)
+
+	// Output the first six words of the new chaining value
+	_mm_storeu_si128((__m128i *)out, _mm_xor_si128(_mm_load_si128(init), _mm_xor_si128(al, cl)));
+	_mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(_mm_load_si128(init + 1), _mm_xor_si128(ah, ch)));
+	_mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(_mm_load_si128(init + 2), _mm_xor_si128(bl, dl)));
+
+	CAT_SECURE_OBJCLR(m);
+}
+
+#undef CAT_SSE_ROUND
+#undef CAT_SSE_M
+#undef CAT_SSE_G2
+#undef CAT_SSE_G1
+#undef CAT_SSE_ROR63
+#undef CAT_SSE_ROR16
+#undef CAT_SSE_ROR24
+#undef CAT_SSE_ROR32
+
+
+//// AVX2: Each row in one register
+
+#define CAT_AVX2_ROR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2,3,0,1))
+#define CAT_AVX2_ROR24(x) _mm256_shuffle_epi8(x, ror24)
+#define CAT_AVX2_ROR16(x) _mm256_shuffle_epi8(x, ror16)
+#define CAT_AVX2_ROR63(x) _mm256_or_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+
+#define CAT_AVX2_G1(a, b, c, d, mx) \
+	CAT_BLAKE2B_G1(_mm256_add_epi64, _mm256_xor_si256, CAT_AVX2_ROR32, CAT_AVX2_ROR24, a, b, c, d, mx)
+#define CAT_AVX2_G2(a, b, c, d, my) \
+	CAT_BLAKE2B_G2(_mm256_add_epi64, _mm256_xor_si256, CAT_AVX2_ROR16, CAT_AVX2_ROR63, a, b, c, d, my)
+
+// Message words for lanes 0 to 3
+#define CAT_AVX2_M(i, j, k, l) _mm256_set_epi64x(m[l], m[k], m[j], m[i])
+
+#define CAT_AVX2_ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, s15) { \
+	/* Columns */ \
+	CAT_AVX2_G1(a, b, c, d, CAT_AVX2_M(s0, s2, s4, s6)) \
+	CAT_AVX2_G2(a, b, c, d, CAT_AVX2_M(s1, s3, s5, s7)) \
+	/* Rotate row a right by one word, c left by one, d by two */ \
+	a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(2,1,0,3)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(0,3,2,1)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1,0,3,2)); \
+	/* Diagonals */ \
+	CAT_AVX2_G1(a, b, c, d, CAT_AVX2_M(s14, s8, s10, s12)) \
+	CAT_AVX2_G2(a, b, c, d, CAT_AVX2_M(s15, s9, s11, s13)) \
+	/* Rotate the rows back */ \
+	a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(0,3,2,1)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(2,1,0,3)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(1,0,3,2)); }
+
+CAT_TARGET("avx2")
+static void blake2b_48_avx2(const u8 *in, u8 *out)
+{
+	const __m256i ror24 = _mm256_setr_epi8(
+		3,4,5,6,7,0,1,2, 11,12,13,14,15,8,9,10,
+		3,4,5,6,7,0,1,2, 11,12,13,14,15,8,9,10);
+	const __m256i ror16 = _mm256_setr_epi8(
+		2,3,4,5,6,7,0,1, 10,11,12,13,14,15,8,9,
+		2,3,4,5,6,7,0,1, 10,11,12,13,14,15,8,9);
+
+	CAT_ALIGNED(32) u64 m[16];
+	blake2b_48_load(in, m);
+
+	const __m256i *init = (const __m256i *)BLAKE2B_48_STATE;
+	__m256i a = _mm256_load_si256(init);
+	__m256i b = _mm256_load_si256(init + 1);
+	__m256i c = _mm256_load_si256(init + 2);
+	__m256i d = _mm256_load_si256(init + 3);
+
+	CAT_BLAKE2B_ROUNDS(CAT_AVX2_ROUND)
+
+	// Output the first six words of the new chaining value
+	const __m256i lo = _mm256_xor_si256(_mm256_load_si256(init), _mm256_xor_si256(a, c));
+	const __m256i hi = _mm256_xor_si256(_mm256_load_si256(init + 1), _mm256_xor_si256(b, d));
+	_mm256_storeu_si256((__m256i *)out, lo);
+	_mm_storeu_si128((__m128i *)(out + 32), _mm256_castsi256_si128(hi));
+
+	CAT_SECURE_OBJCLR(m);
+}
+
+#undef CAT_AVX2_ROUND
+#undef CAT_AVX2_M
+#undef CAT_AVX2_G2
+#undef CAT_AVX2_G1
+#undef CAT_AVX2_ROR63
+#undef CAT_AVX2_ROR16
+#undef CAT_AVX2_ROR24
+#undef CAT_AVX2_ROR32
+#undef CAT_BLAKE2B_G2
+#undef CAT_BLAKE2B_G1
+
+#endif // CAT_HAS_X86_DISPATCH
+
+#undef CAT_BLAKE2B_ROUNDS
+
+
+namespace cat {
+
+const cpu_kernel<blake2b_48_fn> blake2b_48_kernels[] = {
+#ifdef CAT_HAS_X86_DISPATCH
+	{ "avx2", CPU_AVX2, blake2b_48_avx2 },
+	{ "sse41", CPU_SSE41, blake2b_48_sse41 },
+#endif
+	{ "portable", 0, blake2b_48_portable }
+};
+
+cpu_kernel<blake2b_48_fn> blake2b_48_kernel = { "portable", 0, blake2b_48_portable };
+
+void blake2b_48_select(u32 features)
+{
+	blake2b_48_kernel = cpu_select(blake2b_48_kernels, features);
+}
+
+} // namespace cat
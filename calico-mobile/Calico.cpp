@@ -31,21 +31,23 @@
 #include "calico.h"
 
 #include "AntiReplayWindow.hpp"
+#include "Atomic.hpp"
+#include "Blake2bBlock.hpp"
+#include "ChaChaBlocks.hpp"
+#include "ChaChaLanes.hpp"
+#include "SipHashLanes.hpp"
+#include "SipHashState.hpp"
 #include "EndianNeutral.hpp"
 #include "SecureErase.hpp"
 #include "BitMath.hpp"
-#include "Clock.hpp"
+#include "RatchetClock.hpp"
 #include "SipHash.hpp"
+#include "Thread.hpp"
 using namespace cat;
 
 #include <climits>
 
 #include "chacha.h"
-#include "blake2.h"
-
-#ifndef CAT_CHACHA_IMPL
-#define chacha_blocks_impl chacha_blocks_ref
-#endif
 
 // Debug output
 #ifdef CAT_VERBOSE_CALICO
@@ -56,9 +58,6 @@ using namespace std;
 #define CAT_LOG(x)
 #endif
 
-// Using the internal chacha_blocks() function to speed up invalid message rejection
-extern "C" void chacha_blocks_impl(chacha_state_t *state, const uint8_t *in, uint8_t *out, size_t bytes);
-
 // Additional data constants (includes IV and R-bit)
 static const int AD_BYTES = 3;
 static const int AD_BITS = AD_BYTES * 8;
@@ -69,36 +68,101 @@ static const u32 AD_FUZZ = 0xC86AD7;
 // IV constants
 static const int IV_BITS = 23;
 
+// Flipped in the MAC IV word when a message has associated data, so that a
+// tag made over associated data and ciphertext can never verify the same
+// bytes as a plain ciphertext.  IVs never get near the top bit
+static const u64 AD_DOMAIN = 0x8000000000000000ULL;
+
+// Number of bytes encrypted and authenticated together in one cache-resident
+// tile.  Must be a multiple of the ChaCha block size
+static const int AUTH_TILE_BYTES = 4096;
+
 // Number of bytes in the keys for one transmitter
 // Includes 32 bytes for the encryption key
 // and 16 bytes for the MAC key
 static const int KEY_BYTES = 32 + 16;
 
-// One-way key information
-struct HalfDuplexKey {
-	// This is either 0 or 1 to indicate which of the two incoming
-	// keys is "active"; the other key is "inactive" and will be
-	// set to H(K_active)
-	u32 active;
+// Keys for one direction.  The cipher input and MAC state for each message
+// are set up straight from the key, which costs about the same as copying
+// prepared ones and keeps each key slot to 48 bytes
+struct KeySlot {
+	// Encryption key followed by MAC key
+	char key[KEY_BYTES];
+};
+
+// Size of a cache line, as a literal for CAT_ALIGNED()
+#define CAT_CACHE_LINE_BYTES 64
 
-	// This is the millisecond timestamp when incoming ratcheting started.
-	// Otherwise it is set to 0 when ratcheting is not in progress
-	// NOTE: This is unused by responder encryption
-	u32 ratchet_time;
+// Low bits of the flag words that hold the key state.  The other bits tell
+// whether or not the Calico state object is keyed, and for which mode
+static const u32 FLAG_BITS = 255;
 
-	// Next IV
-	// NOTE: This is unused for datagram decryption
+// Bits of TransmitHalf::flag
+static const u32 OUT_ACTIVE = 1;		// Outgoing key bit
+static const u32 REMOTE_ACTIVE = 2;		// Incoming key in use after the old one was erased
+static const u32 REMOTE_NEWEST = 4;		// Incoming key most recently switched to
+static const u32 OUT_INITIATOR = 8;		// Role is CALICO_INITIATOR
+
+// Transmit half of a key: Only accessed by encryption, except that the
+// receive half tells it about remote key changes through the REMOTE_* bits
+struct TransmitHalf {
+	// Mode the object is keyed for, with the outgoing key bit, role and
+	// remote key state in the low bits, see OUT_ACTIVE
+	volatile u32 flag;
+
+	// Millisecond timestamp of the last outgoing ratchet
+	// NOTE: This is unused by the responder
+	volatile u32 ratchet_time;
+
+	// Next outgoing IV
 	u64 iv;
-};
 
-struct Key {
 	// Encryption and MAC key for outgoing data
-	char out_key[KEY_BYTES];
+	KeySlot key;
+};
+
+// Bits of ReceiveHalf::flag
+static const u32 IN_ACTIVE = 1;			// Incoming key bit, or the old one while ratcheting
+static const u32 IN_HOT = 2;			// Datagram key bit kept in ReceiveHalf::key
+static const u32 IN_RATCHETING = 4;		// The old key is replaced when the timer runs out
+static const u32 IN_BUSY = 8;			// One thread is changing the key state concurrently
+static const u32 IN_EXTERNAL = 16;		// The anti-replay bitmap is provided by the application
+
+// Receive half of a key: Only accessed by decryption
+struct ReceiveHalf {
+	// Mode the object is keyed for, so decryption does not read the other
+	// line, with the incoming key bits in the low bits, see IN_ACTIVE
+	volatile u32 flag;
 
-	// Current and next encryption keys for incoming data
-	char in_key[2][KEY_BYTES];
+	// Millisecond timestamp when the remote host last switched keys
+	// NOTE: Datagram keys only use this while IN_RATCHETING is set
+	volatile u32 ratchet_time;
 
-	HalfDuplexKey in, out;
+	// Next IV for streams, or the newest accepted IV for datagrams
+	u64 iv;
+
+	// The only incoming key for streams, or the incoming datagram key for
+	// the IN_HOT bit
+	KeySlot key;
+};
+
+/*
+ * Each key takes two cache lines.  The transmit half fills the first line,
+ * so that encrypting a message reads and writes only that line, including
+ * the flag and role.  The receive half fills the second line, so that one
+ * thread may encrypt while another decrypts without sharing any cache lines
+ * that are written per message.
+ *
+ * Streams arrive in order, so a stream key only keeps one incoming key and
+ * replaces it as soon as a message authenticates under the next one.
+ * Datagrams keep two incoming keys, and the one that is not in the receive
+ * half lives in a cold line at the end of the state object.  Sequential
+ * decryption swaps the newest key into the receive half when the remote host
+ * switches keys, so the cold line is only touched while ratcheting.
+ */
+struct Key {
+	CAT_ALIGNED(CAT_CACHE_LINE_BYTES) TransmitHalf tx;
+	CAT_ALIGNED(CAT_CACHE_LINE_BYTES) ReceiveHalf rx;
 };
 
 #ifndef RATCHET_REMOTE_TIMEOUT
@@ -112,58 +176,156 @@ static const u32 RATCHET_REMOTE_TIMEOUT = 60 * 1000; // 1 minute in milliseconds
 static const u32 RATCHET_PERIOD = 2 * RATCHET_REMOTE_TIMEOUT; // 2 minutes in milliseconds
 #endif
 
-// Constants to indicate the Calico state object is keyed
-static const u32 FLAG_KEYED_STREAM = 0x6501ccef;
-static const u32 FLAG_KEYED_DATAGRAM = 0x6501ccfe;
+// Constants to indicate the Calico state object is keyed, with FLAG_BITS clear
+static const u32 FLAG_KEYED_STREAM = 0x6501ce00;
+static const u32 FLAG_KEYED_DATAGRAM = 0x6501cf00;
+
+// Helper function to read the mode from a flag word
+static CAT_INLINE u32 keyed_mode(u32 flag)
+{
+	return flag & ~FLAG_BITS;
+}
 
+// The opaque state objects are cache line aligned, so the internal state
+// starts at the first byte of them
 struct InternalState {
-	// Flag indicating whether or not the Calico state object is keyed or not
-	u32 flag;
+	// Encryption and MAC keys for datagram mode, or for stream mode if the
+	// object is only keyed for streams.  The flags tell which
+	Key primary;
 
-	// Role of the connection, either CALICO_INITIATOR, CALICO_RESPONDER
-	u32 role;
+	// --- Extended version for datagrams: ---
 
 	// Encryption and MAC keys for stream mode
 	Key stream;
 
-	// --- Extended version for datagrams: ---
+	// Anti-replay bitmap for incoming datagram IVs.  If IN_EXTERNAL is set,
+	// the first word points to the bitmap provided by the application and
+	// the second word holds its window mask
+	CAT_ALIGNED(CAT_CACHE_LINE_BYTES) u64 window[antireplay_state::BITMAP_WORDS];
 
-	// Encryption and MAC keys for datagram mode
-	Key dgram;
+	//// Cold line: Only written while ratcheting
 
-	// Anti-replay window for incoming datagram IVs
-	antireplay_state window;
+	// Incoming datagram key for the bit that is not IN_HOT
+	CAT_ALIGNED(CAT_CACHE_LINE_BYTES) KeySlot cold_key;
+
+	// Outgoing datagram key version for calico_sender objects, which copy the
+	// key while it is even and check it did not change during the copy.
+	// It is odd while one of the senders is ratcheting the key
+	volatile u32 out_epoch;
 };
 
-// Flag to indicate that the library has been initialized with calico_init()
-static bool m_initialized = false;
+// Helper function to find the internal state of an opaque state object
+static CAT_INLINE InternalState *get_state(void *S)
+{
+	// Objects that are not cache line aligned are rejected as invalid input
+	if ((size_t)S & (CAT_CACHE_LINE_BYTES - 1)) {
+		return 0;
+	}
+	return reinterpret_cast<InternalState *>( S );
+}
 
-static Clock m_clock;
+// Number of IVs reserved by a calico_sender at a time
+static const u64 SENDER_IV_BLOCK = 256;
 
+// Distance the shared IV counter may move past a sender's next IV before the
+// rest of its block is abandoned, so that a sender that has been idle does
+// not send IVs that have fallen out of the remote anti-replay window
+static const u64 SENDER_MAX_LAG = 16 * SENDER_IV_BLOCK;
 
-// Helper function to ratchet a key
-static int ratchet_key(const char key[KEY_BYTES], char next_key[KEY_BYTES]) {
-	blake2b_state B;
+// Constant to indicate the calico_sender object is initialized
+static const u32 FLAG_SENDER = 0x6501cd5e;
 
-	// Initialize BLAKE2 for 48 bytes of output (it supports up to 64)
-	if (blake2b_init(&B, KEY_BYTES)) {
-		return -1;
-	}
+// Per-thread encryption state for a shared Calico state object
+struct SenderState {
+	// Flag indicating whether or not the sender is initialized
+	u32 flag;
 
-	// Mix in the previous key
-	if (blake2b_update(&B, (const u8 *)key, KEY_BYTES)) {
-		return -1;
+	// InternalState::out_epoch when the key below was copied
+	u32 epoch;
+
+	// Active key bit for the copied key
+	u32 active;
+
+	// Shared state
+	InternalState *state;
+
+	// Range of reserved IVs
+	u64 next_iv, end_iv;
+
+	// Copy of the outgoing datagram key
+	KeySlot out_key;
+};
+
+// Helper function to find the internal state of an opaque sender object
+static CAT_INLINE SenderState *get_sender(void *S)
+{
+	// Objects that are not cache line aligned are rejected as invalid input
+	if ((size_t)S & (CAT_CACHE_LINE_BYTES - 1)) {
+		return 0;
 	}
+	return reinterpret_cast<SenderState *>( S );
+}
 
-	// Generate the new key
-	if (blake2b_final(&B, (u8 *)next_key, KEY_BYTES)) {
-		return -1;
+// Cipher and MAC partway through a message that is provided in pieces
+struct MessageCursor {
+	chacha_input cipher;
+	siphash_stream mac;
+
+	// Keystream left over from a piece that ended partway through a block
+	u8 keystream[64];
+	int keystream_left;
+};
+
+// Constants to indicate the calico_stream object is initialized
+static const u32 FLAG_STREAM_ENCRYPT = 0x6501cd3e;
+static const u32 FLAG_STREAM_DECRYPT = 0x6501cd3d;
+
+// State for encrypting or decrypting one stream message in pieces
+struct StreamState {
+	// Flag indicating the direction, or 0 if not initialized
+	u32 flag;
+
+	// Key bit for the message
+	u32 ratchet_bit;
+
+	// Shared state
+	InternalState *state;
+
+	// IV of the message
+	u64 iv;
+
+	// Cipher and MAC, copied so that a ratchet before the message is
+	// finished does not affect it
+	MessageCursor cursor;
+};
+
+// Helper function to find the internal state of an opaque stream object
+static CAT_INLINE StreamState *get_stream(void *S)
+{
+	// Objects that are not cache line aligned are rejected as invalid input
+	if ((size_t)S & (CAT_CACHE_LINE_BYTES - 1)) {
+		return 0;
 	}
+	return reinterpret_cast<StreamState *>( S );
+}
 
-	// Erase temporary workspace
-	CAT_SECURE_OBJCLR(B);
+// Flag to indicate that the library has been initialized with calico_init()
+static bool m_initialized = false;
 
-	return 0;
+// Millisecond clock for the ratchet timers
+static RatchetClock m_clock;
+
+
+// Helper function to set up the cipher for a message
+static CAT_INLINE void cipher_begin(chacha_input *S, const KeySlot *key, u64 iv)
+{
+	chacha_input_init(S, key->key, 14, iv);
+}
+
+// Helper function to ratchet a key: K' = BLAKE2b(K), with 48 bytes of
+// output.  The key fits in one BLAKE2b block, so this is one compression
+static void ratchet_key(const KeySlot *slot, KeySlot *next_slot) {
+	blake2b_48(slot->key, next_slot->key);
 }
 
 // Helper function to expand key using ChaCha20
@@ -180,334 +342,454 @@ static bool key_expand(const char key[32], void *buffer, int bytes)
 	return true;
 }
 
-// Helper function to do the basic authenticated encryption
-static u64 auth_encrypt(const char key[48], u64 iv_raw, const void *from,
-						void *to, int bytes)
+// Helper function to set up the MAC for a message, absorbing any associated
+// data ahead of the ciphertext.  Associated data is authenticated as
+// le64(ad_bytes) || ad || zero padding to a whole word, read straight from
+// the caller's buffer.  Without associated data the MAC is unchanged
+static void mac_begin(siphash_state *H, const KeySlot *key, u64 iv_word,
+					  const void *ad, int ad_bytes)
 {
-	const u64 iv = getLE(iv_raw);
-
-	// Setup the cipher with the key and IV
-	chacha_state S;
-	chacha_init(&S, (const chacha_key *)key, (const chacha_iv *)&iv, 14);
-
-	// Encrypt data
-	chacha_blocks_impl(&S, (const u8 *)from, (u8 *)to, bytes);
-
-	// Generate MAC tag
-	return siphash24(key + 32, to, bytes, iv);
-}
-
-// Helper function to conditionally perform key ratchet on receiver side
-static void handle_ratchet(Key *key) {
-	// If ratchet time exceeded,
-	if ((u32)(m_clock.msec() - key->in.ratchet_time) > RATCHET_REMOTE_TIMEOUT) {
-		CAT_LOG(cout << "--Ratcheting key!" << endl);
-
-		// Get active and inactive key
-		const u32 active_key = key->in.active;
-		const u32 inactive_key = active_key ^ 1;
-
-		/*
-		* Before:
-		*
-		*	K[active] = oldest key
-		*	K[inactive] = H(oldest key)
-		*/
+	if (ad_bytes <= 0) {
+		siphash24_begin(H, key->key + 32, iv_word);
+		return;
+	}
 
-		// Update the inactive key: K' = H(K)
-		ratchet_key(key->in_key[inactive_key], key->in_key[active_key]);
+	siphash24_begin(H, key->key + 32, iv_word ^ AD_DOMAIN);
 
-		/*
-		* After:
-		*
-		*	K[inactive] = H(H(oldest key))
-		*	K[active] = H(oldest key)
-		*
-		* The oldest key is now erased.
-		*/
+	const u64 length = getLE((u64)ad_bytes);
+	siphash24_words(H, &length, 1);
 
-		// Switch which key is active
-		key->in.active = inactive_key;
+	siphash24_words(H, ad, ad_bytes >> 3);
 
-		// Ratchet complete
-		key->in.ratchet_time = 0;
+	// Pad the last partial word with zeroes
+	const int tail = ad_bytes & 7;
+	if (tail > 0) {
+		u64 last = 0;
+		memcpy(&last, (const u8 *)ad + (ad_bytes & ~7), tail);
+		siphash24_words(H, &last, 1);
 	}
 }
 
-// Helper function to authenticate a message
-static bool check_auth(const char key[48], u64 iv, int shift,
-					const void *buffer, int bytes, u64 tag)
+// Helper function to encrypt and authenticate with a cipher and MAC that
+// have been set up, returning the MAC tag
+static u64 encrypt_tiles(chacha_input *S, siphash_state *H, const u8 *in,
+						 u8 *out, int bytes)
 {
-	// Generate expected MAC tag
-	const u64 expected_tag = siphash24(key + 32, buffer, bytes, iv) << shift;
-
-	// Verify MAC tag in constant-time
-	const u64 delta = (expected_tag ^ tag) >> shift;
-	const u32 z = (u32)(delta >> 32) | (u32)delta;
-	if (z) {
-		return false;
+	// Encrypt and authenticate one tile at a time while it is still in L1
+	while (bytes > AUTH_TILE_BYTES) {
+		chacha_blocks(S, in, out, AUTH_TILE_BYTES);
+		siphash24_words(H, out, AUTH_TILE_BYTES / 8);
+
+		in += AUTH_TILE_BYTES;
+		out += AUTH_TILE_BYTES;
+		bytes -= AUTH_TILE_BYTES;
 	}
 
-	return true;
+	// Encrypt the last tile
+	chacha_blocks(S, in, out, bytes);
+
+	// Generate MAC tag
+	return siphash24_end(H, out, bytes);
 }
 
-// Helper function to decrypt a message
-static void decrypt(const u64 iv_raw, const char key[48], void *buffer, int bytes)
+// Helper function to do the basic authenticated encryption
+static u64 auth_encrypt(const KeySlot *key, u64 iv_raw, const void *ad,
+						int ad_bytes, const void *from, void *to, int bytes)
 {
-	const u64 iv = getLE(iv_raw);
-
 	// Setup the cipher with the key and IV
-	chacha_state S;
-	chacha_init(&S, (const chacha_key *)key, (const chacha_iv *)&iv, 14);
+	chacha_input S;
+	cipher_begin(&S, key, iv_raw);
 
-	// Decrypt data
-	chacha_blocks_impl(&S, (const u8 *)buffer, (u8 *)buffer, bytes);
-}
+	// Setup the MAC with the key, IV and associated data
+	siphash_state H;
+	mac_begin(&H, key, getLE(iv_raw), ad, ad_bytes);
 
+	return encrypt_tiles(&S, &H, (const u8 *)from, (u8 *)to, bytes);
+}
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+// Helper function to check if a timer has run for longer than the given period
+// The difference is signed so that a timestamp cached slightly before the timer
+// was started does not look like a very long delay
+static CAT_INLINE bool timer_expired(u32 now, u32 start, u32 period) {
+	return (s32)(now - start) > (s32)period;
+}
 
-int _calico_init(int expected_version)
+// Helper function to find the incoming datagram key for a ratchet bit, given
+// the receive half flag
+static CAT_INLINE KeySlot *datagram_slot(InternalState *state, u32 word,
+										 u32 ratchet_bit)
 {
-	// If version does not match,
-	if (CALICO_VERSION != expected_version) {
-		return -1;
-	}
-
-	// If internal state is larger than opaque object,
-	if (sizeof(InternalState) > sizeof(calico_state)) {
-		return -1;
+	if ((word & IN_HOT) >> 1 == ratchet_bit) {
+		return &state->primary.rx.key;
 	}
-	if (offsetof(InternalState, dgram) > sizeof(calico_stream_only)) {
-		return -1;
-	}
-
-	// Make sure clock is initialized
-	m_clock.OnInitialize();
-
-	m_initialized = true;
 
-	return 0;
+	return &state->cold_key;
 }
 
-void calico_cleanup(void *S)
+// Helper function to tell the transmit half about remote key changes, which
+// may happen while the transmit half ratchets
+static void signal_remote(Key *key, u32 remote)
 {
-	InternalState *state = reinterpret_cast<InternalState *>( S );
+	for (;;) {
+		const u32 word = atomic_load_acquire(&key->tx.flag);
+		const u32 next = (word & ~(REMOTE_ACTIVE | REMOTE_NEWEST)) | remote;
 
-	if (state) {
-		if (state->flag == FLAG_KEYED_STREAM) {
-			cat_secure_erase(S, sizeof(calico_stream_only));
-		} else if (state->flag == FLAG_KEYED_DATAGRAM) {
-			cat_secure_erase(S, sizeof(calico_state));
+		if (atomic_cas(&key->tx.flag, word, next)) {
+			return;
 		}
 	}
 }
 
+// Helper function to replace the old incoming datagram key with the key after
+// the new one, once the remote host has had time to stop using it
+static void handle_ratchet(InternalState *state, Key *key, u32 now) {
+	const u32 word = key->rx.flag;
 
-//// Keying
+	// If no ratchet is in progress or the time has not run out,
+	if (!(word & IN_RATCHETING) ||
+		!timer_expired(now, key->rx.ratchet_time, RATCHET_REMOTE_TIMEOUT)) {
+		return;
+	}
 
-int calico_key(void *S, int state_size, int role, const void *key, int key_bytes)
-{
-	InternalState *state = reinterpret_cast<InternalState *>( S );
+	CAT_LOG(cout << "--Ratcheting key!" << endl);
+
+	// Get active and inactive key
+	const u32 active_key = word & IN_ACTIVE;
+	const u32 inactive_key = active_key ^ 1;
+
+	/*
+	* Before:
+	*
+	*	K[active] = oldest key, in the cold line
+	*	K[inactive] = H(oldest key), in the receive half
+	*/
+
+	// Update the oldest key: K' = H(K)
+	ratchet_key(datagram_slot(state, word, inactive_key),
+				datagram_slot(state, word, active_key));
+
+	/*
+	* After:
+	*
+	*	K[inactive] = H(oldest key)
+	*	K[active] = H(H(oldest key))
+	*
+	* The oldest key is now erased.
+	*/
+
+	// Switch which key is active, which completes the ratchet
+	key->rx.flag = (word & ~(IN_ACTIVE | IN_RATCHETING)) | inactive_key;
+
+	// Let the transmit half know the old key is gone
+	signal_remote(key, inactive_key * (REMOTE_ACTIVE | REMOTE_NEWEST));
+}
 
-	// If input is invalid,
-	if (!m_initialized || !key || !state || key_bytes != 32) {
-		CAT_LOG(cout << "calico_key: Invalid input" << endl);
-		return -1;
-	}
+// Version of handle_ratchet() for calico_decrypt_concurrent(), which leaves
+// both keys in their slots since other threads may be reading them
+static void handle_ratchet_concurrent(InternalState *state, Key *key, u32 now) {
+	const u32 word = atomic_load_acquire(&key->rx.flag);
 
-	// Check state size
-	bool datagram_supported;
-	if (state_size == sizeof(calico_state)) {
-		datagram_supported = true;
-		CAT_LOG(cout << "calico_key: Keying datagram mode" << endl);
-	} else if (state_size == sizeof(calico_stream_only)) {
-		datagram_supported = false;
-		CAT_LOG(cout << "calico_key: Keying stream mode" << endl);
-	} else {
-		// Invalid length
-		CAT_LOG(cout << "calico_key: Unsupported state size" << endl);
-		return -1;
+	// If no ratchet is due, or another thread is changing the key state,
+	// which publishes the time before clearing IN_BUSY
+	if (!(word & IN_RATCHETING) || (word & IN_BUSY) ||
+		!timer_expired(now, atomic_load_acquire(&key->rx.ratchet_time), RATCHET_REMOTE_TIMEOUT)) {
+		return;
 	}
 
-	// If role is invalid,
-	if (role != CALICO_INITIATOR && role != CALICO_RESPONDER) {
-		CAT_LOG(cout << "calico_key: Invalid role" << endl);
-		return -1;
+	// Claim the ratchet so only one thread erases the old key
+	if (!atomic_cas(&key->rx.flag, word, word | IN_BUSY)) {
+		return;
 	}
 
-	// Set flag to unkeyed
-	state->flag = 0;
-
-	// Remember role
-	state->role = role;
+	CAT_LOG(cout << "--Ratcheting key!" << endl);
 
-	// Stream and datagram keys for both sides
-	static const int COMBINED_BYTES = KEY_BYTES * 2;
-	char keys[COMBINED_BYTES * 2];
-
-	// Expand key into two sets of two keys
-	if (!key_expand((const char *)key, keys, sizeof(keys))) {
-		CAT_LOG(cout << "calico_key: Unable to expand key" << endl);
-		return -1;
-	}
+	const u32 active_key = word & IN_ACTIVE;
+	const u32 inactive_key = active_key ^ 1;
 
-	// Swap keys based on mode
-	char *lkey = keys, *rkey = keys;
-	if (role == CALICO_INITIATOR) lkey += COMBINED_BYTES;
-	else rkey += COMBINED_BYTES;
+	// Other threads may be about to use the key after the new one, so it is
+	// derived right away over the oldest key: K[active] = H(K[inactive])
+	KeySlot next;
+	ratchet_key(datagram_slot(state, word, inactive_key), &next);
 
-	// Copy stream keys into place
-	memcpy(state->stream.out_key, lkey, KEY_BYTES);
-	memcpy(state->stream.in_key[0], rkey, KEY_BYTES);
+	memcpy(datagram_slot(state, word, active_key), &next, sizeof(KeySlot));
+	CAT_SECURE_OBJCLR(next);
 
-	// Generate the next remote key
-	if (ratchet_key(state->stream.in_key[0], state->stream.in_key[1])) {
-		CAT_LOG(cout << "calico_key: Unable to ratchet stream key" << endl);
-		return -1;
-	}
+	// Switch which key is active, which completes the ratchet
+	atomic_store_release(&key->rx.flag, (word & ~(IN_ACTIVE | IN_RATCHETING)) | inactive_key);
 
-	// Mark when ratchet happened
-	const u32 msec = m_clock.msec();
-	state->stream.out.ratchet_time = msec; // Only used by initiator
-	state->stream.in.ratchet_time = 0;
+	// Let the transmit half know the old key is gone
+	signal_remote(key, inactive_key * (REMOTE_ACTIVE | REMOTE_NEWEST));
+}
 
-	// Set active keys
-	state->stream.in.active = 0;
-	state->stream.out.active = 0;
+// Incoming key for one message.  If the remote host has switched to the
+// stream key after the active one, it is derived into scratch space and only
+// stored by commit_incoming() once a message has authenticated under it, so
+// that forged messages cannot change the key state
+struct IncomingKey {
+	// Key to authenticate and decrypt with
+	const KeySlot *slot;
 
-	// Initialize the IV subsystem for streams
-	state->stream.in.iv = 0;
-	state->stream.out.iv = 0;
+	// Derived key, when slot points here
+	KeySlot scratch;
+};
 
-	// If datagram transport is supported,
-	if (datagram_supported) {
-		// Copy datagram keys into place
-		memcpy(state->dgram.out_key, lkey + KEY_BYTES, KEY_BYTES);
-		memcpy(state->dgram.in_key[0], rkey + KEY_BYTES, KEY_BYTES);
+// Helper function to derive the key after the given one into scratch space
+static void derive_scratch(const KeySlot *slot, IncomingKey *in)
+{
+	ratchet_key(slot, &in->scratch);
 
-		// Generate the next remote key
-		if (ratchet_key(state->dgram.in_key[0], state->dgram.in_key[1])) {
-			CAT_LOG(cout << "calico_key: Unable to ratchet datagram key" << endl);
-			return -1;
-		}
+	in->slot = &in->scratch;
+}
 
-		// Set active keys
-		state->dgram.in.active = 0;
-		state->dgram.out.active = 0;
+// Helper function to check that the remote host may have switched to the
+// stream key after the active one, before paying for deriving it.  The
+// responder switches to a key only after the initiator has switched to it.
+// The initiator switches again only after the responder has followed the
+// last switch, and no sooner than a ratchet period after it
+static bool stream_switch_allowed(const Key *key, u32 ratchet_bit, u32 now)
+{
+	const u32 out = atomic_load_acquire(&key->tx.flag);
 
-		// Initialized the IV subsystem for datagrams
-		state->dgram.in.iv = 0;
-		state->dgram.out.iv = 0;
-		// Note that stream.in.iv is unused
+	if (out & OUT_INITIATOR) {
+		return ratchet_bit == (out & OUT_ACTIVE);
+	}
 
-		// Set datagram ratchet time
-		state->dgram.out.ratchet_time = msec; // Only used by initiator
-		state->dgram.in.ratchet_time = 0;
+	// Half a period allows for the clocks of the two hosts running apart
+	return ratchet_bit != (out & OUT_ACTIVE) &&
+		   timer_expired(now, key->rx.ratchet_time, RATCHET_PERIOD / 2);
+}
 
-		// Initialize the IV subsystem for datagrams
-		antireplay_init(&state->window);
+// Helper function to get the incoming key for a ratchet bit
+// Returns 0 on success, or -1 if the message cannot be authentic
+static int incoming_key(InternalState *state, const Key *key, u32 ratchet_bit,
+						u32 now, IncomingKey *in)
+{
+	const u32 word = key->rx.flag;
+	const u32 active_key = word & IN_ACTIVE;
+
+	// Stream keys only keep the active key, so the key after it is derived
+	// when the remote host switches to it
+	if (keyed_mode(word) != FLAG_KEYED_DATAGRAM) {
+		if (ratchet_bit != active_key) {
+			// Reject forged switches without hashing
+			if (!stream_switch_allowed(key, ratchet_bit, now)) {
+				CAT_LOG(cout << "incoming_key: Remote host cannot have switched stream keys yet" << endl);
+				return -1;
+			}
 
-		// Flag as keyed
-		state->flag = FLAG_KEYED_DATAGRAM;
+			derive_scratch(&key->rx.key, in);
+		} else {
+			in->slot = &key->rx.key;
+		}
 	} else {
-		// Flag as keyed
-		state->flag = FLAG_KEYED_STREAM;
+		in->slot = datagram_slot(state, word, ratchet_bit);
 	}
 
-	// Erase temporary keys from memory
-	CAT_SECURE_OBJCLR(keys);
-
 	return 0;
 }
 
+// Helper function to store a key derived by incoming_key(), after a message
+// has authenticated under it
+static void commit_incoming(Key *key, IncomingKey *in)
+{
+	if (in->slot == &in->scratch) {
+		// Streams arrive in order, so the old key is never used again
+		memcpy(&key->rx.key, &in->scratch, sizeof(KeySlot));
 
-//// Encryption
+		in->slot = &key->rx.key;
+		CAT_SECURE_OBJCLR(in->scratch);
+	}
+}
 
-int calico_encrypt(void *S, void *ciphertext, const void *plaintext, int bytes,
-					void *overhead, int overhead_size)
+// Helper function to erase a key derived by incoming_key() for a message
+// that did not authenticate
+static void release_incoming(IncomingKey *in)
 {
-	InternalState *state = reinterpret_cast<InternalState *>( S );
+	if (in->slot == &in->scratch) {
+		CAT_SECURE_OBJCLR(in->scratch);
+	}
+}
 
-	// If input is invalid or Calico is not keyed,
-	if (!m_initialized || !state || !plaintext || !ciphertext || bytes < 0 ||
-		!overhead) {
-		CAT_LOG(cout << "calico_encrypt: Invalid input" << endl);
-		return -1;
+// Helper function to compare MAC tags in constant-time
+static bool check_tag(u64 expected_tag, u64 tag, int shift)
+{
+	const u64 delta = ((expected_tag << shift) ^ tag) >> shift;
+	const u32 z = (u32)(delta >> 32) | (u32)delta;
+	if (z) {
+		return false;
 	}
 
-	// Select key
-	Key *key;
-	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
-		key = &state->dgram;
+	return true;
+}
+
+// Helper function to authenticate a message
+static bool check_auth(const KeySlot *key, u64 iv, int shift, const void *ad,
+					   int ad_bytes, const void *buffer, int bytes, u64 tag)
+{
+	// Generate expected MAC tag
+	siphash_state H;
+	mac_begin(&H, key, iv, ad, ad_bytes);
+	const u64 expected_tag = siphash24_end(&H, buffer, bytes);
+
+	// Verify MAC tag in constant-time
+	return check_tag(expected_tag, tag, shift);
+}
 
+// Helper function to select the key for the given overhead size, given the
+// flag of the matching half of the primary key
+static Key *select_key(InternalState *state, int overhead_size, u32 flag)
+{
+	flag = keyed_mode(flag);
+
+	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
 		// If state is not keyed for datagrams,
-		if (state->flag != FLAG_KEYED_DATAGRAM) {
-			CAT_LOG(cout << "calico_encrypt: Attempted to use unkeyed datagram mode" << endl);
-			return -1;
+		if (flag != FLAG_KEYED_DATAGRAM) {
+			CAT_LOG(cout << "select_key: Datagram mode requested but not keyed" << endl);
+			return 0;
 		}
 
-		CAT_LOG(cout << "calico_encrypt: Encrypting in datagram mode" << endl);
+		return &state->primary;
 	} else if (overhead_size == CALICO_STREAM_OVERHEAD) {
-		key = &state->stream;
+		// Objects keyed for datagrams keep the stream key after the datagram key
+		if (flag == FLAG_KEYED_DATAGRAM) {
+			return &state->stream;
+		} else if (flag == FLAG_KEYED_STREAM) {
+			return &state->primary;
+		}
 
-		CAT_LOG(cout << "calico_encrypt: Encrypting in stream mode" << endl);
-	} else {
-		// Invalid input
-		return -1;
+		CAT_LOG(cout << "select_key: Stream mode requested but not keyed" << endl);
+		return 0;
 	}
 
-	// Get next IV
-	const u64 iv = key->out.iv;
+	// Invalid input
+	CAT_LOG(cout << "select_key: Invalid overhead size specified" << endl);
+	return 0;
+}
 
-	// If out of IVs,
-	if (iv == 0xffffffffffffffffULL) {
-		CAT_LOG(cout << "calico_encrypt: Refusing to continue encrypting after ran out of IVs" << endl);
-		return -1;
-	}
+// Helper function to read the outgoing key bit
+static CAT_INLINE u32 outgoing_active(const Key *key)
+{
+	return key->tx.flag & OUT_ACTIVE;
+}
+
+// Helper function to decide if it is time to ratchet the outgoing key
+static bool outgoing_ratchet_due(const Key *key, u32 now)
+{
+	const u32 word = atomic_load_acquire(&key->tx.flag);
+	const u32 active = word & OUT_ACTIVE;
 
 	// If initiator,
-	if (state->role == CALICO_INITIATOR) {
+	if (word & OUT_INITIATOR) {
 		// If it is time to ratchet the key again,
-		if (key->out.active == key->in.active) {
-			const u32 msec = m_clock.msec();
+		return active == (word & REMOTE_ACTIVE) >> 1 &&
+			   timer_expired(now, key->tx.ratchet_time, RATCHET_PERIOD);
+	}
 
-			if ((u32)(msec - key->out.ratchet_time) > RATCHET_PERIOD) {
-				CAT_LOG(cout << "calico_encrypt: Ratcheting key" << endl);
+	// If the remote host has switched keys, follow it.
+	// The receive half only signals this once the new key has authenticated
+	// a message, so this is the acknowledgement the initiator waits for
+	return active != (word & REMOTE_NEWEST) >> 2;
+}
 
-				// Ratchet to next key, erasing the old key
-				if (ratchet_key(key->out_key, key->out_key)) {
-					CAT_LOG(cout << "calico_encrypt: Ratcheting failed" << endl);
-					return -1;
-				}
+// Helper function to ratchet the outgoing key, erasing the old key
+static void advance_outgoing(Key *key, u32 now)
+{
+	ratchet_key(&key->tx.key, &key->tx.key);
 
-				// Flip the active key bit
-				key->out.active ^= 1;
+	// Update base ratchet time to add another delay
+	// NOTE: The time is unused by the responder
+	key->tx.ratchet_time = now;
 
-				// Update base ratchet time to add another delay
-				key->out.ratchet_time = msec;
-			}
+	// Flip the active key bit.  The receive half may be writing the remote
+	// bits at the same time
+	for (;;) {
+		const u32 word = atomic_load_acquire(&key->tx.flag);
+
+		if (atomic_cas(&key->tx.flag, word, word ^ OUT_ACTIVE)) {
+			return;
 		}
 	}
+}
 
-	// Increment IV
-	key->out.iv = iv + 1;
+// Helper function to ratchet the outgoing key when it is time to do so
+static void ratchet_outgoing(Key *key, u32 now)
+{
+	if (outgoing_ratchet_due(key, now)) {
+		CAT_LOG(cout << "ratchet_outgoing: Ratcheting key" << endl);
 
-	// Encrypt and generate MAC tag
-	u64 tag = auth_encrypt(key->out_key, iv, plaintext, ciphertext, bytes);
+		advance_outgoing(key, now);
+	}
+}
 
-	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
-		CAT_LOG(cout << "calico_encrypt: Encrypting datagram with IV = " << iv << " and ratchet = " << key->out.active << endl);
+// Version of ratchet_outgoing() for the datagram key of calico_sender
+// objects, where only the sender that claims the ratchet performs it
+static void ratchet_outgoing_shared(InternalState *state, u32 now)
+{
+	const u32 epoch = atomic_load_acquire(&state->out_epoch);
 
-		// Obfuscate the truncated IV
-		u32 trunc_iv = ((u32)iv << 1) | key->out.active;
-		trunc_iv -= (u32)tag;
-		trunc_iv ^= AD_FUZZ;
+	// If another sender is ratcheting, or it is not time,
+	if ((epoch & 1) || !outgoing_ratchet_due(&state->primary, now)) {
+		return;
+	}
 
-		u64 *overhead_tag = reinterpret_cast<u64 *>( overhead );
-		u8 *overhead_iv = reinterpret_cast<u8 *>( overhead_tag + 1 );
+	// Claim the ratchet, which fails if another sender ratcheted since the
+	// decision above was made
+	if (!atomic_cas(&state->out_epoch, epoch, epoch + 1)) {
+		return;
+	}
+
+	// Keep the key writes after the claim
+	atomic_fence();
+
+	CAT_LOG(cout << "ratchet_outgoing_shared: Ratcheting key" << endl);
+
+	advance_outgoing(&state->primary, now);
+
+	// Publish the new key
+	atomic_store_release(&state->out_epoch, epoch + 2);
+}
+
+// Helper function to copy the outgoing datagram key into a sender, retrying
+// if a ratchet happens during the copy
+static void load_sender_key(SenderState *sender, const InternalState *state)
+{
+	const Key *key = &state->primary;
+
+	for (;;) {
+		const u32 epoch = atomic_load_acquire(&state->out_epoch);
+
+		// If a ratchet is in progress, wait for it
+		if (epoch & 1) {
+			continue;
+		}
+
+		memcpy(&sender->out_key, &key->tx.key, sizeof(KeySlot));
+		sender->active = atomic_load_acquire(&key->tx.flag) & OUT_ACTIVE;
+
+		// Keep the copy before the second read of the epoch
+		atomic_fence();
+
+		if (atomic_load_acquire(&state->out_epoch) == epoch) {
+			sender->epoch = epoch;
+			return;
+		}
+	}
+}
+
+// Helper function to write the overhead for an encrypted message
+static void write_overhead(u32 active, u64 iv, u64 tag, void *overhead,
+						   int overhead_size)
+{
+	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
+		CAT_LOG(cout << "write_overhead: Encrypting datagram with IV = " << iv << " and ratchet = " << active << endl);
+
+		// Obfuscate the truncated IV
+		u32 trunc_iv = ((u32)iv << 1) | active;
+		trunc_iv -= (u32)tag;
+		trunc_iv ^= AD_FUZZ;
+
+		u64 *overhead_tag = reinterpret_cast<u64 *>( overhead );
+		u8 *overhead_iv = reinterpret_cast<u8 *>( overhead_tag + 1 );
 
 		// Store IV and tag
 		overhead_iv[0] = (u8)trunc_iv;
@@ -515,157 +797,1992 @@ int calico_encrypt(void *S, void *ciphertext, const void *plaintext, int bytes,
 		overhead_iv[2] = (u8)(trunc_iv >> 8);
 		*overhead_tag = getLE(tag);
 	} else {
-		CAT_LOG(cout << "calico_encrypt: Encrypting stream with IV = " << iv << " and ratchet = " << key->out.active << endl);
+		CAT_LOG(cout << "write_overhead: Encrypting stream with IV = " << iv << " and ratchet = " << active << endl);
 
 		// Attach active key bit to tag field
-		tag = (tag << 1) | key->out.active;
+		tag = (tag << 1) | active;
 
 		u64 *overhead_tag = reinterpret_cast<u64 *>( overhead );
 
 		// Write MAC tag
 		*overhead_tag = getLE(tag);
 	}
+}
 
-	return 0;
+// Helper function to read the tag, ratchet bit and IV from datagram overhead
+static u64 read_datagram_overhead(const void *overhead, u64 newest_iv,
+								  u32 &ratchet_bit, u64 &iv)
+{
+	const u64 *overhead_tag = reinterpret_cast<const u64 *>( overhead );
+	const u8 *overhead_iv = reinterpret_cast<const u8 *>( overhead_tag + 1 );
+
+	// Grab the MAC tag
+	const u64 tag = getLE(*overhead_tag);
+
+	// Grab the obfuscated IV
+	u32 trunc_iv = ((u32)overhead_iv[2] << 8) | ((u32)overhead_iv[1] << 16) | (u32)overhead_iv[0];
+
+	// De-obfuscate the truncated IV
+	trunc_iv ^= AD_FUZZ;
+	trunc_iv += (u32)tag;
+	trunc_iv &= AD_MASK;
+
+	// Pull out the ratchet bit
+	ratchet_bit = trunc_iv & 1;
+	trunc_iv >>= 1;
+
+	// Reconstruct the full IV counter
+	iv = ReconstructCounter<IV_BITS>(newest_iv, trunc_iv);
+
+	return tag;
 }
 
+// Helper function to react to the ratchet bit of an authenticated message,
+// after its key has been used since the newest key may be moved
+static void accept_ratchet_bit(InternalState *state, Key *key, u32 ratchet_bit,
+							   u32 now)
+{
+	u32 word = key->rx.flag;
 
-//// Decryption
+	// If the ratchet bit is the active key, or already ratcheting,
+	if (ratchet_bit == (word & IN_ACTIVE) || (word & IN_RATCHETING)) {
+		return;
+	}
 
-int calico_decrypt(void *S, void *ciphertext, int bytes, const void *overhead,
-					int overhead_size)
+	CAT_LOG(cout << "accept_ratchet_bit: Detected a key ratchet from remote host" << endl);
+
+	// Streams arrive in order, so commit_incoming() has replaced the old key
+	// already and the remote host may ratchet again
+	if (keyed_mode(word) != FLAG_KEYED_DATAGRAM) {
+		key->rx.flag = (word & ~IN_ACTIVE) | ratchet_bit;
+		key->rx.ratchet_time = now;
+
+		signal_remote(key, ratchet_bit * (REMOTE_ACTIVE | REMOTE_NEWEST));
+		return;
+	}
+
+	// Keep the newest key in the receive half and the old one in the cold line
+	if ((word & IN_HOT) >> 1 != ratchet_bit) {
+		KeySlot old;
+		memcpy(&old, &key->rx.key, sizeof(KeySlot));
+		memcpy(&key->rx.key, &state->cold_key, sizeof(KeySlot));
+		memcpy(&state->cold_key, &old, sizeof(KeySlot));
+		CAT_SECURE_OBJCLR(old);
+
+		word ^= IN_HOT;
+	}
+
+	// Set a timer until the key is erased
+	key->rx.ratchet_time = now;
+	key->rx.flag = word | IN_RATCHETING;
+
+	// Let the transmit half know, which is the responder's trigger to
+	// ratchet its encryption key on the next message it sends
+	signal_remote(key, (word & IN_ACTIVE) * REMOTE_ACTIVE | ratchet_bit * REMOTE_NEWEST);
+}
+
+// Version of accept_ratchet_bit() for calico_decrypt_concurrent()
+static void accept_ratchet_bit_concurrent(Key *key, u32 ratchet_bit, u32 now)
 {
-	InternalState *state = reinterpret_cast<InternalState *>( S );
+	const u32 word = atomic_load_acquire(&key->rx.flag);
 
-	// If input is invalid or Calico object is not keyed,
-	if (!m_initialized || !state || !ciphertext || !overhead || bytes < 0) {
-		CAT_LOG(cout << "calico_decrypt: Invalid input" << endl);
-		return -1;
+	// If the ratchet bit is the active key, or already ratcheting,
+	if (ratchet_bit == (word & IN_ACTIVE) || (word & IN_RATCHETING)) {
+		return;
 	}
 
-	// Select key
-	Key *key;
-	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
-		key = &state->dgram;
+	// Claim the ratchet so the timer is only started once, and keep other
+	// threads from reading the time until it is written
+	if (atomic_cas(&key->rx.flag, word, word | IN_RATCHETING | IN_BUSY)) {
+		CAT_LOG(cout << "accept_ratchet_bit_concurrent: Detected a key ratchet from remote host" << endl);
 
-		// If state is not keyed for datagrams,
-		if (state->flag != FLAG_KEYED_DATAGRAM) {
-			CAT_LOG(cout << "calico_decrypt: Datagram decryption requested but not keyed" << endl);
-			return -1;
+		atomic_store_release(&key->rx.ratchet_time, now);
+		atomic_store_release(&key->rx.flag, word | IN_RATCHETING);
+
+		signal_remote(key, (word & IN_ACTIVE) * REMOTE_ACTIVE | ratchet_bit * REMOTE_NEWEST);
+	}
+}
+
+// Helper function to copy the incoming datagram key for a ratchet bit for
+// calico_decrypt_concurrent(), retrying if another thread changes the key
+// state during the copy, so authentication and decryption use the same key
+static void load_incoming_key(KeySlot *out, InternalState *state,
+							  const Key *key, u32 ratchet_bit)
+{
+	for (;;) {
+		const u32 word = atomic_load_acquire(&key->rx.flag);
+
+		// If another thread is changing the keys, wait for it
+		if (word & IN_BUSY) {
+			continue;
+		}
+
+		memcpy(out, datagram_slot(state, word, ratchet_bit), sizeof(KeySlot));
+
+		// Keep the copy before the second read of the flag
+		atomic_fence();
+
+		if (atomic_load_acquire(&key->rx.flag) == word) {
+			return;
 		}
-		CAT_LOG(cout << "calico_decrypt: Decrypting datagram of bytes = " << bytes << endl);
-	} else if (overhead_size == CALICO_STREAM_OVERHEAD) {
-		key = &state->stream;
-		CAT_LOG(cout << "calico_decrypt: Decrypting stream of bytes = " << bytes << endl);
-	} else {
-		// Invalid input
-		CAT_LOG(cout << "calico_decrypt: Invalid overhead size specified" << endl);
-		return -1;
 	}
+}
+
+// Helper function to decrypt a message
+static void decrypt(const u64 iv_raw, const KeySlot *key, const void *from,
+					void *to, int bytes)
+{
+	// Setup the cipher with the key and IV
+	chacha_input S;
+	cipher_begin(&S, key, iv_raw);
+
+	// Decrypt data
+	chacha_blocks(&S, (const u8 *)from, (u8 *)to, bytes);
+}
 
-	// If ratcheting is happening already,
-	if (key->in.ratchet_time) {
-		// Handle ratchet update
-		handle_ratchet(key);
+// Helper function to authenticate and decrypt with a cipher and MAC that
+// have been set up, returning the expected MAC tag
+static u64 decrypt_tiles(chacha_input *S, siphash_state *H, const u8 *in,
+						 u8 *out, int bytes)
+{
+	// Authenticate and decrypt one tile at a time while it is still in L1
+	while (bytes > AUTH_TILE_BYTES) {
+		siphash24_words(H, in, AUTH_TILE_BYTES / 8);
+		chacha_blocks(S, in, out, AUTH_TILE_BYTES);
+
+		in += AUTH_TILE_BYTES;
+		out += AUTH_TILE_BYTES;
+		bytes -= AUTH_TILE_BYTES;
 	}
 
-	const u64 *overhead_tag = reinterpret_cast<const u64 *>( overhead );
+	// Generate expected MAC tag from the last tile
+	const u64 expected_tag = siphash24_end(H, in, bytes);
 
-	// Grab the MAC tag
-	const u64 tag = getLE(*overhead_tag);
+	// Decrypt the last tile
+	chacha_blocks(S, in, out, bytes);
 
-	u32 ratchet_bit;
-	u64 iv;
-	int auth_shift;
+	return expected_tag;
+}
 
-	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
-		const u8 *overhead_iv = reinterpret_cast<const u8 *>( overhead_tag + 1 );
+// Helper function to authenticate and decrypt a message in one pass
+// Returns false if the message is not authentic, in which case the output
+// is erased
+static bool auth_decrypt(const KeySlot *key, u64 iv_raw, int shift,
+						 const void *ad, int ad_bytes, const void *from,
+						 void *to, int bytes, u64 tag)
+{
+	// Setup the cipher with the key and IV
+	chacha_input S;
+	cipher_begin(&S, key, iv_raw);
 
-		// Grab the obfuscated IV
-		u32 trunc_iv = ((u32)overhead_iv[2] << 8) | ((u32)overhead_iv[1] << 16) | (u32)overhead_iv[0];
+	// Setup the MAC with the key, IV and associated data
+	siphash_state H;
+	mac_begin(&H, key, iv_raw, ad, ad_bytes);
 
-		// De-obfuscate the truncated IV
-		trunc_iv ^= AD_FUZZ;
-		trunc_iv += (u32)tag;
-		trunc_iv &= AD_MASK;
+	const u64 expected_tag = decrypt_tiles(&S, &H, (const u8 *)from, (u8 *)to, bytes);
+
+	// Verify MAC tag in constant-time
+	if (!check_tag(expected_tag, tag, shift)) {
+		// Do not release any plaintext from a forged message
+		cat_secure_erase(to, bytes);
+		return false;
+	}
+
+	return true;
+}
 
-		// Pull out the ratchet bit
-		ratchet_bit = trunc_iv & 1;
-		trunc_iv >>= 1;
+// Helper function to find the anti-replay window of a datagram state object
+static CAT_INLINE void get_window(InternalState *state, antireplay_state *window)
+{
+	window->newest_iv = &state->primary.rx.iv;
+
+	if (state->primary.rx.flag & IN_EXTERNAL) {
+		window->bitmap = reinterpret_cast<u64 *>( (size_t)state->window[0] );
+		window->mask = (u32)state->window[1];
+	} else {
+		window->bitmap = state->window;
+		window->mask = antireplay_state::BITMAP_BITS - 1;
+	}
+}
 
-		// Reconstruct the full IV counter
-		iv = ReconstructCounter<IV_BITS>(state->window.newest_iv, trunc_iv);
+// Helper function to read the IV, ratchet bit and tag of an incoming message
+// and check that the IV may be accepted
+// Returns false if the IV was replayed or is too old
+static bool read_message_iv(InternalState *state, const Key *key,
+							const void *overhead, int overhead_size,
+							u32 &ratchet_bit, u64 &iv, u64 &tag, int &auth_shift)
+{
+	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
+		// Read tag and reconstruct the full IV
+		tag = read_datagram_overhead(overhead, key->rx.iv, ratchet_bit, iv);
 
-		CAT_LOG(cout << "calico_decrypt: Decrypting datagram with IV = " << iv << " and ratchet = " << ratchet_bit << endl);
+		CAT_LOG(cout << "read_message_iv: Decrypting datagram with IV = " << iv << " and ratchet = " << ratchet_bit << endl);
 
 		// Validate IV
-		if (!antireplay_check(&state->window, iv)) {
-			CAT_LOG(cout << "calico_decrypt: IV was replayed or too old" << endl);
-			return -1;
+		antireplay_state window;
+		get_window(state, &window);
+		if (!antireplay_check(&window, iv)) {
+			CAT_LOG(cout << "read_message_iv: IV was replayed or too old" << endl);
+			return false;
 		}
 
 		// Full 64 bits are used for MAC tag
 		auth_shift = 0;
 	} else {
+		// Grab the MAC tag
+		tag = getLE(*reinterpret_cast<const u64 *>( overhead ));
+
 		// Extract the IV
-		iv = key->in.iv;
+		iv = key->rx.iv;
 
 		// Extract the ratchet bit
 		ratchet_bit = (u32)tag & 1;
 
-		CAT_LOG(cout << "calico_decrypt: Decrypting stream with IV = " << iv << " and ratchet = " << ratchet_bit << endl);
+		CAT_LOG(cout << "read_message_iv: Decrypting stream with IV = " << iv << " and ratchet = " << ratchet_bit << endl);
 
 		// Shift out the low bit during authentication
 		auth_shift = 1;
 	}
 
+	return true;
+}
+
+// Helper function to accept the IV of an authenticated message
+static void accept_message_iv(InternalState *state, Key *key,
+							  int overhead_size, u64 iv)
+{
+	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
+		// Accept this IV
+		antireplay_state window;
+		get_window(state, &window);
+		antireplay_accept(&window, iv);
+	} else {
+		// Update IV
+		key->rx.iv = iv + 1;
+	}
+}
+
+
+// Helper function to decrypt one message from ciphertext into plaintext,
+// which may be the same buffer
+static int decrypt_message(void *S, void *plaintext, const void *ciphertext,
+						   int bytes, const void *ad, int ad_bytes,
+						   const void *overhead, int overhead_size, u32 now)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico object is not keyed,
+	if (!m_initialized || !state || !ciphertext || !overhead || bytes < 0 ||
+		ad_bytes < 0 || (!ad && ad_bytes > 0)) {
+		CAT_LOG(cout << "decrypt_message: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.rx.flag);
+	if (!key) {
+		CAT_LOG(cout << "decrypt_message: Invalid overhead size or unkeyed mode" << endl);
+		return -1;
+	}
+
+	CAT_LOG(cout << "decrypt_message: Decrypting message of bytes = " << bytes << endl);
+
+	// If ratcheting is happening already, handle ratchet update
+	handle_ratchet(state, key, now);
+
+	u32 ratchet_bit;
+	u64 iv, tag;
+	int auth_shift;
+
+	// Read the IV and check it may be accepted
+	if (!read_message_iv(state, key, overhead, overhead_size, ratchet_bit, iv, tag, auth_shift)) {
+		return -1;
+	}
+
 	// Get deccryption/MAC key
-	const char *dec_key = key->in_key[ratchet_bit];
+	IncomingKey dec_key;
+	if (incoming_key(state, key, ratchet_bit, now, &dec_key)) {
+		return -1;
+	}
+
+	//// No actions may be taken here until the message is authenticated!
+
+	// If decrypting in-place or the message fits in one tile,
+	if (plaintext == ciphertext || bytes <= AUTH_TILE_BYTES) {
+		// Authenticate the message before decrypting to reject forgeries quickly
+		if (!check_auth(dec_key.slot, iv, auth_shift, ad, ad_bytes, ciphertext, bytes, tag)) {
+			CAT_LOG(cout << "decrypt_message: Message authentication failed" << endl);
+			release_incoming(&dec_key);
+			return -1;
+		}
+
+		// Keep a key derived for this message
+		commit_incoming(key, &dec_key);
+
+		decrypt(iv, dec_key.slot, ciphertext, plaintext, bytes);
+
+		// React to the ratchet bit
+		accept_ratchet_bit(state, key, ratchet_bit, now);
+	} else {
+		// Authenticate and decrypt into the output buffer in one pass
+		if (!auth_decrypt(dec_key.slot, iv, auth_shift, ad, ad_bytes, ciphertext, plaintext, bytes, tag)) {
+			CAT_LOG(cout << "decrypt_message: Message authentication failed" << endl);
+			release_incoming(&dec_key);
+			return -1;
+		}
+
+		// Keep a key derived for this message
+		commit_incoming(key, &dec_key);
+
+		// React to the ratchet bit
+		accept_ratchet_bit(state, key, ratchet_bit, now);
+	}
+
+	// Accept this IV
+	accept_message_iv(state, key, overhead_size, iv);
+
+	CAT_LOG(cout << "decrypt_message: Message decrypted successfully" << endl);
+
+	return 0;
+}
+
+// Helper function to decrypt one datagram in-place while other threads may
+// be decrypting datagrams for the same Calico state object
+static int decrypt_concurrent(void *S, void *ciphertext, int bytes,
+							  const void *overhead, int overhead_size, u32 now)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico object is not keyed,
+	if (!m_initialized || !state || !ciphertext || !overhead || bytes < 0) {
+		CAT_LOG(cout << "decrypt_concurrent: Invalid input" << endl);
+		return -1;
+	}
+
+	// Only datagrams may be decrypted out of order
+	if (overhead_size != CALICO_DATAGRAM_OVERHEAD) {
+		CAT_LOG(cout << "decrypt_concurrent: Only datagram mode is supported" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.rx.flag);
+	if (!key) {
+		CAT_LOG(cout << "decrypt_concurrent: Unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// Erase the old key if it is time, on one thread only
+	handle_ratchet_concurrent(state, key, now);
+
+	antireplay_state window;
+	get_window(state, &window);
+
+	// Read tag and reconstruct the full IV
+	u32 ratchet_bit;
+	u64 iv;
+	const u64 tag = read_datagram_overhead(overhead, antireplay_newest_concurrent(&window), ratchet_bit, iv);
+
+	CAT_LOG(cout << "decrypt_concurrent: Decrypting datagram with IV = " << iv << " and ratchet = " << ratchet_bit << endl);
+
+	// Validate IV
+	if (!antireplay_check_concurrent(&window, iv)) {
+		CAT_LOG(cout << "decrypt_concurrent: IV was replayed or too old" << endl);
+		return -1;
+	}
+
+	// Get decryption/MAC key.  Another thread may erase the old key while
+	// this one is using it, so it works from a copy
+	KeySlot dec_key;
+	load_incoming_key(&dec_key, state, key, ratchet_bit);
 
 	//// No actions may be taken here until the message is authenticated!
 
-	// Authenticate the message
-	if (!check_auth(dec_key, iv, auth_shift, ciphertext, bytes, tag)) {
-		CAT_LOG(cout << "calico_decrypt: Message authentication failed" << endl);
+	if (!check_auth(&dec_key, iv, 0, 0, 0, ciphertext, bytes, tag)) {
+		CAT_SECURE_OBJCLR(dec_key);
+		CAT_LOG(cout << "decrypt_concurrent: Message authentication failed" << endl);
 		return -1;
 	}
 
-	// If the ratchet bit is not the active key,
-	if (ratchet_bit ^ key->in.active) {
-		// If not already ratcheting,
-		if (!key->in.ratchet_time) {
-			CAT_LOG(cout << "calico_decrypt: Detected a key ratchet from remote host" << endl);
+	// Accept this IV, unless another thread got the same datagram first
+	if (!antireplay_accept_concurrent(&window, iv)) {
+		CAT_SECURE_OBJCLR(dec_key);
+		CAT_LOG(cout << "decrypt_concurrent: IV was accepted by another thread" << endl);
+		return -1;
+	}
 
-			// Set a timer until the key is erased
-			key->in.ratchet_time = m_clock.msec() | 1; // ensure it is non-zero
+	// React to the ratchet bit
+	accept_ratchet_bit_concurrent(key, ratchet_bit, now);
 
-			// If responder,
-			if (state->role == CALICO_RESPONDER) {
-				CAT_LOG(cout << "calico_decrypt: Ratcheting key since this is the responder" << endl);
-				// This is our trigger to ratchet our encryption key.
+	decrypt(iv, &dec_key, ciphertext, ciphertext, bytes);
+	CAT_SECURE_OBJCLR(dec_key);
 
-				// Ratchet to next key, erasing the old key
-				if (ratchet_key(key->out_key, key->out_key)) {
-					return -1;
-				}
+	CAT_LOG(cout << "decrypt_concurrent: Message decrypted successfully" << endl);
 
-				// Flip the active key bit
-				key->out.active ^= 1;
-			}
+	return 0;
+}
+
+
+//// Messages in pieces
+
+enum CursorOperation {
+	CURSOR_ENCRYPT,	// Encrypt and authenticate the output
+	CURSOR_DECRYPT,	// Authenticate the input and decrypt
+	CURSOR_CIPHER	// Decrypt only
+};
+
+// Helper function to start a message that is provided in pieces
+static void cursor_begin(MessageCursor *cursor, const KeySlot *key, u64 iv,
+						 u64 ad)
+{
+	cipher_begin(&cursor->cipher, key, iv);
+	siphash24_stream_begin(&cursor->mac, key->key + 32, ad);
+	cursor->keystream_left = 0;
+}
+
+// Helper function to XOR with the keystream left over from the last block
+static void cursor_xor(MessageCursor *cursor, CursorOperation op,
+					   const u8 *in, u8 *out, int bytes)
+{
+	const u8 *keystream = cursor->keystream + 64 - cursor->keystream_left;
+
+	if (op == CURSOR_DECRYPT) {
+		siphash24_update(&cursor->mac, in, bytes);
+	}
+	int ii = 0;
+	for (; ii + 8 <= bytes; ii += 8) {
+		u64 x, k;
+		memcpy(&x, in + ii, 8);
+		memcpy(&k, keystream + ii, 8);
+		x ^= k;
+		memcpy(out + ii, &x, 8);
+	}
+	for (; ii < bytes; ++ii) {
+		out[ii] = in[ii] ^ keystream[ii];
+	}
+	if (op == CURSOR_ENCRYPT) {
+		siphash24_update(&cursor->mac, out, bytes);
+	}
+
+	cursor->keystream_left -= bytes;
+}
+
+// Helper function to process the next piece of a message
+// The last piece of a message may end in a partial block without keeping
+// the rest of the keystream
+static void cursor_update(MessageCursor *cursor, CursorOperation op,
+						  const u8 *in, u8 *out, int bytes, bool last)
+{
+	// Use up the keystream left over from the last piece
+	const int used = cursor->keystream_left < bytes ? cursor->keystream_left : bytes;
+	if (used > 0) {
+		cursor_xor(cursor, op, in, out, used);
+
+		in += used;
+		out += used;
+		bytes -= used;
+	}
+
+	// Process whole blocks one tile at a time while they are still in L1
+	while (bytes >= 64 || (last && bytes > 0)) {
+		int tile = bytes < AUTH_TILE_BYTES ? bytes : AUTH_TILE_BYTES;
+		if (!last || tile < bytes) {
+			tile &= ~63;
+		}
+
+		if (op == CURSOR_DECRYPT) {
+			siphash24_update(&cursor->mac, in, tile);
+		}
+		chacha_blocks(&cursor->cipher, in, out, tile);
+		if (op == CURSOR_ENCRYPT) {
+			siphash24_update(&cursor->mac, out, tile);
 		}
+
+		in += tile;
+		out += tile;
+		bytes -= tile;
 	}
 
-	decrypt(iv, dec_key, ciphertext, bytes);
+	// Keep the rest of the keystream for a final partial block
+	if (bytes > 0) {
+		chacha_blocks(&cursor->cipher, 0, cursor->keystream, 64);
+		cursor->keystream_left = 64;
 
-	if (overhead_size == CALICO_DATAGRAM_OVERHEAD) {
-		// Accept this IV
-		antireplay_accept(&state->window, iv);
-	} else {
-		// Update IV
-		key->in.iv = iv + 1;
+		cursor_xor(cursor, op, in, out, bytes);
+	}
+}
+
+// Helper function to process a message of the given length, split
+// differently into input and output segments
+static void cursor_segments(MessageCursor *cursor, CursorOperation op,
+							const calico_segment *in, int in_count,
+							const calico_segment *out, int out_count,
+							int message_bytes)
+{
+	int ii = 0, oo = 0;
+	int in_used = 0, out_used = 0;
+
+	while (ii < in_count && oo < out_count) {
+		const int in_left = in[ii].bytes - in_used;
+		const int out_left = out[oo].bytes - out_used;
+
+		// Skip to the next segment when one runs out
+		if (in_left <= 0) {
+			++ii;
+			in_used = 0;
+			continue;
+		}
+		if (out_left <= 0) {
+			++oo;
+			out_used = 0;
+			continue;
+		}
+
+		const int bytes = in_left < out_left ? in_left : out_left;
+
+		message_bytes -= bytes;
+
+		cursor_update(cursor, op, (const u8 *)in[ii].data + in_used,
+					  (u8 *)out[oo].data + out_used, bytes, message_bytes == 0);
+
+		in_used += bytes;
+		out_used += bytes;
+	}
+}
+
+// Helper function to check a segment array and find its total length
+// Returns -1 if it is invalid or the total does not fit in an int
+static int segments_bytes(const calico_segment *segments, int count)
+{
+	if (!segments || count < 0) {
+		return -1;
+	}
+
+	int total = 0;
+
+	for (int ii = 0; ii < count; ++ii) {
+		const int bytes = segments[ii].bytes;
+
+		if (bytes < 0 || (!segments[ii].data && bytes > 0) ||
+			bytes > INT_MAX - total) {
+			return -1;
+		}
+
+		total += bytes;
 	}
 
-	CAT_LOG(cout << "calico_decrypt: Message decrypted successfully" << endl);
+	return total;
+}
+
+
+//// Large messages
+
+/*
+ * Large messages are split into chunks that are processed in parallel.
+ *
+ * The keystream for chunk i starts at its own block counter, which is the
+ * nonce derived for that chunk, so the ciphertext is the same as one serial
+ * pass would produce.  Each chunk has its own SipHash tag with the chunk
+ * index as additional data, under a MAC key taken from the message keystream
+ * far past the end of any message.  The chunk tags are then absorbed in chunk
+ * order by the usual message MAC key, with LARGE_DOMAIN flipped in the IV
+ * word, and the message length closes the MAC.  Moving, dropping or changing
+ * a chunk changes the final tag, so only that tag needs to be sent, in the
+ * usual overhead.
+ *
+ * Chunks are handed out in rounds, so the tags of one round can be kept in
+ * order without an allocation.  The threads come from a pool that is kept
+ * between messages.
+ */
+
+// Bytes in each chunk, a multiple of the tile size
+static const u64 LARGE_CHUNK_BYTES = 16 * AUTH_TILE_BYTES;
+
+// Chunks handed out together, whose tags are absorbed once all are done
+static const int LARGE_ROUND_CHUNKS = 256;
+
+// Most threads used for one message
+static const int LARGE_MAX_THREADS = THREAD_POOL_MAX_HELPERS + 1;
+
+// Keystream block that keys the chunk MACs, which message data never reaches
+static const u64 LARGE_MAC_KEY_BLOCK = 0x8000000000000000ULL;
+
+// Flipped in the MAC IV word of the final tag, so that it can never verify
+// as the tag of an ordinary message or one with associated data
+static const u64 LARGE_DOMAIN = 0x4000000000000000ULL;
+
+enum LargeOperation {
+	LARGE_ENCRYPT,		// Encrypt and authenticate
+	LARGE_AUTHENTICATE,	// Authenticate only
+	LARGE_DECRYPT,		// Decrypt only
+	LARGE_AUTH_DECRYPT	// Authenticate and decrypt
+};
+
+// Work shared by the threads processing one large message
+struct LargeJob {
+	LargeOperation op;
+
+	// Message key and IV
+	const KeySlot *key;
+	u64 iv;
+
+	// Chunk MAC with the key for this message mixed in
+	siphash_state chunk_mac;
+
+	const u8 *in;
+	u8 *out;
+	u64 bytes, chunks;
+
+	// First chunk of the round and the chunk after its last one
+	u64 round_first, round_end;
+
+	// Next chunk to claim
+	volatile u64 next_chunk;
+
+	// Tags of the chunks in the round, in chunk order
+	u64 tags[LARGE_ROUND_CHUNKS];
+};
+
+// Helper function to process chunks of a large message until none are left
+// in the round
+static void large_worker(void *param)
+{
+	LargeJob *job = reinterpret_cast<LargeJob *>( param );
+
+	for (;;) {
+		const u64 chunk = atomic_fetch_add64(&job->next_chunk, 1);
+		if (chunk >= job->round_end) {
+			break;
+		}
+
+		const u64 offset = chunk * LARGE_CHUNK_BYTES;
+		const u64 remaining = job->bytes - offset;
+		const int bytes = (int)(remaining < LARGE_CHUNK_BYTES ? remaining : LARGE_CHUNK_BYTES);
+		const u8 *in = job->in + offset;
+		u8 *out = job->out + offset;
+
+		// Setup the cipher at the first block of the chunk
+		chacha_input S;
+		cipher_begin(&S, job->key, job->iv);
+		chacha_input_seek(&S, offset / 64);
+
+		// Setup the MAC with the chunk index
+		siphash_state H;
+		siphash24_begin(&H, &job->chunk_mac, chunk);
+
+		u64 tag = 0;
+
+		switch (job->op) {
+		case LARGE_ENCRYPT:
+			tag = encrypt_tiles(&S, &H, in, out, bytes);
+			break;
+		case LARGE_AUTHENTICATE:
+			tag = siphash24_end(&H, in, bytes);
+			break;
+		case LARGE_DECRYPT:
+			chacha_blocks(&S, in, out, bytes);
+			break;
+		case LARGE_AUTH_DECRYPT:
+			tag = decrypt_tiles(&S, &H, in, out, bytes);
+			break;
+		}
+
+		job->tags[chunk - job->round_first] = getLE(tag);
+	}
+}
+
+// Helper function to run a large message job on up to the given number of
+// threads, including this one.  If a MAC is given, the chunk tags are
+// absorbed into it in chunk order
+static void run_large_job(LargeJob *job, int threads, siphash_state *H)
+{
+	if (threads > LARGE_MAX_THREADS) {
+		threads = LARGE_MAX_THREADS;
+	}
+
+	for (u64 first = 0; first < job->chunks; first += LARGE_ROUND_CHUNKS) {
+		const u64 remaining = job->chunks - first;
+		const int count = (int)(remaining < (u64)LARGE_ROUND_CHUNKS ? remaining : LARGE_ROUND_CHUNKS);
+
+		job->round_first = first;
+		job->round_end = first + count;
+		job->next_chunk = first;
+
+		thread_pool_run(large_worker, job, (threads < count ? threads : count) - 1);
+
+		if (H) {
+			siphash24_words(H, job->tags, count);
+		}
+	}
+}
+
+// Helper function to set up a large message job
+static void large_job_init(LargeJob *job, LargeOperation op, const KeySlot *key,
+						   u64 iv, const void *in, void *out, u64 bytes)
+{
+	job->op = op;
+	job->key = key;
+	job->iv = iv;
+	job->in = (const u8 *)in;
+	job->out = (u8 *)out;
+	job->bytes = bytes;
+	job->chunks = (bytes + LARGE_CHUNK_BYTES - 1) / LARGE_CHUNK_BYTES;
+
+	// Take the chunk MAC key from the message keystream
+	chacha_input S;
+	cipher_begin(&S, key, iv);
+	chacha_input_seek(&S, LARGE_MAC_KEY_BLOCK);
+
+	u8 block[64];
+	chacha_blocks(&S, 0, block, sizeof(block));
+
+	siphash24_begin(&job->chunk_mac, (const char *)block);
+
+	CAT_SECURE_OBJCLR(block);
+	CAT_SECURE_OBJCLR(S);
+}
+
+// Helper function to run a large message job and return the final tag
+static u64 run_large_job_tag(LargeJob *job, int threads)
+{
+	siphash_state H;
+	siphash24_begin(&H, job->key->key + 32, job->iv ^ LARGE_DOMAIN);
+
+	run_large_job(job, threads, &H);
+
+	// Bind the chained chunk tags to the message length
+	const u64 length = getLE(job->bytes);
+	return siphash24_end(&H, &length, sizeof(length));
+}
+
+// Helper function to erase a buffer that may be larger than 2 GB
+static void secure_erase_large(void *buffer, u64 bytes)
+{
+	u8 *data = (u8 *)buffer;
+
+	while (bytes > 0) {
+		const int len = (int)(bytes < LARGE_CHUNK_BYTES ? bytes : LARGE_CHUNK_BYTES);
+		cat_secure_erase(data, len);
+		data += len;
+		bytes -= len;
+	}
+}
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int _calico_init(int expected_version)
+{
+	// If version does not match,
+	if (CALICO_VERSION != expected_version) {
+		return -1;
+	}
+
+	// If internal state is larger than opaque object,
+	if (sizeof(InternalState) > sizeof(calico_state)) {
+		return -1;
+	}
+	if (offsetof(InternalState, stream) > sizeof(calico_stream_only)) {
+		return -1;
+	}
+	if (sizeof(SenderState) > sizeof(calico_sender)) {
+		return -1;
+	}
+	if (sizeof(StreamState) > sizeof(calico_stream)) {
+		return -1;
+	}
+
+	// If either half of a key spills past its cache line,
+	if (sizeof(TransmitHalf) > CAT_CACHE_LINE_BYTES ||
+		sizeof(ReceiveHalf) > CAT_CACHE_LINE_BYTES) {
+		return -1;
+	}
+
+	// If keys cannot be ratcheted with a single BLAKE2b block,
+	if (KEY_BYTES != BLAKE2B_48_BYTES) {
+		return -1;
+	}
+
+	// Make sure clock is initialized
+	m_clock.OnInitialize();
+
+	// Pick the fastest kernels this CPU supports
+	const u32 features = cpu_features();
+	chacha_blocks_select(features);
+	chacha_lanes_select(features);
+	siphash24_lanes_select(features);
+	blake2b_48_select(features);
+
+	m_initialized = true;
+
+	return 0;
+}
+
+const char *calico_kernels()
+{
+	static char description[128];
+
+	// If not initialized yet,
+	if (!m_initialized) {
+		return "uninitialized";
+	}
+
+	// Build the description once
+	if (!description[0]) {
+		const char *parts[8] = {
+			"chacha=", chacha_blocks_kernel.name,
+			" chacha_lanes=", chacha_lanes_kernel.name,
+			" siphash_lanes=", siphash24_lanes_kernel.name,
+			" blake2b=", blake2b_48_kernel.name
+		};
+
+		int used = 0;
+		for (int ii = 0; ii < 8; ++ii) {
+			for (const char *ch = parts[ii]; *ch && used < (int)sizeof(description) - 1; ++ch) {
+				description[used++] = *ch;
+			}
+		}
+		description[used] = '\0';
+	}
+
+	return description;
+}
+
+unsigned int calico_msec()
+{
+	return m_clock.msec();
+}
+
+void calico_cleanup(void *S)
+{
+	InternalState *state = get_state(S);
+
+	if (state) {
+		const u32 mode = keyed_mode(state->primary.tx.flag);
+
+		if (mode == FLAG_KEYED_STREAM) {
+			cat_secure_erase(S, sizeof(calico_stream_only));
+		} else if (mode == FLAG_KEYED_DATAGRAM) {
+			cat_secure_erase(S, sizeof(calico_state));
+		}
+	}
+}
+
+
+//// Keying
+
+int calico_key(void *S, int state_size, int role, const void *key, int key_bytes)
+{
+	return calico_key_window(S, state_size, role, key, key_bytes, 0,
+							 antireplay_state::BITMAP_BITS);
+}
+
+int calico_key_window(void *S, int state_size, int role, const void *key,
+					  int key_bytes, void *window, int window_bits)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid,
+	if (!m_initialized || !key || !state || key_bytes != 32) {
+		CAT_LOG(cout << "calico_key: Invalid input" << endl);
+		return -1;
+	}
+
+	// If window is not 8-byte aligned,
+	if ((size_t)window & 7) {
+		CAT_LOG(cout << "calico_key: Window is not aligned" << endl);
+		return -1;
+	}
+
+	// Check state size
+	bool datagram_supported;
+	if (state_size == sizeof(calico_state)) {
+		datagram_supported = true;
+		CAT_LOG(cout << "calico_key: Keying datagram mode" << endl);
+	} else if (state_size == sizeof(calico_stream_only)) {
+		datagram_supported = false;
+		CAT_LOG(cout << "calico_key: Keying stream mode" << endl);
+	} else {
+		// Invalid length
+		CAT_LOG(cout << "calico_key: Unsupported state size" << endl);
+		return -1;
+	}
+
+	// If role is invalid,
+	if (role != CALICO_INITIATOR && role != CALICO_RESPONDER) {
+		CAT_LOG(cout << "calico_key: Invalid role" << endl);
+		return -1;
+	}
+
+	// Set flag to unkeyed
+	state->primary.tx.flag = 0;
+	state->primary.rx.flag = 0;
+
+	// If the window is not valid for this state object,
+	if (datagram_supported) {
+		if (window_bits < antireplay_state::BITMAP_BITS || window_bits > antireplay_state::MAX_BITS ||
+			(window_bits & (window_bits - 1)) != 0 ||
+			(!window && window_bits > antireplay_state::BITMAP_BITS)) {
+			CAT_LOG(cout << "calico_key: Invalid anti-replay window" << endl);
+			return -1;
+		}
+	} else if (window || window_bits != antireplay_state::BITMAP_BITS) {
+		CAT_LOG(cout << "calico_key: Anti-replay window requires datagram mode" << endl);
+		return -1;
+	}
+
+	// Stream and datagram keys for both sides
+	static const int COMBINED_BYTES = KEY_BYTES * 2;
+	char keys[COMBINED_BYTES * 2];
+
+	// Expand key into two sets of two keys
+	if (!key_expand((const char *)key, keys, sizeof(keys))) {
+		CAT_LOG(cout << "calico_key: Unable to expand key" << endl);
+		return -1;
+	}
+
+	// Swap keys based on mode
+	char *lkey = keys, *rkey = keys;
+	if (role == CALICO_INITIATOR) lkey += COMBINED_BYTES;
+	else rkey += COMBINED_BYTES;
+
+	// Remember role, and mark when ratchet happened.  The outgoing ratchet
+	// time is only used by the initiator
+	const u32 out_role = (role == CALICO_INITIATOR) ? OUT_INITIATOR : 0;
+	const u32 now = m_clock.msec();
+
+	// Objects keyed for datagrams keep the stream key after the datagram key
+	Key *stream = datagram_supported ? &state->stream : &state->primary;
+
+	// Copy stream keys into place.  The next remote key is derived when the
+	// remote host switches to it
+	memcpy(stream->tx.key.key, lkey, KEY_BYTES);
+	memcpy(stream->rx.key.key, rkey, KEY_BYTES);
+
+	// Set active keys and initialize the IV subsystem for streams
+	stream->tx.flag = FLAG_KEYED_STREAM | out_role;
+	stream->tx.ratchet_time = now;
+	stream->tx.iv = 0;
+	stream->rx.flag = FLAG_KEYED_STREAM;
+	stream->rx.ratchet_time = now;
+	stream->rx.iv = 0;
+
+	// If datagram transport is supported,
+	if (datagram_supported) {
+		Key *dgram = &state->primary;
+
+		// Copy datagram keys into place
+		memcpy(dgram->tx.key.key, lkey + KEY_BYTES, KEY_BYTES);
+		memcpy(dgram->rx.key.key, rkey + KEY_BYTES, KEY_BYTES);
+
+		// Generate the next remote key
+		ratchet_key(&dgram->rx.key, &state->cold_key);
+
+		// Set active keys, with key 0 in the receive half
+		dgram->tx.ratchet_time = now;
+		dgram->tx.iv = 0;
+		dgram->rx.flag = 0;
+		dgram->rx.ratchet_time = 0;
+		state->out_epoch = 0;
+
+		// Initialize the IV subsystem for datagrams
+		antireplay_state replay;
+		if (window) {
+			state->window[0] = (size_t)window;
+			state->window[1] = window_bits - 1;
+			dgram->rx.flag = IN_EXTERNAL;
+		}
+		get_window(state, &replay);
+		antireplay_init(&replay, replay.newest_iv, replay.bitmap, window_bits);
+
+		// Flag as keyed
+		dgram->rx.flag |= FLAG_KEYED_DATAGRAM;
+		dgram->tx.flag = FLAG_KEYED_DATAGRAM | out_role;
+	}
+
+	// Erase temporary keys from memory
+	CAT_SECURE_OBJCLR(keys);
+
+	return 0;
+}
+
+
+//// Encryption
+
+int calico_encrypt(void *S, void *ciphertext, const void *plaintext, int bytes,
+					void *overhead, int overhead_size)
+{
+	return calico_encrypt_at(S, ciphertext, plaintext, bytes, overhead,
+							 overhead_size, m_clock.msec());
+}
+
+int calico_encrypt_at(void *S, void *ciphertext, const void *plaintext,
+					  int bytes, void *overhead, int overhead_size,
+					  unsigned int now_msec)
+{
+	return calico_encrypt_ad_at(S, ciphertext, plaintext, bytes, 0, 0,
+								overhead, overhead_size, now_msec);
+}
+
+int calico_encrypt_ad(void *S, void *ciphertext, const void *plaintext,
+					  int bytes, const void *ad, int ad_bytes, void *overhead,
+					  int overhead_size)
+{
+	return calico_encrypt_ad_at(S, ciphertext, plaintext, bytes, ad, ad_bytes,
+								overhead, overhead_size, m_clock.msec());
+}
+
+int calico_encrypt_ad_at(void *S, void *ciphertext, const void *plaintext,
+						 int bytes, const void *ad, int ad_bytes,
+						 void *overhead, int overhead_size,
+						 unsigned int now_msec)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico is not keyed,
+	if (!m_initialized || !state || !plaintext || !ciphertext || bytes < 0 ||
+		!overhead || ad_bytes < 0 || (!ad && ad_bytes > 0)) {
+		CAT_LOG(cout << "calico_encrypt: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.tx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_encrypt: Invalid overhead size or unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// Get next IV
+	const u64 iv = key->tx.iv;
+
+	// If out of IVs,
+	if (iv == 0xffffffffffffffffULL) {
+		CAT_LOG(cout << "calico_encrypt: Refusing to continue encrypting after ran out of IVs" << endl);
+		return -1;
+	}
+
+	// Ratchet the key if it is time to do so
+	ratchet_outgoing(key, now_msec);
+
+	// Increment IV
+	key->tx.iv = iv + 1;
+
+	// Encrypt and generate MAC tag
+	const u64 tag = auth_encrypt(&key->tx.key, iv, ad, ad_bytes, plaintext, ciphertext, bytes);
+
+	// Write IV and tag
+	write_overhead(outgoing_active(key), iv, tag, overhead, overhead_size);
+
+	return 0;
+}
+
+int calico_encrypt_batch(void *S, calico_encrypt_desc *messages, int count,
+						 int overhead_size)
+{
+	return calico_encrypt_batch_at(S, messages, count, overhead_size,
+								   m_clock.msec());
+}
+
+int calico_encrypt_batch_at(void *S, calico_encrypt_desc *messages, int count,
+							int overhead_size, unsigned int now_msec)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico is not keyed,
+	if (!m_initialized || !state || !messages || count < 0) {
+		CAT_LOG(cout << "calico_encrypt_batch: Invalid input" << endl);
+		return -1;
+	}
+
+	// Validate all of the messages before any state is changed
+	for (int ii = 0; ii < count; ++ii) {
+		const calico_encrypt_desc *msg = messages + ii;
+
+		if (!msg->plaintext || !msg->ciphertext || msg->bytes < 0 ||
+			!msg->overhead) {
+			CAT_LOG(cout << "calico_encrypt_batch: Invalid message " << ii << endl);
+			return -1;
+		}
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.tx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_encrypt_batch: Invalid overhead size or unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// Get first IV in the range
+	const u64 iv = key->tx.iv;
+
+	// If there are not enough IVs left for the whole batch,
+	if ((u64)count > 0xffffffffffffffffULL - iv) {
+		CAT_LOG(cout << "calico_encrypt_batch: Refusing to continue encrypting after ran out of IVs" << endl);
+		return -1;
+	}
+
+	// Ratchet decision is made once for the whole batch
+	ratchet_outgoing(key, now_msec);
+
+	// Reserve the IV range
+	key->tx.iv = iv + count;
+
+	chacha_lane lanes[CHACHA_LANES];
+	siphash_lane macs[CHACHA_LANES];
+	u64 tags[CHACHA_LANES];
+
+	for (int offset = 0; offset < count; offset += CHACHA_LANES) {
+		calico_encrypt_desc *group = messages + offset;
+		const int group_count = (count - offset < CHACHA_LANES) ? count - offset : CHACHA_LANES;
+
+		// Encrypt the whole group with one pass of the multi-buffer kernel
+		for (int ii = 0; ii < group_count; ++ii) {
+			lanes[ii].key = key->tx.key.key;
+			lanes[ii].iv = iv + offset + ii;
+			lanes[ii].in = group[ii].plaintext;
+			lanes[ii].out = group[ii].ciphertext;
+			lanes[ii].bytes = group[ii].bytes;
+		}
+
+		chacha_lanes(lanes, group_count, 14);
+
+		// Generate MAC tags for the whole group
+		for (int ii = 0; ii < group_count; ++ii) {
+			macs[ii].key = key->tx.key.key + 32;
+			macs[ii].data = group[ii].ciphertext;
+			macs[ii].bytes = group[ii].bytes;
+			macs[ii].ad = getLE(lanes[ii].iv);
+		}
+
+		siphash24_lanes(macs, group_count, tags);
+
+		// Write IV and tag
+		for (int ii = 0; ii < group_count; ++ii) {
+			write_overhead(outgoing_active(key), lanes[ii].iv, tags[ii], group[ii].overhead, overhead_size);
+		}
+	}
+
+	return 0;
+}
+
+
+//// Scatter-gather messages
+
+int calico_encryptv(void *S, const calico_segment *ciphertext, int ciphertext_count,
+					const calico_segment *plaintext, int plaintext_count,
+					void *overhead, int overhead_size)
+{
+	return calico_encryptv_at(S, ciphertext, ciphertext_count, plaintext,
+							  plaintext_count, overhead, overhead_size,
+							  m_clock.msec());
+}
+
+int calico_encryptv_at(void *S, const calico_segment *ciphertext, int ciphertext_count,
+					   const calico_segment *plaintext, int plaintext_count,
+					   void *overhead, int overhead_size, unsigned int now_msec)
+{
+	InternalState *state = get_state(S);
+
+	const int bytes = segments_bytes(plaintext, plaintext_count);
+
+	// If input is invalid or Calico is not keyed,
+	if (!m_initialized || !state || bytes < 0 || !overhead ||
+		segments_bytes(ciphertext, ciphertext_count) != bytes) {
+		CAT_LOG(cout << "calico_encryptv: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.tx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_encryptv: Invalid overhead size or unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// Get next IV
+	const u64 iv = key->tx.iv;
+
+	// If out of IVs,
+	if (iv == 0xffffffffffffffffULL) {
+		CAT_LOG(cout << "calico_encryptv: Refusing to continue encrypting after ran out of IVs" << endl);
+		return -1;
+	}
+
+	// Ratchet the key if it is time to do so
+	ratchet_outgoing(key, now_msec);
+
+	// Increment IV
+	key->tx.iv = iv + 1;
+
+	// Encrypt and authenticate each segment, carrying the keystream and MAC
+	// state across the boundaries
+	MessageCursor cursor;
+	cursor_begin(&cursor, &key->tx.key, iv, getLE(iv));
+	cursor_segments(&cursor, CURSOR_ENCRYPT, plaintext, plaintext_count,
+					ciphertext, ciphertext_count, bytes);
+
+	const u64 tag = siphash24_final(&cursor.mac);
+
+	// Write IV and tag
+	write_overhead(outgoing_active(key), iv, tag, overhead, overhead_size);
+
+	CAT_SECURE_OBJCLR(cursor);
+
+	return 0;
+}
+
+int calico_decryptv(void *S, const calico_segment *plaintext, int plaintext_count,
+					const calico_segment *ciphertext, int ciphertext_count,
+					const void *overhead, int overhead_size)
+{
+	return calico_decryptv_at(S, plaintext, plaintext_count, ciphertext,
+							  ciphertext_count, overhead, overhead_size,
+							  m_clock.msec());
+}
+
+int calico_decryptv_at(void *S, const calico_segment *plaintext, int plaintext_count,
+					   const calico_segment *ciphertext, int ciphertext_count,
+					   const void *overhead, int overhead_size, unsigned int now_msec)
+{
+	InternalState *state = get_state(S);
+
+	const int bytes = segments_bytes(ciphertext, ciphertext_count);
+
+	// If input is invalid or Calico object is not keyed,
+	if (!m_initialized || !state || bytes < 0 || !overhead ||
+		segments_bytes(plaintext, plaintext_count) != bytes) {
+		CAT_LOG(cout << "calico_decryptv: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.rx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_decryptv: Invalid overhead size or unkeyed mode" << endl);
+		return -1;
+	}
+
+	// If ratcheting is happening already, handle ratchet update
+	handle_ratchet(state, key, now_msec);
+
+	u32 ratchet_bit;
+	u64 iv, tag;
+	int auth_shift;
+
+	// Read the IV and check it may be accepted
+	if (!read_message_iv(state, key, overhead, overhead_size, ratchet_bit, iv, tag, auth_shift)) {
+		return -1;
+	}
+
+	IncomingKey dec_key;
+	if (incoming_key(state, key, ratchet_bit, now_msec, &dec_key)) {
+		return -1;
+	}
+
+	// Authenticate every segment before any output is written, since the
+	// output segments may overlap the input
+	siphash_stream mac;
+	siphash24_stream_begin(&mac, dec_key.slot->key + 32, iv);
+	for (int ii = 0; ii < ciphertext_count; ++ii) {
+		if (ciphertext[ii].bytes > 0) {
+			siphash24_update(&mac, ciphertext[ii].data, ciphertext[ii].bytes);
+		}
+	}
+
+	if (!check_tag(siphash24_final(&mac), tag, auth_shift)) {
+		CAT_LOG(cout << "calico_decryptv: Message authentication failed" << endl);
+		release_incoming(&dec_key);
+		return -1;
+	}
+
+	// Keep a key derived for this message
+	commit_incoming(key, &dec_key);
+
+	// Decrypt each segment, carrying the keystream across the boundaries
+	MessageCursor cursor;
+	cursor_begin(&cursor, dec_key.slot, iv, iv);
+	cursor_segments(&cursor, CURSOR_CIPHER, ciphertext, ciphertext_count,
+					plaintext, plaintext_count, bytes);
+
+	CAT_SECURE_OBJCLR(cursor);
+
+	// React to the ratchet bit
+	accept_ratchet_bit(state, key, ratchet_bit, now_msec);
+
+	// Accept this IV
+	accept_message_iv(state, key, overhead_size, iv);
+
+	return 0;
+}
+
+
+//// Incremental stream messages
+
+int calico_stream_init(calico_stream *stream_object, void *S, int direction,
+					   void *header)
+{
+	InternalState *state = get_state(S);
+	StreamState *stream = get_stream(stream_object);
+
+	// If input is invalid,
+	if (!m_initialized || !state || !stream || !header) {
+		CAT_LOG(cout << "calico_stream_init: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select the stream key from the half used for this direction
+	const u32 flag = (direction == CALICO_STREAM_ENCRYPT) ? state->primary.tx.flag : state->primary.rx.flag;
+	Key *key = select_key(state, CALICO_STREAM_OVERHEAD, flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_stream_init: Unkeyed stream mode" << endl);
+		return -1;
+	}
+
+	if (direction == CALICO_STREAM_ENCRYPT) {
+		// Get next IV
+		const u64 iv = key->tx.iv;
+
+		// If out of IVs,
+		if (iv == 0xffffffffffffffffULL) {
+			CAT_LOG(cout << "calico_stream_init: Refusing to continue encrypting after ran out of IVs" << endl);
+			return -1;
+		}
+
+		// Ratchet the key if it is time to do so
+		ratchet_outgoing(key, m_clock.msec());
+
+		// Reserve the IV
+		key->tx.iv = iv + 1;
+
+		stream->iv = iv;
+		stream->ratchet_bit = outgoing_active(key);
+		stream->flag = FLAG_STREAM_ENCRYPT;
+		const KeySlot *slot = &key->tx.key;
+
+		// Send the key bit up front so the receiver can start decrypting
+		*(u8 *)header = (u8)stream->ratchet_bit;
+
+		cursor_begin(&stream->cursor, slot, iv, getLE(iv));
+	} else if (direction == CALICO_STREAM_DECRYPT) {
+		const u8 ratchet_bit = *(const u8 *)header;
+
+		// If the header is invalid,
+		if (ratchet_bit > 1) {
+			CAT_LOG(cout << "calico_stream_init: Invalid header" << endl);
+			return -1;
+		}
+
+		// The key is only stored by calico_stream_final() once the message
+		// has authenticated
+		IncomingKey dec_key;
+		if (incoming_key(state, key, ratchet_bit, m_clock.msec(), &dec_key)) {
+			return -1;
+		}
+
+		stream->iv = key->rx.iv;
+		stream->ratchet_bit = ratchet_bit;
+		stream->flag = FLAG_STREAM_DECRYPT;
+
+		cursor_begin(&stream->cursor, dec_key.slot, stream->iv, stream->iv);
+
+		release_incoming(&dec_key);
+	} else {
+		CAT_LOG(cout << "calico_stream_init: Invalid direction" << endl);
+		return -1;
+	}
+
+	stream->state = state;
+
+	return 0;
+}
+
+int calico_stream_update(calico_stream *stream_object, void *output,
+						 const void *input, int bytes)
+{
+	StreamState *stream = get_stream(stream_object);
+
+	// If input is invalid or the stream is not initialized,
+	if (!m_initialized || !stream || !output || !input || bytes < 0 ||
+		(stream->flag != FLAG_STREAM_ENCRYPT && stream->flag != FLAG_STREAM_DECRYPT)) {
+		CAT_LOG(cout << "calico_stream_update: Invalid input" << endl);
+		return -1;
+	}
+
+	const CursorOperation op = (stream->flag == FLAG_STREAM_ENCRYPT) ? CURSOR_ENCRYPT : CURSOR_DECRYPT;
+
+	cursor_update(&stream->cursor, op, (const u8 *)input, (u8 *)output, bytes, false);
+
+	return 0;
+}
+
+int calico_stream_final(calico_stream *stream_object, void *overhead,
+						int overhead_size)
+{
+	StreamState *stream = get_stream(stream_object);
+
+	// If input is invalid or the stream is not initialized,
+	if (!m_initialized || !stream || !overhead ||
+		overhead_size != CALICO_STREAM_OVERHEAD ||
+		(stream->flag != FLAG_STREAM_ENCRYPT && stream->flag != FLAG_STREAM_DECRYPT)) {
+		CAT_LOG(cout << "calico_stream_final: Invalid input" << endl);
+		return -1;
+	}
+
+	const u64 expected_tag = siphash24_final(&stream->cursor.mac);
+	const bool encrypt = (stream->flag == FLAG_STREAM_ENCRYPT);
+	InternalState *state = stream->state;
+	const u64 iv = stream->iv;
+	const u32 ratchet_bit = stream->ratchet_bit;
+
+	// The stream object may not be used again without calling init
+	cat_secure_erase(stream_object, sizeof(calico_stream));
+
+	if (encrypt) {
+		// Write tag
+		write_overhead(ratchet_bit, iv, expected_tag, overhead, overhead_size);
+		return 0;
+	}
+
+	Key *key = select_key(state, CALICO_STREAM_OVERHEAD, state->primary.rx.flag);
+
+	// If another message was decrypted since this one started,
+	if (!key || key->rx.iv != iv) {
+		CAT_LOG(cout << "calico_stream_final: Message was not decrypted in order" << endl);
+		return -1;
+	}
+
+	// Verify MAC tag in constant-time
+	const u64 tag = getLE(*reinterpret_cast<const u64 *>( overhead ));
+	if (!check_tag(expected_tag, tag, 1)) {
+		CAT_LOG(cout << "calico_stream_final: Message authentication failed" << endl);
+		return -1;
+	}
+
+	const u32 now = m_clock.msec();
+
+	// Derive again and keep a key that was derived for this message
+	IncomingKey dec_key;
+	if (incoming_key(state, key, ratchet_bit, now, &dec_key)) {
+		return -1;
+	}
+	commit_incoming(key, &dec_key);
+
+	// React to the ratchet bit
+	accept_ratchet_bit(state, key, ratchet_bit, now);
+
+	// Update IV
+	key->rx.iv = iv + 1;
+
+	return 0;
+}
+
+
+//// Large messages
+
+int calico_encrypt_large(void *S, void *ciphertext, const void *plaintext,
+						 unsigned long long bytes, void *overhead,
+						 int overhead_size, int threads)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico is not keyed,
+	if (!m_initialized || !state || !plaintext || !ciphertext || !overhead ||
+		threads < 1) {
+		CAT_LOG(cout << "calico_encrypt_large: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.tx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_encrypt_large: Invalid overhead size or unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// Get next IV
+	const u64 iv = key->tx.iv;
+
+	// If out of IVs,
+	if (iv == 0xffffffffffffffffULL) {
+		CAT_LOG(cout << "calico_encrypt_large: Refusing to continue encrypting after ran out of IVs" << endl);
+		return -1;
+	}
+
+	// Ratchet the key if it is time to do so
+	ratchet_outgoing(key, m_clock.msec());
+
+	// Increment IV
+	key->tx.iv = iv + 1;
+
+	// Encrypt and authenticate the chunks in parallel
+	LargeJob job;
+	large_job_init(&job, LARGE_ENCRYPT, &key->tx.key, iv, plaintext, ciphertext, bytes);
+	const u64 tag = run_large_job_tag(&job, threads);
+
+	CAT_SECURE_OBJCLR(job.chunk_mac);
+
+	// Write IV and tag
+	write_overhead(outgoing_active(key), iv, tag, overhead, overhead_size);
+
+	return 0;
+}
+
+int calico_decrypt_large(void *S, void *plaintext, const void *ciphertext,
+						 unsigned long long bytes, const void *overhead,
+						 int overhead_size, int threads)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico object is not keyed,
+	if (!m_initialized || !state || !plaintext || !ciphertext || !overhead ||
+		threads < 1) {
+		CAT_LOG(cout << "calico_decrypt_large: Invalid input" << endl);
+		return -1;
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.rx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_decrypt_large: Invalid overhead size or unkeyed mode" << endl);
+		return -1;
+	}
+
+	const u32 now = m_clock.msec();
+
+	// If ratcheting is happening already, handle ratchet update
+	handle_ratchet(state, key, now);
+
+	u32 ratchet_bit;
+	u64 iv, tag;
+	int auth_shift;
+
+	// Read the IV and check it may be accepted
+	if (!read_message_iv(state, key, overhead, overhead_size, ratchet_bit, iv, tag, auth_shift)) {
+		return -1;
+	}
+
+	// Get deccryption/MAC key
+	IncomingKey dec_key;
+	if (incoming_key(state, key, ratchet_bit, now, &dec_key)) {
+		return -1;
+	}
+
+	//// No actions may be taken here until the message is authenticated!
+
+	LargeJob job;
+	bool authentic;
+
+	// If decrypting in-place,
+	if (plaintext == ciphertext) {
+		// Authenticate the whole message before decrypting any of it
+		large_job_init(&job, LARGE_AUTHENTICATE, dec_key.slot, iv, ciphertext, plaintext, bytes);
+		const u64 expected_tag = run_large_job_tag(&job, threads);
+
+		authentic = check_tag(expected_tag, tag, auth_shift);
+
+		if (authentic) {
+			job.op = LARGE_DECRYPT;
+			run_large_job(&job, threads, 0);
+		}
+	} else {
+		// Authenticate and decrypt into the output buffer in one pass
+		large_job_init(&job, LARGE_AUTH_DECRYPT, dec_key.slot, iv, ciphertext, plaintext, bytes);
+		const u64 expected_tag = run_large_job_tag(&job, threads);
+
+		authentic = check_tag(expected_tag, tag, auth_shift);
+
+		if (!authentic) {
+			// Do not release any plaintext from a forged message
+			secure_erase_large(plaintext, bytes);
+		}
+	}
+
+	CAT_SECURE_OBJCLR(job.chunk_mac);
+
+	if (!authentic) {
+		CAT_LOG(cout << "calico_decrypt_large: Message authentication failed" << endl);
+		release_incoming(&dec_key);
+		return -1;
+	}
+
+	// Keep a key derived for this message
+	commit_incoming(key, &dec_key);
+
+	// React to the ratchet bit
+	accept_ratchet_bit(state, key, ratchet_bit, now);
+
+	// Accept this IV
+	accept_message_iv(state, key, overhead_size, iv);
+
+	return 0;
+}
+
+
+//// Multi-threaded encryption
+
+int calico_sender_init(void *S, calico_sender *sender_object)
+{
+	InternalState *state = get_state(S);
+	SenderState *sender = get_sender(sender_object);
+
+	// If input is invalid or Calico object is not keyed for datagrams,
+	if (!m_initialized || !state || !sender || keyed_mode(state->primary.tx.flag) != FLAG_KEYED_DATAGRAM) {
+		CAT_LOG(cout << "calico_sender_init: Invalid input" << endl);
+		return -1;
+	}
+
+	sender->state = state;
+
+	// Start with an empty block, so the first message reserves one
+	sender->next_iv = 0;
+	sender->end_iv = 0;
+
+	load_sender_key(sender, state);
+
+	sender->flag = FLAG_SENDER;
+
+	return 0;
+}
+
+int calico_encrypt_sender(calico_sender *sender_object, void *ciphertext,
+						  const void *plaintext, int bytes, void *overhead,
+						  int overhead_size)
+{
+	return calico_encrypt_sender_at(sender_object, ciphertext, plaintext,
+									bytes, overhead, overhead_size,
+									m_clock.msec());
+}
+
+int calico_encrypt_sender_at(calico_sender *sender_object, void *ciphertext,
+							 const void *plaintext, int bytes, void *overhead,
+							 int overhead_size, unsigned int now_msec)
+{
+	SenderState *sender = get_sender(sender_object);
+
+	// If input is invalid or sender is not initialized,
+	if (!m_initialized || !sender || sender->flag != FLAG_SENDER ||
+		!plaintext || !ciphertext || bytes < 0 || !overhead) {
+		CAT_LOG(cout << "calico_encrypt_sender: Invalid input" << endl);
+		return -1;
+	}
+
+	// Only datagrams may be received out of order
+	if (overhead_size != CALICO_DATAGRAM_OVERHEAD) {
+		CAT_LOG(cout << "calico_encrypt_sender: Only datagram mode is supported" << endl);
+		return -1;
+	}
+
+	InternalState *state = sender->state;
+	Key *key = &state->primary;
+
+	// Ratchet the shared key if it is time to do so
+	ratchet_outgoing_shared(state, now_msec);
+
+	// If another sender ratcheted the key, pick up the new one
+	if (atomic_load_acquire(&state->out_epoch) != sender->epoch) {
+		load_sender_key(sender, state);
+	}
+
+	// If the block is used up, or the other senders have moved far ahead,
+	if (sender->next_iv == sender->end_iv ||
+		atomic_load_acquire64(&key->tx.iv) - sender->next_iv > SENDER_MAX_LAG) {
+		// Reserve the next block with one atomic add
+		const u64 iv = atomic_fetch_add64(&key->tx.iv, SENDER_IV_BLOCK);
+
+		// If out of IVs,
+		if (iv > 0xffffffffffffffffULL - SENDER_IV_BLOCK) {
+			CAT_LOG(cout << "calico_encrypt_sender: Refusing to continue encrypting after ran out of IVs" << endl);
+			return -1;
+		}
+
+		sender->next_iv = iv;
+		sender->end_iv = iv + SENDER_IV_BLOCK;
+	}
+
+	// Get next IV
+	const u64 iv = sender->next_iv++;
+
+	// Encrypt and generate MAC tag
+	const u64 tag = auth_encrypt(&sender->out_key, iv, 0, 0, plaintext, ciphertext, bytes);
+
+	// Write IV and tag
+	write_overhead(sender->active, iv, tag, overhead, overhead_size);
+
+	return 0;
+}
+
+void calico_sender_cleanup(calico_sender *sender_object)
+{
+	if (sender_object) {
+		cat_secure_erase(sender_object, sizeof(calico_sender));
+	}
+}
+
+
+//// Decryption
+
+int calico_decrypt(void *S, void *ciphertext, int bytes, const void *overhead,
+					int overhead_size)
+{
+	return decrypt_message(S, ciphertext, ciphertext, bytes, 0, 0, overhead,
+						   overhead_size, m_clock.msec());
+}
+
+int calico_decrypt_at(void *S, void *ciphertext, int bytes, const void *overhead,
+					  int overhead_size, unsigned int now_msec)
+{
+	return decrypt_message(S, ciphertext, ciphertext, bytes, 0, 0, overhead,
+						   overhead_size, now_msec);
+}
+
+int calico_decrypt_ad(void *S, void *ciphertext, int bytes, const void *ad,
+					  int ad_bytes, const void *overhead, int overhead_size)
+{
+	return decrypt_message(S, ciphertext, ciphertext, bytes, ad, ad_bytes,
+						   overhead, overhead_size, m_clock.msec());
+}
+
+int calico_decrypt_ad_at(void *S, void *ciphertext, int bytes, const void *ad,
+						 int ad_bytes, const void *overhead, int overhead_size,
+						 unsigned int now_msec)
+{
+	return decrypt_message(S, ciphertext, ciphertext, bytes, ad, ad_bytes,
+						   overhead, overhead_size, now_msec);
+}
+
+int calico_decrypt_concurrent(void *S, void *ciphertext, int bytes,
+							  const void *overhead, int overhead_size)
+{
+	return decrypt_concurrent(S, ciphertext, bytes, overhead, overhead_size,
+							  m_clock.msec());
+}
+
+int calico_decrypt_concurrent_at(void *S, void *ciphertext, int bytes,
+								 const void *overhead, int overhead_size,
+								 unsigned int now_msec)
+{
+	return decrypt_concurrent(S, ciphertext, bytes, overhead, overhead_size,
+							  now_msec);
+}
+
+int calico_decrypt_to(void *S, void *plaintext, const void *ciphertext,
+					  int bytes, const void *overhead, int overhead_size)
+{
+	// If output buffer is invalid,
+	if (!plaintext) {
+		CAT_LOG(cout << "calico_decrypt_to: Invalid input" << endl);
+		return -1;
+	}
+
+	return decrypt_message(S, plaintext, ciphertext, bytes, 0, 0, overhead,
+						   overhead_size, m_clock.msec());
+}
+
+int calico_decrypt_batch(void *S, calico_decrypt_desc *packets, int count,
+						 int overhead_size, int *results)
+{
+	return calico_decrypt_batch_at(S, packets, count, overhead_size, results,
+								   m_clock.msec());
+}
+
+int calico_decrypt_batch_at(void *S, calico_decrypt_desc *packets, int count,
+							int overhead_size, int *results,
+							unsigned int now_msec)
+{
+	InternalState *state = get_state(S);
+
+	// If input is invalid or Calico object is not keyed,
+	if (!m_initialized || !state || !packets || count < 0 || !results) {
+		CAT_LOG(cout << "calico_decrypt_batch: Invalid input" << endl);
+		return -1;
+	}
+
+	// Only datagrams may be decrypted out of order
+	if (overhead_size != CALICO_DATAGRAM_OVERHEAD) {
+		CAT_LOG(cout << "calico_decrypt_batch: Only datagram mode is supported" << endl);
+		return -1;
+	}
+
+	// Validate all of the packets before any state is changed
+	for (int ii = 0; ii < count; ++ii) {
+		const calico_decrypt_desc *pkt = packets + ii;
+
+		if (!pkt->ciphertext || pkt->bytes < 0 || !pkt->overhead) {
+			CAT_LOG(cout << "calico_decrypt_batch: Invalid packet " << ii << endl);
+			return -1;
+		}
+	}
+
+	// Select key
+	Key *key = select_key(state, overhead_size, state->primary.rx.flag);
+	if (!key) {
+		CAT_LOG(cout << "calico_decrypt_batch: Unkeyed datagram mode" << endl);
+		return -1;
+	}
+
+	// If ratcheting is happening already, handle ratchet update once for the
+	// whole batch
+	handle_ratchet(state, key, now_msec);
+
+	antireplay_state window;
+	get_window(state, &window);
+
+	// Process the batch in groups of up to GROUP packets to bound stack usage
+	static const int GROUP = 64;
+	u64 ivs[GROUP];
+	u32 ratchet_bits[GROUP];
+	u64 tags[GROUP];
+	chacha_lane lanes[GROUP];
+	siphash_lane macs[GROUP];
+	u64 expected_tags[GROUP];
+
+	int offset = 0;
+
+	while (offset < count) {
+		calico_decrypt_desc *group = packets + offset;
+		int *group_results = results + offset;
+		const int group_count = (count - offset < GROUP) ? count - offset : GROUP;
+
+		// Read all of the IVs up front, relative to the same window position
+		const u64 newest_iv = key->rx.iv;
+
+		// Keys for each ratchet bit, looked up when first needed
+		IncomingKey dec_keys[2];
+		bool have_keys[2] = { false, false };
+
+		//// No actions may be taken here until the messages are authenticated!
+
+		int mac_count = 0;
+
+		for (int ii = 0; ii < group_count; ++ii) {
+			const calico_decrypt_desc *pkt = group + ii;
+
+			tags[ii] = read_datagram_overhead(pkt->overhead, newest_iv,
+											  ratchet_bits[ii], ivs[ii]);
+
+			// Validate IV
+			if (!antireplay_check(&window, ivs[ii])) {
+				CAT_LOG(cout << "calico_decrypt_batch: IV was replayed or too old for packet " << offset + ii << endl);
+				group_results[ii] = -1;
+				continue;
+			}
+
+			// Get deccryption/MAC key
+			const u32 ratchet_bit = ratchet_bits[ii];
+			if (!have_keys[ratchet_bit]) {
+				if (incoming_key(state, key, ratchet_bit, now_msec, &dec_keys[ratchet_bit])) {
+					group_results[ii] = -1;
+					continue;
+				}
+
+				have_keys[ratchet_bit] = true;
+			}
+
+			// Queue for authentication
+			siphash_lane *mac = macs + mac_count++;
+			mac->key = dec_keys[ratchet_bit].slot->key + 32;
+			mac->data = pkt->ciphertext;
+			mac->bytes = pkt->bytes;
+			mac->ad = ivs[ii];
+
+			group_results[ii] = 0;
+		}
+
+		// Generate expected MAC tags for all of the queued packets at once
+		siphash24_lanes(macs, mac_count, expected_tags);
+
+		// Authenticate the messages
+		for (int ii = 0, jj = 0; ii < group_count; ++ii) {
+			if (group_results[ii]) {
+				continue;
+			}
+
+			if (!check_tag(expected_tags[jj++], tags[ii], 0)) {
+				CAT_LOG(cout << "calico_decrypt_batch: Message authentication failed for packet " << offset + ii << endl);
+				group_results[ii] = -1;
+			}
+		}
+
+		// Commit the authenticated packets in order, stopping at the first
+		// packet whose IV reads differently now that the window has moved
+		int lane_count = 0;
+		int done = group_count;
+
+		for (int ii = 0; ii < group_count; ++ii) {
+			if (key->rx.iv != newest_iv) {
+				u32 ratchet_bit;
+				u64 iv;
+				read_datagram_overhead(group[ii].overhead, key->rx.iv, ratchet_bit, iv);
+
+				// calico_decrypt() would read a different IV for this packet
+				if (iv != ivs[ii]) {
+					done = ii;
+					break;
+				}
+			}
+
+			if (group_results[ii]) {
+				continue;
+			}
+
+			const calico_decrypt_desc *pkt = group + ii;
+			const u64 iv = ivs[ii];
+
+			// Drop duplicates of a packet accepted earlier in the batch
+			if (!antireplay_check(&window, iv)) {
+				CAT_LOG(cout << "calico_decrypt_batch: IV was replayed within the batch" << endl);
+				group_results[ii] = -1;
+				continue;
+			}
+
+			// Keep a key derived for this message
+			commit_incoming(key, &dec_keys[ratchet_bits[ii]]);
+
+			// Queue for decryption
+			chacha_lane *lane = lanes + lane_count++;
+			lane->key = dec_keys[ratchet_bits[ii]].slot->key;
+			lane->iv = iv;
+			lane->in = pkt->ciphertext;
+			lane->out = pkt->ciphertext;
+			lane->bytes = pkt->bytes;
+
+			// Accept this IV
+			antireplay_accept(&window, iv);
+		}
+
+		// Decrypt all of the accepted packets at once
+		chacha_lanes(lanes, lane_count, 14);
+
+		// Erase any key derived only for packets that did not authenticate
+		for (int bit = 0; bit < 2; ++bit) {
+			if (have_keys[bit]) {
+				release_incoming(&dec_keys[bit]);
+			}
+		}
+
+		// React to the ratchet bits in order, after the keys have been used
+		for (int ii = 0; ii < done; ++ii) {
+			if (!group_results[ii]) {
+				accept_ratchet_bit(state, key, ratchet_bits[ii], now_msec);
+			}
+		}
+
+		offset += done;
+
+		// Decrypt the packet that stopped the group on its own, which reads
+		// its IV from the window as it is now
+		if (done < group_count) {
+			calico_decrypt_desc *pkt = group + done;
+
+			group_results[done] = decrypt_message(S, pkt->ciphertext, pkt->ciphertext,
+												  pkt->bytes, 0, 0, pkt->overhead,
+												  CALICO_DATAGRAM_OVERHEAD, now_msec);
+			++offset;
+		}
+	}
 
 	return 0;
 }
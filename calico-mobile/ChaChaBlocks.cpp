@@ -0,0 +1,487 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ChaChaBlocks.hpp"
+#include "SecureErase.hpp"
+using namespace cat;
+
+#include <cstring>
+
+
+#ifdef CAT_HAS_X86_DISPATCH
+
+/*
+ * The SIMD kernels below keep one state word per register and one block per
+ * 32-bit lane, so every round is done for 4, 8 or 16 consecutive blocks at
+ * once.  The keystream is transposed back into block order on output.
+ */
+
+// Set up the counter words for consecutive blocks
+static void chacha_counters(u64 counter, int count, u32 *lo, u32 *hi)
+{
+	for (int ii = 0; ii < count; ++ii) {
+		const u64 c = counter + ii;
+		lo[ii] = (u32)c;
+		hi[ii] = (u32)(c >> 32);
+	}
+}
+
+// XOR the keystream into up to 64 bytes of one block
+static void chacha_xor_partial(const u8 *in, u8 *out, const u8 *keystream, size_t bytes)
+{
+	for (size_t ii = 0; ii < bytes; ++ii) {
+		out[ii] = (in ? in[ii] : 0) ^ keystream[ii];
+	}
+}
+
+#define CAT_CHACHA_QUARTER(vadd, vxor, rotl16, rotl12, rotl8, rotl7, a, b, c, d) \
+	a = vadd(a, b); d = rotl16(vxor(d, a)); \
+	c = vadd(c, d); b = rotl12(vxor(b, c)); \
+	a = vadd(a, b); d = rotl8(vxor(d, a)); \
+	c = vadd(c, d); b = rotl7(vxor(b, c));
+
+#define CAT_CHACHA_DOUBLE_ROUND(Q, x) \
+	Q(x[0], x[4], x[8], x[12]) \
+	Q(x[1], x[5], x[9], x[13]) \
+	Q(x[2], x[6], x[10], x[14]) \
+	Q(x[3], x[7], x[11], x[15]) \
+	Q(x[0], x[5], x[10], x[15]) \
+	Q(x[1], x[6], x[11], x[12]) \
+	Q(x[2], x[7], x[8], x[13]) \
+	Q(x[3], x[4], x[9], x[14])
+
+
+//// SSE2 and SSSE3: 4 blocks per pass
+
+#define CAT_SSE_ROTL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n))
+#define CAT_SSE2_ROTL16(x) CAT_SSE_ROTL(x, 16)
+#define CAT_SSE2_ROTL12(x) CAT_SSE_ROTL(x, 12)
+#define CAT_SSE2_ROTL8(x) CAT_SSE_ROTL(x, 8)
+#define CAT_SSE2_ROTL7(x) CAT_SSE_ROTL(x, 7)
+#define CAT_SSSE3_ROTL16(x) _mm_shuffle_epi8(x, rot16)
+#define CAT_SSSE3_ROTL8(x) _mm_shuffle_epi8(x, rot8)
+
+#define CAT_SSE2_QUARTER(a, b, c, d) \
+	CAT_CHACHA_QUARTER(_mm_add_epi32, _mm_xor_si128, CAT_SSE2_ROTL16, CAT_SSE2_ROTL12, CAT_SSE2_ROTL8, CAT_SSE2_ROTL7, a, b, c, d)
+#define CAT_SSSE3_QUARTER(a, b, c, d) \
+	CAT_CHACHA_QUARTER(_mm_add_epi32, _mm_xor_si128, CAT_SSSE3_ROTL16, CAT_SSE2_ROTL12, CAT_SSSE3_ROTL8, CAT_SSE2_ROTL7, a, b, c, d)
+
+// Transpose a 4x4 matrix of 32-bit words held in 4 registers
+#define CAT_SSE_TRANSPOSE4(r) { \
+	const __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]); \
+	const __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]); \
+	const __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]); \
+	const __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]); \
+	r[0] = _mm_unpacklo_epi64(t0, t1); \
+	r[1] = _mm_unpackhi_epi64(t0, t1); \
+	r[2] = _mm_unpacklo_epi64(t2, t3); \
+	r[3] = _mm_unpackhi_epi64(t2, t3); }
+
+// One ChaCha quarter-round on whole rows, for the single block path
+#define CAT_SSE_ROW_QUARTER(ROTL16, ROTL8, a, b, c, d) \
+	CAT_CHACHA_QUARTER(_mm_add_epi32, _mm_xor_si128, ROTL16, CAT_SSE2_ROTL12, ROTL8, CAT_SSE2_ROTL7, a, b, c, d)
+
+/*
+ * Runs 4 blocks per pass with one state word per register, and then the
+ * last 1..3 blocks one at a time with one row of the state per register
+ */
+#define CAT_CHACHA_SSE_KERNEL(QUARTER, ROTL16, ROTL8) { \
+	chacha_input *S = reinterpret_cast<chacha_input *>( state ); \
+	u32 j[12]; \
+	memcpy(j, S->s, sizeof(j)); \
+	u64 counter = j[8] | ((u64)j[9] << 32); \
+	const int rounds = (int)S->rounds; \
+	CAT_ALIGNED(16) u32 lo[4], hi[4]; \
+	while (bytes >= 4 * 64) { \
+		__m128i x[16]; \
+		x[0] = _mm_set1_epi32(0x61707865); \
+		x[1] = _mm_set1_epi32(0x3320646e); \
+		x[2] = _mm_set1_epi32(0x79622d32); \
+		x[3] = _mm_set1_epi32(0x6b206574); \
+		for (int ii = 0; ii < 8; ++ii) x[4 + ii] = _mm_set1_epi32(j[ii]); \
+		chacha_counters(counter, 4, lo, hi); \
+		x[12] = _mm_load_si128((const __m128i *)lo); \
+		x[13] = _mm_load_si128((const __m128i *)hi); \
+		x[14] = _mm_set1_epi32(j[10]); \
+		x[15] = _mm_set1_epi32(j[11]); \
+		for (int r = rounds; r > 0; r -= 2) { \
+			CAT_CHACHA_DOUBLE_ROUND(QUARTER, x) \
+		} \
+		x[0] = _mm_add_epi32(x[0], _mm_set1_epi32(0x61707865)); \
+		x[1] = _mm_add_epi32(x[1], _mm_set1_epi32(0x3320646e)); \
+		x[2] = _mm_add_epi32(x[2], _mm_set1_epi32(0x79622d32)); \
+		x[3] = _mm_add_epi32(x[3], _mm_set1_epi32(0x6b206574)); \
+		for (int ii = 0; ii < 8; ++ii) x[4 + ii] = _mm_add_epi32(x[4 + ii], _mm_set1_epi32(j[ii])); \
+		x[12] = _mm_add_epi32(x[12], _mm_load_si128((const __m128i *)lo)); \
+		x[13] = _mm_add_epi32(x[13], _mm_load_si128((const __m128i *)hi)); \
+		x[14] = _mm_add_epi32(x[14], _mm_set1_epi32(j[10])); \
+		x[15] = _mm_add_epi32(x[15], _mm_set1_epi32(j[11])); \
+		CAT_SSE_TRANSPOSE4(x) \
+		CAT_SSE_TRANSPOSE4((x + 4)) \
+		CAT_SSE_TRANSPOSE4((x + 8)) \
+		CAT_SSE_TRANSPOSE4((x + 12)) \
+		for (int b = 0; b < 4; ++b) { \
+			for (int g = 0; g < 4; ++g) { \
+				__m128i k = x[4 * g + b]; \
+				if (in) k = _mm_xor_si128(k, _mm_loadu_si128((const __m128i *)(in + 64 * b + 16 * g))); \
+				_mm_storeu_si128((__m128i *)(out + 64 * b + 16 * g), k); \
+			} \
+		} \
+		counter += 4; \
+		if (in) in += 4 * 64; \
+		out += 4 * 64; \
+		bytes -= 4 * 64; \
+	} \
+	const __m128i r0 = _mm_setr_epi32(0x61707865, 0x3320646e, 0x79622d32, 0x6b206574); \
+	const __m128i r1 = _mm_loadu_si128((const __m128i *)S->s); \
+	const __m128i r2 = _mm_loadu_si128((const __m128i *)(S->s + 16)); \
+	CAT_ALIGNED(16) u8 tmp[64]; \
+	while (bytes > 0) { \
+		const __m128i r3 = _mm_setr_epi32((u32)counter, (u32)(counter >> 32), j[10], j[11]); \
+		__m128i a = r0, b = r1, c = r2, d = r3; \
+		for (int r = rounds; r > 0; r -= 2) { \
+			CAT_SSE_ROW_QUARTER(ROTL16, ROTL8, a, b, c, d) \
+			b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1)); \
+			c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+			d = _mm_shuffle_epi32(d, _MM_SHUFFLE(2, 1, 0, 3)); \
+			CAT_SSE_ROW_QUARTER(ROTL16, ROTL8, a, b, c, d) \
+			b = _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3)); \
+			c = _mm_shuffle_epi32(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+			d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1)); \
+		} \
+		__m128i k[4]; \
+		k[0] = _mm_add_epi32(a, r0); \
+		k[1] = _mm_add_epi32(b, r1); \
+		k[2] = _mm_add_epi32(c, r2); \
+		k[3] = _mm_add_epi32(d, r3); \
+		++counter; \
+		if (bytes < 64) { \
+			for (int g = 0; g < 4; ++g) _mm_store_si128((__m128i *)(tmp + 16 * g), k[g]); \
+			chacha_xor_partial(in, out, tmp, bytes); \
+			CAT_SECURE_OBJCLR(tmp); \
+			break; \
+		} \
+		for (int g = 0; g < 4; ++g) { \
+			if (in) k[g] = _mm_xor_si128(k[g], _mm_loadu_si128((const __m128i *)(in + 16 * g))); \
+			_mm_storeu_si128((__m128i *)(out + 16 * g), k[g]); \
+		} \
+		if (in) in += 64; \
+		out += 64; \
+		bytes -= 64; \
+	} \
+	j[8] = (u32)counter; \
+	j[9] = (u32)(counter >> 32); \
+	memcpy(S->s + 32, j + 8, 8); }
+
+CAT_TARGET("sse2")
+static void chacha_blocks_sse2(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes)
+{
+	CAT_CHACHA_SSE_KERNEL(CAT_SSE2_QUARTER, CAT_SSE2_ROTL16, CAT_SSE2_ROTL8)
+}
+
+CAT_TARGET("ssse3")
+static void chacha_blocks_ssse3(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes)
+{
+	const __m128i rot16 = _mm_setr_epi8(2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13);
+	const __m128i rot8 = _mm_setr_epi8(3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14);
+
+	CAT_CHACHA_SSE_KERNEL(CAT_SSSE3_QUARTER, CAT_SSSE3_ROTL16, CAT_SSSE3_ROTL8)
+}
+
+
+//// AVX2: 8 blocks per pass
+
+#define CAT_AVX2_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n))
+#define CAT_AVX2_ROTL16(x) _mm256_shuffle_epi8(x, rot16)
+#define CAT_AVX2_ROTL12(x) CAT_AVX2_ROTL(x, 12)
+#define CAT_AVX2_ROTL8(x) _mm256_shuffle_epi8(x, rot8)
+#define CAT_AVX2_ROTL7(x) CAT_AVX2_ROTL(x, 7)
+
+#define CAT_AVX2_QUARTER(a, b, c, d) \
+	CAT_CHACHA_QUARTER(_mm256_add_epi32, _mm256_xor_si256, CAT_AVX2_ROTL16, CAT_AVX2_ROTL12, CAT_AVX2_ROTL8, CAT_AVX2_ROTL7, a, b, c, d)
+
+// Transpose an 8x8 matrix of 32-bit words held in 8 registers
+CAT_TARGET("avx2")
+static CAT_INLINE void chacha_transpose8(__m256i r[8])
+{
+	const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+CAT_TARGET("avx2")
+static void chacha_blocks_avx2(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes)
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+		2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13,
+		2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13);
+	const __m256i rot8 = _mm256_setr_epi8(
+		3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14,
+		3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14);
+
+	chacha_input *S = reinterpret_cast<chacha_input *>( state );
+	u32 j[12];
+	memcpy(j, S->s, sizeof(j));
+	u64 counter = j[8] | ((u64)j[9] << 32);
+	const int rounds = (int)S->rounds;
+
+	CAT_ALIGNED(32) u32 lo[8], hi[8];
+
+	while (bytes >= 8 * 64) {
+		__m256i x[16];
+
+		x[0] = _mm256_set1_epi32(0x61707865);
+		x[1] = _mm256_set1_epi32(0x3320646e);
+		x[2] = _mm256_set1_epi32(0x79622d32);
+		x[3] = _mm256_set1_epi32(0x6b206574);
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = _mm256_set1_epi32(j[ii]);
+		}
+		chacha_counters(counter, 8, lo, hi);
+		x[12] = _mm256_load_si256((const __m256i *)lo);
+		x[13] = _mm256_load_si256((const __m256i *)hi);
+		x[14] = _mm256_set1_epi32(j[10]);
+		x[15] = _mm256_set1_epi32(j[11]);
+
+		for (int r = rounds; r > 0; r -= 2) {
+			CAT_CHACHA_DOUBLE_ROUND(CAT_AVX2_QUARTER, x)
+		}
+
+		x[0] = _mm256_add_epi32(x[0], _mm256_set1_epi32(0x61707865));
+		x[1] = _mm256_add_epi32(x[1], _mm256_set1_epi32(0x3320646e));
+		x[2] = _mm256_add_epi32(x[2], _mm256_set1_epi32(0x79622d32));
+		x[3] = _mm256_add_epi32(x[3], _mm256_set1_epi32(0x6b206574));
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = _mm256_add_epi32(x[4 + ii], _mm256_set1_epi32(j[ii]));
+		}
+		x[12] = _mm256_add_epi32(x[12], _mm256_load_si256((const __m256i *)lo));
+		x[13] = _mm256_add_epi32(x[13], _mm256_load_si256((const __m256i *)hi));
+		x[14] = _mm256_add_epi32(x[14], _mm256_set1_epi32(j[10]));
+		x[15] = _mm256_add_epi32(x[15], _mm256_set1_epi32(j[11]));
+
+		// Convert from one word per register to one half-block per register
+		chacha_transpose8(x);
+		chacha_transpose8(x + 8);
+
+		for (int b = 0; b < 8; ++b) {
+			__m256i k0 = x[b], k1 = x[8 + b];
+			if (in) {
+				k0 = _mm256_xor_si256(k0, _mm256_loadu_si256((const __m256i *)(in + 64 * b)));
+				k1 = _mm256_xor_si256(k1, _mm256_loadu_si256((const __m256i *)(in + 64 * b + 32)));
+			}
+			_mm256_storeu_si256((__m256i *)(out + 64 * b), k0);
+			_mm256_storeu_si256((__m256i *)(out + 64 * b + 32), k1);
+		}
+
+		counter += 8;
+		if (in) in += 8 * 64;
+		out += 8 * 64;
+		bytes -= 8 * 64;
+	}
+
+	// Store the counter back to the state
+	j[8] = (u32)counter;
+	j[9] = (u32)(counter >> 32);
+	memcpy(S->s + 32, j + 8, 8);
+
+	_mm256_zeroall();
+
+	// Short messages and the remainder use the narrower kernel
+	if (bytes > 0) {
+		chacha_blocks_ssse3(state, in, out, bytes);
+	}
+}
+
+
+
+//// AVX-512: 16 blocks per pass
+
+#ifdef CAT_HAS_AVX512_DISPATCH
+
+#define CAT_AVX512_QUARTER(a, b, c, d) \
+	CAT_CHACHA_QUARTER(_mm512_add_epi32, _mm512_xor_si512, CAT_AVX512_ROTL16, CAT_AVX512_ROTL12, CAT_AVX512_ROTL8, CAT_AVX512_ROTL7, a, b, c, d)
+#define CAT_AVX512_ROTL16(x) _mm512_rol_epi32(x, 16)
+#define CAT_AVX512_ROTL12(x) _mm512_rol_epi32(x, 12)
+#define CAT_AVX512_ROTL8(x) _mm512_rol_epi32(x, 8)
+#define CAT_AVX512_ROTL7(x) _mm512_rol_epi32(x, 7)
+
+// Transpose a 16x16 matrix of 32-bit words held in 16 registers
+CAT_TARGET("avx512f")
+static CAT_INLINE void chacha_transpose16(__m512i r[16])
+{
+	__m512i t[16], u[16];
+
+	// Interleave words, then pairs of words, within each 128-bit lane
+	for (int ii = 0; ii < 16; ii += 2) {
+		t[ii] = _mm512_unpacklo_epi32(r[ii], r[ii + 1]);
+		t[ii + 1] = _mm512_unpackhi_epi32(r[ii], r[ii + 1]);
+	}
+	for (int ii = 0; ii < 16; ii += 4) {
+		u[ii] = _mm512_unpacklo_epi64(t[ii], t[ii + 2]);
+		u[ii + 1] = _mm512_unpackhi_epi64(t[ii], t[ii + 2]);
+		u[ii + 2] = _mm512_unpacklo_epi64(t[ii + 1], t[ii + 3]);
+		u[ii + 3] = _mm512_unpackhi_epi64(t[ii + 1], t[ii + 3]);
+	}
+
+	// Gather the 128-bit lanes of each block into one register
+	for (int k = 0; k < 4; ++k) {
+		const __m512i v0 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0x88);
+		const __m512i v1 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0xdd);
+		const __m512i w0 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0x88);
+		const __m512i w1 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0xdd);
+
+		r[k] = _mm512_shuffle_i32x4(v0, w0, 0x88);
+		r[4 + k] = _mm512_shuffle_i32x4(v1, w1, 0x88);
+		r[8 + k] = _mm512_shuffle_i32x4(v0, w0, 0xdd);
+		r[12 + k] = _mm512_shuffle_i32x4(v1, w1, 0xdd);
+	}
+}
+
+CAT_TARGET("avx512f")
+static void chacha_blocks_avx512(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes)
+{
+	chacha_input *S = reinterpret_cast<chacha_input *>( state );
+	u32 j[12];
+	memcpy(j, S->s, sizeof(j));
+	u64 counter = j[8] | ((u64)j[9] << 32);
+	const int rounds = (int)S->rounds;
+
+	CAT_ALIGNED(64) u32 lo[16], hi[16];
+
+	while (bytes >= 16 * 64) {
+		__m512i x[16];
+
+		x[0] = _mm512_set1_epi32(0x61707865);
+		x[1] = _mm512_set1_epi32(0x3320646e);
+		x[2] = _mm512_set1_epi32(0x79622d32);
+		x[3] = _mm512_set1_epi32(0x6b206574);
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = _mm512_set1_epi32(j[ii]);
+		}
+		chacha_counters(counter, 16, lo, hi);
+		x[12] = _mm512_load_si512(lo);
+		x[13] = _mm512_load_si512(hi);
+		x[14] = _mm512_set1_epi32(j[10]);
+		x[15] = _mm512_set1_epi32(j[11]);
+
+		for (int r = rounds; r > 0; r -= 2) {
+			CAT_CHACHA_DOUBLE_ROUND(CAT_AVX512_QUARTER, x)
+		}
+
+		x[0] = _mm512_add_epi32(x[0], _mm512_set1_epi32(0x61707865));
+		x[1] = _mm512_add_epi32(x[1], _mm512_set1_epi32(0x3320646e));
+		x[2] = _mm512_add_epi32(x[2], _mm512_set1_epi32(0x79622d32));
+		x[3] = _mm512_add_epi32(x[3], _mm512_set1_epi32(0x6b206574));
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = _mm512_add_epi32(x[4 + ii], _mm512_set1_epi32(j[ii]));
+		}
+		x[12] = _mm512_add_epi32(x[12], _mm512_load_si512(lo));
+		x[13] = _mm512_add_epi32(x[13], _mm512_load_si512(hi));
+		x[14] = _mm512_add_epi32(x[14], _mm512_set1_epi32(j[10]));
+		x[15] = _mm512_add_epi32(x[15], _mm512_set1_epi32(j[11]));
+
+		// Convert from one word per register to one block per register
+		chacha_transpose16(x);
+
+		for (int b = 0; b < 16; ++b) {
+			__m512i k = x[b];
+			if (in) {
+				k = _mm512_xor_si512(k, _mm512_loadu_si512(in + 64 * b));
+			}
+			_mm512_storeu_si512(out + 64 * b, k);
+		}
+
+		counter += 16;
+		if (in) in += 16 * 64;
+		out += 16 * 64;
+		bytes -= 16 * 64;
+	}
+
+	// Store the counter back to the state
+	j[8] = (u32)counter;
+	j[9] = (u32)(counter >> 32);
+	memcpy(S->s + 32, j + 8, 8);
+
+	_mm256_zeroall();
+
+	// Short messages and the remainder use the narrower kernels
+	if (bytes > 0) {
+		chacha_blocks_avx2(state, in, out, bytes);
+	}
+}
+
+#endif // CAT_HAS_AVX512_DISPATCH
+
+#endif // CAT_HAS_X86_DISPATCH
+
+
+namespace cat {
+
+const cpu_kernel<chacha_blocks_fn> chacha_blocks_kernels[] = {
+#ifdef CAT_HAS_AVX512_DISPATCH
+	{ "avx512", CPU_AVX512, chacha_blocks_avx512 },
+#endif
+#ifdef CAT_HAS_X86_DISPATCH
+	{ "avx2", CPU_AVX2, chacha_blocks_avx2 },
+	{ "ssse3", CPU_SSSE3, chacha_blocks_ssse3 },
+	{ "sse2", CPU_SSE2, chacha_blocks_sse2 },
+#endif
+	{ "ref", 0, chacha_blocks_ref }
+};
+
+cpu_kernel<chacha_blocks_fn> chacha_blocks_kernel = { "ref", 0, chacha_blocks_ref };
+
+void chacha_blocks_select(u32 features)
+{
+	chacha_blocks_kernel = cpu_select(chacha_blocks_kernels, features);
+}
+
+} // namespace cat
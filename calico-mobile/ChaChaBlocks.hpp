@@ -0,0 +1,105 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_CHACHA_BLOCKS_HPP
+#define CAT_CHACHA_BLOCKS_HPP
+
+#include "CpuDispatch.hpp"
+#include "EndianNeutral.hpp"
+#include "chacha.h"
+
+#include <cstring>
+
+/*
+ * ChaCha block function with runtime kernel selection
+ *
+ * chacha_blocks() has the same interface as the chacha_blocks_ref() kernel:
+ * it continues from the block counter stored in the state, and the counter
+ * is advanced by one for each block including a final partial block.
+ * Input may be null to produce the raw keystream.
+ */
+
+// Portable kernel
+extern "C" void chacha_blocks_ref(chacha_state_t *state, const uint8_t *in, uint8_t *out, size_t bytes);
+
+namespace cat {
+
+
+// Block function input: the prefix of the state written by chacha_init()
+// that the kernels read and update.  A chacha_input may be passed to any
+// kernel in place of a full chacha_state
+struct chacha_input {
+	u8 s[48];		// key | counter | iv
+	size_t rounds;
+};
+
+// Expand a key into a block function input with zero counter and the given IV
+static CAT_INLINE void chacha_input_init(chacha_input *input, const char key[32], int rounds, u64 iv = 0)
+{
+	memcpy(input->s, key, 32);
+	memset(input->s + 32, 0, 8);
+
+	iv = getLE(iv);
+	memcpy(input->s + 40, &iv, 8);
+
+	input->rounds = rounds;
+}
+
+// Move to the given block of the keystream
+static CAT_INLINE void chacha_input_seek(chacha_input *input, u64 block)
+{
+	block = getLE(block);
+	memcpy(input->s + 32, &block, 8);
+}
+
+typedef void (*chacha_blocks_fn)(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes);
+
+// All kernels built into the library, from most to least preferred
+extern const cpu_kernel<chacha_blocks_fn> chacha_blocks_kernels[];
+
+// Kernel currently in use
+extern cpu_kernel<chacha_blocks_fn> chacha_blocks_kernel;
+
+// Select the best kernel for the given CPU features
+void chacha_blocks_select(u32 features);
+
+// Encrypt or decrypt with the selected kernel
+static CAT_INLINE void chacha_blocks(chacha_state_t *state, const u8 *in, u8 *out, size_t bytes)
+{
+	chacha_blocks_kernel.fn(state, in, out, bytes);
+}
+
+static CAT_INLINE void chacha_blocks(chacha_input *input, const u8 *in, u8 *out, size_t bytes)
+{
+	chacha_blocks_kernel.fn(reinterpret_cast<chacha_state_t *>( input ), in, out, bytes);
+}
+
+
+} // namespace cat
+
+#endif // CAT_CHACHA_BLOCKS_HPP
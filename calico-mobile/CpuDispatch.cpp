@@ -0,0 +1,120 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "CpuDispatch.hpp"
+using namespace cat;
+
+#ifdef CAT_HAS_X86_DISPATCH
+
+#if defined(CAT_COMPILER_MSVC)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void cpuid(u32 leaf, u32 subleaf, u32 regs[4])
+{
+#if defined(CAT_COMPILER_MSVC)
+	__cpuidex((int *)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Read the register state that the OS saves on context switches
+static u64 xgetbv0()
+{
+#if defined(CAT_COMPILER_MSVC)
+	return _xgetbv(0);
+#else
+	u32 lo, hi;
+	__asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((u64)hi << 32) | lo;
+#endif
+}
+
+u32 cat::cpu_features()
+{
+	u32 regs[4];
+	u32 features = 0;
+
+	cpuid(0, 0, regs);
+	const u32 max_leaf = regs[0];
+
+	if (max_leaf < 1) {
+		return 0;
+	}
+
+	cpuid(1, 0, regs);
+	const u32 ecx1 = regs[2], edx1 = regs[3];
+
+	if (edx1 & (1 << 26)) {
+		features |= CPU_SSE2;
+	}
+	if (ecx1 & (1 << 9)) {
+		features |= CPU_SSSE3;
+	}
+	if (ecx1 & (1 << 19)) {
+		features |= CPU_SSE41;
+	}
+
+	// AVX state must be enabled by the OS before AVX2 or AVX-512 can be used
+	if (!(ecx1 & (1 << 27)) || !(ecx1 & (1 << 28)) || max_leaf < 7) {
+		return features;
+	}
+
+	const u64 xcr0 = xgetbv0();
+	if ((xcr0 & 0x06) != 0x06) {
+		return features;
+	}
+
+	cpuid(7, 0, regs);
+	const u32 ebx7 = regs[1];
+
+	if (ebx7 & (1 << 5)) {
+		features |= CPU_AVX2;
+	}
+
+	// AVX-512 F, BW and VL, with opmask and ZMM state enabled
+	const u32 avx512_bits = (1 << 16) | (1 << 30) | ((u32)1 << 31);
+	if ((features & CPU_AVX2) && (ebx7 & avx512_bits) == avx512_bits &&
+		(xcr0 & 0xe6) == 0xe6) {
+		features |= CPU_AVX512;
+	}
+
+	return features;
+}
+
+#else // CAT_HAS_X86_DISPATCH
+
+u32 cat::cpu_features()
+{
+	return 0;
+}
+
+#endif // CAT_HAS_X86_DISPATCH
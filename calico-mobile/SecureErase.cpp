@@ -26,6 +26,11 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+	Fixed copy of libcat/SecureErase.cpp: the unaligned 32-byte loop there
+	never advances its pointer, so only the first 32 bytes get erased.
+*/
+
 #include "SecureErase.hpp"
 using namespace cat;
 
@@ -56,6 +61,7 @@ void cat_secure_erase(volatile void *data, int len) {
 			word[1] = 0;
 			word[2] = 0;
 			word[3] = 0;
+			word += 4;
 			words -= 4;
 		}
 #ifdef CAT_HAS_VECTOR_EXTENSIONS
@@ -0,0 +1,512 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "calico.h"
+
+#include "Atomic.hpp"
+#include "Thread.hpp"
+#include "SecureErase.hpp"
+using namespace cat;
+
+#include <cstring>
+
+/*
+ * Session table
+ *
+ * Each shard has its own state objects, free list and open-addressing index,
+ * so a core that owns a shard never shares cache lines with another core.
+ * The index is a power-of-two array of 64-byte buckets.  One bucket holds
+ * five connection IDs and the state slots they map to, so a lookup that
+ * hits the first bucket costs one cache miss before the state itself.
+ *
+ * Lookups take no lock.  Each bucket has a sequence number that is odd while
+ * it is being written, and a reader retries if it changes under it.  Inserts
+ * and evictions take a per-shard lock, so they only wait for other writers
+ * on the same shard.
+ *
+ * Buckets are probed in order until one with a never-used entry is found.
+ * An evicted entry is marked as a tombstone so later entries stay reachable,
+ * unless its bucket has a never-used entry, in which case no probe ever
+ * passed through it and the entry can be freed outright.
+ */
+
+// Size of a cache line
+#define CAT_CACHE_LINE_BYTES 64
+
+// Constant to indicate the session table is initialized
+static const u32 FLAG_SESSIONS = 0x6501cd7a;
+
+// Number of entries in one bucket
+static const int BUCKET_ENTRIES = 5;
+
+// Slot values for entries that do not map to a state object
+static const u32 SLOT_EMPTY = 0;
+static const u32 SLOT_TOMBSTONE = 0xffffffff;
+
+// Largest number of shards in one table
+static const int MAX_SHARDS = 1024;
+
+// Bytes reserved for each state object
+static const u64 STATE_BYTES = (sizeof(calico_state) + CAT_CACHE_LINE_BYTES - 1) & ~(u64)(CAT_CACHE_LINE_BYTES - 1);
+
+// One cache line of the index
+struct SessionBucket {
+	// Incremented before and after each write, so odd while being written
+	volatile u32 sequence;
+
+	// State slot index + 1, SLOT_EMPTY or SLOT_TOMBSTONE
+	volatile u32 slots[BUCKET_ENTRIES];
+
+	// Connection IDs
+	volatile u64 ids[BUCKET_ENTRIES];
+};
+
+struct SessionShard {
+	// Held by inserts and evictions
+	volatile u32 lock;
+
+	// Number of buckets - 1
+	u32 bucket_mask;
+
+	// Number of state slots and how many are on the free list
+	u32 slot_count;
+	u32 free_count;
+
+	SessionBucket *buckets;
+	u32 *free_slots;
+	u8 *states;
+};
+
+struct SessionTable {
+	u32 flag;
+	u32 shard_count;
+
+	// Shards follow, each on its own cache line
+};
+
+// Sizes of the parts of one shard
+struct SessionLayout {
+	u32 shard_slots;
+	u32 bucket_count;
+	u64 shard_bytes;
+	u64 table_bytes;
+};
+
+// Helper function to round up to a whole number of cache lines
+static CAT_INLINE u64 round_to_line(u64 bytes)
+{
+	return (bytes + CAT_CACHE_LINE_BYTES - 1) & ~(u64)(CAT_CACHE_LINE_BYTES - 1);
+}
+
+// Helper function to work out where everything goes in the table memory
+// Returns false if the parameters are invalid
+static bool session_layout(unsigned int capacity, int shards, SessionLayout *layout)
+{
+	if (capacity < 1 || shards < 1 || shards > MAX_SHARDS) {
+		return false;
+	}
+
+	// Give each shard some slack, since IDs do not hash perfectly evenly
+	const u64 share = ((u64)capacity + shards - 1) / shards;
+	const u64 slots = share + share / 16 + 16;
+	if (slots >= 0x7fffffff) {
+		return false;
+	}
+
+	// Keep the index at most half full
+	u32 buckets = 1;
+	while ((u64)buckets * BUCKET_ENTRIES < slots * 2) {
+		buckets <<= 1;
+	}
+
+	layout->shard_slots = (u32)slots;
+	layout->bucket_count = buckets;
+	layout->shard_bytes = (u64)buckets * sizeof(SessionBucket) +
+						  round_to_line(slots * sizeof(u32)) +
+						  slots * STATE_BYTES;
+	layout->table_bytes = CAT_CACHE_LINE_BYTES +
+						  round_to_line(sizeof(SessionTable)) +
+						  shards * round_to_line(sizeof(SessionShard)) +
+						  shards * layout->shard_bytes;
+
+	return true;
+}
+
+// Helper function to find the internal table inside the caller's memory
+static CAT_INLINE SessionTable *get_table(void *T)
+{
+	const size_t mask = CAT_CACHE_LINE_BYTES - 1;
+	return reinterpret_cast<SessionTable *>( ((size_t)T + mask) & ~mask );
+}
+
+static CAT_INLINE SessionShard *get_shard(SessionTable *table, u32 index)
+{
+	u8 *shards = (u8 *)table + round_to_line(sizeof(SessionTable));
+	return reinterpret_cast<SessionShard *>( shards + index * round_to_line(sizeof(SessionShard)) );
+}
+
+// Helper function to mix the bits of a connection ID (MurmurHash3 finalizer)
+static CAT_INLINE u64 session_hash(u64 id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	id *= 0xc4ceb9fe1a85ec53ULL;
+	id ^= id >> 33;
+	return id;
+}
+
+// Helper function to pick the shard from the high bits of the hash
+static CAT_INLINE u32 session_shard(const SessionTable *table, u64 hash)
+{
+	return (u32)(((hash >> 32) * table->shard_count) >> 32);
+}
+
+static CAT_INLINE void *slot_state(const SessionShard *shard, u32 slot)
+{
+	return shard->states + slot * STATE_BYTES;
+}
+
+static void shard_lock(SessionShard *shard)
+{
+	while (!atomic_cas(&shard->lock, 0, 1)) {
+		thread_yield();
+	}
+}
+
+static CAT_INLINE void shard_unlock(SessionShard *shard)
+{
+	atomic_store_release(&shard->lock, 0);
+}
+
+// Helper function for writers to change one entry of a bucket
+static void bucket_write(SessionBucket *bucket, int entry, u64 id, u32 slot)
+{
+	const u32 sequence = bucket->sequence;
+
+	// Readers that see the odd sequence number wait for the write to finish
+	atomic_store_release(&bucket->sequence, sequence + 1);
+	atomic_fence();
+
+	bucket->ids[entry] = id;
+	bucket->slots[entry] = slot;
+
+	atomic_store_release(&bucket->sequence, sequence + 2);
+}
+
+// Helper function for writers to find an ID, which cannot change under them
+// Returns false if it is not in the table
+static bool shard_find(const SessionShard *shard, u64 hash, u64 id,
+					   u32 &bucket_index, int &entry)
+{
+	const u32 mask = shard->bucket_mask;
+
+	for (u32 probe = 0; probe <= mask; ++probe) {
+		const u32 index = ((u32)hash + probe) & mask;
+		const SessionBucket *bucket = shard->buckets + index;
+		bool end = false;
+
+		for (int ii = 0; ii < BUCKET_ENTRIES; ++ii) {
+			const u32 slot = bucket->slots[ii];
+
+			if (slot == SLOT_EMPTY) {
+				end = true;
+			} else if (slot != SLOT_TOMBSTONE && bucket->ids[ii] == id) {
+				bucket_index = index;
+				entry = ii;
+				return true;
+			}
+		}
+
+		// No entry was ever pushed past a bucket with room in it
+		if (end) {
+			break;
+		}
+	}
+
+	return false;
+}
+
+
+//// Session table API
+
+unsigned long long calico_sessions_bytes(unsigned int capacity, int shards)
+{
+	SessionLayout layout;
+
+	if (!session_layout(capacity, shards, &layout)) {
+		return 0;
+	}
+
+	return layout.table_bytes;
+}
+
+int calico_sessions_init(void *T, unsigned long long table_bytes,
+						 unsigned int capacity, int shards)
+{
+	SessionLayout layout;
+
+	// If input is invalid,
+	if (!T || !session_layout(capacity, shards, &layout) ||
+		table_bytes < layout.table_bytes) {
+		return -1;
+	}
+
+	SessionTable *table = get_table(T);
+	table->flag = 0;
+	table->shard_count = shards;
+
+	u8 *memory = (u8 *)get_shard(table, shards);
+
+	for (int ii = 0; ii < shards; ++ii) {
+		SessionShard *shard = get_shard(table, ii);
+
+		shard->lock = 0;
+		shard->bucket_mask = layout.bucket_count - 1;
+		shard->slot_count = layout.shard_slots;
+		shard->free_count = layout.shard_slots;
+
+		shard->buckets = reinterpret_cast<SessionBucket *>( memory );
+		memory += (u64)layout.bucket_count * sizeof(SessionBucket);
+		shard->free_slots = reinterpret_cast<u32 *>( memory );
+		memory += round_to_line(layout.shard_slots * sizeof(u32));
+		shard->states = memory;
+		memory += layout.shard_slots * STATE_BYTES;
+
+		memset(shard->buckets, 0, (u64)layout.bucket_count * sizeof(SessionBucket));
+
+		// Hand out the lowest slots first so a lightly loaded shard stays compact
+		for (u32 jj = 0; jj < layout.shard_slots; ++jj) {
+			shard->free_slots[jj] = layout.shard_slots - 1 - jj;
+		}
+	}
+
+	table->flag = FLAG_SESSIONS;
+
+	return 0;
+}
+
+int calico_sessions_shard(void *T, unsigned long long id)
+{
+	SessionTable *table = get_table(T);
+
+	// If input is invalid,
+	if (!T || table->flag != FLAG_SESSIONS) {
+		return -1;
+	}
+
+	return (int)session_shard(table, session_hash(id));
+}
+
+void *calico_sessions_lookup(void *T, unsigned long long id)
+{
+	SessionTable *table = get_table(T);
+
+	// If input is invalid,
+	if (!T || table->flag != FLAG_SESSIONS) {
+		return 0;
+	}
+
+	const u64 hash = session_hash(id);
+	const SessionShard *shard = get_shard(table, session_shard(table, hash));
+	const u32 mask = shard->bucket_mask;
+
+	for (u32 probe = 0; probe <= mask; ++probe) {
+		const SessionBucket *bucket = shard->buckets + (((u32)hash + probe) & mask);
+		u32 found, sequence;
+		bool end;
+
+		// Read the bucket again if a writer changed it while it was read
+		for (;;) {
+			sequence = atomic_load_acquire(&bucket->sequence);
+			if (sequence & 1) {
+				thread_yield();
+				continue;
+			}
+
+			found = SLOT_EMPTY;
+			end = false;
+
+			for (int ii = 0; ii < BUCKET_ENTRIES; ++ii) {
+				const u32 slot = bucket->slots[ii];
+
+				if (slot == SLOT_EMPTY) {
+					end = true;
+				} else if (slot != SLOT_TOMBSTONE && bucket->ids[ii] == id) {
+					found = slot;
+				}
+			}
+
+			atomic_fence();
+
+			if (bucket->sequence == sequence) {
+				break;
+			}
+		}
+
+		if (found != SLOT_EMPTY) {
+			return slot_state(shard, found - 1);
+		}
+
+		if (end) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void *calico_sessions_insert(void *T, unsigned long long id, int role,
+							 const void *key, int key_bytes)
+{
+	SessionTable *table = get_table(T);
+
+	// If input is invalid,
+	if (!T || table->flag != FLAG_SESSIONS) {
+		return 0;
+	}
+
+	const u64 hash = session_hash(id);
+	SessionShard *shard = get_shard(table, session_shard(table, hash));
+	void *state = 0;
+
+	shard_lock(shard);
+
+	u32 bucket_index;
+	int entry;
+
+	// If the ID is new and the shard has room,
+	if (!shard_find(shard, hash, id, bucket_index, entry) && shard->free_count > 0) {
+		const u32 slot = shard->free_slots[--shard->free_count];
+		state = slot_state(shard, slot);
+
+		// Key the state object before any reader can find it
+		if (calico_key(state, sizeof(calico_state), role, key, key_bytes)) {
+			shard->free_slots[shard->free_count++] = slot;
+			state = 0;
+		} else {
+			const u32 mask = shard->bucket_mask;
+
+			// Take the first unused entry along the probe sequence.  The
+			// index is never more than half full, so one is always found
+			for (u32 probe = 0; probe <= mask; ++probe) {
+				SessionBucket *bucket = shard->buckets + (((u32)hash + probe) & mask);
+
+				for (entry = 0; entry < BUCKET_ENTRIES; ++entry) {
+					const u32 old = bucket->slots[entry];
+					if (old == SLOT_EMPTY || old == SLOT_TOMBSTONE) {
+						break;
+					}
+				}
+
+				if (entry < BUCKET_ENTRIES) {
+					bucket_write(bucket, entry, id, slot + 1);
+					break;
+				}
+			}
+		}
+	}
+
+	shard_unlock(shard);
+
+	return state;
+}
+
+int calico_sessions_evict(void *T, unsigned long long id)
+{
+	SessionTable *table = get_table(T);
+
+	// If input is invalid,
+	if (!T || table->flag != FLAG_SESSIONS) {
+		return -1;
+	}
+
+	const u64 hash = session_hash(id);
+	SessionShard *shard = get_shard(table, session_shard(table, hash));
+	int result = -1;
+
+	shard_lock(shard);
+
+	u32 bucket_index;
+	int entry;
+
+	if (shard_find(shard, hash, id, bucket_index, entry)) {
+		SessionBucket *bucket = shard->buckets + bucket_index;
+		const u32 slot = bucket->slots[entry] - 1;
+
+		// If no probe sequence ever continued past this bucket,
+		u32 replacement = SLOT_TOMBSTONE;
+		for (int ii = 0; ii < BUCKET_ENTRIES; ++ii) {
+			if (bucket->slots[ii] == SLOT_EMPTY) {
+				replacement = SLOT_EMPTY;
+			}
+		}
+
+		// Unpublish the entry before the state object is erased
+		bucket_write(bucket, entry, 0, replacement);
+
+		calico_cleanup(slot_state(shard, slot));
+		shard->free_slots[shard->free_count++] = slot;
+
+		result = 0;
+	}
+
+	shard_unlock(shard);
+
+	return result;
+}
+
+void calico_sessions_cleanup(void *T)
+{
+	SessionTable *table = get_table(T);
+
+	// If input is invalid,
+	if (!T || table->flag != FLAG_SESSIONS) {
+		return;
+	}
+
+	for (u32 ii = 0; ii < table->shard_count; ++ii) {
+		SessionShard *shard = get_shard(table, ii);
+
+		for (u32 jj = 0; jj <= shard->bucket_mask; ++jj) {
+			SessionBucket *bucket = shard->buckets + jj;
+
+			for (int kk = 0; kk < BUCKET_ENTRIES; ++kk) {
+				const u32 slot = bucket->slots[kk];
+
+				if (slot != SLOT_EMPTY && slot != SLOT_TOMBSTONE) {
+					calico_cleanup(slot_state(shard, slot - 1));
+				}
+			}
+		}
+
+		CAT_SECURE_OBJCLR(*shard);
+	}
+
+	table->flag = 0;
+}
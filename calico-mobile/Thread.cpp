@@ -0,0 +1,351 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Thread.hpp"
+#include "Atomic.hpp"
+using namespace cat;
+
+#if defined(CAT_OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+# include <process.h>
+#else
+# include <sched.h>
+# include <time.h>
+# include <errno.h>
+#endif
+
+
+#if defined(CAT_OS_WINDOWS)
+
+static unsigned __stdcall thread_entry(void *param)
+{
+	thread_handle *thread = reinterpret_cast<thread_handle *>( param );
+
+	thread->fn(thread->param);
+
+	return 0;
+}
+
+bool cat::thread_start(thread_handle *thread, thread_fn fn, void *param)
+{
+	thread->fn = fn;
+	thread->param = param;
+
+	thread->handle = (void *)_beginthreadex(0, 0, thread_entry, thread, 0, 0);
+
+	return thread->handle != 0;
+}
+
+void cat::thread_join(thread_handle *thread)
+{
+	WaitForSingleObject((HANDLE)thread->handle, INFINITE);
+	CloseHandle((HANDLE)thread->handle);
+}
+
+void cat::thread_detach(thread_handle *thread)
+{
+	CloseHandle((HANDLE)thread->handle);
+}
+
+void cat::thread_yield()
+{
+	SwitchToThread();
+}
+
+static SRWLOCK m_pool_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE m_pool_wake = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE m_pool_done = CONDITION_VARIABLE_INIT;
+
+static void pool_lock()
+{
+	AcquireSRWLockExclusive(&m_pool_lock);
+}
+
+static void pool_unlock()
+{
+	ReleaseSRWLockExclusive(&m_pool_lock);
+}
+
+static void pool_wait(CONDITION_VARIABLE *cond)
+{
+	SleepConditionVariableSRW(cond, &m_pool_lock, INFINITE, 0);
+}
+
+static u64 pool_msec()
+{
+	return GetTickCount64();
+}
+
+// Returns false if the deadline from pool_msec() passed without a wakeup
+static bool pool_wait_until(CONDITION_VARIABLE *cond, u64 deadline)
+{
+	const u64 now = pool_msec();
+
+	if (now >= deadline) {
+		return false;
+	}
+
+	return SleepConditionVariableSRW(cond, &m_pool_lock, (DWORD)(deadline - now), 0) ||
+		   GetLastError() != ERROR_TIMEOUT;
+}
+
+static void pool_wake_all(CONDITION_VARIABLE *cond)
+{
+	WakeAllConditionVariable(cond);
+}
+
+#if defined(CAT_ATOMIC_LOCKED)
+
+static SRWLOCK m_atomic_lock = SRWLOCK_INIT;
+
+void cat::atomic_lock()
+{
+	AcquireSRWLockExclusive(&m_atomic_lock);
+}
+
+void cat::atomic_unlock()
+{
+	ReleaseSRWLockExclusive(&m_atomic_lock);
+}
+
+#endif // CAT_ATOMIC_LOCKED
+
+#else
+
+static void *thread_entry(void *param)
+{
+	thread_handle *thread = reinterpret_cast<thread_handle *>( param );
+
+	thread->fn(thread->param);
+
+	return 0;
+}
+
+bool cat::thread_start(thread_handle *thread, thread_fn fn, void *param)
+{
+	thread->fn = fn;
+	thread->param = param;
+
+	return 0 == pthread_create(&thread->thread, 0, thread_entry, thread);
+}
+
+void cat::thread_join(thread_handle *thread)
+{
+	pthread_join(thread->thread, 0);
+}
+
+void cat::thread_detach(thread_handle *thread)
+{
+	pthread_detach(thread->thread);
+}
+
+void cat::thread_yield()
+{
+	sched_yield();
+}
+
+static pthread_mutex_t m_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m_pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t m_pool_done = PTHREAD_COND_INITIALIZER;
+
+static void pool_lock()
+{
+	pthread_mutex_lock(&m_pool_lock);
+}
+
+static void pool_unlock()
+{
+	pthread_mutex_unlock(&m_pool_lock);
+}
+
+static void pool_wait(pthread_cond_t *cond)
+{
+	pthread_cond_wait(cond, &m_pool_lock);
+}
+
+// Read the clock used by pthread_cond_timedwait()
+static u64 pool_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (u64)ts.tv_sec * 1000 + (u64)ts.tv_nsec / 1000000;
+}
+
+// Returns false if the deadline from pool_msec() passed without a wakeup
+static bool pool_wait_until(pthread_cond_t *cond, u64 deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(deadline / 1000);
+	ts.tv_nsec = (long)(deadline % 1000) * 1000000;
+
+	return pthread_cond_timedwait(cond, &m_pool_lock, &ts) != ETIMEDOUT;
+}
+
+static void pool_wake_all(pthread_cond_t *cond)
+{
+	pthread_cond_broadcast(cond);
+}
+
+#if defined(CAT_ATOMIC_LOCKED)
+
+static pthread_mutex_t m_atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cat::atomic_lock()
+{
+	pthread_mutex_lock(&m_atomic_lock);
+}
+
+void cat::atomic_unlock()
+{
+	pthread_mutex_unlock(&m_atomic_lock);
+}
+
+#endif // CAT_ATOMIC_LOCKED
+
+#endif
+
+
+//// Thread pool
+
+// Shared by all callers, guarded by the pool lock
+static struct {
+	// A call is in progress
+	bool busy;
+
+	// Helper threads running.  They are detached, so each handle is only
+	// used to start its thread
+	int started;
+	thread_handle threads[THREAD_POOL_MAX_HELPERS];
+
+	// Work for the call in progress
+	thread_fn fn;
+	void *param;
+
+	// Helpers wanted by the call, helpers that joined it and helpers that
+	// have returned from it
+	int wanted, joined, finished;
+} m_pool;
+
+// Helper function run by each pool thread: join calls as they are made, and
+// exit if none wants this thread for THREAD_POOL_IDLE_MSEC
+static void pool_thread(void *)
+{
+	pool_lock();
+
+	for (;;) {
+		const u64 deadline = pool_msec() + THREAD_POOL_IDLE_MSEC;
+
+		while (m_pool.joined >= m_pool.wanted) {
+			if (!pool_wait_until(&m_pool_wake, deadline) &&
+				m_pool.joined >= m_pool.wanted) {
+				--m_pool.started;
+				pool_unlock();
+				return;
+			}
+		}
+
+		++m_pool.joined;
+		thread_fn fn = m_pool.fn;
+		void *param = m_pool.param;
+
+		pool_unlock();
+
+		fn(param);
+
+		pool_lock();
+
+		if (++m_pool.finished == m_pool.joined) {
+			pool_wake_all(&m_pool_done);
+		}
+	}
+}
+
+void cat::thread_pool_run(thread_fn fn, void *param, int helpers)
+{
+	if (helpers > THREAD_POOL_MAX_HELPERS) {
+		helpers = THREAD_POOL_MAX_HELPERS;
+	}
+
+	pool_lock();
+
+	// If there is no use for helpers or another call has them,
+	if (helpers <= 0 || m_pool.busy) {
+		pool_unlock();
+		fn(param);
+		return;
+	}
+
+	m_pool.busy = true;
+
+	// Start more helpers if needed, carrying on with fewer if any fail
+	while (m_pool.started < helpers &&
+		   thread_start(&m_pool.threads[m_pool.started], pool_thread, 0)) {
+		thread_detach(&m_pool.threads[m_pool.started]);
+		++m_pool.started;
+	}
+	if (helpers > m_pool.started) {
+		helpers = m_pool.started;
+	}
+
+	m_pool.fn = fn;
+	m_pool.param = param;
+	m_pool.wanted = helpers;
+	m_pool.joined = 0;
+	m_pool.finished = 0;
+	pool_wake_all(&m_pool_wake);
+
+	pool_unlock();
+
+	// This thread works too
+	fn(param);
+
+	pool_lock();
+
+	// Helpers that have not woken up yet are not waited for, since fn()
+	// does not need them once this thread has returned from it
+	m_pool.wanted = m_pool.joined;
+
+	while (m_pool.finished < m_pool.joined) {
+		pool_wait(&m_pool_done);
+	}
+
+	m_pool.busy = false;
+
+	pool_unlock();
+}
+
+int cat::thread_pool_helpers()
+{
+	pool_lock();
+	const int helpers = m_pool.started;
+	pool_unlock();
+
+	return helpers;
+}
@@ -30,16 +30,23 @@
 #define CAT_CALICO_H
 
 /*
- * These functions are NOT thread-safe.
+ * These functions are NOT thread-safe, with one exception:
  *
- * It is NOT safe to encrypt in one thread while decrypting in another.
+ * One thread may encrypt while one other thread decrypts with the same Calico
+ * state object, without any locking.  The encryption and decryption state are
+ * kept on separate cache lines so that full-duplex use on two cores does not
+ * slow either side down.  Two threads must not both encrypt or both decrypt
+ * with the same object at the same time, except through
+ * calico_encrypt_sender() and calico_decrypt_concurrent().
+ *
+ * The session table functions may be called from any thread.
  */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define CALICO_VERSION 7
+#define CALICO_VERSION 15
 
 /*
  * Verify binary compatibility with the Calico API on startup.
@@ -56,15 +63,72 @@ extern "C" {
 extern int _calico_init(int expected_version);
 #define calico_init() _calico_init(CALICO_VERSION)
 
+/*
+ * Describe the kernels selected for this CPU by calico_init()
+ *
+ * Returns a string such as
+ * "chacha=avx2 chacha_lanes=avx2 siphash_lanes=avx2 blake2b=avx2"
+ * that is suitable for logging.
+ */
+extern const char *calico_kernels(void);
+
+/*
+ * Millisecond timestamp used for key ratchet timing
+ *
+ * This is the clock that calico_encrypt() and calico_decrypt() read on every
+ * call.  An application that already reads the time once per wakeup may read
+ * this instead and pass the result to the *_at() variants below, so that
+ * a whole batch of messages shares one clock read.
+ */
+extern unsigned int calico_msec(void);
+
+
+/*
+ * Cache line alignment of the state objects
+ *
+ * Every calico_stream_only, calico_state, calico_sender and calico_stream
+ * must start on a 64-byte boundary.  Declared objects are aligned by the
+ * compiler.  Heap objects need an aligned allocator such as posix_memalign(),
+ * _aligned_malloc(), C++17 operator new or calico_pool_alloc().  Functions
+ * given a misaligned object fail as for any other invalid input.  An aligned
+ * object may be moved to another aligned address with memcpy().
+ *
+ * This requirement is new in API level 15.  Earlier levels accepted objects
+ * at any address, so code that allocates them with malloc() or new before
+ * C++17 must change to one of the allocators above.  calico_init() fails for
+ * applications built against an older calico.h.
+ */
+#if defined(_MSC_VER)
+# define CALICO_ALIGNED __declspec(align(64))
+#else
+# define CALICO_ALIGNED __attribute__ ((aligned (64)))
+#endif
+
+/*
+ * Sizes of the state objects in bytes, for applications that lay out many
+ * sessions in their own memory.  Each size is a multiple of the alignment.
+ */
+enum CalicoStateBytes {
+	CALICO_STREAM_ONLY_BYTES = 64 + 64,				// sizeof(calico_stream_only)
+	CALICO_STATE_BYTES = 64 + 64 + 64 + 64 + 128 + 64	// sizeof(calico_state)
+};
 
 typedef struct {
-	char internal[8 + 176 + 8];
+	CALICO_ALIGNED char internal[CALICO_STREAM_ONLY_BYTES];
 } calico_stream_only;
 
 typedef struct {
-	char internal[8 + 176 + 8 + 176 + 136];
+	CALICO_ALIGNED char internal[CALICO_STATE_BYTES];
 } calico_state;
 
+typedef struct {
+	CALICO_ALIGNED char internal[128];
+} calico_sender;
+
+typedef struct {
+	CALICO_ALIGNED char internal[256];
+} calico_stream;
+
 
 enum CalicoRoles {
 	CALICO_INITIATOR = 1,
@@ -73,7 +137,13 @@ enum CalicoRoles {
 
 enum CalicoOverhead {
 	CALICO_DATAGRAM_OVERHEAD = 11,	// Number of bytes added per datagram
-	CALICO_STREAM_OVERHEAD = 8		// Number of bytes added per stream message
+	CALICO_STREAM_OVERHEAD = 8,		// Number of bytes added per stream message
+	CALICO_STREAM_HEADER = 1		// Number of bytes before an incremental stream message
+};
+
+enum CalicoStreamDirection {
+	CALICO_STREAM_ENCRYPT = 1,
+	CALICO_STREAM_DECRYPT = 2
 };
 
 enum CalicoTransport {
@@ -117,6 +187,30 @@ enum CalicoTransport {
  */
 extern int calico_key(void *S, int state_size, int role, const void *key, int key_bytes);
 
+/*
+ * Initializes the calico_state object with a larger anti-replay window
+ *
+ * Same as calico_key(), except that the datagram anti-replay window tracks the
+ * last window_bits IVs instead of the last 1024.  Links with a lot of packet
+ * reordering, such as multipath routes at high packet rates, may deliver some
+ * packets after more than 1024 newer ones, and these are dropped as replays
+ * with the default window.
+ *
+ * The window is stored in memory provided by the application, which must stay
+ * valid until the Calico state object is cleaned up or keyed again.  It does
+ * not contain any secrets.
+ *
+ * Preconditions:
+ * 	S = calico_state object; stream-only objects have no anti-replay window
+ * 	window_bits = 1024, 2048, 4096, 8192, 16384, 32768 or 65536
+ * 	window = Valid pointer to window_bits / 8 bytes, aligned to 8 bytes,
+ * 		or null for the 1024-bit window inside the state object
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_key_window(void *S, int state_size, int role, const void *key, int key_bytes, void *window, int window_bits);
+
 /*
  * Encrypt plaintext into ciphertext
  *
@@ -137,6 +231,269 @@ extern int calico_key(void *S, int state_size, int role, const void *key, int ke
  */
 extern int calico_encrypt(void *S, void *ciphertext, const void *plaintext, int bytes, void *overhead, int overhead_size);
 
+/*
+ * Encrypt plaintext into ciphertext at the given time
+ *
+ * Same as calico_encrypt(), except that now_msec is used for ratchet timing
+ * instead of reading the clock.  now_msec should come from calico_msec(),
+ * though it may be cached for a while.  Timestamps passed for one Calico
+ * state object should not go backwards by more than a few seconds.
+ */
+extern int calico_encrypt_at(void *S, void *ciphertext, const void *plaintext, int bytes, void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Encrypt plaintext and authenticate associated data along with it
+ *
+ * Same as calico_encrypt(), except that the ad_bytes bytes at ad are also
+ * covered by the MAC tag without being encrypted or sent.  Use this for a
+ * cleartext header that is sent beside the ciphertext.  The receiver must
+ * pass the same associated data to calico_decrypt_ad().
+ *
+ * With ad_bytes = 0 the output is the same as calico_encrypt().
+ *
+ * Preconditions:
+ * 	ad = Valid pointer to ad_bytes bytes, or null if ad_bytes = 0
+ * 	ad_bytes >= 0
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_encrypt_ad(void *S, void *ciphertext, const void *plaintext, int bytes, const void *ad, int ad_bytes, void *overhead, int overhead_size);
+
+/*
+ * Encrypt plaintext with associated data at the given time
+ *
+ * Same as calico_encrypt_ad(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_encrypt_ad_at(void *S, void *ciphertext, const void *plaintext, int bytes, const void *ad, int ad_bytes, void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Descriptor for one message in a calico_encrypt_batch() call
+ *
+ * The fields have the same meaning as the parameters of calico_encrypt().
+ */
+typedef struct {
+	const void *plaintext;	// Message to encrypt
+	void *ciphertext;		// Encrypted output, may be the same as plaintext
+	int bytes;				// Number of bytes in the message
+	void *overhead;			// Overhead output of overhead_size bytes
+} calico_encrypt_desc;
+
+/*
+ * Encrypt a batch of messages for one Calico state object
+ *
+ * This produces the same output as calling calico_encrypt() on each message
+ * in order, but the input validation, key selection, IV reservation and the
+ * ratchet decision are only done once for the whole batch.  All messages in
+ * the batch use the same mode, selected by overhead_size.
+ *
+ * Transmit each overhead buffer along with its ciphertext.
+ *
+ * Preconditions:
+ * 	messages = Valid pointer to an array of count message descriptors
+ * 	count >= 0
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid, in which case
+ * none of the messages are encrypted.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_encrypt_batch(void *S, calico_encrypt_desc *messages, int count, int overhead_size);
+
+/*
+ * Encrypt a batch of messages at the given time
+ *
+ * Same as calico_encrypt_batch(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_encrypt_batch_at(void *S, calico_encrypt_desc *messages, int count, int overhead_size, unsigned int now_msec);
+
+/*
+ * One segment of a message split across several buffers
+ *
+ * Like struct iovec, so an array of segments describes a message built from
+ * a header, a payload and a trailer without copying them together.
+ */
+typedef struct {
+	void *data;				// Start of the segment
+	int bytes;				// Number of bytes in the segment
+} calico_segment;
+
+/*
+ * Encrypt a message made of several segments
+ *
+ * The ciphertext and overhead are the same as calico_encrypt() produces for
+ * the segments joined together, so the receiver may use either decryption
+ * function.  The ciphertext segments may be split at different places than
+ * the plaintext segments, but must add up to the same number of bytes.  A
+ * ciphertext segment may be the same buffer as the plaintext segment it
+ * covers, but segments must not otherwise overlap.
+ *
+ * Preconditions:
+ * 	ciphertext = Valid pointer to an array of ciphertext_count segments
+ * 	plaintext = Valid pointer to an array of plaintext_count segments
+ * 	overhead_size = CALICO_DATAGRAM_OVERHEAD or CALICO_STREAM_OVERHEAD
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_encryptv(void *S, const calico_segment *ciphertext, int ciphertext_count, const calico_segment *plaintext, int plaintext_count, void *overhead, int overhead_size);
+
+/*
+ * Encrypt a message made of several segments at the given time
+ *
+ * Same as calico_encryptv(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_encryptv_at(void *S, const calico_segment *ciphertext, int ciphertext_count, const calico_segment *plaintext, int plaintext_count, void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Start encrypting or decrypting a stream message in pieces
+ *
+ * For messages too large to hold in memory at once, such as a backup piped
+ * through a small buffer.  Pass each piece to calico_stream_update() in order
+ * and finish with calico_stream_final().  The message may be split anywhere,
+ * and memory use does not depend on its length.
+ *
+ * The message is a stream mode message, numbered when encryption starts, so
+ * messages must be sent in the order they were started.  The ciphertext and
+ * overhead are the same as calico_encrypt() produces, so a message that fits
+ * in memory may also be decrypted with calico_decrypt().
+ *
+ * The receiver must know which key the sender used before the overhead
+ * arrives, so encryption writes a CALICO_STREAM_HEADER byte header that must
+ * be sent before the ciphertext, and decryption reads it.
+ *
+ * When decrypting, the plaintext is produced before the overhead is checked.
+ * Do not act on it until calico_stream_final() returns 0.
+ *
+ * Preconditions:
+ * 	S = calico_state or calico_stream_only object
+ * 	direction = CALICO_STREAM_ENCRYPT or CALICO_STREAM_DECRYPT
+ * 	header = Valid pointer to CALICO_STREAM_HEADER bytes
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_stream_init(calico_stream *stream, void *S, int direction, void *header);
+
+/*
+ * Encrypt or decrypt the next piece of a stream message
+ *
+ * The output is the same size as the input, and may be the same buffer.
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_stream_update(calico_stream *stream, void *output, const void *input, int bytes);
+
+/*
+ * Finish a stream message
+ *
+ * When encrypting, this writes the overhead to send after the ciphertext.
+ * When decrypting, this checks the overhead that followed it.  In both cases
+ * the stream object must be initialized again before it is reused.
+ *
+ * Preconditions:
+ * 	overhead_size = CALICO_STREAM_OVERHEAD
+ *
+ * Returns 0 on success.
+ * Returns non-zero if the message is not authentic or an input is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_stream_final(calico_stream *stream, void *overhead, int overhead_size);
+
+/*
+ * Encrypt a large message on several threads
+ *
+ * Same as calico_encrypt(), except that the message length is 64 bits and the
+ * work is spread over up to the given number of threads, including the
+ * calling thread.  The message is split into 64 KB chunks that are encrypted
+ * and authenticated in parallel, and the chunk tags are bound together with
+ * the message length into the one tag in the overhead, so that chunks cannot
+ * be reordered, dropped or truncated.  The output is the same whatever the
+ * number of threads.  The helper threads are started on first use and kept
+ * for later calls; while one call is using them, a concurrent call runs on
+ * its calling thread alone.
+ *
+ * Large messages must be decrypted with calico_decrypt_large().  The usual
+ * overhead is used, and large messages may be mixed with other messages.
+ *
+ * Preconditions:
+ * 	threads >= 1
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_encrypt_large(void *S, void *ciphertext, const void *plaintext, unsigned long long bytes, void *overhead, int overhead_size, int threads);
+
+/*
+ * Decrypt a large message on several threads
+ *
+ * Decrypts a message from calico_encrypt_large(), using up to the given
+ * number of threads including the calling thread.  The plaintext may be the
+ * same buffer as the ciphertext; in that case the whole message is
+ * authenticated before any of it is decrypted, which reads it twice.
+ * Otherwise it is authenticated and decrypted in one pass, and the plaintext
+ * is erased if the message is not authentic.
+ *
+ * Preconditions:
+ * 	threads >= 1
+ *
+ * Returns 0 on success.
+ * Returns non-zero if the message is not authentic or an input is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decrypt_large(void *S, void *plaintext, const void *ciphertext, unsigned long long bytes, const void *overhead, int overhead_size, int threads);
+
+/*
+ * Initialize a sender for encrypting datagrams on one of several threads
+ *
+ * Each thread that encrypts datagrams for a shared Calico state object needs
+ * its own calico_sender.  A sender reserves a block of IVs from the state
+ * object with one atomic operation and then encrypts the next few hundred
+ * datagrams without writing to any shared memory.  Key ratchets are made by
+ * whichever sender finds that it is time, and picked up by the others.
+ *
+ * Datagrams from several senders arrive out of IV order, so the remote host
+ * should key with calico_key_window() and a window of at least 8192 bits.
+ * Once keyed, datagrams for a Calico state object must be encrypted either
+ * with senders or with the other encryption functions, but not both.
+ *
+ * Preconditions:
+ * 	S = calico_state object keyed for datagrams
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_sender_init(void *S, calico_sender *sender);
+
+/*
+ * Encrypt a datagram with a sender
+ *
+ * Same as calico_encrypt() for the Calico state object the sender was
+ * initialized with.  Only datagram mode is supported: overhead_size must be
+ * CALICO_DATAGRAM_OVERHEAD.  A sender must only be used by one thread at a
+ * time.
+ */
+extern int calico_encrypt_sender(calico_sender *sender, void *ciphertext, const void *plaintext, int bytes, void *overhead, int overhead_size);
+
+/*
+ * Encrypt a datagram with a sender at the given time
+ *
+ * Same as calico_encrypt_sender(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_encrypt_sender_at(calico_sender *sender, void *ciphertext, const void *plaintext, int bytes, void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Clean up a calico_sender object
+ *
+ * Securely erases the copy of the key held by the sender.  This should be
+ * done before the Calico state object is cleaned up.
+ */
+extern void calico_sender_cleanup(calico_sender *sender);
+
 /*
  * Decrypt ciphertext into plaintext
  *
@@ -148,6 +505,167 @@ extern int calico_encrypt(void *S, void *ciphertext, const void *plaintext, int
  */
 extern int calico_decrypt(void *S, void *ciphertext, int bytes, const void *overhead, int overhead_size);
 
+/*
+ * Decrypt ciphertext into plaintext at the given time
+ *
+ * Same as calico_decrypt(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_decrypt_at(void *S, void *ciphertext, int bytes, const void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Decrypt ciphertext and check associated data along with it
+ *
+ * Same as calico_decrypt(), for a message from calico_encrypt_ad().  The
+ * message is only accepted if ad holds the same associated data that the
+ * sender used.
+ *
+ * Preconditions:
+ * 	ad = Valid pointer to ad_bytes bytes, or null if ad_bytes = 0
+ * 	ad_bytes >= 0
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decrypt_ad(void *S, void *ciphertext, int bytes, const void *ad, int ad_bytes, const void *overhead, int overhead_size);
+
+/*
+ * Decrypt ciphertext with associated data at the given time
+ *
+ * Same as calico_decrypt_ad(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_decrypt_ad_at(void *S, void *ciphertext, int bytes, const void *ad, int ad_bytes, const void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Decrypt a datagram while other threads decrypt for the same object
+ *
+ * Same as calico_decrypt(), except that any number of threads may call this
+ * at once with the same Calico state object, for example one per receive
+ * queue.  Authentication and decryption run in parallel, and only the replay
+ * check and key ratchet bookkeeping are shared, through atomic operations.
+ * A datagram delivered to several threads is accepted by exactly one of them.
+ * One other thread may still encrypt at the same time.
+ *
+ * The anti-replay window tracks half as many IVs as it does for
+ * calico_decrypt(), so a larger window from calico_key_window() is a good
+ * idea when packets are spread over many queues.  Once keyed, datagrams for
+ * a Calico state object must be decrypted either with this function or with
+ * the other decryption functions, but not both.
+ *
+ * Only datagram mode is supported: overhead_size must be
+ * CALICO_DATAGRAM_OVERHEAD.
+ *
+ * Returns 0 on success.
+ * Returns non-zero if the datagram was rejected or an input is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decrypt_concurrent(void *S, void *ciphertext, int bytes, const void *overhead, int overhead_size);
+
+/*
+ * Decrypt a datagram concurrently at the given time
+ *
+ * Same as calico_decrypt_concurrent(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_decrypt_concurrent_at(void *S, void *ciphertext, int bytes, const void *overhead, int overhead_size, unsigned int now_msec);
+
+/*
+ * Decrypt ciphertext into a separate plaintext buffer
+ *
+ * Behaves like calico_decrypt(), except that the ciphertext is left intact
+ * and the plaintext is written to a separate buffer of the same size.
+ *
+ * Messages larger than a few kilobytes are authenticated and decrypted in a
+ * single pass over the ciphertext, so forged messages of that size cost
+ * about as much to reject as valid ones do to accept.  Plaintext from a
+ * forged message is erased before returning, and the IV state is only
+ * updated once the message has been authenticated.
+ *
+ * Preconditions:
+ * 	plaintext = Valid pointer to a buffer of bytes in length
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decrypt_to(void *S, void *plaintext, const void *ciphertext, int bytes, const void *overhead, int overhead_size);
+
+/*
+ * Descriptor for one packet in a calico_decrypt_batch() call
+ *
+ * The fields have the same meaning as the parameters of calico_decrypt().
+ */
+typedef struct {
+	void *ciphertext;		// Encrypted message, decrypted in-place
+	int bytes;				// Number of bytes in the message
+	const void *overhead;	// Overhead of CALICO_DATAGRAM_OVERHEAD bytes
+} calico_decrypt_desc;
+
+/*
+ * Decrypt a batch of datagrams for one Calico state object
+ *
+ * All of the IVs are read and all of the packets are authenticated before
+ * any state is changed.  The authenticated packets are then decrypted in-place
+ * and accepted in order, so the result is the same as calling calico_decrypt()
+ * on each packet in order with the same timestamp.  Forged, replayed,
+ * duplicated or too-old packets are dropped without affecting the rest of the
+ * batch.
+ *
+ * IVs are read relative to the newest IV accepted before the batch.  If the
+ * packets accepted earlier in the batch move the window far enough that a
+ * later packet's IV would be read differently, which takes a jump of about
+ * four million IVs, that packet is decrypted on its own as calico_decrypt()
+ * would and the rest of the batch carries on from there.
+ *
+ * Only datagram mode is supported: overhead_size must be
+ * CALICO_DATAGRAM_OVERHEAD.
+ *
+ * Preconditions:
+ * 	packets = Valid pointer to an array of count packet descriptors
+ * 	results = Valid pointer to an array of count integers
+ * 	count >= 0
+ *
+ * On success, results[i] is set to 0 if packet i was decrypted, or non-zero
+ * if it was dropped.
+ *
+ * Returns 0 on success, even if some of the packets were dropped.
+ * Returns non-zero if one of the input parameters is invalid, in which case
+ * none of the packets are processed.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decrypt_batch(void *S, calico_decrypt_desc *packets, int count, int overhead_size, int *results);
+
+/*
+ * Decrypt a batch of datagrams at the given time
+ *
+ * Same as calico_decrypt_batch(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_decrypt_batch_at(void *S, calico_decrypt_desc *packets, int count, int overhead_size, int *results, unsigned int now_msec);
+
+/*
+ * Decrypt a message made of several segments
+ *
+ * Decrypts a message from calico_encrypt() or calico_encryptv() that was
+ * received into several buffers.  The segments follow the same rules as in
+ * calico_encryptv().  All of the ciphertext is authenticated before any
+ * plaintext is written, so nothing is changed if the message is forged.
+ *
+ * Preconditions:
+ * 	plaintext = Valid pointer to an array of plaintext_count segments
+ * 	ciphertext = Valid pointer to an array of ciphertext_count segments
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ * It is important to check the return value to avoid active attacks.
+ */
+extern int calico_decryptv(void *S, const calico_segment *plaintext, int plaintext_count, const calico_segment *ciphertext, int ciphertext_count, const void *overhead, int overhead_size);
+
+/*
+ * Decrypt a message made of several segments at the given time
+ *
+ * Same as calico_decryptv(), with now_msec as in calico_encrypt_at().
+ */
+extern int calico_decryptv_at(void *S, const calico_segment *plaintext, int plaintext_count, const calico_segment *ciphertext, int ciphertext_count, const void *overhead, int overhead_size, unsigned int now_msec);
+
 /*
  * Clean up a calico_state or calico_stream_only object
  *
@@ -156,6 +674,175 @@ extern int calico_decrypt(void *S, void *ciphertext, int bytes, const void *over
  */
 extern void calico_cleanup(void *S);
 
+/*
+ * Session table
+ *
+ * Maps 64-bit connection IDs to calico_state objects for servers with many
+ * peers.  The table is split into shards, each with its own index, state
+ * objects and lock, so that a server can run one receive thread per shard
+ * without any two cores sharing cache lines.  calico_sessions_shard() tells
+ * which shard an ID belongs to, so packets can be steered to its thread.
+ *
+ * Lookups do not take a lock and may run on any thread at the same time as
+ * inserts and evictions.  One 64-byte bucket of the index holds five IDs, so
+ * most lookups read one cache line before the state object.
+ *
+ * The state objects are owned by the table: insert keys them with
+ * calico_key() and evict erases them with calico_cleanup().  Do not evict a
+ * session while another thread may still be using its state object.
+ *
+ * Connection IDs should be chosen by the server, for example at random, so
+ * that a remote host cannot pick IDs that all land in the same bucket.
+ */
+
+/*
+ * Get the number of bytes of memory needed for a session table
+ *
+ * Each shard gets an equal share of the capacity plus a little slack.
+ *
+ * Preconditions:
+ * 	capacity >= 1
+ * 	1 <= shards <= 1024
+ *
+ * Returns the number of bytes needed.
+ * Returns 0 if one of the input parameters is invalid.
+ */
+extern unsigned long long calico_sessions_bytes(unsigned int capacity, int shards);
+
+/*
+ * Initialize a session table in the given memory
+ *
+ * The memory must not be moved while the table is in use.
+ *
+ * Preconditions:
+ * 	T = Valid pointer to table_bytes of memory
+ * 	table_bytes >= calico_sessions_bytes(capacity, shards)
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_sessions_init(void *T, unsigned long long table_bytes, unsigned int capacity, int shards);
+
+/*
+ * Get the shard that a connection ID belongs to
+ *
+ * Returns the shard index on success.
+ * Returns -1 if the table is not initialized.
+ */
+extern int calico_sessions_shard(void *T, unsigned long long id);
+
+/*
+ * Add a session and key its state object
+ *
+ * The arguments after id are passed to calico_key().
+ *
+ * Returns the new calico_state object on success.
+ * Returns 0 if the ID is already in the table, its shard is full or keying
+ * failed.
+ */
+extern void *calico_sessions_insert(void *T, unsigned long long id, int role, const void *key, int key_bytes);
+
+/*
+ * Find the state object for a connection ID
+ *
+ * Returns the calico_state object on success.
+ * Returns 0 if the ID is not in the table.
+ */
+extern void *calico_sessions_lookup(void *T, unsigned long long id);
+
+/*
+ * Remove a session and erase its state object
+ *
+ * Returns 0 on success.
+ * Returns non-zero if the ID is not in the table.
+ */
+extern int calico_sessions_evict(void *T, unsigned long long id);
+
+/*
+ * Clean up a session table
+ *
+ * Erases the state objects of all sessions still in the table.  No other
+ * thread may use the table at the same time.
+ */
+extern void calico_sessions_cleanup(void *T);
+
+/*
+ * State pool
+ *
+ * Hands out calico_state or calico_stream_only objects from 2 MB slabs of
+ * memory, backed by huge pages where the OS allows it.  Each object starts
+ * on a cache line and objects are packed with no heap headers between them,
+ * which keeps RSS and TLB misses down for servers with a million sessions.
+ *
+ * Each thread that allocates or frees objects needs its own
+ * calico_pool_cache, which keeps a short free list so the pool's lock is
+ * only taken about once every 32 calls.  An object may be freed through a
+ * different cache than it was allocated from.
+ */
+typedef struct {
+	char internal[64 + 64];
+} calico_pool;
+
+typedef struct {
+	char internal[64 + 32];
+} calico_pool_cache;
+
+/*
+ * Initialize a state pool
+ *
+ * Preconditions:
+ * 	state_size = sizeof(calico_state) or sizeof(calico_stream_only)
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_pool_init(calico_pool *pool, int state_size);
+
+/*
+ * Initialize a per-thread cache for a state pool
+ *
+ * A cache must only be used by one thread at a time.
+ *
+ * Returns 0 on success.
+ * Returns non-zero if one of the input parameters is invalid.
+ */
+extern int calico_pool_cache_init(calico_pool *pool, calico_pool_cache *cache);
+
+/*
+ * Allocate a state object
+ *
+ * The object is state_size bytes as given to calico_pool_init() and is
+ * keyed as usual with calico_key(S, state_size, ...).
+ *
+ * Returns the state object on success.
+ * Returns 0 if the input is invalid or the OS is out of memory.
+ */
+extern void *calico_pool_alloc(calico_pool_cache *cache);
+
+/*
+ * Free a state object
+ *
+ * The object is erased with calico_cleanup() before it is reused, so it does
+ * not need to be cleaned up first.
+ */
+extern void calico_pool_free(calico_pool_cache *cache, void *S);
+
+/*
+ * Clean up a per-thread cache
+ *
+ * Returns the objects on its free list to the pool.
+ */
+extern void calico_pool_cache_cleanup(calico_pool_cache *cache);
+
+/*
+ * Clean up a state pool
+ *
+ * Returns all of its memory to the OS.  Clean up every cache first.  If some
+ * objects were never freed, all of the memory is erased before it is
+ * returned.
+ */
+extern void calico_pool_cleanup(calico_pool *pool);
+
 
 #ifdef __cplusplus
 }
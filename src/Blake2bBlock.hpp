@@ -0,0 +1,73 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_BLAKE2B_BLOCK_HPP
+#define CAT_BLAKE2B_BLOCK_HPP
+
+#include "CpuDispatch.hpp"
+
+/*
+ * Single-block BLAKE2b for key ratcheting
+ *
+ * Every key ratchet hashes one 48-byte key into the next 48-byte key, which
+ * BLAKE2b does with one compression of a zero-padded block.  blake2b_48()
+ * produces the same output as the reference blake2b() with a 48-byte digest,
+ * no key and a 48-byte input, without the parameter block and buffering of
+ * the general interface.
+ *
+ * This is the only BLAKE2b in the library.  General-length hashing is left
+ * out on purpose, since no other input is ever hashed.
+ */
+
+namespace cat {
+
+
+// Bytes of input and output for blake2b_48()
+static const int BLAKE2B_48_BYTES = 48;
+
+typedef void (*blake2b_48_fn)(const u8 *in, u8 *out);
+
+// All kernels built into the library, from most to least preferred
+extern const cpu_kernel<blake2b_48_fn> blake2b_48_kernels[];
+
+// Kernel currently in use
+extern cpu_kernel<blake2b_48_fn> blake2b_48_kernel;
+
+// Select the best kernel for the given CPU features
+void blake2b_48_select(u32 features);
+
+// Hash 48 bytes of input into 48 bytes of output, which may overlap
+static CAT_INLINE void blake2b_48(const void *in, void *out)
+{
+	blake2b_48_kernel.fn((const u8 *)in, (u8 *)out);
+}
+
+
+} // namespace cat
+
+#endif // CAT_BLAKE2B_BLOCK_HPP
@@ -0,0 +1,242 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "ChaChaLanes.hpp"
+#include "ChaChaBlocks.hpp"
+#include "EndianNeutral.hpp"
+#include "SecureErase.hpp"
+using namespace cat;
+
+
+// Portable version runs one message at a time
+static void chacha_lanes_portable(const chacha_lane *lanes, int count, int rounds)
+{
+	for (int ii = 0; ii < count; ++ii) {
+		const chacha_lane *lane = lanes + ii;
+		const u64 iv = getLE(lane->iv);
+
+		chacha_state S;
+		chacha_init(&S, (const chacha_key *)lane->key, (const chacha_iv *)&iv, rounds);
+
+		chacha_blocks(&S, (const u8 *)lane->in, (u8 *)lane->out, lane->bytes);
+	}
+}
+
+
+#ifdef CAT_HAS_X86_DISPATCH
+
+// Transpose an 8x8 matrix of 32-bit words held in 8 registers
+CAT_TARGET("avx2")
+static CAT_INLINE void transpose8(__m256i r[8])
+{
+	const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+#define CAT_ROTL_SHIFT(x, n) \
+	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n))
+
+#define CAT_QUARTER(a, b, c, d) \
+	a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CAT_ROTL_SHIFT(b, 12); \
+	a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CAT_ROTL_SHIFT(b, 7);
+
+// Encrypt up to 8 messages at once, one per 32-bit lane
+CAT_TARGET("avx2")
+static void chacha_lanes_avx2(const chacha_lane *lanes, int count, int rounds)
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+		2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13,
+		2,3,0,1, 6,7,4,5, 10,11,8,9, 14,15,12,13);
+	const __m256i rot8 = _mm256_setr_epi8(
+		3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14,
+		3,0,1,2, 7,4,5,6, 11,8,9,10, 15,12,13,14);
+
+	// Unused lanes repeat the first lane and discard the output
+	const u8 *in[CHACHA_LANES];
+	u8 *out[CHACHA_LANES];
+	int remaining[CHACHA_LANES];
+	u32 iv_lo[CHACHA_LANES], iv_hi[CHACHA_LANES];
+	__m256i key[8];
+	int longest = 0;
+
+	for (int ii = 0; ii < CHACHA_LANES; ++ii) {
+		const chacha_lane *lane = lanes + (ii < count ? ii : 0);
+
+		in[ii] = (const u8 *)lane->in;
+		out[ii] = (u8 *)lane->out;
+		remaining[ii] = ii < count ? lane->bytes : 0;
+		iv_lo[ii] = (u32)lane->iv;
+		iv_hi[ii] = (u32)(lane->iv >> 32);
+		key[ii] = _mm256_loadu_si256((const __m256i *)lane->key);
+
+		if (remaining[ii] > longest) {
+			longest = remaining[ii];
+		}
+	}
+
+	// Convert from one key per register to one key word per register
+	transpose8(key);
+
+	const __m256i iv0 = _mm256_loadu_si256((const __m256i *)iv_lo);
+	const __m256i iv1 = _mm256_loadu_si256((const __m256i *)iv_hi);
+
+	CAT_ALIGNED(32) u8 tmp[64];
+
+	for (u64 block = 0; longest > 0; ++block, longest -= 64) {
+		__m256i x[16];
+
+		x[0] = _mm256_set1_epi32(0x61707865);
+		x[1] = _mm256_set1_epi32(0x3320646e);
+		x[2] = _mm256_set1_epi32(0x79622d32);
+		x[3] = _mm256_set1_epi32(0x6b206574);
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = key[ii];
+		}
+		x[12] = _mm256_set1_epi32((u32)block);
+		x[13] = _mm256_set1_epi32((u32)(block >> 32));
+		x[14] = iv0;
+		x[15] = iv1;
+
+		for (int r = rounds; r > 0; r -= 2) {
+			CAT_QUARTER(x[0], x[4], x[8], x[12])
+			CAT_QUARTER(x[1], x[5], x[9], x[13])
+			CAT_QUARTER(x[2], x[6], x[10], x[14])
+			CAT_QUARTER(x[3], x[7], x[11], x[15])
+			CAT_QUARTER(x[0], x[5], x[10], x[15])
+			CAT_QUARTER(x[1], x[6], x[11], x[12])
+			CAT_QUARTER(x[2], x[7], x[8], x[13])
+			CAT_QUARTER(x[3], x[4], x[9], x[14])
+		}
+
+		x[0] = _mm256_add_epi32(x[0], _mm256_set1_epi32(0x61707865));
+		x[1] = _mm256_add_epi32(x[1], _mm256_set1_epi32(0x3320646e));
+		x[2] = _mm256_add_epi32(x[2], _mm256_set1_epi32(0x79622d32));
+		x[3] = _mm256_add_epi32(x[3], _mm256_set1_epi32(0x6b206574));
+		for (int ii = 0; ii < 8; ++ii) {
+			x[4 + ii] = _mm256_add_epi32(x[4 + ii], key[ii]);
+		}
+		x[12] = _mm256_add_epi32(x[12], _mm256_set1_epi32((u32)block));
+		x[13] = _mm256_add_epi32(x[13], _mm256_set1_epi32((u32)(block >> 32)));
+		x[14] = _mm256_add_epi32(x[14], iv0);
+		x[15] = _mm256_add_epi32(x[15], iv1);
+
+		// Convert from one word per register to one half-block per register
+		transpose8(x);
+		transpose8(x + 8);
+
+		for (int ii = 0; ii < count && ii < CHACHA_LANES; ++ii) {
+			const int bytes = remaining[ii];
+
+			if (bytes >= 64) {
+				const __m256i a = _mm256_loadu_si256((const __m256i *)in[ii]);
+				const __m256i b = _mm256_loadu_si256((const __m256i *)(in[ii] + 32));
+				_mm256_storeu_si256((__m256i *)out[ii], _mm256_xor_si256(a, x[ii]));
+				_mm256_storeu_si256((__m256i *)(out[ii] + 32), _mm256_xor_si256(b, x[8 + ii]));
+			} else if (bytes > 0) {
+				// Final partial block goes through a temporary buffer
+				_mm256_store_si256((__m256i *)tmp, x[ii]);
+				_mm256_store_si256((__m256i *)(tmp + 32), x[8 + ii]);
+				for (int jj = 0; jj < bytes; ++jj) {
+					out[ii][jj] = in[ii][jj] ^ tmp[jj];
+				}
+			} else {
+				continue;
+			}
+
+			in[ii] += 64;
+			out[ii] += 64;
+			remaining[ii] = bytes - 64;
+		}
+	}
+
+	// Erase key material from the stack
+	CAT_SECURE_OBJCLR(tmp);
+	_mm256_zeroall();
+}
+
+#undef CAT_QUARTER
+#undef CAT_ROTL_SHIFT
+
+#endif // CAT_HAS_X86_DISPATCH
+
+
+namespace cat {
+
+const cpu_kernel<chacha_lanes_fn> chacha_lanes_kernels[] = {
+#ifdef CAT_HAS_X86_DISPATCH
+	{ "avx2", CPU_AVX2, chacha_lanes_avx2 },
+#endif
+	{ "portable", 0, chacha_lanes_portable }
+};
+
+cpu_kernel<chacha_lanes_fn> chacha_lanes_kernel = { "portable", 0, chacha_lanes_portable };
+
+void chacha_lanes_select(u32 features)
+{
+	chacha_lanes_kernel = cpu_select(chacha_lanes_kernels, features);
+}
+
+void chacha_lanes(const chacha_lane *lanes, int count, int rounds)
+{
+	while (count > 0) {
+		const int n = count < CHACHA_LANES ? count : CHACHA_LANES;
+
+		chacha_lanes_kernel.fn(lanes, n, rounds);
+
+		lanes += n;
+		count -= n;
+	}
+}
+
+} // namespace cat
@@ -0,0 +1,79 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_CHACHA_LANES_HPP
+#define CAT_CHACHA_LANES_HPP
+
+#include "CpuDispatch.hpp"
+
+/*
+ * Multi-buffer ChaCha
+ *
+ * Short messages only use one or two blocks of a ChaCha kernel that is
+ * designed to generate many blocks at once.  This kernel instead encrypts
+ * several independent messages at once, one message per SIMD lane, so that
+ * batches of short messages run at close to the bulk throughput.
+ *
+ * Each lane has its own key and IV, and the block counter starts at 0 for
+ * every lane, matching chacha_init() followed by chacha_blocks().
+ */
+
+namespace cat {
+
+
+// One independent message for chacha_lanes()
+struct chacha_lane {
+	const char *key;	// 32-byte ChaCha key
+	u64 iv;				// IV for this message
+	const void *in;		// Input data, may be the same as out
+	void *out;			// Output data
+	int bytes;			// Number of bytes to encrypt
+};
+
+// Number of messages processed in one pass of the kernel
+static const int CHACHA_LANES = 8;
+
+typedef void (*chacha_lanes_fn)(const chacha_lane *lanes, int count, int rounds);
+
+// All kernels built into the library, from most to least preferred
+// Each kernel processes at most CHACHA_LANES messages per call
+extern const cpu_kernel<chacha_lanes_fn> chacha_lanes_kernels[];
+
+// Kernel currently in use
+extern cpu_kernel<chacha_lanes_fn> chacha_lanes_kernel;
+
+// Select the best kernel for the given CPU features
+void chacha_lanes_select(u32 features);
+
+// Encrypt or decrypt count independent messages with the given round count
+void chacha_lanes(const chacha_lane *lanes, int count, int rounds);
+
+
+} // namespace cat
+
+#endif // CAT_CHACHA_LANES_HPP
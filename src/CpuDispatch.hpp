@@ -0,0 +1,98 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_CPU_DISPATCH_HPP
+#define CAT_CPU_DISPATCH_HPP
+
+#include "Platform.hpp"
+
+/*
+ * Runtime CPU feature dispatch
+ *
+ * Kernels that need instruction set extensions are compiled with per-function
+ * target attributes, so one binary carries all of them.  Each module lists
+ * its kernels in a table from most to least preferred, ending with a portable
+ * kernel that requires nothing, and cpu_select() picks the first one that the
+ * CPU supports.  The selection is made once by calico_init().
+ */
+
+// SIMD kernels are available on x86 with GCC, Clang or Visual Studio 2013+
+#if defined(CAT_ISA_X86) && (defined(CAT_COMPILER_GCC) || \
+	(defined(CAT_COMPILER_MSVC) && _MSC_VER >= 1800))
+# define CAT_HAS_X86_DISPATCH
+# include <immintrin.h>
+#endif
+
+// AVX-512 intrinsics need Visual Studio 2017+
+#if defined(CAT_HAS_X86_DISPATCH) && (!defined(CAT_COMPILER_MSVC) || _MSC_VER >= 1910)
+# define CAT_HAS_AVX512_DISPATCH
+#endif
+
+// Compile one function for an instruction set extension
+#if defined(CAT_HAS_X86_DISPATCH) && defined(CAT_COMPILER_GCC)
+# define CAT_TARGET(isa) __attribute__ ((target (isa)))
+#else
+# define CAT_TARGET(isa)
+#endif
+
+namespace cat {
+
+
+enum CpuFeatures {
+	CPU_SSE2 = 1,
+	CPU_SSSE3 = 2,
+	CPU_AVX2 = 4,
+	CPU_AVX512 = 8,	// AVX-512 F, BW and VL
+	CPU_SSE41 = 16
+};
+
+// Detect the instruction set extensions usable on this CPU and OS
+u32 cpu_features();
+
+// One implementation of a kernel and the features it needs
+template<typename T> struct cpu_kernel {
+	const char *name;
+	u32 required;
+	T fn;
+};
+
+// Pick the first kernel in the table whose required features are all present
+// The last kernel in the table must require no features
+template<typename T>
+const cpu_kernel<T> &cpu_select(const cpu_kernel<T> *table, u32 features)
+{
+	while (table->required & ~features) {
+		++table;
+	}
+	return *table;
+}
+
+
+} // namespace cat
+
+#endif // CAT_CPU_DISPATCH_HPP
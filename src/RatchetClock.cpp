@@ -0,0 +1,62 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "RatchetClock.hpp"
+using namespace cat;
+
+#if !defined(CAT_OS_WINDOWS)
+# include <time.h>
+
+# if defined(CLOCK_MONOTONIC_COARSE)
+#  define CAT_RATCHET_CLOCK_ID CLOCK_MONOTONIC_COARSE
+# elif defined(CLOCK_MONOTONIC)
+#  define CAT_RATCHET_CLOCK_ID CLOCK_MONOTONIC
+# endif
+#endif
+
+bool RatchetClock::OnInitialize()
+{
+	return _clock.OnInitialize();
+}
+
+u32 RatchetClock::msec()
+{
+#if defined(CAT_RATCHET_CLOCK_ID)
+
+	struct timespec ts;
+
+	clock_gettime(CAT_RATCHET_CLOCK_ID, &ts);
+
+	return static_cast<u32>(ts.tv_sec) * 1000 + static_cast<u32>(ts.tv_nsec / 1000000);
+
+#else
+
+	return _clock.msec_fast();
+
+#endif
+}
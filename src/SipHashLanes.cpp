@@ -0,0 +1,241 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "SipHashLanes.hpp"
+#include "SipHash.hpp"
+#include "EndianNeutral.hpp"
+using namespace cat;
+
+#include <climits>
+
+
+// Portable version runs one message at a time
+static void siphash24_lanes_portable(const siphash_lane *lanes, int count, u64 *tags)
+{
+	for (int ii = 0; ii < count; ++ii) {
+		const siphash_lane *lane = lanes + ii;
+
+		tags[ii] = siphash24(lane->key, lane->data, lane->bytes, lane->ad);
+	}
+}
+
+
+#ifdef CAT_HAS_X86_DISPATCH
+
+/*
+ * Final word of the message, mixed with the length
+ *
+ * This must match siphash24() bit for bit, including the sign extension
+ * of the tail bytes that happens when they are read through a char pointer.
+ */
+static CAT_INLINE u64 siphash_last7(const void *vm, int len)
+{
+	const char *m = (const char *)vm + (len & ~7);
+	u64 last7 = (u64)len << 56;
+	switch (len & 7) {
+		case 7: last7 |= (u64)m[6] << 48;
+		case 6: last7 |= (u64)m[5] << 40;
+		case 5: last7 |= (u64)m[4] << 32;
+		case 4: last7 |= getLE(*(const u32 *)m); // low -> low
+			break;
+		case 3: last7 |= (u64)m[2] << 16;
+		case 2: last7 |= (u64)m[1] << 8;
+		case 1: last7 |= (u64)m[0];
+			break;
+	};
+	return last7;
+}
+
+#define CAT_ROL64_SHIFT(x, n) \
+	_mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - n))
+
+#define CAT_SIP_HALF_ROUND(a, b, c, d, s, t, rot_t) \
+	a = _mm256_add_epi64(a, b); \
+	c = _mm256_add_epi64(c, d); \
+	b = _mm256_xor_si256(CAT_ROL64_SHIFT(b, s), a); \
+	d = _mm256_xor_si256(rot_t, c); \
+	a = _mm256_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1));
+
+#define CAT_SIP_DOUBLE_ROUND(v0, v1, v2, v3) \
+	CAT_SIP_HALF_ROUND(v0, v1, v2, v3, 13, 16, _mm256_shuffle_epi8(v3, rot16)); \
+	CAT_SIP_HALF_ROUND(v2, v1, v0, v3, 17, 21, CAT_ROL64_SHIFT(v3, 21)); \
+	CAT_SIP_HALF_ROUND(v0, v1, v2, v3, 13, 16, _mm256_shuffle_epi8(v3, rot16)); \
+	CAT_SIP_HALF_ROUND(v2, v1, v0, v3, 17, 21, CAT_ROL64_SHIFT(v3, 21));
+
+// Hash up to 4 messages at once, one per 64-bit lane
+CAT_TARGET("avx2")
+static void siphash24_lanes_avx2(const siphash_lane *lanes, int count, u64 *tags)
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+		6,7,0,1,2,3,4,5, 14,15,8,9,10,11,12,13,
+		6,7,0,1,2,3,4,5, 14,15,8,9,10,11,12,13);
+
+	// Unused lanes repeat the first lane and discard the output
+	const u64 *m64[SIPHASH_LANES];
+	CAT_ALIGNED(32) u64 k0[SIPHASH_LANES], k1[SIPHASH_LANES];
+	CAT_ALIGNED(32) u64 words[SIPHASH_LANES], last7[SIPHASH_LANES];
+	int longest = 0, shortest = INT_MAX;
+
+	for (int ii = 0; ii < SIPHASH_LANES; ++ii) {
+		const siphash_lane *lane = lanes + (ii < count ? ii : 0);
+
+		k0[ii] = getLE(*(const u64 *)lane->key) ^ lane->ad;
+		k1[ii] = getLE(*(const u64 *)(lane->key + 8));
+		m64[ii] = (const u64 *)lane->data;
+		words[ii] = lane->bytes >> 3;
+		last7[ii] = siphash_last7(lane->data, lane->bytes);
+
+		if ((int)words[ii] > longest) {
+			longest = (int)words[ii];
+		}
+		if ((int)words[ii] < shortest) {
+			shortest = (int)words[ii];
+		}
+	}
+
+	// Mix the key across initial state
+	const __m256i key0 = _mm256_load_si256((const __m256i *)k0);
+	const __m256i key1 = _mm256_load_si256((const __m256i *)k1);
+	__m256i v0 = _mm256_xor_si256(key0, _mm256_set1_epi64x(0x736f6d6570736575ULL));
+	__m256i v1 = _mm256_xor_si256(key1, _mm256_set1_epi64x(0x646f72616e646f6dULL));
+	__m256i v2 = _mm256_xor_si256(key0, _mm256_set1_epi64x(0x6c7967656e657261ULL));
+	__m256i v3 = _mm256_xor_si256(key1, _mm256_set1_epi64x(0x7465646279746573ULL));
+
+	const __m256i word_counts = _mm256_load_si256((const __m256i *)words);
+	const __m256i final_words = _mm256_load_si256((const __m256i *)last7);
+
+	int w = 0;
+
+	// All lanes have at least this many full words, so no masking is needed
+	for (; w + 4 <= shortest; w += 4) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i *)(m64[0] + w));
+		const __m256i a1 = _mm256_loadu_si256((const __m256i *)(m64[1] + w));
+		const __m256i a2 = _mm256_loadu_si256((const __m256i *)(m64[2] + w));
+		const __m256i a3 = _mm256_loadu_si256((const __m256i *)(m64[3] + w));
+
+		// Transpose so that each register holds one word from every lane
+		const __m256i t0 = _mm256_unpacklo_epi64(a0, a1);
+		const __m256i t1 = _mm256_unpackhi_epi64(a0, a1);
+		const __m256i t2 = _mm256_unpacklo_epi64(a2, a3);
+		const __m256i t3 = _mm256_unpackhi_epi64(a2, a3);
+
+		__m256i mi[4];
+		mi[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+		mi[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+		mi[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+		mi[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+
+		for (int jj = 0; jj < 4; ++jj) {
+			v3 = _mm256_xor_si256(v3, mi[jj]);
+			CAT_SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+			v0 = _mm256_xor_si256(v0, mi[jj]);
+		}
+	}
+
+	/*
+	 * Each lane absorbs its remaining full words and then its final word,
+	 * and lanes that finished early keep their state unchanged until the
+	 * longest lane catches up.  The finalization is then shared by all lanes.
+	 */
+	for (; w <= longest; ++w) {
+		CAT_ALIGNED(32) u64 block[SIPHASH_LANES];
+
+		for (int ii = 0; ii < SIPHASH_LANES; ++ii) {
+			block[ii] = w < (int)words[ii] ? getLE(m64[ii][w]) : 0;
+		}
+
+		const __m256i index = _mm256_set1_epi64x(w);
+
+		// Lanes that are reading their final word this round
+		const __m256i final_mask = _mm256_cmpeq_epi64(index, word_counts);
+
+		// Lanes that are still absorbing input this round
+		const __m256i active_mask = _mm256_cmpgt_epi64(_mm256_add_epi64(word_counts, _mm256_set1_epi64x(1)), index);
+
+		const __m256i mi = _mm256_blendv_epi8(_mm256_load_si256((const __m256i *)block), final_words, final_mask);
+
+		__m256i t0 = v0, t1 = v1, t2 = v2, t3 = _mm256_xor_si256(v3, mi);
+		CAT_SIP_DOUBLE_ROUND(t0, t1, t2, t3);
+		t0 = _mm256_xor_si256(t0, mi);
+
+		v0 = _mm256_blendv_epi8(v0, t0, active_mask);
+		v1 = _mm256_blendv_epi8(v1, t1, active_mask);
+		v2 = _mm256_blendv_epi8(v2, t2, active_mask);
+		v3 = _mm256_blendv_epi8(v3, t3, active_mask);
+	}
+
+	// Final mix
+	v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+	CAT_SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+	CAT_SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+
+	CAT_ALIGNED(32) u64 out[SIPHASH_LANES];
+	_mm256_store_si256((__m256i *)out, _mm256_xor_si256(_mm256_xor_si256(v0, v1), _mm256_xor_si256(v2, v3)));
+
+	for (int ii = 0; ii < count; ++ii) {
+		tags[ii] = out[ii];
+	}
+}
+
+#undef CAT_SIP_DOUBLE_ROUND
+#undef CAT_SIP_HALF_ROUND
+#undef CAT_ROL64_SHIFT
+
+#endif // CAT_HAS_X86_DISPATCH
+
+
+namespace cat {
+
+const cpu_kernel<siphash24_lanes_fn> siphash24_lanes_kernels[] = {
+#ifdef CAT_HAS_X86_DISPATCH
+	{ "avx2", CPU_AVX2, siphash24_lanes_avx2 },
+#endif
+	{ "portable", 0, siphash24_lanes_portable }
+};
+
+cpu_kernel<siphash24_lanes_fn> siphash24_lanes_kernel = { "portable", 0, siphash24_lanes_portable };
+
+void siphash24_lanes_select(u32 features)
+{
+	siphash24_lanes_kernel = cpu_select(siphash24_lanes_kernels, features);
+}
+
+void siphash24_lanes(const siphash_lane *lanes, int count, u64 *tags)
+{
+	while (count > 0) {
+		const int n = count < SIPHASH_LANES ? count : SIPHASH_LANES;
+
+		siphash24_lanes_kernel.fn(lanes, n, tags);
+
+		lanes += n;
+		tags += n;
+		count -= n;
+	}
+}
+
+} // namespace cat
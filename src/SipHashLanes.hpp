@@ -0,0 +1,75 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_SIPHASH_LANES_HPP
+#define CAT_SIPHASH_LANES_HPP
+
+#include "CpuDispatch.hpp"
+
+/*
+ * Multi-buffer SipHash-2-4
+ *
+ * Computes siphash24() tags for several independent messages at once, one
+ * message per 64-bit SIMD lane.  Each lane has its own key, length, and
+ * additional data, and the tags are identical to calling siphash24() on
+ * each message in turn.
+ */
+
+namespace cat {
+
+
+// One independent message for siphash24_lanes()
+struct siphash_lane {
+	const char *key;	// 16-byte SipHash key
+	const void *data;	// Message to authenticate
+	int bytes;			// Number of bytes in the message
+	u64 ad;				// Additional data, as for siphash24()
+};
+
+// Number of messages processed in one pass of the kernel
+static const int SIPHASH_LANES = 4;
+
+typedef void (*siphash24_lanes_fn)(const siphash_lane *lanes, int count, u64 *tags);
+
+// All kernels built into the library, from most to least preferred
+// Each kernel processes at most SIPHASH_LANES messages per call
+extern const cpu_kernel<siphash24_lanes_fn> siphash24_lanes_kernels[];
+
+// Kernel currently in use
+extern cpu_kernel<siphash24_lanes_fn> siphash24_lanes_kernel;
+
+// Select the best kernel for the given CPU features
+void siphash24_lanes_select(u32 features);
+
+// Compute the tags for count independent messages
+void siphash24_lanes(const siphash_lane *lanes, int count, u64 *tags);
+
+
+} // namespace cat
+
+#endif // CAT_SIPHASH_LANES_HPP
@@ -0,0 +1,133 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "SipHashState.hpp"
+#include "EndianNeutral.hpp"
+using namespace cat;
+
+#include <cstring>
+
+#define SIP_HALF_ROUND(a, b, c, d, s, t) \
+	a += b; \
+	c += d; \
+	b = CAT_ROL64(b, s) ^ a; \
+	d = CAT_ROL64(d, t) ^ c; \
+	a = CAT_ROL64(a, 32);
+
+#define SIP_DOUBLE_ROUND(v0, v1, v2, v3) \
+	SIP_HALF_ROUND(v0, v1, v2, v3, 13, 16); \
+	SIP_HALF_ROUND(v2, v1, v0, v3, 17, 21); \
+	SIP_HALF_ROUND(v0, v1, v2, v3, 13, 16); \
+	SIP_HALF_ROUND(v2, v1, v0, v3, 17, 21);
+
+void cat::siphash24_words(siphash_state *state, const void *vm, int words) {
+	u64 v0 = state->v0, v1 = state->v1, v2 = state->v2, v3 = state->v3;
+
+	// Perform SIP rounds on 8 bytes of input at a time
+	const u64 *m64 = (const u64 *)vm;
+	for (int ii = words; ii > 0; --ii) {
+		u64 mi = getLE(*m64++);
+
+		v3 ^= mi;
+		SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+		v0 ^= mi;
+	}
+
+	state->v0 = v0;
+	state->v1 = v1;
+	state->v2 = v2;
+	state->v3 = v3;
+	state->bytes += (u64)words << 3;
+}
+
+u64 cat::siphash24_end(siphash_state *state, const void *vm, int len) {
+	siphash24_words(state, vm, len >> 3);
+
+	u64 v0 = state->v0, v1 = state->v1, v2 = state->v2, v3 = state->v3;
+
+	// Mix the last 1..7 bytes with the length, exactly as siphash24() does
+	const char *m = (const char *)vm + (len & ~7);
+	u64 last7 = (state->bytes + (len & 7)) << 56;
+	switch (len & 7) {
+		case 7: last7 |= (u64)m[6] << 48;
+		case 6: last7 |= (u64)m[5] << 40;
+		case 5: last7 |= (u64)m[4] << 32;
+		case 4: last7 |= getLE(*(const u32 *)m); // low -> low
+			break;
+		case 3: last7 |= (u64)m[2] << 16;
+		case 2: last7 |= (u64)m[1] << 8;
+		case 1: last7 |= (u64)m[0];
+			break;
+	};
+
+	// Final mix
+	v3 ^= last7;
+	SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+	v0 ^= last7;
+	v2 ^= 0xff;
+	SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+	SIP_DOUBLE_ROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+void cat::siphash24_update(siphash_stream *stream, const void *vm, int len) {
+	const u8 *m = (const u8 *)vm;
+
+	// If a partial word is buffered,
+	if (stream->buffered > 0) {
+		int take = 8 - stream->buffered;
+		if (take > len) {
+			take = len;
+		}
+
+		memcpy(stream->buffer + stream->buffered, m, take);
+		stream->buffered += take;
+		m += take;
+		len -= take;
+
+		// If the word is still not complete,
+		if (stream->buffered < 8) {
+			return;
+		}
+
+		siphash24_words(&stream->state, stream->buffer, 1);
+		stream->buffered = 0;
+	}
+
+	// Absorb whole words directly from the input
+	siphash24_words(&stream->state, m, len >> 3);
+
+	// Keep the rest for next time
+	stream->buffered = len & 7;
+	memcpy(stream->buffer, m + (len & ~7), stream->buffered);
+}
+
+u64 cat::siphash24_final(siphash_stream *stream) {
+	return siphash24_end(&stream->state, stream->buffer, stream->buffered);
+}
@@ -0,0 +1,119 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_SIPHASH_STATE_HPP
+#define CAT_SIPHASH_STATE_HPP
+
+#include "Platform.hpp"
+#include "EndianNeutral.hpp"
+
+/*
+ * Incremental SipHash-2-4
+ *
+ * Produces the same tags as siphash24() for a message that is provided in
+ * pieces.  Every piece except the last must be a whole number of 8-byte
+ * words, which lets the caller hash data in cache-sized tiles right after
+ * it has been produced.
+ */
+
+namespace cat {
+
+
+struct siphash_state {
+	u64 v0, v1, v2, v3;
+	u64 bytes;	// Number of bytes absorbed so far
+};
+
+// Set up the state as siphash24(key, ..., ad) would
+static CAT_INLINE void siphash24_begin(siphash_state *state, const char key[16], const u64 ad = 0)
+{
+	// Convert key into two 64-bit integers
+	const u64 k0 = getLE(*(const u64 *)key) ^ ad;
+	const u64 k1 = getLE(*(const u64 *)(key + 8));
+
+	// Mix the key across initial state
+	state->v0 = k0 ^ 0x736f6d6570736575ULL;
+	state->v1 = k1 ^ 0x646f72616e646f6dULL;
+	state->v2 = k0 ^ 0x6c7967656e657261ULL;
+	state->v3 = k1 ^ 0x7465646279746573ULL;
+	state->bytes = 0;
+}
+
+// Set up the state from one prepared by siphash24_begin() with no additional
+// data, which saves reloading the key for each message
+static CAT_INLINE void siphash24_begin(siphash_state *state, const siphash_state *prepared, const u64 ad)
+{
+	*state = *prepared;
+	state->v0 ^= ad;
+	state->v2 ^= ad;
+}
+
+// Absorb the given number of whole 8-byte words
+void siphash24_words(siphash_state *state, const void *vm, int words);
+
+// Absorb the final piece of the message of any length and return the tag
+u64 siphash24_end(siphash_state *state, const void *vm, int len);
+
+
+/*
+ * Incremental SipHash-2-4 for pieces of any length
+ *
+ * Buffers a partial word between pieces, so a message may be split anywhere.
+ * Pieces that follow a whole number of words are absorbed directly.
+ */
+
+struct siphash_stream {
+	siphash_state state;
+	u8 buffer[8];	// Partial word carried over to the next piece
+	int buffered;	// Number of bytes in the buffer
+};
+
+// Set up the stream from a state prepared by siphash24_begin()
+static CAT_INLINE void siphash24_stream_begin(siphash_stream *stream, const siphash_state *prepared, const u64 ad)
+{
+	siphash24_begin(&stream->state, prepared, ad);
+	stream->buffered = 0;
+}
+
+// Set up the stream as siphash24(key, ..., ad) would
+static CAT_INLINE void siphash24_stream_begin(siphash_stream *stream, const char key[16], const u64 ad)
+{
+	siphash24_begin(&stream->state, key, ad);
+	stream->buffered = 0;
+}
+
+// Absorb the next piece of the message
+void siphash24_update(siphash_stream *stream, const void *vm, int len);
+
+// Return the tag for all of the pieces
+u64 siphash24_final(siphash_stream *stream);
+
+
+} // namespace cat
+
+#endif // CAT_SIPHASH_STATE_HPP
@@ -0,0 +1,400 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "calico.h"
+
+#include "Atomic.hpp"
+#include "Thread.hpp"
+#include "SecureErase.hpp"
+using namespace cat;
+
+#if defined(CAT_OS_WINDOWS)
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# include <sys/mman.h>
+#endif
+
+/*
+ * State pool
+ *
+ * State objects are carved out of 2 MB slabs, each one huge page where the
+ * OS allows it, so a million sessions take a few hundred TLB entries rather
+ * than a few hundred thousand.  Every object starts on a cache line so the
+ * keys inside it never straddle one, and no heap header sits between them.
+ *
+ * Each thread keeps its own free list in a calico_pool_cache and only takes
+ * the pool lock to move a batch of objects to or from the shared free list.
+ * Freed objects are erased with calico_cleanup() before they are linked
+ * into a free list, so the link overwrites only erased memory.
+ */
+
+// Size of a cache line
+#define CAT_CACHE_LINE_BYTES 64
+
+// Constants to indicate the pool objects are initialized
+static const u32 FLAG_POOL = 0x6501cd9a;
+static const u32 FLAG_POOL_CACHE = 0x6501cd9c;
+
+// Bytes in one slab, the size of an x86 huge page
+static const u64 SLAB_BYTES = 2 * 1024 * 1024;
+
+// Number of objects moved between a cache and the pool at a time
+static const u32 CACHE_BATCH = 32;
+
+// A cache hands a batch back to the pool when it holds more than this
+static const u32 CACHE_MAX = 2 * CACHE_BATCH;
+
+// Link in a free list, stored in the first bytes of an erased object
+struct PoolFree {
+	PoolFree *next;
+};
+
+// Header in the first cache line of each slab
+struct PoolSlab {
+	PoolSlab *next;
+};
+
+struct StatePool {
+	u32 flag;
+
+	// Held while the shared free list or the slabs are changed
+	volatile u32 lock;
+
+	// Bytes per object, rounded up to a whole number of cache lines
+	u32 object_bytes;
+
+	// Objects that have never been handed out in the newest slab
+	u8 *slab_next;
+	u8 *slab_end;
+
+	// All slabs, newest first
+	PoolSlab *slabs;
+
+	// Shared free list
+	PoolFree *free_list;
+
+	// Objects held by caches, either in use or on their free lists
+	u64 outstanding;
+};
+
+struct PoolCache {
+	u32 flag;
+
+	// Number of objects on the free list
+	u32 count;
+
+	StatePool *pool;
+	PoolFree *free_list;
+};
+
+// Helper function to find the internal object inside an opaque one
+template<class T>
+static CAT_INLINE T *get_aligned(void *P)
+{
+	const size_t mask = CAT_CACHE_LINE_BYTES - 1;
+	return reinterpret_cast<T *>( ((size_t)P + mask) & ~mask );
+}
+
+// Helper function to get one slab of memory from the OS
+// Returns null if the OS is out of memory
+static PoolSlab *slab_map()
+{
+	PoolSlab *slab = 0;
+
+#if defined(CAT_OS_WINDOWS)
+	// Large pages need a privilege most processes do not hold, so ask for
+	// ordinary pages
+	slab = (PoolSlab *)VirtualAlloc(0, SLAB_BYTES, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+# if defined(MAP_HUGETLB)
+	// Use a reserved huge page if the administrator set any aside
+	void *p = mmap(0, SLAB_BYTES, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		slab = (PoolSlab *)p;
+	}
+# endif
+
+	if (!slab) {
+		// Map twice the size and trim it to a huge page boundary, so that
+		// transparent huge pages can back the whole slab
+		u8 *q = (u8 *)mmap(0, 2 * SLAB_BYTES, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (q == (u8 *)MAP_FAILED) {
+			return 0;
+		}
+
+		u8 *aligned = (u8 *)(((size_t)q + SLAB_BYTES - 1) & ~(size_t)(SLAB_BYTES - 1));
+		if (aligned > q) {
+			munmap(q, aligned - q);
+		}
+		munmap(aligned + SLAB_BYTES, q + SLAB_BYTES - aligned);
+
+# if defined(MADV_HUGEPAGE)
+		madvise(aligned, SLAB_BYTES, MADV_HUGEPAGE);
+# endif
+
+		slab = (PoolSlab *)aligned;
+	}
+#endif
+
+	if (slab) {
+		slab->next = 0;
+	}
+
+	return slab;
+}
+
+static void slab_unmap(PoolSlab *slab)
+{
+#if defined(CAT_OS_WINDOWS)
+	VirtualFree(slab, 0, MEM_RELEASE);
+#else
+	munmap(slab, SLAB_BYTES);
+#endif
+}
+
+static void pool_lock(StatePool *pool)
+{
+	while (!atomic_cas(&pool->lock, 0, 1)) {
+		thread_yield();
+	}
+}
+
+static CAT_INLINE void pool_unlock(StatePool *pool)
+{
+	atomic_store_release(&pool->lock, 0);
+}
+
+// Helper function to move up to CACHE_BATCH objects from the pool to a cache
+// Returns false if the OS is out of memory
+static bool cache_refill(PoolCache *cache)
+{
+	StatePool *pool = cache->pool;
+	bool success = true;
+
+	pool_lock(pool);
+
+	u32 moved = 0;
+
+	// Reuse freed objects first
+	while (moved < CACHE_BATCH && pool->free_list) {
+		PoolFree *node = pool->free_list;
+		pool->free_list = node->next;
+
+		node->next = cache->free_list;
+		cache->free_list = node;
+		++moved;
+	}
+
+	// Then carve new objects from the newest slab
+	while (moved < CACHE_BATCH) {
+		if (pool->slab_next + pool->object_bytes > pool->slab_end) {
+			PoolSlab *slab = slab_map();
+			if (!slab) {
+				success = (moved > 0);
+				break;
+			}
+
+			slab->next = pool->slabs;
+			pool->slabs = slab;
+			pool->slab_next = (u8 *)slab + CAT_CACHE_LINE_BYTES;
+			pool->slab_end = (u8 *)slab + SLAB_BYTES;
+		}
+
+		PoolFree *node = reinterpret_cast<PoolFree *>( pool->slab_next );
+		pool->slab_next += pool->object_bytes;
+
+		node->next = cache->free_list;
+		cache->free_list = node;
+		++moved;
+	}
+
+	pool->outstanding += moved;
+	cache->count += moved;
+
+	pool_unlock(pool);
+
+	return success;
+}
+
+// Helper function to move up to count objects from a cache back to the pool
+static void cache_drain(PoolCache *cache, u32 count)
+{
+	StatePool *pool = cache->pool;
+
+	pool_lock(pool);
+
+	u32 moved = 0;
+	while (moved < count && cache->free_list) {
+		PoolFree *node = cache->free_list;
+		cache->free_list = node->next;
+
+		node->next = pool->free_list;
+		pool->free_list = node;
+		++moved;
+	}
+
+	pool->outstanding -= moved;
+	cache->count -= moved;
+
+	pool_unlock(pool);
+}
+
+
+//// State pool API
+
+int calico_pool_init(calico_pool *pool_object, int state_size)
+{
+	StatePool *pool = get_aligned<StatePool>(pool_object);
+
+	// If input is invalid,
+	if (!pool_object || (state_size != sizeof(calico_state) &&
+						 state_size != sizeof(calico_stream_only))) {
+		return -1;
+	}
+
+	// If the opaque objects are too small for this build,
+	if (sizeof(StatePool) + CAT_CACHE_LINE_BYTES - 1 > sizeof(calico_pool) ||
+		sizeof(PoolCache) + CAT_CACHE_LINE_BYTES - 1 > sizeof(calico_pool_cache)) {
+		return -1;
+	}
+
+	pool->lock = 0;
+	pool->object_bytes = (state_size + CAT_CACHE_LINE_BYTES - 1) & ~(CAT_CACHE_LINE_BYTES - 1);
+	pool->slab_next = 0;
+	pool->slab_end = 0;
+	pool->slabs = 0;
+	pool->free_list = 0;
+	pool->outstanding = 0;
+	pool->flag = FLAG_POOL;
+
+	return 0;
+}
+
+int calico_pool_cache_init(calico_pool *pool_object, calico_pool_cache *cache_object)
+{
+	StatePool *pool = get_aligned<StatePool>(pool_object);
+	PoolCache *cache = get_aligned<PoolCache>(cache_object);
+
+	// If input is invalid,
+	if (!pool_object || !cache_object || pool->flag != FLAG_POOL) {
+		return -1;
+	}
+
+	cache->count = 0;
+	cache->pool = pool;
+	cache->free_list = 0;
+	cache->flag = FLAG_POOL_CACHE;
+
+	return 0;
+}
+
+void *calico_pool_alloc(calico_pool_cache *cache_object)
+{
+	PoolCache *cache = get_aligned<PoolCache>(cache_object);
+
+	// If input is invalid,
+	if (!cache_object || cache->flag != FLAG_POOL_CACHE) {
+		return 0;
+	}
+
+	if (!cache->free_list && !cache_refill(cache)) {
+		return 0;
+	}
+
+	PoolFree *node = cache->free_list;
+	cache->free_list = node->next;
+	cache->count--;
+
+	// Clear the link so the object reads as erased
+	node->next = 0;
+
+	return node;
+}
+
+void calico_pool_free(calico_pool_cache *cache_object, void *S)
+{
+	PoolCache *cache = get_aligned<PoolCache>(cache_object);
+
+	// If input is invalid,
+	if (!cache_object || !S || cache->flag != FLAG_POOL_CACHE) {
+		return;
+	}
+
+	// Erase the keys before the object is reused
+	calico_cleanup(S);
+
+	PoolFree *node = reinterpret_cast<PoolFree *>( S );
+	node->next = cache->free_list;
+	cache->free_list = node;
+
+	if (++cache->count > CACHE_MAX) {
+		cache_drain(cache, CACHE_BATCH);
+	}
+}
+
+void calico_pool_cache_cleanup(calico_pool_cache *cache_object)
+{
+	PoolCache *cache = get_aligned<PoolCache>(cache_object);
+
+	// If input is invalid,
+	if (!cache_object || cache->flag != FLAG_POOL_CACHE) {
+		return;
+	}
+
+	cache_drain(cache, cache->count);
+
+	cache->flag = 0;
+}
+
+void calico_pool_cleanup(calico_pool *pool_object)
+{
+	StatePool *pool = get_aligned<StatePool>(pool_object);
+
+	// If input is invalid,
+	if (!pool_object || pool->flag != FLAG_POOL) {
+		return;
+	}
+
+	PoolSlab *slab = pool->slabs;
+	while (slab) {
+		PoolSlab *next = slab->next;
+
+		// If some objects were never freed, erase them along with the slab
+		if (pool->outstanding > 0) {
+			cat_secure_erase(slab, (int)SLAB_BYTES);
+		}
+
+		slab_unmap(slab);
+		slab = next;
+	}
+
+	CAT_SECURE_OBJCLR(*pool);
+}
@@ -0,0 +1,95 @@
+/*
+	Copyright (c) 2012-2014 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of Calico nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.	 IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_THREAD_HPP
+#define CAT_THREAD_HPP
+
+#include "Platform.hpp"
+
+#if !defined(CAT_OS_WINDOWS)
+# include <pthread.h>
+#endif
+
+/*
+ * Minimal portable threads
+ */
+
+namespace cat {
+
+
+typedef void (*thread_fn)(void *param);
+
+struct thread_handle {
+#if defined(CAT_OS_WINDOWS)
+	void *handle;
+#else
+	pthread_t thread;
+#endif
+
+	thread_fn fn;
+	void *param;
+};
+
+// Run fn(param) in a new thread
+// Returns false if the thread could not be started
+bool thread_start(thread_handle *thread, thread_fn fn, void *param);
+
+// Wait for a thread started with thread_start() to finish
+void thread_join(thread_handle *thread);
+
+// Let a thread started with thread_start() release its resources when it
+// returns, instead of being joined
+void thread_detach(thread_handle *thread);
+
+// Give up the rest of this time slice to another thread
+void thread_yield();
+
+// Most threads that a pool call may add to the calling thread
+static const int THREAD_POOL_MAX_HELPERS = 63;
+
+// Time a pool helper waits for work before it exits
+static const u32 THREAD_POOL_IDLE_MSEC = 1000;
+
+// Run fn(param) on this thread and on up to the given number of helper
+// threads at the same time, returning once every one of them has returned.
+// fn must share out its work so that the work is done when any number of
+// threads have run it; helpers that wake after this thread is done skip it.
+// The helpers are started on first use and then kept waiting for the next
+// call, so a call does not pay to start threads.  A helper that is not used
+// for THREAD_POOL_IDLE_MSEC exits, and a later call starts it again.  There
+// is one pool for the process; a call made while another is running uses
+// only this thread
+void thread_pool_run(thread_fn fn, void *param, int helpers);
+
+// Number of helper threads the pool has running
+int thread_pool_helpers();
+
+
+} // namespace cat
+
+#endif // CAT_THREAD_HPP
@@ -2,14 +2,31 @@
 #include <cassert>
 #include <cstdlib>
 #include <climits>
+#include <cstring>
+#include <algorithm>
 using namespace std;
 
 #include "calico.h"
 #include "Clock.hpp"
 #include "AbyssinianPRNG.hpp"
 #include "SecureEqual.hpp"
+#include "SecureErase.hpp"
+#include "SipHash.hpp"
+#include "SipHashState.hpp"
+#include "Blake2bBlock.hpp"
+#include "ChaChaBlocks.hpp"
+#include "AntiReplayWindow.hpp"
+#include "Atomic.hpp"
+#include "Thread.hpp"
+#include "chacha.h"
 using namespace cat;
 
+#ifndef CAT_OS_WINDOWS
+#include <unistd.h>
+#endif
+
+#include <fstream>
+
 static Clock m_clock;
 
 typedef void (*TestFunction)();
@@ -33,6 +50,166 @@ void UninitializedTest() {
 	assert(calico_decrypt(&S, data, bytes, overhead, sizeof(overhead)));
 }
 
+/*
+ * Check that state objects which are not cache line aligned are rejected
+ */
+void MisalignedStateTest() {
+	static CALICO_ALIGNED char buffer[sizeof(calico_state) + 64];
+
+	char key[32] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	char data[10] = {0};
+
+	for (int offset = 0; offset < 64; offset += 8) {
+		void *S = buffer + offset;
+		const int expected = offset ? -1 : 0;
+
+		assert(calico_key(S, sizeof(calico_state), CALICO_INITIATOR, key, sizeof(key)) == expected);
+		assert(calico_encrypt(S, data, data, sizeof(data), overhead, sizeof(overhead)) == expected);
+	}
+
+	calico_cleanup(buffer);
+}
+
+/*
+ * Check that every ChaCha kernel supported by this CPU matches the reference
+ */
+void ChaChaKernelTest() {
+	static const int MAX_BYTES = 2000;
+
+	static u8 orig[MAX_BYTES], expected[MAX_BYTES], actual[MAX_BYTES];
+	char key[32];
+	u64 iv;
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	const u32 features = cpu_features();
+
+	for (const cpu_kernel<chacha_blocks_fn> *kernel = chacha_blocks_kernels;; ++kernel) {
+		if ((kernel->required & features) == kernel->required) {
+			for (int round = 0; round < 1000; ++round) {
+				const int bytes = prng.Next() % MAX_BYTES;
+				const int split = (prng.Next() % (bytes / 64 + 1)) * 64;
+				const bool keystream = (round % 5) == 0;
+				const bool in_place = (round % 3) == 0;
+
+				for (int ii = 0; ii < 32; ++ii) {
+					key[ii] = (char)prng.Next();
+				}
+				for (int ii = 0; ii < bytes; ++ii) {
+					orig[ii] = (u8)prng.Next();
+				}
+				iv = ((u64)prng.Next() << 32) | prng.Next();
+
+				// Start some rounds just before the low counter word wraps
+				const u64 counter = (round & 1) ? 0xfffffffcULL : 0;
+
+				chacha_state S;
+				chacha_init(&S, (const chacha_key *)key, (const chacha_iv *)&iv, 14);
+				chacha_set_counter(&S, counter);
+				chacha_blocks_ref(&S, keystream ? 0 : orig, expected, bytes);
+
+				// Check the kernel continues from the stored counter
+				if (in_place) {
+					memcpy(actual, orig, bytes);
+				}
+				const u8 *in = keystream ? 0 : (in_place ? actual : orig);
+				chacha_init(&S, (const chacha_key *)key, (const chacha_iv *)&iv, 14);
+				chacha_set_counter(&S, counter);
+				kernel->fn(&S, in, actual, split);
+				kernel->fn(&S, in ? in + split : 0, actual + split, bytes - split);
+
+				assert(!memcmp(expected, actual, bytes));
+				assert(chacha_get_counter(&S) == counter + (bytes + 63) / 64);
+			}
+		}
+
+		// Reference kernel is last
+		if (!kernel->required) {
+			break;
+		}
+	}
+}
+
+/*
+ * Check that every BLAKE2b kernel supported by this CPU matches the standard
+ */
+void Blake2bKernelTest() {
+	// BLAKE2b with a 48-byte digest of 48 zero bytes
+	static const u8 ZERO_HASH[48] = {
+		0xa3, 0x8e, 0x51, 0xe8, 0xdc, 0xac, 0xdc, 0x67, 0xb5, 0x49, 0x4b, 0xc4,
+		0x06, 0x91, 0xa2, 0x6a, 0xfd, 0x8a, 0xff, 0xa8, 0x42, 0xc1, 0xc2, 0xb8,
+		0xed, 0xf6, 0xb9, 0x02, 0x39, 0x65, 0x42, 0xa3, 0xa6, 0xe6, 0x07, 0x6c,
+		0x78, 0x8c, 0xac, 0x56, 0xbd, 0xbb, 0x29, 0x83, 0xcf, 0x4a, 0x55, 0x77
+	};
+
+	// BLAKE2b with a 48-byte digest of the bytes 0, 1, ..., 47
+	static const u8 COUNTING_HASH[48] = {
+		0xaa, 0x83, 0x39, 0xe7, 0x09, 0xce, 0x63, 0xec, 0x65, 0x97, 0x40, 0x1e,
+		0x71, 0xf1, 0x30, 0xd6, 0x15, 0xb8, 0x30, 0xd3, 0xac, 0xd5, 0x0a, 0x8f,
+		0x61, 0xed, 0x68, 0xdf, 0x50, 0xce, 0xac, 0x46, 0x21, 0xdd, 0xaa, 0x12,
+		0xdd, 0x68, 0x26, 0x78, 0x78, 0xcd, 0x4a, 0xb7, 0xa2, 0xba, 0x69, 0x75
+	};
+
+	// 48 zero bytes hashed 1000 times over
+	static const u8 CHAIN_HASH[48] = {
+		0x28, 0x76, 0x84, 0x78, 0x95, 0x57, 0x6e, 0x2d, 0xeb, 0x82, 0x49, 0x7e,
+		0x34, 0xcb, 0x46, 0x73, 0x16, 0x81, 0xab, 0x1a, 0xbd, 0x75, 0x58, 0x6d,
+		0x3d, 0x48, 0xcd, 0x93, 0x3e, 0x3c, 0x8f, 0x2f, 0xdf, 0xcb, 0x20, 0x35,
+		0xc0, 0x6f, 0x99, 0x5e, 0xbb, 0x7c, 0x11, 0x66, 0x73, 0x06, 0x4e, 0x10
+	};
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	const u32 features = cpu_features();
+
+	// The portable kernel is last
+	const cpu_kernel<blake2b_48_fn> *portable = blake2b_48_kernels;
+	while (portable->required) {
+		++portable;
+	}
+
+	for (const cpu_kernel<blake2b_48_fn> *kernel = blake2b_48_kernels;; ++kernel) {
+		if ((kernel->required & features) == kernel->required) {
+			u8 in[48], out[48], expected[48];
+
+			memset(in, 0, sizeof(in));
+			kernel->fn(in, out);
+			assert(!memcmp(out, ZERO_HASH, sizeof(out)));
+
+			for (int ii = 0; ii < 48; ++ii) {
+				in[ii] = (u8)ii;
+			}
+			kernel->fn(in, out);
+			assert(!memcmp(out, COUNTING_HASH, sizeof(out)));
+
+			// Hash in place, as the ratchet does
+			memset(in, 0, sizeof(in));
+			for (int ii = 0; ii < 1000; ++ii) {
+				kernel->fn(in, in);
+			}
+			assert(!memcmp(in, CHAIN_HASH, sizeof(in)));
+
+			for (int round = 0; round < 1000; ++round) {
+				for (int ii = 0; ii < 48; ++ii) {
+					in[ii] = (u8)prng.Next();
+				}
+
+				portable->fn(in, expected);
+				kernel->fn(in, out);
+
+				assert(!memcmp(expected, out, sizeof(out)));
+			}
+		}
+
+		if (!kernel->required) {
+			break;
+		}
+	}
+}
+
 /*
  * Check that data may be sent over the tunnel without getting corrupted
  */
@@ -134,6 +311,300 @@ void StreamModeTest() {
 	}
 }
 
+/*
+ * Check that batch encryption matches single-message decryption
+ */
+void BatchEncryptTest() {
+	static const int BATCH = 32;
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char orig[BATCH][1400];
+	char data[BATCH][1400];
+	char overhead[BATCH][CALICO_DATAGRAM_OVERHEAD];
+	calico_encrypt_desc msgs[BATCH];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	for (int ii = 0; ii < BATCH; ++ii) {
+		for (int jj = 0; jj < (int)sizeof(orig[ii]); ++jj) {
+			orig[ii][jj] = (char)prng.Next();
+		}
+
+		msgs[ii].plaintext = orig[ii];
+		msgs[ii].ciphertext = data[ii];
+		msgs[ii].bytes = prng.Next() % sizeof(orig[ii]);
+		msgs[ii].overhead = overhead[ii];
+	}
+
+	// Invalid input checks
+	assert(calico_encrypt_batch(0, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+	assert(calico_encrypt_batch(&x, 0, BATCH, CALICO_DATAGRAM_OVERHEAD));
+	assert(calico_encrypt_batch(&x, msgs, -1, CALICO_DATAGRAM_OVERHEAD));
+	assert(calico_encrypt_batch(&x, msgs, BATCH, 0));
+	assert(!calico_encrypt_batch(&x, msgs, 0, CALICO_DATAGRAM_OVERHEAD));
+
+	msgs[BATCH / 2].bytes = -1;
+	assert(calico_encrypt_batch(&x, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+	msgs[BATCH / 2].bytes = 100;
+
+	// Interleave batches with single messages to check the IV sequence
+	for (int round = 0; round < 10; ++round) {
+		assert(!calico_encrypt_batch(&x, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+
+		for (int ii = BATCH - 1; ii >= 0; --ii) {
+			assert(!calico_decrypt(&y, data[ii], msgs[ii].bytes, overhead[ii], CALICO_DATAGRAM_OVERHEAD));
+			assert(SecureEqual(data[ii], orig[ii], msgs[ii].bytes));
+		}
+
+		assert(!calico_encrypt(&x, data[0], orig[0], 100, overhead[0], CALICO_DATAGRAM_OVERHEAD));
+		assert(!calico_decrypt(&y, data[0], 100, overhead[0], CALICO_DATAGRAM_OVERHEAD));
+	}
+
+	// Stream mode must stay in order
+	calico_stream_only sx, sy;
+	char stream_overhead[BATCH][CALICO_STREAM_OVERHEAD];
+
+	assert(!calico_key(&sx, sizeof(sx), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&sy, sizeof(sy), CALICO_RESPONDER, key, sizeof(key)));
+
+	for (int ii = 0; ii < BATCH; ++ii) {
+		msgs[ii].overhead = stream_overhead[ii];
+	}
+
+	assert(calico_encrypt_batch(&sx, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+	assert(!calico_encrypt_batch(&sx, msgs, BATCH, CALICO_STREAM_OVERHEAD));
+
+	for (int ii = 0; ii < BATCH; ++ii) {
+		assert(!calico_decrypt(&sy, data[ii], msgs[ii].bytes, stream_overhead[ii], CALICO_STREAM_OVERHEAD));
+		assert(SecureEqual(data[ii], orig[ii], msgs[ii].bytes));
+	}
+}
+
+/*
+ * Check that batch decryption drops bad packets without stalling good ones
+ */
+void BatchDecryptTest() {
+	static const int BATCH = 40;
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char orig[BATCH][1400];
+	char data[BATCH][1400];
+	char overhead[BATCH][CALICO_DATAGRAM_OVERHEAD];
+	calico_decrypt_desc pkts[BATCH];
+	int results[BATCH];
+	int bytes[BATCH];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	// Invalid input checks
+	assert(calico_decrypt_batch(0, pkts, BATCH, CALICO_DATAGRAM_OVERHEAD, results));
+	assert(calico_decrypt_batch(&y, 0, BATCH, CALICO_DATAGRAM_OVERHEAD, results));
+	assert(calico_decrypt_batch(&y, pkts, BATCH, CALICO_DATAGRAM_OVERHEAD, 0));
+	assert(calico_decrypt_batch(&y, pkts, -1, CALICO_DATAGRAM_OVERHEAD, results));
+	assert(calico_decrypt_batch(&y, pkts, BATCH, CALICO_STREAM_OVERHEAD, results));
+	assert(!calico_decrypt_batch(&y, pkts, 0, CALICO_DATAGRAM_OVERHEAD, results));
+
+	for (int round = 0; round < 100; ++round) {
+		// Encrypt 32 good packets
+		for (int ii = 0; ii < 32; ++ii) {
+			bytes[ii] = prng.Next() % sizeof(orig[ii]);
+
+			for (int jj = 0; jj < bytes[ii]; ++jj) {
+				orig[ii][jj] = (char)prng.Next();
+			}
+
+			assert(!calico_encrypt(&x, data[ii], orig[ii], bytes[ii], overhead[ii], CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		// Add forgeries and duplicates
+		for (int ii = 32; ii < BATCH; ++ii) {
+			const int src = prng.Next() % 32;
+
+			bytes[ii] = bytes[src];
+			memcpy(orig[ii], orig[src], bytes[src]);
+			memcpy(data[ii], data[src], bytes[src]);
+			memcpy(overhead[ii], overhead[src], CALICO_DATAGRAM_OVERHEAD);
+
+			// Corrupt every other one
+			if (ii & 1) {
+				overhead[ii][prng.Next() % CALICO_DATAGRAM_OVERHEAD] ^= 1 << (prng.Next() % 8);
+			}
+		}
+
+		// Shuffle the batch
+		int order[BATCH];
+		for (int ii = 0; ii < BATCH; ++ii) {
+			order[ii] = ii;
+		}
+		for (int ii = BATCH - 1; ii > 0; --ii) {
+			int jj = prng.Next() % (ii + 1);
+			int t = order[ii];
+			order[ii] = order[jj];
+			order[jj] = t;
+		}
+
+		for (int ii = 0; ii < BATCH; ++ii) {
+			pkts[ii].ciphertext = data[order[ii]];
+			pkts[ii].bytes = bytes[order[ii]];
+			pkts[ii].overhead = overhead[order[ii]];
+		}
+
+		assert(!calico_decrypt_batch(&y, pkts, BATCH, CALICO_DATAGRAM_OVERHEAD, results));
+
+		// Every good packet is accepted exactly once
+		int accepted = 0;
+		for (int ii = 0; ii < BATCH; ++ii) {
+			if (!results[ii]) {
+				assert(SecureEqual(pkts[ii].ciphertext, orig[order[ii]], pkts[ii].bytes));
+				++accepted;
+			}
+		}
+		assert(accepted == 32);
+
+		// Replaying the whole batch is rejected
+		for (int ii = 0; ii < BATCH; ++ii) {
+			pkts[ii].ciphertext = data[order[ii]];
+		}
+		assert(!calico_encrypt(&x, data[0], orig[0], 0, overhead[0], CALICO_DATAGRAM_OVERHEAD));
+		for (int ii = 1; ii < 32; ++ii) {
+			memcpy(overhead[ii], overhead[0], CALICO_DATAGRAM_OVERHEAD);
+		}
+		assert(!calico_decrypt_batch(&y, pkts, BATCH, CALICO_DATAGRAM_OVERHEAD, results));
+		accepted = 0;
+		for (int ii = 0; ii < BATCH; ++ii) {
+			if (!results[ii]) {
+				++accepted;
+			}
+		}
+		assert(accepted <= 1);
+	}
+
+	// The second packet is only read as the right IV once the first one has
+	// moved the window, as it would be by calico_decrypt()
+	calico_state a, b;
+	assert(!calico_key(&a, sizeof(a), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&b, sizeof(b), CALICO_RESPONDER, key, sizeof(key)));
+
+	char jump[2][16];
+	char jump_overhead[2][CALICO_DATAGRAM_OVERHEAD];
+
+	for (int ii = 0; ii < (1 << 21); ++ii) {
+		assert(!calico_encrypt(&a, jump[0], orig[0], sizeof(jump[0]), jump_overhead[0], CALICO_DATAGRAM_OVERHEAD));
+	}
+	for (int ii = 0; ii < (1 << 22) - 10; ++ii) {
+		assert(!calico_encrypt(&a, jump[1], orig[1], sizeof(jump[1]), jump_overhead[1], CALICO_DATAGRAM_OVERHEAD));
+	}
+
+	for (int ii = 0; ii < 2; ++ii) {
+		pkts[ii].ciphertext = jump[ii];
+		pkts[ii].bytes = sizeof(jump[ii]);
+		pkts[ii].overhead = jump_overhead[ii];
+	}
+
+	assert(!calico_decrypt_batch(&b, pkts, 2, CALICO_DATAGRAM_OVERHEAD, results));
+	assert(!results[0] && !results[1]);
+	assert(SecureEqual(jump[0], orig[0], sizeof(jump[0])));
+	assert(SecureEqual(jump[1], orig[1], sizeof(jump[1])));
+
+	calico_cleanup(&a);
+	calico_cleanup(&b);
+}
+
+/*
+ * Decrypt into a separate buffer, including messages that span many tiles
+ */
+void DecryptToTest() {
+	static const int MAX_BYTES = 70000;
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	static char orig[MAX_BYTES], data[MAX_BYTES], plain[MAX_BYTES + 1];
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	for (int ii = 0; ii < MAX_BYTES; ++ii) {
+		orig[ii] = (char)prng.Next();
+	}
+
+	// Invalid input checks
+	assert(calico_decrypt_to(&y, 0, data, 100, overhead, sizeof(overhead)));
+	assert(calico_decrypt_to(&y, plain, 0, 100, overhead, sizeof(overhead)));
+	assert(calico_decrypt_to(&y, plain, data, -1, overhead, sizeof(overhead)));
+
+	for (int round = 0; round < 200; ++round) {
+		const int bytes = (round < 100) ? round * 83 : prng.Next() % MAX_BYTES;
+
+		assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+
+		memset(plain, 'A', bytes + 1);
+
+		// Forged message must not release plaintext or accept the IV
+		if (bytes > 0) {
+			data[bytes / 2] ^= 1;
+			assert(calico_decrypt_to(&y, plain, data, bytes, overhead, sizeof(overhead)));
+			data[bytes / 2] ^= 1;
+
+			// Output is either untouched or erased
+			const char fill = plain[0];
+			assert(fill == 'A' || fill == 0);
+			for (int ii = 0; ii < bytes; ++ii) {
+				assert(plain[ii] == fill);
+			}
+			plain[0] = 'A';
+		}
+
+		// Original message still decrypts, and ciphertext is left intact
+		assert(!calico_decrypt_to(&y, plain, data, bytes, overhead, sizeof(overhead)));
+		assert(SecureEqual(plain, orig, bytes));
+		assert(plain[bytes] == 'A');
+
+		// Replay is rejected
+		assert(calico_decrypt_to(&y, plain, data, bytes, overhead, sizeof(overhead)));
+		assert(calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+	}
+}
+
+/*
+ * Secure erase must clear every byte of the range at any alignment
+ */
+void SecureEraseTest() {
+	static const int MAX_BYTES = 300;
+
+	u64 storage[(MAX_BYTES + 32) / 8 + 1];
+	char *buffer = (char*)storage;
+
+	for (int offset = 0; offset < 16; ++offset) {
+		for (int bytes = 0; bytes <= MAX_BYTES; ++bytes) {
+			memset(buffer, 0xff, sizeof(storage));
+
+			cat_secure_erase(buffer + offset, bytes);
+
+			for (int ii = 0; ii < (int)sizeof(storage); ++ii) {
+				const bool inside = ii >= offset && ii < offset + bytes;
+				assert(buffer[ii] == (inside ? 0 : (char)0xff));
+			}
+		}
+	}
+}
+
 /*
  * Test where each side is using a different key
  */
@@ -246,224 +717,2932 @@ void ReplayWindowTest() {
 }
 
 /*
- * Test performance of Initialize() function
+ * Check the anti-replay window against a simple model for random IV patterns
  */
-void BenchmarkInitialize() {
-	char key[32] = {0};
+void AntiReplayModelTest() {
+	static const int MAX_IV = 200000;
+	static bool seen[MAX_IV];
+	static u64 window[antireplay_state::MAX_BITS / 64];
 
-	double t0 = m_clock.usec();
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
 
-	for (int ii = 0; ii < 100000; ++ii) {
-		key[ii % 32] += 37;
+	for (int round = 0; round < 100; ++round) {
+		// Use the default window or a larger one of 2K to 64K IVs
+		const int window_bits = antireplay_state::BITMAP_BITS << (round % 7);
 
-		calico_state x;
+		antireplay_state S;
+		u64 newest_iv;
+		assert(antireplay_init(&S, &newest_iv, window, window_bits));
+		CAT_OBJCLR(seen);
 
-		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
-	}
+		u64 newest = 0;
+		const u32 max_jump = 1 << (round % 16);
 
-	double t1 = m_clock.usec();
+		while (newest < MAX_IV - 2 * max_jump) {
+			// Mostly move forward, sometimes deliver an older IV
+			u64 iv = newest + 1 + prng.Next() % max_jump;
+			if (prng.Next() & 1) {
+				const u64 back = prng.Next() % (2 * max_jump);
+				iv = (back > newest) ? 0 : newest - back;
+			}
 
-	double adt = (t1 - t0) / 100000.0;
+			// Accept newer IVs and unseen IVs within the window
+			const bool expected = iv > newest || (newest - iv < (u64)window_bits && !seen[iv]);
 
-	double fps = 1000000.0 / adt;
+			assert(antireplay_check(&S, iv) == expected);
 
-	cout << "Benchmark: Initialize() in " << adt << " usec on average / " << fps << " per second" << endl;
+			if (expected) {
+				antireplay_accept(&S, iv);
+				seen[iv] = true;
+				if (iv > newest) {
+					newest = iv;
+				}
+			}
+		}
+	}
 }
 
 /*
- * Test performance of Encrypt() function
+ * Test performance of the anti-replay window for different IV patterns
  */
-void BenchmarkEncrypt() {
-	char key[32] = {0};
-	calico_state x;
+void BenchmarkAntiReplay() {
+	static const int ROUNDS = 10000000;
+	static const char *PATTERNS[3] = { "in-order", "small-jump", "large-jump" };
 
-	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	for (int pattern = 0; pattern < 3; ++pattern) {
+		antireplay_state S;
+		u64 newest_iv, bitmap[antireplay_state::BITMAP_WORDS];
+		antireplay_init(&S, &newest_iv, bitmap);
 
-	char orig[10000] = {0};
-	char data[10000] = {0};
-	char overhead[CALICO_DATAGRAM_OVERHEAD];
+		Abyssinian prng;
+		prng.Initialize(0, 0);
+
+		u64 newest = 0;
+		int accepted = 0;
 
-	for (int bytes = 10000; bytes > 0; bytes /= 10) {
 		double t0 = m_clock.usec();
 
-		for (int ii = 0; ii < 100000; ++ii) {
-			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			u64 iv;
+
+			if (pattern == 0) {
+				// Every IV in order
+				iv = ++newest;
+			} else if (pattern == 1) {
+				// Short gaps with some reordering
+				const u32 r = prng.Next();
+				newest += 1 + (r & 15);
+				iv = newest - ((r >> 4) & 7);
+			} else {
+				// Jumps across most or all of the window
+				newest += (prng.Next() & 1) ? 700 : 1500;
+				iv = newest;
+			}
+
+			if (antireplay_check(&S, iv)) {
+				antireplay_accept(&S, iv);
+				++accepted;
+			}
 		}
 
 		double t1 = m_clock.usec();
 
-		double adt = (t1 - t0) / 100000.0;
-
-		double fps = 1000000.0 / adt;
-
-		double mbps = bytes * fps / 1000000.0;
-
-		cout << "calico_encrypt: " << bytes << " bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+		cout << "antireplay " << PATTERNS[pattern] << ": " << (t1 - t0) * 1000.0 / ROUNDS << " nsec per IV (" << accepted << " accepted)" << endl;
 	}
 }
 
 /*
- * Test performance of Decrypt() function when it fails
+ * Measure the fraction of reordered datagrams dropped for each window size
  */
-void BenchmarkDecryptFail() {
+void BenchmarkReorderDrops() {
+	static const int PACKETS = 100000;
+	static const int DEPTHS[5] = { 256, 1024, 4096, 16384, 65536 };
+	static const int WINDOWS[3] = { 1024, 8192, 65536 };
+
+	static char ciphertext[PACKETS][16];
+	static char overhead[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u64 order[PACKETS];
+	static u64 window[65536 / 64];
+
 	char key[32] = {0};
 	calico_state x, y;
 
 	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
-	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
 
-	char data[10000] = {0};
-	char overhead[CALICO_DATAGRAM_OVERHEAD];
-
-	for (int bytes = 10000; bytes > 0; bytes /= 10) {
-		assert(!calico_encrypt(&x, data, data, bytes, overhead, sizeof(overhead)));
+	for (int ii = 0; ii < PACKETS; ++ii) {
+		assert(!calico_encrypt(&x, ciphertext[ii], ciphertext[ii], 16, overhead[ii], CALICO_DATAGRAM_OVERHEAD));
+	}
 
-		data[0] ^= 1;
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
 
-		double t0 = m_clock.usec();
+	for (int dd = 0; dd < 5; ++dd) {
+		const int depth = DEPTHS[dd];
 
-		for (int ii = 0; ii < 100000; ++ii) {
-			assert(calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+		// Delay each packet by up to depth packet times, keeping the index in the low bits
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			order[ii] = ((u64)(ii + prng.Next() % depth) << 32) | ii;
 		}
+		std::sort(order, order + PACKETS);
 
-		double t1 = m_clock.usec();
+		for (int ww = 0; ww < 3; ++ww) {
+			assert(!calico_key_window(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key), window, WINDOWS[ww]));
 
-		double adt = (t1 - t0) / 100000.0;
+			int drops = 0;
 
-		double fps = 1000000.0 / adt;
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				const int index = (u32)order[ii];
+				char data[16];
 
-		double mbps = bytes * fps / 1000000.0;
+				memcpy(data, ciphertext[index], sizeof(data));
 
-		cout << "calico_decrypt: drops " << bytes << " corrupted bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+				if (calico_decrypt(&y, data, sizeof(data), overhead[index], CALICO_DATAGRAM_OVERHEAD)) {
+					++drops;
+				}
+			}
+
+			cout << "Reorder depth " << depth << " with " << WINDOWS[ww] << "-bit window: " << drops * 100.0 / PACKETS << "% dropped" << endl;
+		}
 	}
 }
 
 /*
- * Test performance of Decrypt() function when it succeeds
+ * Test the cost of reading the millisecond clock used for key ratcheting
  */
-void BenchmarkDecryptSuccess() {
-	char key[32] = {0};
-	calico_state x, y;
+void BenchmarkClock() {
+	static const int ROUNDS = 1000000;
 
-	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
-	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+	u32 sum = 0;
 
-	char data[10000];
-	char temp[sizeof(data)];
-	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	// Check the ratchet clock keeps time to within a scheduler tick
+	const u32 start = calico_msec();
+	Clock::sleep(50);
+	const u32 elapsed = calico_msec() - start;
+	assert(elapsed >= 40 && elapsed < 1000);
 
-	Abyssinian prng;
-	prng.Initialize(m_clock.msec(), Clock::cycles());
+	u32 t0 = Clock::cycles();
 
-	for (int bytes = 10000; bytes > 0; bytes /= 10) {
-		double t_sum = 0;
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		sum += m_clock.msec();
+	}
 
-		u32 *data_ptr = reinterpret_cast<u32*>( temp );
-		for (int jj = 0; jj < (bytes + 3) / 4; ++jj) {
-			data_ptr[jj] = prng.Next();
-		}
+	u32 t1 = Clock::cycles();
 
-		for (int ii = 0; ii < 100000; ++ii) {
-			assert(!calico_encrypt(&x, data, temp, bytes, overhead, sizeof(overhead)));
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		sum += calico_msec();
+	}
+
+	u32 t2 = Clock::cycles();
+
+	cout << "Clock::msec: " << (t1 - t0) / (double)ROUNDS << " cycles per call" << endl;
+	cout << "calico_msec: " << (t2 - t1) / (double)ROUNDS << " cycles per call" << endl;
+
+	// Keep the results live
+	if (sum == 0) {
+		cout << "(ignore)" << endl;
+	}
+}
+
+/*
+ * Test performance of Initialize() function
+ */
+void BenchmarkInitialize() {
+	char key[32] = {0};
+
+	double t0 = m_clock.usec();
+
+	for (int ii = 0; ii < 100000; ++ii) {
+		key[ii % 32] += 37;
+
+		calico_state x;
+
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	}
+
+	double t1 = m_clock.usec();
+
+	double adt = (t1 - t0) / 100000.0;
+
+	double fps = 1000000.0 / adt;
+
+	cout << "Benchmark: Initialize() in " << adt << " usec on average / " << fps << " per second" << endl;
+}
+
+/*
+ * Test performance of the BLAKE2b kernels that ratchet the keys
+ */
+void BenchmarkBlake2b() {
+	static const int HASHES = 1000000;
+
+	const u32 features = cpu_features();
+
+	for (const cpu_kernel<blake2b_48_fn> *kernel = blake2b_48_kernels;; ++kernel) {
+		if ((kernel->required & features) == kernel->required) {
+			u8 key[48] = {0};
+
+			double t0 = m_clock.usec();
+
+			for (int ii = 0; ii < HASHES; ++ii) {
+				kernel->fn(key, key);
+			}
+
+			double t1 = m_clock.usec();
+
+			// Keep the result live
+			if (key[0] == 0 && key[1] == 0) {
+				cout << "(ignore)" << endl;
+			}
+
+			cout << "blake2b_48 " << kernel->name << ": " << (t1 - t0) * 1000. / HASHES << " nsec per key ratchet" << endl;
+		}
+
+		if (!kernel->required) {
+			break;
+		}
+	}
+}
+
+/*
+ * Test performance of Encrypt() function
+ */
+void BenchmarkEncrypt() {
+	char key[32] = {0};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	char orig[10000] = {0};
+	char data[10000] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	for (int bytes = 10000; bytes > 0; bytes /= 10) {
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < 100000; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+		}
+
+		double t1 = m_clock.usec();
+
+		double adt = (t1 - t0) / 100000.0;
+
+		double fps = 1000000.0 / adt;
+
+		double mbps = bytes * fps / 1000000.0;
+
+		cout << "calico_encrypt: " << bytes << " bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+	}
+}
+
+/*
+ * Test performance of batched encryption against the single-message path
+ */
+void BenchmarkEncryptBatch() {
+	static const int BATCH = 32;
+	static const int ROUNDS = 10000;
+	static const int SIZES[3] = { 64, 256, 1400 };
+
+	char key[32] = {0};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	static char orig[BATCH][1400];
+	static char data[BATCH][1400];
+	char overhead[BATCH][CALICO_DATAGRAM_OVERHEAD];
+	calico_encrypt_desc msgs[BATCH];
+
+	for (int kk = 0; kk < 3; ++kk) {
+		const int bytes = SIZES[kk];
+
+		for (int ii = 0; ii < BATCH; ++ii) {
+			msgs[ii].plaintext = orig[ii];
+			msgs[ii].ciphertext = data[ii];
+			msgs[ii].bytes = bytes;
+			msgs[ii].overhead = overhead[ii];
+		}
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			for (int jj = 0; jj < BATCH; ++jj) {
+				assert(!calico_encrypt(&x, data[jj], orig[jj], bytes, overhead[jj], CALICO_DATAGRAM_OVERHEAD));
+			}
+		}
+
+		double t1 = m_clock.usec();
+
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			assert(!calico_encrypt_batch(&x, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		double t2 = m_clock.usec();
+
+		double single_adt = (t1 - t0) / (ROUNDS * BATCH);
+		double batch_adt = (t2 - t1) / (ROUNDS * BATCH);
+
+		cout << "calico_encrypt_batch: " << bytes << " bytes in " << batch_adt << " usec per packet (single calls: " << single_adt << " usec) / " << 1000000.0 / batch_adt << " per second" << endl;
+	}
+}
+
+/*
+ * Test performance of Encrypt() for bulk data against a two-pass equivalent
+ */
+void BenchmarkEncryptBulk() {
+	static const int SIZES[4] = { 1024, 65536, 1048576, 16777216 };
+	static const int TOTAL = 256 * 1048576;
+
+	char key[32] = {0};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	static char orig[16777216];
+	static char data[16777216];
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	char slot_key[48] = {0};	// Cipher key followed by MAC key
+	u64 sum = 0;
+
+	for (int kk = 0; kk < 4; ++kk) {
+		const int bytes = SIZES[kk];
+		const int rounds = TOTAL / bytes;
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+		}
+
+		double t1 = m_clock.usec();
+
+		// Same work done as a full ChaCha pass followed by a full SipHash
+		// pass, with the same kernels that calico_encrypt() uses
+		for (int ii = 0; ii < rounds; ++ii) {
+			const u64 iv = ii;
+
+			chacha_input S;
+			chacha_input_init(&S, slot_key, 14, iv);
+			chacha_blocks(&S, (const u8 *)orig, (u8 *)data, bytes);
+
+			siphash_state H;
+			siphash24_begin(&H, slot_key + 32, iv);
+			sum += siphash24_end(&H, data, bytes);
+		}
+
+		double t2 = m_clock.usec();
+
+		double fused_mbps = bytes * (double)rounds / (t1 - t0);
+		double two_pass_mbps = bytes * (double)rounds / (t2 - t1);
+
+		cout << "calico_encrypt: " << bytes << " bytes at " << fused_mbps << " MBPS (two-pass: " << two_pass_mbps << " MBPS)" << endl;
+	}
+
+	// Keep the results live
+	if (sum == 0) {
+		cout << "(ignore)" << endl;
+	}
+}
+
+/*
+ * Test performance of each supported ChaCha kernel and of stream mode on bulk data
+ */
+void BenchmarkChaChaBulk() {
+	static const int SIZES[3] = { 65536, 262144, 1048576 };
+	static const int TOTAL = 64 * 1048576;
+
+	static u8 orig[1048576];
+	static u8 data[1048576];
+	char key[32] = {0};
+	u64 iv = 0;
+
+	const u32 features = cpu_features();
+
+	for (const cpu_kernel<chacha_blocks_fn> *kernel = chacha_blocks_kernels;; ++kernel) {
+		if ((kernel->required & features) == kernel->required) {
+			for (int kk = 0; kk < 3; ++kk) {
+				const int bytes = SIZES[kk];
+				const int rounds = TOTAL / bytes;
+
+				chacha_state S;
+				chacha_init(&S, (const chacha_key *)key, (const chacha_iv *)&iv, 14);
+
+				double t0 = m_clock.usec();
+
+				for (int ii = 0; ii < rounds; ++ii) {
+					kernel->fn(&S, data, data, bytes);
+				}
+
+				double t1 = m_clock.usec();
+
+				for (int ii = 0; ii < rounds; ++ii) {
+					kernel->fn(&S, orig, data, bytes);
+				}
+
+				double t2 = m_clock.usec();
+
+				double in_place_mbps = bytes * (double)rounds / (t1 - t0);
+				double out_of_place_mbps = bytes * (double)rounds / (t2 - t1);
+
+				cout << "chacha_blocks_" << kernel->name << ": " << bytes << " bytes at " << in_place_mbps << " MBPS in-place / " << out_of_place_mbps << " MBPS out-of-place" << endl;
+			}
+		}
+
+		// Reference kernel is last
+		if (!kernel->required) {
+			break;
+		}
+	}
+
+	// Stream mode records through the selected kernel
+	calico_stream_only x;
+	char overhead[CALICO_STREAM_OVERHEAD];
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	for (int kk = 0; kk < 3; ++kk) {
+		const int bytes = SIZES[kk];
+		const int rounds = TOTAL / bytes;
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, data, bytes, overhead, sizeof(overhead)));
+		}
+
+		double t1 = m_clock.usec();
+
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+		}
+
+		double t2 = m_clock.usec();
+
+		double in_place_mbps = bytes * (double)rounds / (t1 - t0);
+		double out_of_place_mbps = bytes * (double)rounds / (t2 - t1);
+
+		cout << "calico_encrypt (stream): " << bytes << " bytes at " << in_place_mbps << " MBPS in-place / " << out_of_place_mbps << " MBPS out-of-place" << endl;
+	}
+}
+
+// Work for one side of BenchmarkFullDuplex()
+struct DuplexBenchmark {
+	static const int PACKETS = 100000;
+	static const int BYTES = 64;
+
+	calico_state *state;
+	char (*data)[BYTES];
+	char (*overhead)[CALICO_DATAGRAM_OVERHEAD];
+	int failures;
+};
+
+static void BenchmarkTransmit(void *param) {
+	DuplexBenchmark *work = reinterpret_cast<DuplexBenchmark *>( param );
+
+	for (int ii = 0; ii < DuplexBenchmark::PACKETS; ++ii) {
+		if (calico_encrypt(work->state, work->data[ii], work->data[ii], DuplexBenchmark::BYTES, work->overhead[ii], CALICO_DATAGRAM_OVERHEAD)) {
+			++work->failures;
+		}
+	}
+}
+
+static void BenchmarkReceive(void *param) {
+	DuplexBenchmark *work = reinterpret_cast<DuplexBenchmark *>( param );
+
+	for (int ii = 0; ii < DuplexBenchmark::PACKETS; ++ii) {
+		if (calico_decrypt(work->state, work->data[ii], DuplexBenchmark::BYTES, work->overhead[ii], CALICO_DATAGRAM_OVERHEAD)) {
+			++work->failures;
+		}
+	}
+}
+
+/*
+ * Test throughput of one session encrypting and decrypting on two threads
+ */
+void BenchmarkFullDuplex() {
+	static char tx_data[DuplexBenchmark::PACKETS][DuplexBenchmark::BYTES];
+	static char tx_overhead[DuplexBenchmark::PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static char rx_data[DuplexBenchmark::PACKETS][DuplexBenchmark::BYTES];
+	static char rx_overhead[DuplexBenchmark::PACKETS][CALICO_DATAGRAM_OVERHEAD];
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	for (int threaded = 0; threaded < 2; ++threaded) {
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+		assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+		// Packets from the remote host for x to receive
+		for (int ii = 0; ii < DuplexBenchmark::PACKETS; ++ii) {
+			assert(!calico_encrypt(&y, rx_data[ii], rx_data[ii], DuplexBenchmark::BYTES, rx_overhead[ii], CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		DuplexBenchmark tx = { &x, tx_data, tx_overhead, 0 };
+		DuplexBenchmark rx = { &x, rx_data, rx_overhead, 0 };
+
+		double t0 = m_clock.usec();
+
+		if (threaded) {
+			thread_handle threads[2];
+			assert(thread_start(&threads[0], BenchmarkTransmit, &tx));
+			assert(thread_start(&threads[1], BenchmarkReceive, &rx));
+			thread_join(&threads[0]);
+			thread_join(&threads[1]);
+		} else {
+			BenchmarkTransmit(&tx);
+			BenchmarkReceive(&rx);
+		}
+
+		double t1 = m_clock.usec();
+
+		assert(tx.failures == 0);
+		assert(rx.failures == 0);
+
+		const double pps = 2.0 * DuplexBenchmark::PACKETS * 1000000.0 / (t1 - t0);
+
+		cout << "Full-duplex " << DuplexBenchmark::BYTES << "-byte datagrams on " << (threaded ? "two threads" : "one thread") << ": " << pps << " packets per second" << endl;
+	}
+}
+
+// Work for one thread calling calico_decrypt_concurrent()
+struct ConcurrentDecryptWork {
+	static const int BYTES = 32;
+
+	calico_state *state;
+	char (*data)[BYTES];
+	const char (*overhead)[CALICO_DATAGRAM_OVERHEAD];
+
+	// Packets (first + k * stride) % count for k < steps
+	int count, first, stride, steps;
+	u32 now;
+
+	// Set for each packet this thread decrypted
+	u8 *accepted;
+};
+
+static void ConcurrentDecrypt(void *param) {
+	ConcurrentDecryptWork *work = reinterpret_cast<ConcurrentDecryptWork *>( param );
+
+	for (int kk = 0; kk < work->steps; ++kk) {
+		const int index = (work->first + kk * work->stride) % work->count;
+
+		if (!calico_decrypt_concurrent_at(work->state, work->data[index], ConcurrentDecryptWork::BYTES, work->overhead[index], CALICO_DATAGRAM_OVERHEAD, work->now)) {
+			work->accepted[index] = 1;
+		}
+	}
+}
+
+/*
+ * Test how calico_decrypt_concurrent() scales with the number of threads
+ * sharing one Calico state object
+ */
+void BenchmarkConcurrentDecrypt() {
+	// Each round fits in the window, so threads that are scheduled far apart
+	// do not drop each other's packets as too old
+	static const int PACKETS = 30000;
+	static const int ROUNDS = 5;
+	static const int BYTES = ConcurrentDecryptWork::BYTES;
+	static const int MAX_THREADS = 16;
+
+	static char data[PACKETS][BYTES];
+	static char overhead[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u8 accepted[PACKETS];
+	static u64 window[65536 / 64];
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	for (int thread_count = 1; thread_count <= MAX_THREADS; thread_count *= 2) {
+		double usec = 0;
+		int decrypted = 0;
+
+		for (int round = 0; round < ROUNDS; ++round) {
+			assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+			assert(!calico_key_window(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key), window, 65536));
+
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				assert(!calico_encrypt(&x, data[ii], data[ii], BYTES, overhead[ii], CALICO_DATAGRAM_OVERHEAD));
+			}
+			memset(accepted, 0, sizeof(accepted));
+
+			// Spread the packets over the threads like receive queues would
+			ConcurrentDecryptWork work[MAX_THREADS];
+			thread_handle threads[MAX_THREADS];
+			const u32 now = calico_msec();
+
+			double t0 = m_clock.usec();
+
+			for (int tt = 0; tt < thread_count; ++tt) {
+				ConcurrentDecryptWork &w = work[tt];
+				w.state = &y;
+				w.data = data;
+				w.overhead = overhead;
+				w.count = PACKETS;
+				w.first = tt;
+				w.stride = thread_count;
+				w.steps = (PACKETS - tt + thread_count - 1) / thread_count;
+				w.now = now;
+				w.accepted = accepted;
+
+				assert(thread_start(&threads[tt], ConcurrentDecrypt, &w));
+			}
+
+			for (int tt = 0; tt < thread_count; ++tt) {
+				thread_join(&threads[tt]);
+			}
+
+			double t1 = m_clock.usec();
+			usec += t1 - t0;
+
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				decrypted += accepted[ii];
+			}
+		}
+
+		assert(decrypted == PACKETS * ROUNDS);
+
+		const double pps = decrypted * 1000000.0 / usec;
+
+		cout << "calico_decrypt_concurrent() with " << thread_count << " threads: " << pps << " packets per second" << endl;
+	}
+}
+
+// Work for one thread encrypting with a calico_sender
+struct SenderWork {
+	static const int PACKETS = 2000;
+	static const int BYTES = 32;
+
+	calico_sender sender;
+	int id;
+	u32 now;
+
+	char (*data)[BYTES];
+	char (*overhead)[CALICO_DATAGRAM_OVERHEAD];
+};
+
+static void SenderEncrypt(void *param) {
+	SenderWork *work = reinterpret_cast<SenderWork *>( param );
+
+	for (int ii = 0; ii < SenderWork::PACKETS; ++ii) {
+		memset(work->data[ii], (u8)ii, SenderWork::BYTES);
+		work->data[ii][0] = (char)work->id;
+
+		assert(!calico_encrypt_sender_at(&work->sender, work->data[ii], work->data[ii], SenderWork::BYTES, work->overhead[ii], CALICO_DATAGRAM_OVERHEAD, work->now));
+	}
+}
+
+// Work for one thread in BenchmarkMultiSender()
+struct SenderBenchmark {
+	static const int BYTES = 256;
+	static const int BUFFERS = 64;
+
+	calico_sender sender;
+	int packets;
+
+	char data[BUFFERS][BYTES];
+	char overhead[BUFFERS][CALICO_DATAGRAM_OVERHEAD];
+};
+
+static void SenderBenchmarkEncrypt(void *param) {
+	SenderBenchmark *work = reinterpret_cast<SenderBenchmark *>( param );
+
+	for (int ii = 0; ii < work->packets; ++ii) {
+		const int index = ii % SenderBenchmark::BUFFERS;
+
+		assert(!calico_encrypt_sender(&work->sender, work->data[index], work->data[index], SenderBenchmark::BYTES, work->overhead[index], CALICO_DATAGRAM_OVERHEAD));
+	}
+}
+
+/*
+ * Test how encryption on one Calico state object scales with the number of
+ * sender threads
+ */
+void BenchmarkMultiSender() {
+	static const int PACKETS = 320000;
+	static const int MAX_THREADS = 16;
+
+	static SenderBenchmark work[MAX_THREADS];
+
+	char key[32] = {0};
+	calico_state x;
+
+	// Single-threaded calico_encrypt() for comparison
+	{
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			const int index = ii % SenderBenchmark::BUFFERS;
+
+			assert(!calico_encrypt(&x, work[0].data[index], work[0].data[index], SenderBenchmark::BYTES, work[0].overhead[index], CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		double t1 = m_clock.usec();
+
+		cout << "calico_encrypt() " << SenderBenchmark::BYTES << "-byte datagrams: " << PACKETS * 1000000.0 / (t1 - t0) << " packets per second" << endl;
+	}
+
+	for (int thread_count = 1; thread_count <= MAX_THREADS; thread_count *= 2) {
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+		thread_handle threads[MAX_THREADS];
+
+		for (int tt = 0; tt < thread_count; ++tt) {
+			assert(!calico_sender_init(&x, &work[tt].sender));
+			work[tt].packets = PACKETS / thread_count;
+		}
+
+		double t0 = m_clock.usec();
+
+		for (int tt = 0; tt < thread_count; ++tt) {
+			assert(thread_start(&threads[tt], SenderBenchmarkEncrypt, &work[tt]));
+		}
+
+		for (int tt = 0; tt < thread_count; ++tt) {
+			thread_join(&threads[tt]);
+		}
+
+		double t1 = m_clock.usec();
+
+		cout << "calico_encrypt_sender() with " << thread_count << " threads: " << PACKETS * 1000000.0 / (t1 - t0) << " packets per second" << endl;
+
+		for (int tt = 0; tt < thread_count; ++tt) {
+			calico_sender_cleanup(&work[tt].sender);
+		}
+	}
+}
+
+/*
+ * Test how calico_encrypt_large() and calico_decrypt_large() scale with the
+ * number of threads
+ */
+void BenchmarkLargeMessage() {
+	static const int BYTES = 64 * 1024 * 1024;
+	static const int MAX_THREADS = 16;
+
+	u8 *plaintext = new u8[BYTES];
+	u8 *ciphertext = new u8[BYTES];
+	memset(plaintext, 0, BYTES);
+	memset(ciphertext, 0, BYTES);
+
+	char key[32] = {0};
+	calico_state x, y;
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	// Single-threaded calico_encrypt() for comparison
+	{
+		double t0 = m_clock.usec();
+		assert(!calico_encrypt(&x, ciphertext, plaintext, BYTES, overhead, CALICO_DATAGRAM_OVERHEAD));
+		double t1 = m_clock.usec();
+
+		cout << "calico_encrypt() " << BYTES / 1000000 << " MB: " << BYTES / (t1 - t0) << " MB/s" << endl;
+
+		assert(!calico_decrypt(&y, ciphertext, BYTES, overhead, CALICO_DATAGRAM_OVERHEAD));
+	}
+
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double t0 = m_clock.usec();
+		assert(!calico_encrypt_large(&x, ciphertext, plaintext, BYTES, overhead, CALICO_DATAGRAM_OVERHEAD, threads));
+		double t1 = m_clock.usec();
+		assert(!calico_decrypt_large(&y, plaintext, ciphertext, BYTES, overhead, CALICO_DATAGRAM_OVERHEAD, threads));
+		double t2 = m_clock.usec();
+
+		cout << "Large message with " << threads << " threads: Encrypt " << BYTES / (t1 - t0) << " MB/s, decrypt " << BYTES / (t2 - t1) << " MB/s" << endl;
+	}
+
+	delete []plaintext;
+	delete []ciphertext;
+}
+
+/*
+ * Test the speed of piping a large message through a 64 KB buffer
+ */
+void BenchmarkIncrementalStream() {
+	static const int BUFFER_BYTES = 65536;
+	static const int ROUNDS = 1024;
+
+	static u8 buffer[BUFFER_BYTES];
+
+	char key[32] = {0};
+	calico_stream_only x, y;
+	calico_stream stream;
+	char header[CALICO_STREAM_HEADER], overhead[CALICO_STREAM_OVERHEAD];
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	double t0 = m_clock.usec();
+
+	assert(!calico_stream_init(&stream, &x, CALICO_STREAM_ENCRYPT, header));
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		assert(!calico_stream_update(&stream, buffer, buffer, BUFFER_BYTES));
+	}
+	assert(!calico_stream_final(&stream, overhead, sizeof(overhead)));
+
+	double t1 = m_clock.usec();
+
+	// Decrypting garbage exercises the same code, and the tag fails at the end
+	assert(!calico_stream_init(&stream, &y, CALICO_STREAM_DECRYPT, header));
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		assert(!calico_stream_update(&stream, buffer, buffer, BUFFER_BYTES));
+	}
+	assert(calico_stream_final(&stream, overhead, sizeof(overhead)));
+
+	double t2 = m_clock.usec();
+
+	const double bytes = (double)BUFFER_BYTES * ROUNDS;
+
+	cout << "calico_stream_update() " << bytes / 1000000 << " MB in 64 KB pieces: Encrypt " << bytes / (t1 - t0) << " MB/s, decrypt " << bytes / (t2 - t1) << " MB/s" << endl;
+}
+
+/*
+ * Test the speed of encrypting a packet built from a header, payload and
+ * trailer, compared to copying it into one buffer first
+ */
+void BenchmarkScatterGather() {
+	static const int HEADER_BYTES = 16;
+	static const int PAYLOAD_BYTES = 1200;
+	static const int TRAILER_BYTES = 8;
+	static const int BYTES = HEADER_BYTES + PAYLOAD_BYTES + TRAILER_BYTES;
+	static const int ROUNDS = 100000;
+
+	char key[32] = {0};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	u8 header[HEADER_BYTES] = {1}, payload[PAYLOAD_BYTES] = {2}, trailer[TRAILER_BYTES] = {3};
+	u8 staging[BYTES], ciphertext[BYTES];
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	calico_segment plaintext[3] = {
+		{ header, HEADER_BYTES },
+		{ payload, PAYLOAD_BYTES },
+		{ trailer, TRAILER_BYTES }
+	};
+	calico_segment output = { ciphertext, BYTES };
+
+	double t0 = m_clock.usec();
+
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		memcpy(staging, header, HEADER_BYTES);
+		memcpy(staging + HEADER_BYTES, payload, PAYLOAD_BYTES);
+		memcpy(staging + HEADER_BYTES + PAYLOAD_BYTES, trailer, TRAILER_BYTES);
+		assert(!calico_encrypt(&x, ciphertext, staging, BYTES, overhead, sizeof(overhead)));
+	}
+
+	double t1 = m_clock.usec();
+
+	for (int ii = 0; ii < ROUNDS; ++ii) {
+		assert(!calico_encryptv(&x, &output, 1, plaintext, 3, overhead, sizeof(overhead)));
+	}
+
+	double t2 = m_clock.usec();
+
+	cout << "calico_encryptv() " << BYTES << " bytes in 3 segments: memcpy+calico_encrypt " << (t1 - t0) / ROUNDS << " usec, calico_encryptv " << (t2 - t1) / ROUNDS << " usec" << endl;
+}
+
+/*
+ * Test the cost of authenticating a cleartext header along with a packet
+ */
+void BenchmarkAssociatedData() {
+	static const int BYTES = 1200;
+	static const int ROUNDS = 10000;
+	static const int TRIALS = 10;
+	static const int AD_SIZES[] = { 0, 8, 16, 64, 256, 1024 };
+	static const int SIZE_COUNT = (int)(sizeof(AD_SIZES) / sizeof(AD_SIZES[0]));
+
+	// Sizes from this one up are used to fit the cost per AD byte
+	static const int SLOPE_MIN_BYTES = 64;
+
+	char key[32] = {0};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	char data[BYTES] = {0}, ad[1024] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	double best_usec[SIZE_COUNT];
+
+	// Take the best of several trials, interleaving the sizes so that
+	// a slow period on a busy machine does not land on just one of them
+	for (int ii = 0; ii < SIZE_COUNT; ++ii) {
+		best_usec[ii] = 1e30;
+	}
+
+	for (int trial = 0; trial < TRIALS; ++trial) {
+		for (int ii = 0; ii < SIZE_COUNT; ++ii) {
+			const int ad_bytes = AD_SIZES[ii];
+
+			double t0 = m_clock.usec();
+
+			for (int jj = 0; jj < ROUNDS; ++jj) {
+				assert(!calico_encrypt_ad(&x, data, data, BYTES, ad, ad_bytes, overhead, sizeof(overhead)));
+			}
+
+			double t1 = m_clock.usec();
+
+			best_usec[ii] = min(best_usec[ii], (t1 - t0) / ROUNDS);
+		}
+	}
+
+	for (int ii = 0; ii < SIZE_COUNT; ++ii) {
+		cout << "calico_encrypt_ad: " << BYTES << " bytes with " << AD_SIZES[ii] << " bytes of AD in " << best_usec[ii] << " usec" << endl;
+	}
+
+	// Least-squares slope of time against AD bytes over the larger sizes,
+	// since the fixed cost of small AD is lost in timing noise
+	double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+	int count = 0;
+
+	for (int ii = 0; ii < SIZE_COUNT; ++ii) {
+		if (AD_SIZES[ii] >= SLOPE_MIN_BYTES) {
+			const double ad_bytes = AD_SIZES[ii];
+			sum_x += ad_bytes;
+			sum_y += best_usec[ii];
+			sum_xx += ad_bytes * ad_bytes;
+			sum_xy += ad_bytes * best_usec[ii];
+			++count;
+		}
+	}
+
+	const double slope = (count * sum_xy - sum_x * sum_y) / (count * sum_xx - sum_x * sum_x);
+
+	cout << "calico_encrypt_ad: " << slope * 1000.0 << " nsec per AD byte from " << SLOPE_MIN_BYTES << " to " << AD_SIZES[SIZE_COUNT - 1] << " bytes of AD" << endl;
+}
+
+// Connection ID for the ii-th session in the session table tests
+static u64 SessionID(u32 ii)
+{
+	return (ii + 1) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Memory the benchmarks may allocate: 3/4 of the free physical memory, or
+// 2 GB where that cannot be read
+static unsigned long long BenchmarkMemoryLimit()
+{
+#ifndef CAT_OS_WINDOWS
+	const long pages = sysconf(_SC_AVPHYS_PAGES);
+	const long page_size = sysconf(_SC_PAGESIZE);
+
+	if (pages > 0 && page_size > 0) {
+		return (unsigned long long)pages * page_size / 4 * 3;
+	}
+#endif
+
+	return 2000000000ULL;
+}
+
+/*
+ * Test session lookup and decryption with many peers, at each size that
+ * fits in memory, so the scaling is measured up to the largest table the
+ * machine can hold
+ */
+void BenchmarkSessionTable() {
+	static const unsigned int SIZES[] = { 10000, 100000, 1000000, 4000000, 10000000 };
+	static const int SHARDS = 4;
+	static const int PACKETS = 4096;
+	static const int BYTES = 100;
+	static const int ROUNDS = 16;
+
+	static u8 packets[PACKETS][BYTES];
+	static char overheads[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u64 ids[PACKETS];
+
+	Abyssinian prng;
+	prng.Initialize(0, 0);
+
+	char key[32] = {8};
+	calico_state x;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	const unsigned long long memory_limit = BenchmarkMemoryLimit();
+
+	for (int ss = 0; ss < (int)(sizeof(SIZES) / sizeof(SIZES[0])); ++ss) {
+		const unsigned int sessions = SIZES[ss];
+		const unsigned long long bytes = calico_sessions_bytes(sessions, SHARDS);
+
+		if (bytes > memory_limit) {
+			cout << "calico_sessions: " << sessions << " sessions need " << bytes / 1000000 << " MB of " << memory_limit / 1000000 << " MB available, skipped" << endl;
+			continue;
+		}
+
+		u8 *memory = new (nothrow) u8[bytes];
+		if (!memory) {
+			cout << "calico_sessions: " << sessions << " sessions need " << bytes / 1000000 << " MB, allocation failed" << endl;
+			continue;
+		}
+
+		assert(!calico_sessions_init(memory, bytes, sessions, SHARDS));
+
+		double t0 = m_clock.usec();
+
+		for (u32 ii = 0; ii < sessions; ++ii) {
+			assert(calico_sessions_insert(memory, SessionID(ii), CALICO_RESPONDER, key, sizeof(key)));
+		}
+
+		double t1 = m_clock.usec();
+
+		double lookup_usec = 0, decrypt_usec = 0;
+
+		for (int round = 0; round < ROUNDS; ++round) {
+			// Send each packet to a random session
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				ids[ii] = SessionID(prng.Next() % sessions);
+				assert(!calico_encrypt(&x, packets[ii], packets[ii], BYTES, overheads[ii], CALICO_DATAGRAM_OVERHEAD));
+			}
+
+			double t2 = m_clock.usec();
+
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				assert(calico_sessions_lookup(memory, ids[ii]));
+			}
+
+			double t3 = m_clock.usec();
+
+			for (int ii = 0; ii < PACKETS; ++ii) {
+				void *S = calico_sessions_lookup(memory, ids[ii]);
+				assert(!calico_decrypt(S, packets[ii], BYTES, overheads[ii], CALICO_DATAGRAM_OVERHEAD));
+			}
+
+			double t4 = m_clock.usec();
+
+			lookup_usec += t3 - t2;
+			decrypt_usec += t4 - t3;
+		}
+
+		cout << "calico_sessions: " << sessions << " sessions in " << bytes / 1000000 << " MB (" << bytes / sessions << " bytes each), inserted in " << (t1 - t0) / sessions << " usec each, lookup " << lookup_usec * 1000.0 / (PACKETS * ROUNDS) << " nsec, lookup+decrypt of " << BYTES << " bytes " << decrypt_usec * 1000.0 / (PACKETS * ROUNDS) << " nsec" << endl;
+
+		calico_sessions_cleanup(memory);
+		delete []memory;
+	}
+}
+
+// Resident set size of the process in MB, or 0 where it cannot be read
+static double ResidentMB()
+{
+	unsigned long long size = 0, resident = 0;
+
+	ifstream statm("/proc/self/statm");
+	if (!(statm >> size >> resident)) {
+		return 0;
+	}
+
+#ifndef CAT_OS_WINDOWS
+	return resident * (double)sysconf(_SC_PAGESIZE) / 1000000.0;
+#else
+	return 0;
+#endif
+}
+
+// Decrypt packets sent to random sessions, returning nsec per packet
+static double DecryptRandomSessions(void **sessions, u32 count, Abyssinian &prng)
+{
+	static const int PACKETS = 4096;
+	static const int BYTES = 100;
+	static const int ROUNDS = 16;
+
+	static u8 packets[PACKETS][BYTES];
+	static char overheads[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u32 targets[PACKETS];
+
+	char key[32] = {9};
+	calico_state x;
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	double usec = 0;
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			targets[ii] = prng.Next() % count;
+			assert(!calico_encrypt(&x, packets[ii], packets[ii], BYTES, overheads[ii], CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			assert(!calico_decrypt(sessions[targets[ii]], packets[ii], BYTES, overheads[ii], CALICO_DATAGRAM_OVERHEAD));
+		}
+
+		double t1 = m_clock.usec();
+
+		usec += t1 - t0;
+	}
+
+	return usec * 1000.0 / (PACKETS * ROUNDS);
+}
+
+/*
+ * Compare memory use and decryption cost of pooled and heap state objects
+ */
+void BenchmarkStatePool() {
+	static const u32 SESSIONS = 1000000;
+
+	void **sessions = new void*[SESSIONS];
+
+	Abyssinian prng;
+	prng.Initialize(0, 0);
+
+	char key[32] = {9};
+
+	// One heap allocation per session
+	{
+		const double rss0 = ResidentMB();
+
+		for (u32 ii = 0; ii < SESSIONS; ++ii) {
+			sessions[ii] = new calico_state;
+			assert(!calico_key(sessions[ii], sizeof(calico_state), CALICO_RESPONDER, key, sizeof(key)));
+		}
+
+		const double rss1 = ResidentMB();
+		const double nsec = DecryptRandomSessions(sessions, SESSIONS, prng);
+
+		cout << "new calico_state: " << SESSIONS << " sessions use " << rss1 - rss0 << " MB, decrypt " << nsec << " nsec per packet" << endl;
+
+		for (u32 ii = 0; ii < SESSIONS; ++ii) {
+			calico_cleanup(sessions[ii]);
+			delete reinterpret_cast<calico_state *>( sessions[ii] );
+		}
+	}
+
+	// Pooled state objects
+	{
+		calico_pool pool;
+		calico_pool_cache cache;
+
+		assert(!calico_pool_init(&pool, sizeof(calico_state)));
+		assert(!calico_pool_cache_init(&pool, &cache));
+
+		const double rss0 = ResidentMB();
+
+		for (u32 ii = 0; ii < SESSIONS; ++ii) {
+			sessions[ii] = calico_pool_alloc(&cache);
+			assert(sessions[ii]);
+			assert(!calico_key(sessions[ii], sizeof(calico_state), CALICO_RESPONDER, key, sizeof(key)));
+		}
+
+		const double rss1 = ResidentMB();
+		const double nsec = DecryptRandomSessions(sessions, SESSIONS, prng);
+
+		cout << "calico_pool_alloc: " << SESSIONS << " sessions use " << rss1 - rss0 << " MB, decrypt " << nsec << " nsec per packet" << endl;
+
+		for (u32 ii = 0; ii < SESSIONS; ++ii) {
+			calico_pool_free(&cache, sessions[ii]);
+		}
+
+		calico_pool_cache_cleanup(&cache);
+		calico_pool_cleanup(&pool);
+	}
+
+	delete []sessions;
+}
+
+// Encrypt packets for random sessions, returning the best nsec per packet
+static double EncryptRandomSessions(void **sessions, u32 count,
+									Abyssinian &prng, int overhead_size)
+{
+	static const int PACKETS = 4096;
+	static const int BYTES = 100;
+	static const int ROUNDS = 16;
+
+	static u32 targets[PACKETS];
+
+	u8 packet[BYTES] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	double best = 0;
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			targets[ii] = prng.Next() % count;
+		}
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			assert(!calico_encrypt(sessions[targets[ii]], packet, packet, BYTES, overhead, overhead_size));
+		}
+
+		double t1 = m_clock.usec();
+
+		const double nsec = (t1 - t0) * 1000.0 / PACKETS;
+		if (round == 0 || nsec < best) {
+			best = nsec;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Measure memory per session and the cost of sessions that are not in cache
+ */
+void BenchmarkSessionMemory() {
+	static const u32 SESSIONS = 1000000;
+
+	cout << "calico_state: " << sizeof(calico_state) << " bytes per session, calico_stream_only: " << sizeof(calico_stream_only) << " bytes per session" << endl;
+
+	// Pooled so that TLB misses do not hide the cache misses
+	calico_pool pool;
+	calico_pool_cache cache;
+
+	assert(!calico_pool_init(&pool, sizeof(calico_state)));
+	assert(!calico_pool_cache_init(&pool, &cache));
+
+	void **sessions = new void*[SESSIONS];
+
+	Abyssinian prng;
+	prng.Initialize(0, 0);
+
+	char key[32] = {9};
+
+	for (u32 ii = 0; ii < SESSIONS; ++ii) {
+		sessions[ii] = calico_pool_alloc(&cache);
+		assert(sessions[ii]);
+		assert(!calico_key(sessions[ii], sizeof(calico_state), CALICO_RESPONDER, key, sizeof(key)));
+	}
+
+	const double dgram_hot = EncryptRandomSessions(sessions, 1, prng, CALICO_DATAGRAM_OVERHEAD);
+	const double dgram_cold = EncryptRandomSessions(sessions, SESSIONS, prng, CALICO_DATAGRAM_OVERHEAD);
+	const double stream_hot = EncryptRandomSessions(sessions, 1, prng, CALICO_STREAM_OVERHEAD);
+	const double stream_cold = EncryptRandomSessions(sessions, SESSIONS, prng, CALICO_STREAM_OVERHEAD);
+	const double decrypt_cold = DecryptRandomSessions(sessions, SESSIONS, prng);
+
+	cout << "calico_encrypt: datagram " << dgram_hot << " nsec for one session / " << dgram_cold << " nsec across " << SESSIONS << " sessions" << endl;
+	cout << "calico_encrypt: stream " << stream_hot << " nsec for one session / " << stream_cold << " nsec across " << SESSIONS << " sessions" << endl;
+	cout << "calico_decrypt: datagram " << decrypt_cold << " nsec across " << SESSIONS << " sessions" << endl;
+
+	for (u32 ii = 0; ii < SESSIONS; ++ii) {
+		calico_pool_free(&cache, sessions[ii]);
+	}
+
+	calico_pool_cache_cleanup(&cache);
+	calico_pool_cleanup(&pool);
+
+	delete []sessions;
+}
+
+#ifndef RATCHET_REMOTE_TIMEOUT
+#define RATCHET_REMOTE_TIMEOUT (60*1000) /* Library default */
+#endif
+
+/*
+ * Time every message exchanged while the keys ratchet
+ */
+static void RatchetLatency() {
+	static const u32 EXCHANGES = 200000;
+	static const u32 SAMPLES = EXCHANGES * 4;
+
+	// Initiator ratchets about once every thousand exchanges
+	static const u32 STEP_MSEC = (2 * RATCHET_REMOTE_TIMEOUT + 999) / 1000;
+
+	char key[32] = {3};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	double *samples = new double[SAMPLES];
+	u32 count = 0;
+
+	char data[64] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	u32 now = calico_msec();
+
+	for (u32 ii = 0; ii < EXCHANGES; ++ii, now += STEP_MSEC) {
+		double t0 = m_clock.usec();
+		assert(!calico_encrypt_at(&x, data, data, sizeof(data), overhead, sizeof(overhead), now));
+		double t1 = m_clock.usec();
+		assert(!calico_decrypt_at(&y, data, sizeof(data), overhead, sizeof(overhead), now));
+		double t2 = m_clock.usec();
+		assert(!calico_encrypt_at(&y, data, data, sizeof(data), overhead, sizeof(overhead), now));
+		double t3 = m_clock.usec();
+		assert(!calico_decrypt_at(&x, data, sizeof(data), overhead, sizeof(overhead), now));
+		double t4 = m_clock.usec();
+
+		samples[count++] = t1 - t0;
+		samples[count++] = t2 - t1;
+		samples[count++] = t3 - t2;
+		samples[count++] = t4 - t3;
+	}
+
+	std::sort(samples, samples + count);
+
+	cout << "Ratchet latency: p50 " << samples[count / 2] * 1000. << " nsec, p99 " << samples[count / 100 * 99] * 1000. << " nsec, p99.9 " << samples[count / 1000 * 999] * 1000. << " nsec, p99.99 " << samples[count / 10000 * 9999] * 1000. << " nsec, max " << samples[count - 1] * 1000. << " nsec" << endl;
+
+	calico_cleanup(&x);
+	calico_cleanup(&y);
+
+	delete []samples;
+}
+
+/*
+ * Test tail latency of datagrams while ratcheting
+ */
+void BenchmarkRatchetLatency() {
+	for (int ii = 0; ii < 3; ++ii) {
+		RatchetLatency();
+	}
+}
+
+/*
+ * Test performance of Decrypt() function when it fails
+ */
+void BenchmarkDecryptFail() {
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char data[10000] = {0};
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	for (int bytes = 10000; bytes > 0; bytes /= 10) {
+		assert(!calico_encrypt(&x, data, data, bytes, overhead, sizeof(overhead)));
+
+		data[0] ^= 1;
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < 100000; ++ii) {
+			assert(calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+		}
+
+		double t1 = m_clock.usec();
+
+		double adt = (t1 - t0) / 100000.0;
+
+		double fps = 1000000.0 / adt;
+
+		double mbps = bytes * fps / 1000000.0;
+
+		cout << "calico_decrypt: drops " << bytes << " corrupted bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+	}
+}
+
+/*
+ * Test performance of batched decryption against the single-message path
+ */
+void BenchmarkDecryptBatch() {
+	static const int BATCH = 32;
+	static const int ROUNDS = 10000;
+	static const int SIZES[3] = { 64, 256, 1400 };
+
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	static char data[BATCH][1400];
+	char overhead[BATCH][CALICO_DATAGRAM_OVERHEAD];
+	calico_encrypt_desc msgs[BATCH];
+	calico_decrypt_desc pkts[BATCH];
+	int results[BATCH];
+
+	for (int kk = 0; kk < 3; ++kk) {
+		const int bytes = SIZES[kk];
+		double single_sum = 0, batch_sum = 0;
+
+		for (int ii = 0; ii < BATCH; ++ii) {
+			msgs[ii].plaintext = data[ii];
+			msgs[ii].ciphertext = data[ii];
+			msgs[ii].bytes = bytes;
+			msgs[ii].overhead = overhead[ii];
+
+			pkts[ii].ciphertext = data[ii];
+			pkts[ii].bytes = bytes;
+			pkts[ii].overhead = overhead[ii];
+		}
+
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			assert(!calico_encrypt_batch(&x, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+
+			double t0 = m_clock.usec();
+
+			for (int jj = 0; jj < BATCH; ++jj) {
+				assert(!calico_decrypt(&y, data[jj], bytes, overhead[jj], CALICO_DATAGRAM_OVERHEAD));
+			}
+
+			double t1 = m_clock.usec();
+
+			assert(!calico_encrypt_batch(&x, msgs, BATCH, CALICO_DATAGRAM_OVERHEAD));
+
+			double t2 = m_clock.usec();
+
+			assert(!calico_decrypt_batch(&y, pkts, BATCH, CALICO_DATAGRAM_OVERHEAD, results));
+
+			double t3 = m_clock.usec();
+
+			single_sum += t1 - t0;
+			batch_sum += t3 - t2;
+		}
+
+		double single_adt = single_sum / (ROUNDS * BATCH);
+		double batch_adt = batch_sum / (ROUNDS * BATCH);
+
+		cout << "calico_decrypt_batch: " << bytes << " bytes in " << batch_adt << " usec per packet (single calls: " << single_adt << " usec) / " << 1000000.0 / batch_adt << " per second" << endl;
+	}
+}
+
+/*
+ * Test performance of Decrypt() function when it succeeds
+ */
+void BenchmarkDecryptSuccess() {
+	char key[32] = {0};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char data[10000];
+	char temp[sizeof(data)];
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	for (int bytes = 10000; bytes > 0; bytes /= 10) {
+		double t_sum = 0;
+
+		u32 *data_ptr = reinterpret_cast<u32*>( temp );
+		for (int jj = 0; jj < (bytes + 3) / 4; ++jj) {
+			data_ptr[jj] = prng.Next();
+		}
+
+		for (int ii = 0; ii < 100000; ++ii) {
+			assert(!calico_encrypt(&x, data, temp, bytes, overhead, sizeof(overhead)));
+
+			double t0 = m_clock.usec();
+
+			assert(!calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+
+			double t1 = m_clock.usec();
+
+			assert(SecureEqual(data, temp, bytes));
+
+			t_sum += t1 - t0;
+		}
+
+		double adt = t_sum / 100000.0;
+
+		double fps = 1000000.0 / adt;
+
+		double mbps = bytes * fps / 1000000.0;
+
+		cout << "calico_decrypt: " << bytes << " bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+	}
+}
+
+/*
+ * Test performance of Decrypt() for bulk data, in-place, to a separate buffer,
+ * and against a two-pass MAC-then-decrypt on the same kernels
+ */
+void BenchmarkDecryptBulk() {
+	static const int SIZES[3] = { 1024, 65536, 1048576 };
+	static const int TOTAL = 64 * 1048576;
+
+	char key[32] = {0};
+	char slot_key[48] = {0};	// Cipher key followed by MAC key
+	calico_state x, y;
+	u64 sum = 0;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	static char orig[1048576];
+	static char data[1048576];
+	static char plain[1048576];
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+
+	for (int kk = 0; kk < 3; ++kk) {
+		const int bytes = SIZES[kk];
+		const int rounds = TOTAL / bytes;
+		double t_inplace = 0, t_to = 0, t_two_pass = 0;
+
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+
+			double t0 = m_clock.usec();
+
+			assert(!calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+
+			double t1 = m_clock.usec();
+
+			t_inplace += t1 - t0;
+		}
+
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+
+			double t0 = m_clock.usec();
+
+			assert(!calico_decrypt_to(&y, plain, data, bytes, overhead, sizeof(overhead)));
+
+			double t1 = m_clock.usec();
+
+			t_to += t1 - t0;
+		}
+
+		// Same work done as a full SipHash pass over the ciphertext followed
+		// by a full ChaCha pass into the separate buffer, with the same kernels
+		for (int ii = 0; ii < rounds; ++ii) {
+			assert(!calico_encrypt(&x, data, orig, bytes, overhead, sizeof(overhead)));
+
+			const u64 iv = ii;
+
+			double t0 = m_clock.usec();
+
+			siphash_state H;
+			siphash24_begin(&H, slot_key + 32, iv);
+			sum += siphash24_end(&H, data, bytes);
+
+			chacha_input S;
+			chacha_input_init(&S, slot_key, 14, iv);
+			chacha_blocks(&S, (const u8 *)data, (u8 *)plain, bytes);
+
+			double t1 = m_clock.usec();
+
+			t_two_pass += t1 - t0;
+		}
+
+		double inplace_mbps = bytes * (double)rounds / t_inplace;
+		double to_mbps = bytes * (double)rounds / t_to;
+		double two_pass_mbps = bytes * (double)rounds / t_two_pass;
+
+		cout << "calico_decrypt_to: " << bytes << " bytes at " << to_mbps << " MBPS (two-pass to a separate buffer: " << two_pass_mbps << " MBPS, calico_decrypt in-place: " << inplace_mbps << " MBPS)" << endl;
+	}
+
+	// Keep the results live
+	if (sum == 0) {
+		cout << "(ignore)" << endl;
+	}
+}
+
+/*
+ * Test to ensure that the MAC includes the IV
+ *
+ * The first 3 bytes of overhead are assumed to be the IV for this test
+ *
+ * I verified that if the last parameter to siphash24() that is currently
+ * the IV is set to 0 instead, then it will fail this test.
+ */
+void ReplayMACTest() {
+	char key[32] = {0};
+
+	calico_stream_only x, y;
+	char data_iv0[32] = {0};
+	char overhead_iv0[CALICO_STREAM_OVERHEAD];
+	char data_iv1[32] = {1};
+	char overhead_iv1[CALICO_STREAM_OVERHEAD];
+	char plaintext[32];
+	char overhead_iv_mod[CALICO_STREAM_OVERHEAD];
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	assert(!calico_encrypt(&x, data_iv0, data_iv0, 32, overhead_iv0, sizeof(overhead_iv0)));
+	assert(!calico_encrypt(&x, data_iv1, data_iv1, 32, overhead_iv1, sizeof(overhead_iv1)));
+
+	memcpy(plaintext, data_iv0, 32);
+	assert(!calico_decrypt(&y, plaintext, 32, overhead_iv0, sizeof(overhead_iv0)));
+
+	// Use IV = 1, but keep the MAC the same as for IV = 0
+
+	memcpy(overhead_iv_mod, overhead_iv0, sizeof(overhead_iv_mod));
+
+	assert(calico_decrypt(&y, data_iv0, 32, overhead_iv_mod, sizeof(overhead_iv_mod)));
+}
+
+/*
+ * Test for key ratcheting
+ */
+void RatchetKeyTest() {
+	cout << "This is testing the forward secrecy feature of Calico.  Normally the rekeying interval is two minutes.  But for this test the Makefile has changed the rekeying interval to 1 second.  Turning on CAT_VERBOSE_CALICO helps visualize what is going on.  Note that in this protocol the client initiates the key ratcheting on its timer and the server ratchets in acknowledgement." << endl;
+
+	char key[32] = {9};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char orig[32] = {0};
+
+	u32 t0 = m_clock.msec();
+
+	while ((u32)(m_clock.msec() - t0) < 20000) {
+		char c2s_data[32] = {0};
+		char c2s_over[CALICO_STREAM_OVERHEAD];
+		char s2c_data[32] = {0};
+		char s2c_over[CALICO_STREAM_OVERHEAD];
+
+		cout << "- c2s transmit" << endl;
+		assert(!calico_encrypt(&x, c2s_data, c2s_data, 32, c2s_over, sizeof(c2s_over)));
+
+		Clock::sleep(137);
+
+		cout << "-- server receiving" << endl;
+		assert(!calico_decrypt(&y, c2s_data, 32, c2s_over, sizeof(c2s_over)));
+		assert(SecureEqual(c2s_data, orig, sizeof(c2s_data)));
+
+		cout << "- s2c transmit" << endl;
+		assert(!calico_encrypt(&y, s2c_data, s2c_data, 32, s2c_over, sizeof(s2c_over)));
+
+		Clock::sleep(122);
+
+		cout << "-- client receiving" << endl;
+		assert(!calico_decrypt(&x, s2c_data, 32, s2c_over, sizeof(s2c_over)));
+		assert(SecureEqual(s2c_data, orig, sizeof(s2c_data)));
+
+		Clock::sleep(15);
+	}
+}
+
+/*
+ * Drive the key ratchet with caller-supplied timestamps instead of the clock
+ */
+void TimestampRatchetTest() {
+	char key[32] = {7};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char orig[32] = {0};
+	u32 now = calico_msec();
+	u32 last_bit = 0;
+	int flips = 0;
+
+	// Simulate an hour of traffic with one exchange every 10 seconds
+	for (int ii = 0; ii < 360; ++ii, now += 10000) {
+		char c2s_data[32] = {0};
+		char c2s_over[CALICO_STREAM_OVERHEAD];
+		char s2c_data[32] = {0};
+		char s2c_over[CALICO_STREAM_OVERHEAD];
+		char dgram_data[32] = {0};
+		char dgram_over[CALICO_DATAGRAM_OVERHEAD];
+
+		assert(!calico_encrypt_at(&x, c2s_data, c2s_data, 32, c2s_over, sizeof(c2s_over), now));
+
+		// Count ratchets using the key bit at the bottom of the stream tag
+		const u32 bit = (u8)c2s_over[0] & 1;
+		if (bit != last_bit) {
+			last_bit = bit;
+			++flips;
+		}
+
+		assert(!calico_decrypt_at(&y, c2s_data, 32, c2s_over, sizeof(c2s_over), now + 5));
+		assert(SecureEqual(c2s_data, orig, sizeof(c2s_data)));
+
+		calico_encrypt_desc msg = { s2c_data, s2c_data, 32, s2c_over };
+		assert(!calico_encrypt_batch_at(&y, &msg, 1, CALICO_STREAM_OVERHEAD, now + 5));
+
+		assert(!calico_decrypt_at(&x, s2c_data, 32, s2c_over, sizeof(s2c_over), now + 10));
+		assert(SecureEqual(s2c_data, orig, sizeof(s2c_data)));
+
+		// Datagrams follow the same ratchet
+		assert(!calico_encrypt_at(&x, dgram_data, dgram_data, 32, dgram_over, sizeof(dgram_over), now + 10));
+
+		calico_decrypt_desc pkt = { dgram_data, 32, dgram_over };
+		int result = -1;
+		assert(!calico_decrypt_batch_at(&y, &pkt, 1, CALICO_DATAGRAM_OVERHEAD, &result, now + 15));
+		assert(!result);
+		assert(SecureEqual(dgram_data, orig, sizeof(dgram_data)));
+	}
+
+	// The initiator ratchets at least every few minutes
+	assert(flips >= 10);
+}
+
+/*
+ * Stream keys switch as soon as a message authenticates under the next key
+ */
+void StreamRatchetTest() {
+	static const u32 RATCHET_PERIOD = 2 * RATCHET_REMOTE_TIMEOUT;
+
+	char key[32] = {3};
+	calico_stream_only x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	char orig[32] = {0};
+	u32 now = calico_msec();
+	u32 bit = 0;
+
+	// Each round is one ratchet period with only one exchange in it, so the
+	// initiator never decrypts after a remote key timeout could have expired
+	for (int ii = 0; ii < 8; ++ii) {
+		char c2s_data[32] = {0}, s2c_data[32] = {0}, forged[32];
+		char c2s_over[CALICO_STREAM_OVERHEAD], s2c_over[CALICO_STREAM_OVERHEAD];
+		char forged_over[CALICO_STREAM_OVERHEAD];
+
+		// Use times with low bits set, so that a ratchet time that dropped them
+		// would expire early
+		now = (now + RATCHET_PERIOD + 1) | 15;
+		bit ^= 1;
+
+		// The initiator ratchets as soon as the period has elapsed
+		assert(!calico_encrypt_at(&x, c2s_data, c2s_data, 32, c2s_over, sizeof(c2s_over), now));
+		assert(((u8)c2s_over[0] & 1) == bit);
+
+		// A forged message under the next key does not switch keys
+		memcpy(forged, c2s_data, sizeof(forged));
+		memcpy(forged_over, c2s_over, sizeof(forged_over));
+		forged[ii] ^= 1;
+		assert(calico_decrypt_at(&y, forged, 32, forged_over, sizeof(forged_over), now + 1));
+
+		assert(!calico_decrypt_at(&y, c2s_data, 32, c2s_over, sizeof(c2s_over), now + 1));
+		assert(SecureEqual(c2s_data, orig, sizeof(c2s_data)));
+
+		// The old key is gone, so a message under it is rejected
+		memcpy(forged_over, c2s_over, sizeof(forged_over));
+		forged_over[0] ^= 1;
+		assert(calico_decrypt_at(&y, c2s_data, 32, forged_over, sizeof(forged_over), now + 1));
+
+		// The responder follows right away
+		assert(!calico_encrypt_at(&y, s2c_data, s2c_data, 32, s2c_over, sizeof(s2c_over), now + 2));
+		assert(((u8)s2c_over[0] & 1) == bit);
+
+		assert(!calico_decrypt_at(&x, s2c_data, 32, s2c_over, sizeof(s2c_over), now + 3));
+		assert(SecureEqual(s2c_data, orig, sizeof(s2c_data)));
+	}
+
+	// The initiator ratchets again one period after the last ratchet, to the
+	// millisecond
+	char data[32] = {0};
+	char overhead[CALICO_STREAM_OVERHEAD];
+
+	assert(!calico_encrypt_at(&x, data, data, 32, overhead, sizeof(overhead), now + RATCHET_PERIOD));
+	assert(((u8)overhead[0] & 1) == bit);
+
+	assert(!calico_encrypt_at(&x, data, data, 32, overhead, sizeof(overhead), now + RATCHET_PERIOD + 1));
+	assert(((u8)overhead[0] & 1) != bit);
+
+	calico_cleanup(&x);
+	calico_cleanup(&y);
+}
+
+// Single-producer single-consumer queue of stream messages between threads
+struct MessageQueue {
+	static const int SLOTS = 256;
+
+	struct Message {
+		char data[32];
+		char overhead[CALICO_STREAM_OVERHEAD];
+	};
+
+	Message messages[SLOTS];
+
+	// Written by the producer
+	volatile u32 head;
+	char pad[64];
+
+	// Written by the consumer
+	volatile u32 tail;
+};
+
+static void queue_push(MessageQueue *queue, const MessageQueue::Message &msg) {
+	const u32 head = queue->head;
+
+	while (head - atomic_load_acquire(&queue->tail) >= MessageQueue::SLOTS) {
+		thread_yield();
+	}
+
+	queue->messages[head % MessageQueue::SLOTS] = msg;
+	atomic_store_release(&queue->head, head + 1);
+}
+
+static void queue_pop(MessageQueue *queue, MessageQueue::Message &msg) {
+	const u32 tail = queue->tail;
+
+	while (atomic_load_acquire(&queue->head) == tail) {
+		thread_yield();
+	}
+
+	msg = queue->messages[tail % MessageQueue::SLOTS];
+	atomic_store_release(&queue->tail, tail + 1);
+}
+
+// One side of a full-duplex session, with its own transmit and receive threads
+struct DuplexEndpoint {
+	static const int MESSAGES = 50000;
+	static const u32 MSEC_PER_MESSAGE = 20;
+
+	calico_state *state;
+	MessageQueue *tx, *rx;
+	u32 base_time;
+
+	int flips;	// Written by the transmit thread
+	int errors;	// Written by the receive thread
+};
+
+static void DuplexTransmit(void *param) {
+	DuplexEndpoint *ep = reinterpret_cast<DuplexEndpoint *>( param );
+	u32 last_bit = 0;
+
+	for (int ii = 0; ii < DuplexEndpoint::MESSAGES; ++ii) {
+		MessageQueue::Message msg;
+		memset(msg.data, (u8)ii, sizeof(msg.data));
+
+		const u32 now = ep->base_time + ii * DuplexEndpoint::MSEC_PER_MESSAGE;
+		assert(!calico_encrypt_at(ep->state, msg.data, msg.data, sizeof(msg.data), msg.overhead, sizeof(msg.overhead), now));
+
+		// Count ratchets using the key bit at the bottom of the stream tag
+		const u32 bit = (u8)msg.overhead[0] & 1;
+		if (bit != last_bit) {
+			last_bit = bit;
+			++ep->flips;
+		}
+
+		queue_push(ep->tx, msg);
+	}
+}
+
+static void DuplexReceive(void *param) {
+	DuplexEndpoint *ep = reinterpret_cast<DuplexEndpoint *>( param );
+
+	for (int ii = 0; ii < DuplexEndpoint::MESSAGES; ++ii) {
+		MessageQueue::Message msg;
+		queue_pop(ep->rx, msg);
+
+		const u32 now = ep->base_time + ii * DuplexEndpoint::MSEC_PER_MESSAGE;
+		if (calico_decrypt_at(ep->state, msg.data, sizeof(msg.data), msg.overhead, sizeof(msg.overhead), now)) {
+			++ep->errors;
+			continue;
+		}
+
+		for (int jj = 0; jj < (int)sizeof(msg.data); ++jj) {
+			if (msg.data[jj] != (char)(u8)ii) {
+				++ep->errors;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Encrypt and decrypt with each session object on separate threads while
+ * the keys are ratcheted
+ */
+void FullDuplexThreadTest() {
+	char key[32] = {5};
+	static calico_state x, y;
+	static MessageQueue c2s, s2c;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	c2s.head = c2s.tail = 0;
+	s2c.head = s2c.tail = 0;
+
+	const u32 now = calico_msec();
+	DuplexEndpoint client = { &x, &c2s, &s2c, now, 0, 0 };
+	DuplexEndpoint server = { &y, &s2c, &c2s, now, 0, 0 };
+
+	thread_handle threads[4];
+	assert(thread_start(&threads[0], DuplexTransmit, &client));
+	assert(thread_start(&threads[1], DuplexReceive, &client));
+	assert(thread_start(&threads[2], DuplexTransmit, &server));
+	assert(thread_start(&threads[3], DuplexReceive, &server));
+
+	for (int ii = 0; ii < 4; ++ii) {
+		thread_join(&threads[ii]);
+	}
+
+	assert(client.errors == 0);
+	assert(server.errors == 0);
+
+	// The session covers several ratchet periods
+	assert(client.flips >= 2);
+	assert(server.flips >= 2);
+}
+
+/*
+ * Deliver every datagram to several threads at once and check that each one
+ * is accepted exactly once, across a remote key ratchet
+ */
+void ConcurrentDecryptTest() {
+	static const int THREADS = 4;
+	static const int PACKETS = 10000;
+	static const int BYTES = ConcurrentDecryptWork::BYTES;
+
+	static char data[THREADS][PACKETS][BYTES];
+	static char overhead[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u8 accepted[THREADS][PACKETS];
+	static u64 window[65536 / 64];
+
+	char key[32] = {3};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key_window(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key), window, 65536));
+
+	const u32 base_time = calico_msec();
+
+	// First pass: the initiator ratchets partway through
+	// Second pass: the old key is erased while the threads are running
+	for (int pass = 0; pass < 2; ++pass) {
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			memset(data[0][ii], (u8)ii, BYTES);
+
+			const u32 now = base_time + (pass * PACKETS + ii) * 30;
+			assert(!calico_encrypt_at(&x, data[0][ii], data[0][ii], BYTES, overhead[ii], CALICO_DATAGRAM_OVERHEAD, now));
+		}
+
+		for (int tt = 1; tt < THREADS; ++tt) {
+			memcpy(data[tt], data[0], sizeof(data[0]));
+		}
+		memset(accepted, 0, sizeof(accepted));
+
+		// Each thread gets every packet, starting from a different place
+		ConcurrentDecryptWork work[THREADS];
+		thread_handle threads[THREADS];
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			ConcurrentDecryptWork &w = work[tt];
+			w.state = &y;
+			w.data = data[tt];
+			w.overhead = overhead;
+			w.count = PACKETS;
+			w.first = tt * PACKETS / THREADS;
+			w.stride = 1;
+			w.steps = PACKETS;
+			w.now = base_time + pass * 10 * 60 * 1000;
+			w.accepted = accepted[tt];
+
+			assert(thread_start(&threads[tt], ConcurrentDecrypt, &w));
+		}
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			thread_join(&threads[tt]);
+		}
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			int count = 0;
+
+			for (int tt = 0; tt < THREADS; ++tt) {
+				if (accepted[tt][ii]) {
+					++count;
+
+					for (int jj = 0; jj < BYTES; ++jj) {
+						assert(data[tt][ii][jj] == (char)(u8)ii);
+					}
+				}
+			}
+
+			assert(count == 1);
+		}
+	}
+}
+
+// Ratchet bit of a datagram, decoded the same way the receiver does
+static u32 DatagramRatchetBit(const char *overhead) {
+	const u8 *overhead_iv = reinterpret_cast<const u8 *>( overhead ) + 8;
+	u64 tag;
+	memcpy(&tag, overhead, sizeof(tag));
+
+	u32 trunc_iv = ((u32)overhead_iv[2] << 8) | ((u32)overhead_iv[1] << 16) | (u32)overhead_iv[0];
+	trunc_iv ^= 0xC86AD7;
+	trunc_iv += (u32)tag;
+
+	return trunc_iv & 1;
+}
+
+// Work for one thread decrypting old-key datagrams while the clock advances
+// past the point where the old key is erased
+struct EraseRaceWork {
+	static const int BYTES = 1024;
+
+	calico_state *state;
+	char (*data)[BYTES];
+	const char (*overhead)[CALICO_DATAGRAM_OVERHEAD];
+
+	// Packets first + k * stride for k < steps, at now + k * step_msec
+	int first, stride, steps;
+	u32 now, step_msec;
+
+	// Set for each packet this thread decrypted
+	u8 *accepted;
+};
+
+static void EraseRaceDecrypt(void *param) {
+	EraseRaceWork *work = reinterpret_cast<EraseRaceWork *>( param );
+
+	for (int kk = 0; kk < work->steps; ++kk) {
+		const int index = work->first + kk * work->stride;
+		const u32 now = work->now + kk * work->step_msec;
+
+		if (!calico_decrypt_concurrent_at(work->state, work->data[index], EraseRaceWork::BYTES, work->overhead[index], CALICO_DATAGRAM_OVERHEAD, now)) {
+			work->accepted[index] = 1;
+		}
+	}
+}
+
+/*
+ * Keep delivering datagrams under the old key to several threads while one
+ * of them erases it at the end of a remote ratchet, and check that every
+ * datagram that is accepted decrypts to the plaintext that was sent
+ */
+void ConcurrentRatchetStressTest() {
+	static const int THREADS = 4;
+	static const int PACKETS = 2000;
+	static const int ROUNDS = 200;
+	static const int BYTES = EraseRaceWork::BYTES;
+	static const u32 RATCHET_PERIOD = 2 * RATCHET_REMOTE_TIMEOUT;
+
+	// The old key is erased halfway through each thread's packets
+	static const int STEPS = PACKETS / THREADS;
+	static const u32 STEP_MSEC = (2 * RATCHET_REMOTE_TIMEOUT + STEPS - 1) / STEPS;
+
+	static char data[PACKETS][BYTES];
+	static char overhead[PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static u8 accepted[PACKETS];
+	static u64 window[65536 / 64];
+
+	char key[32] = {9};
+	char next_data[32], next_overhead[CALICO_DATAGRAM_OVERHEAD];
+	calico_state x, y;
+	int total_accepted = 0;
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+		assert(!calico_key_window(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key), window, 65536));
+
+		const u32 t0 = calico_msec();
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			memset(data[ii], (u8)(ii + round), BYTES);
+			assert(!calico_encrypt_at(&x, data[ii], data[ii], BYTES, overhead[ii], CALICO_DATAGRAM_OVERHEAD, t0));
+			assert(DatagramRatchetBit(overhead[ii]) == 0);
+		}
+
+		// The initiator ratchets, and the first datagram under the new key
+		// starts the receiver's timer to erase the old one
+		const u32 t1 = t0 + RATCHET_PERIOD + 1;
+		memset(next_data, 0, sizeof(next_data));
+		assert(!calico_encrypt_at(&x, next_data, next_data, sizeof(next_data), next_overhead, sizeof(next_overhead), t1));
+		assert(DatagramRatchetBit(next_overhead) == 1);
+		assert(!calico_decrypt_concurrent_at(&y, next_data, sizeof(next_data), next_overhead, sizeof(next_overhead), t1));
+
+		memset(accepted, 0, sizeof(accepted));
+
+		EraseRaceWork work[THREADS];
+		thread_handle threads[THREADS];
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			EraseRaceWork &w = work[tt];
+			w.state = &y;
+			w.data = data;
+			w.overhead = overhead;
+			w.first = tt;
+			w.stride = THREADS;
+			w.steps = STEPS;
+			w.now = t1;
+			w.step_msec = STEP_MSEC;
+			w.accepted = accepted;
+
+			assert(thread_start(&threads[tt], EraseRaceDecrypt, &w));
+		}
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			thread_join(&threads[tt]);
+		}
+
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			if (accepted[ii]) {
+				++total_accepted;
+
+				for (int jj = 0; jj < BYTES; ++jj) {
+					assert(data[ii][jj] == (char)(u8)(ii + round));
+				}
+			}
+		}
+	}
+
+	// Some datagrams arrived before the old key was erased and some after
+	assert(total_accepted > 0);
+	assert(total_accepted < PACKETS * ROUNDS);
+}
+
+/*
+ * Encrypt on several threads through IV block reservation while the keys
+ * are ratcheted, and check that the remote host accepts every datagram
+ */
+void MultiSenderTest() {
+	static const int THREADS = 4;
+	static const int PACKETS = SenderWork::PACKETS;
+	static const int BYTES = SenderWork::BYTES;
+
+	static char data[THREADS][PACKETS][BYTES];
+	static char overhead[THREADS][PACKETS][CALICO_DATAGRAM_OVERHEAD];
+	static SenderWork work[THREADS];
+	static u64 window[65536 / 64];
+
+	char key[32] = {7};
+	calico_state x, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key_window(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key), window, 65536));
+
+	for (int tt = 0; tt < THREADS; ++tt) {
+		assert(!calico_sender_init(&x, &work[tt].sender));
+		work[tt].id = tt;
+		work[tt].data = data[tt];
+		work[tt].overhead = overhead[tt];
+	}
+
+	const u32 base_time = calico_msec();
+
+	for (int phase = 0; phase < 4; ++phase) {
+		// Each phase is long enough for the initiator to ratchet once
+		const u32 now = base_time + (phase + 1) * 10 * 60 * 1000;
+
+		thread_handle threads[THREADS];
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			work[tt].now = now;
+			assert(thread_start(&threads[tt], SenderEncrypt, &work[tt]));
+		}
+
+		for (int tt = 0; tt < THREADS; ++tt) {
+			thread_join(&threads[tt]);
+		}
+
+		// Receive the datagrams interleaved across the senders
+		for (int ii = 0; ii < PACKETS; ++ii) {
+			for (int tt = 0; tt < THREADS; ++tt) {
+				assert(DatagramRatchetBit(overhead[tt][ii]) == (u32)((phase + 1) & 1));
+
+				assert(!calico_decrypt_at(&y, data[tt][ii], BYTES, overhead[tt][ii], CALICO_DATAGRAM_OVERHEAD, now));
+
+				assert(data[tt][ii][0] == (char)tt);
+				for (int jj = 1; jj < BYTES; ++jj) {
+					assert(data[tt][ii][jj] == (char)(u8)ii);
+				}
+			}
+		}
+
+		// Send replies so that the initiator may ratchet again next phase
+		for (int reply = 0; reply < 2; ++reply) {
+			const u32 reply_time = now + reply * 5 * 60 * 1000;
+			char msg[BYTES] = {0}, msg_overhead[CALICO_DATAGRAM_OVERHEAD];
+
+			assert(!calico_encrypt_at(&y, msg, msg, BYTES, msg_overhead, CALICO_DATAGRAM_OVERHEAD, reply_time));
+			assert(!calico_decrypt_at(&x, msg, BYTES, msg_overhead, CALICO_DATAGRAM_OVERHEAD, reply_time));
+		}
+	}
+
+	for (int tt = 0; tt < THREADS; ++tt) {
+		calico_sender_cleanup(&work[tt].sender);
+	}
+}
+
+/*
+ * Encrypt and decrypt large messages in chunks on several threads, and check
+ * that chunks cannot be changed, reordered or truncated
+ */
+void LargeMessageTest() {
+	static const int CHUNK = 65536;
+	static const int SIZES[6] = { 0, 1, CHUNK - 1, CHUNK, CHUNK + 1, 3 * CHUNK + 17 };
+	static const int THREADS[3] = { 1, 3, 8 };
+	static const int OVERHEADS[2] = { CALICO_DATAGRAM_OVERHEAD, CALICO_STREAM_OVERHEAD };
+
+	static u8 plaintext[4 * CHUNK], ciphertext[4 * CHUNK], ciphertext2[4 * CHUNK], decrypted[4 * CHUNK];
+
+	for (int ii = 0; ii < (int)sizeof(plaintext); ++ii) {
+		plaintext[ii] = (u8)(ii * 7 + (ii >> 16));
+	}
+
+	char key[32] = {9};
+	calico_state x, x2, y;
 
-			double t0 = m_clock.usec();
+	for (int oo = 0; oo < 2; ++oo) {
+		const int overhead_size = OVERHEADS[oo];
 
-			assert(!calico_decrypt(&y, data, bytes, overhead, sizeof(overhead)));
+		assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+		assert(!calico_key(&x2, sizeof(x2), CALICO_INITIATOR, key, sizeof(key)));
+		assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
 
-			double t1 = m_clock.usec();
+		for (int ss = 0; ss < 6; ++ss) {
+			for (int tt = 0; tt < 3; ++tt) {
+				const int bytes = SIZES[ss];
+				char overhead[CALICO_DATAGRAM_OVERHEAD], overhead2[CALICO_DATAGRAM_OVERHEAD];
+
+				assert(!calico_encrypt_large(&x, ciphertext, plaintext, bytes, overhead, overhead_size, THREADS[tt]));
+
+				// The output does not depend on the number of threads
+				assert(!calico_encrypt_large(&x2, ciphertext2, plaintext, bytes, overhead2, overhead_size, 1));
+				assert(!memcmp(ciphertext, ciphertext2, bytes));
+				assert(!memcmp(overhead, overhead2, overhead_size));
+
+				if (bytes > 2 * CHUNK) {
+					// Changed chunk
+					ciphertext[2 * CHUNK + 5] ^= 1;
+					memset(decrypted, 1, bytes);
+					assert(calico_decrypt_large(&y, decrypted, ciphertext, bytes, overhead, overhead_size, THREADS[tt]));
+					for (int jj = 0; jj < bytes; ++jj) {
+						assert(decrypted[jj] == 0);
+					}
+					ciphertext[2 * CHUNK + 5] ^= 1;
+
+					// Reordered chunks
+					memcpy(ciphertext2, ciphertext, bytes);
+					memcpy(ciphertext2, ciphertext + CHUNK, CHUNK);
+					memcpy(ciphertext2 + CHUNK, ciphertext, CHUNK);
+					assert(calico_decrypt_large(&y, ciphertext2, ciphertext2, bytes, overhead, overhead_size, THREADS[tt]));
+
+					// Truncated message
+					assert(calico_decrypt_large(&y, decrypted, ciphertext, bytes - CHUNK, overhead, overhead_size, THREADS[tt]));
+				}
+
+				// Decrypt in-place for one of the thread counts
+				if (tt == 1) {
+					assert(!calico_decrypt_large(&y, ciphertext, ciphertext, bytes, overhead, overhead_size, THREADS[tt]));
+					assert(!memcmp(ciphertext, plaintext, bytes));
+				} else {
+					assert(!calico_decrypt_large(&y, decrypted, ciphertext, bytes, overhead, overhead_size, THREADS[tt]));
+					assert(!memcmp(decrypted, plaintext, bytes));
+				}
+			}
+		}
 
-			assert(SecureEqual(data, temp, bytes));
+		// An empty large message does not verify as an ordinary message
+		char overhead[CALICO_DATAGRAM_OVERHEAD];
+		assert(!calico_encrypt_large(&x, ciphertext, plaintext, 0, overhead, overhead_size, 1));
+		assert(calico_decrypt(&y, ciphertext, 0, overhead, overhead_size));
+		assert(!calico_decrypt_large(&y, decrypted, ciphertext, 0, overhead, overhead_size, 1));
+	}
+}
 
-			t_sum += t1 - t0;
+struct LargeSession {
+	calico_state x, y;
+	u8 *buffer;
+	u64 bytes;
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	int threads;
+	bool ok;
+};
+
+static void LargeSessionRoundTrip(void *param)
+{
+	LargeSession *session = reinterpret_cast<LargeSession *>( param );
+
+	session->ok = !calico_encrypt_large(&session->x, session->buffer, session->buffer, session->bytes,
+										session->overhead, CALICO_DATAGRAM_OVERHEAD, session->threads) &&
+				  !calico_decrypt_large(&session->y, session->buffer, session->buffer, session->bytes,
+										session->overhead, CALICO_DATAGRAM_OVERHEAD, session->threads);
+}
+
+/*
+ * Verify that large messages with chunk tags from several rounds are bound
+ * in order, and that concurrent callers share the thread pool correctly
+ */
+void LargeMessageRoundsTest() {
+	static const u64 CHUNK = 65536;
+	static const u64 BYTES = 300 * CHUNK + 5;
+
+	u8 *plaintext = new u8[BYTES];
+	u8 *ciphertext = new u8[BYTES];
+	u8 *ciphertext2 = new u8[BYTES];
+
+	for (u64 ii = 0; ii < BYTES; ++ii) {
+		plaintext[ii] = (u8)(ii * 11 + (ii >> 16));
+	}
+
+	char key[32] = {10};
+	calico_state x, x2, y;
+	char overhead[CALICO_DATAGRAM_OVERHEAD], overhead2[CALICO_DATAGRAM_OVERHEAD];
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&x2, sizeof(x2), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	assert(!calico_encrypt_large(&x, ciphertext, plaintext, BYTES, overhead, sizeof(overhead), 4));
+	assert(!calico_encrypt_large(&x2, ciphertext2, plaintext, BYTES, overhead2, sizeof(overhead2), 1));
+	assert(!memcmp(ciphertext, ciphertext2, BYTES));
+	assert(!memcmp(overhead, overhead2, sizeof(overhead)));
+
+	// Chunks swapped between rounds
+	memcpy(ciphertext2, ciphertext + 280 * CHUNK, CHUNK);
+	memcpy(ciphertext2 + 280 * CHUNK, ciphertext, CHUNK);
+	assert(calico_decrypt_large(&y, ciphertext2, ciphertext2, BYTES, overhead, sizeof(overhead), 4));
+
+	assert(!calico_decrypt_large(&y, ciphertext, ciphertext, BYTES, overhead, sizeof(overhead), 4));
+	assert(!memcmp(ciphertext, plaintext, BYTES));
+
+	// Concurrent callers each get the same result as a serial caller
+	static const int SESSIONS = 3;
+	LargeSession *sessions = new LargeSession[SESSIONS];
+	thread_handle threads[SESSIONS];
+
+	for (int ii = 0; ii < SESSIONS; ++ii) {
+		assert(!calico_key(&sessions[ii].x, sizeof(calico_state), CALICO_INITIATOR, key, sizeof(key)));
+		assert(!calico_key(&sessions[ii].y, sizeof(calico_state), CALICO_RESPONDER, key, sizeof(key)));
+		sessions[ii].buffer = new u8[BYTES / 4];
+		sessions[ii].bytes = BYTES / 4;
+		sessions[ii].threads = 4;
+		memcpy(sessions[ii].buffer, plaintext, BYTES / 4);
+	}
+
+	for (int ii = 0; ii < SESSIONS; ++ii) {
+		assert(thread_start(&threads[ii], LargeSessionRoundTrip, &sessions[ii]));
+	}
+
+	for (int ii = 0; ii < SESSIONS; ++ii) {
+		thread_join(&threads[ii]);
+		assert(sessions[ii].ok);
+		assert(!memcmp(sessions[ii].buffer, plaintext, BYTES / 4));
+		delete []sessions[ii].buffer;
+	}
+
+	delete []sessions;
+	delete []plaintext;
+	delete []ciphertext;
+	delete []ciphertext2;
+}
+
+// Work shared out by the thread pool test: each thread claims items until
+// there are none left
+struct PoolWork {
+	static const u32 ITEMS = 10000;
+
+	volatile u32 next;
+	u8 done[ITEMS];
+};
+
+static void PoolWorker(void *param) {
+	PoolWork *work = reinterpret_cast<PoolWork *>( param );
+
+	for (;;) {
+		const u32 item = atomic_load_acquire(&work->next);
+
+		if (item >= PoolWork::ITEMS) {
+			return;
 		}
 
-		double adt = t_sum / 100000.0;
+		if (atomic_cas(&work->next, item, item + 1)) {
+			work->done[item] = 1;
+		}
+	}
+}
 
-		double fps = 1000000.0 / adt;
+/*
+ * Check that idle pool helpers exit and that the pool starts them again
+ */
+void ThreadPoolIdleTest() {
+	static const int HELPERS = 8;
 
-		double mbps = bytes * fps / 1000000.0;
+	static PoolWork work;
 
-		cout << "calico_decrypt: " << bytes << " bytes in " << adt << " usec on average / " << mbps << " MBPS / " << fps << " per second" << endl;
+	for (int round = 0; round < 2; ++round) {
+		work.next = 0;
+		memset(work.done, 0, sizeof(work.done));
+
+		thread_pool_run(PoolWorker, &work, HELPERS);
+
+		for (u32 ii = 0; ii < PoolWork::ITEMS; ++ii) {
+			assert(work.done[ii]);
+		}
+
+		// Helpers stay around for the next call, then exit once idle
+		assert(thread_pool_helpers() > 0);
+
+		const u32 t0 = m_clock.msec();
+
+		while (thread_pool_helpers() > 0) {
+			assert(m_clock.msec() - t0 < 5 * THREAD_POOL_IDLE_MSEC);
+			Clock::sleep(10);
+		}
 	}
 }
 
 /*
- * Test to ensure that the MAC includes the IV
- *
- * The first 3 bytes of overhead are assumed to be the IV for this test
- *
- * I verified that if the last parameter to siphash24() that is currently
- * the IV is set to 0 instead, then it will fail this test.
+ * Encrypt and decrypt stream messages in pieces of random sizes
  */
-void ReplayMACTest() {
-	char key[32] = {0};
+void IncrementalStreamTest() {
+	static const int BYTES = 300000;
+
+	static u8 plaintext[BYTES], ciphertext[BYTES], decrypted[BYTES];
+
+	for (int ii = 0; ii < BYTES; ++ii) {
+		plaintext[ii] = (u8)(ii * 13 + (ii >> 8));
+	}
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
 
+	char key[32] = {4};
 	calico_stream_only x, y;
-	char data_iv0[32] = {0};
-	char overhead_iv0[CALICO_STREAM_OVERHEAD];
-	char data_iv1[32] = {1};
-	char overhead_iv1[CALICO_STREAM_OVERHEAD];
-	char plaintext[32];
-	char overhead_iv_mod[CALICO_STREAM_OVERHEAD];
+	calico_stream stream;
 
 	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
 	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
 
-	assert(!calico_encrypt(&x, data_iv0, data_iv0, 32, overhead_iv0, sizeof(overhead_iv0)));
-	assert(!calico_encrypt(&x, data_iv1, data_iv1, 32, overhead_iv1, sizeof(overhead_iv1)));
+	for (int trial = 0; trial < 20; ++trial) {
+		const int bytes = (trial == 0) ? 0 : prng.Next() % BYTES;
+		const int max_piece = (trial & 1) ? 100 : 100000;
+		char header[CALICO_STREAM_HEADER], overhead[CALICO_STREAM_OVERHEAD];
+
+		// Encrypt in pieces, sometimes in-place
+		assert(!calico_stream_init(&stream, &x, CALICO_STREAM_ENCRYPT, header));
+		for (int offset = 0; offset < bytes;) {
+			int piece = prng.Next() % max_piece;
+			if (piece > bytes - offset) {
+				piece = bytes - offset;
+			}
 
-	memcpy(plaintext, data_iv0, 32);
-	assert(!calico_decrypt(&y, plaintext, 32, overhead_iv0, sizeof(overhead_iv0)));
+			if (trial & 2) {
+				memcpy(ciphertext + offset, plaintext + offset, piece);
+				assert(!calico_stream_update(&stream, ciphertext + offset, ciphertext + offset, piece));
+			} else {
+				assert(!calico_stream_update(&stream, ciphertext + offset, plaintext + offset, piece));
+			}
+			offset += piece;
+		}
+		assert(!calico_stream_final(&stream, overhead, sizeof(overhead)));
+
+		// The message is the same as calico_encrypt() would produce
+		if (trial % 5 == 4) {
+			memcpy(decrypted, ciphertext, bytes);
+			assert(!calico_decrypt(&y, decrypted, bytes, overhead, sizeof(overhead)));
+			assert(!memcmp(decrypted, plaintext, bytes));
+			continue;
+		}
 
-	// Use IV = 1, but keep the MAC the same as for IV = 0
+		// Forged overhead is rejected, without using up the IV
+		overhead[3] ^= 1;
+		assert(!calico_stream_init(&stream, &y, CALICO_STREAM_DECRYPT, header));
+		assert(!calico_stream_update(&stream, decrypted, ciphertext, bytes));
+		assert(calico_stream_final(&stream, overhead, sizeof(overhead)));
+		overhead[3] ^= 1;
+
+		// Decrypt in different pieces
+		assert(!calico_stream_init(&stream, &y, CALICO_STREAM_DECRYPT, header));
+		for (int offset = 0; offset < bytes;) {
+			int piece = prng.Next() % max_piece;
+			if (piece > bytes - offset) {
+				piece = bytes - offset;
+			}
 
-	memcpy(overhead_iv_mod, overhead_iv0, sizeof(overhead_iv_mod));
+			assert(!calico_stream_update(&stream, decrypted + offset, ciphertext + offset, piece));
+			offset += piece;
+		}
+		assert(!calico_stream_final(&stream, overhead, sizeof(overhead)));
 
-	assert(calico_decrypt(&y, data_iv0, 32, overhead_iv_mod, sizeof(overhead_iv_mod)));
+		assert(!memcmp(decrypted, plaintext, bytes));
+	}
+}
+
+// Split a buffer into a random number of segments, some of them empty
+static int RandomSegments(Abyssinian &prng, u8 *buffer, int bytes,
+						  calico_segment *segments, int max_segments)
+{
+	int count = 0, offset = 0;
+
+	while (count < max_segments - 1 && offset < bytes && prng.Next() % 8 != 0) {
+		int piece = prng.Next() % 300;
+		if (piece > bytes - offset) {
+			piece = bytes - offset;
+		}
+
+		segments[count].data = buffer + offset;
+		segments[count].bytes = piece;
+		++count;
+		offset += piece;
+	}
+
+	segments[count].data = buffer + offset;
+	segments[count].bytes = bytes - offset;
+
+	return count + 1;
 }
 
 /*
- * Test for key ratcheting
+ * Verify that scatter-gather encryption matches the contiguous functions
  */
-void RatchetKeyTest() {
-	cout << "This is testing the forward secrecy feature of Calico.  Normally the rekeying interval is two minutes.  But for this test the Makefile has changed the rekeying interval to 1 second.  Turning on CAT_VERBOSE_CALICO helps visualize what is going on.  Note that in this protocol the client initiates the key ratcheting on its timer and the server ratchets in acknowledgement." << endl;
+void ScatterGatherTest() {
+	static const int BYTES = 3000;
+	static const int MAX_SEGMENTS = 20;
 
-	char key[32] = {9};
-	calico_state x, y;
+	u8 plaintext[BYTES], expected[BYTES], ciphertext[BYTES], decrypted[BYTES];
+	calico_segment in[MAX_SEGMENTS], out[MAX_SEGMENTS];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	char key[32] = {5};
+	calico_state x, reference, y;
 
 	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&reference, sizeof(reference), CALICO_INITIATOR, key, sizeof(key)));
 	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
 
-	char orig[32] = {0};
+	for (int trial = 0; trial < 1000; ++trial) {
+		const int bytes = prng.Next() % BYTES;
+		const int overhead_size = (trial & 1) ? CALICO_STREAM_OVERHEAD : CALICO_DATAGRAM_OVERHEAD;
+		char overhead[CALICO_DATAGRAM_OVERHEAD], expected_overhead[CALICO_DATAGRAM_OVERHEAD];
 
-	u32 t0 = m_clock.msec();
+		for (int ii = 0; ii < bytes; ++ii) {
+			plaintext[ii] = (u8)prng.Next();
+		}
 
-	while ((u32)(m_clock.msec() - t0) < 20000) {
-		char c2s_data[32] = {0};
-		char c2s_over[CALICO_STREAM_OVERHEAD];
-		char s2c_data[32] = {0};
-		char s2c_over[CALICO_STREAM_OVERHEAD];
+		// Output is identical to calico_encrypt()
+		assert(!calico_encrypt(&reference, expected, plaintext, bytes, expected_overhead, overhead_size));
 
-		cout << "- c2s transmit" << endl;
-		assert(!calico_encrypt(&x, c2s_data, c2s_data, 32, c2s_over, sizeof(c2s_over)));
+		const int in_count = RandomSegments(prng, plaintext, bytes, in, MAX_SEGMENTS);
+		const int out_count = RandomSegments(prng, ciphertext, bytes, out, MAX_SEGMENTS);
+		assert(!calico_encryptv(&x, out, out_count, in, in_count, overhead, overhead_size));
 
-		Clock::sleep(137);
+		assert(!memcmp(ciphertext, expected, bytes));
+		assert(!memcmp(overhead, expected_overhead, overhead_size));
 
-		cout << "-- server receiving" << endl;
-		assert(!calico_decrypt(&y, c2s_data, 32, c2s_over, sizeof(c2s_over)));
-		assert(SecureEqual(c2s_data, orig, sizeof(c2s_data)));
+		// Forged messages are rejected before any output is written
+		if (bytes >= 8 && trial % 3 == 0) {
+			memset(decrypted, 0, bytes);
 
-		cout << "- s2c transmit" << endl;
-		assert(!calico_encrypt(&y, s2c_data, s2c_data, 32, s2c_over, sizeof(s2c_over)));
+			// Flip a bit in one of the whole words, since the final partial
+			// word is mixed with sign extension like the original SipHash code
+			ciphertext[prng.Next() % (bytes & ~7)] ^= 1;
 
-		Clock::sleep(122);
+			const int forged_count = RandomSegments(prng, ciphertext, bytes, in, MAX_SEGMENTS);
+			assert(calico_decryptv(&y, out, RandomSegments(prng, decrypted, bytes, out, MAX_SEGMENTS), in, forged_count, overhead, overhead_size));
 
-		cout << "-- client receiving" << endl;
-		assert(!calico_decrypt(&x, s2c_data, 32, s2c_over, sizeof(s2c_over)));
-		assert(SecureEqual(s2c_data, orig, sizeof(s2c_data)));
+			for (int ii = 0; ii < bytes; ++ii) {
+				assert(decrypted[ii] == 0);
+			}
 
-		Clock::sleep(15);
+			memcpy(ciphertext, expected, bytes);
+		}
+
+		// Decrypt with different segments, sometimes in-place
+		const int ct_count = RandomSegments(prng, ciphertext, bytes, in, MAX_SEGMENTS);
+		if (trial & 2) {
+			assert(!calico_decryptv(&y, in, ct_count, in, ct_count, overhead, overhead_size));
+			assert(!memcmp(ciphertext, plaintext, bytes));
+		} else {
+			const int pt_count = RandomSegments(prng, decrypted, bytes, out, MAX_SEGMENTS);
+			assert(!calico_decryptv(&y, out, pt_count, in, ct_count, overhead, overhead_size));
+			assert(!memcmp(decrypted, plaintext, bytes));
+		}
+	}
+
+	// Segments that do not add up to the same length are rejected
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	in[0].data = plaintext;
+	in[0].bytes = 100;
+	out[0].data = ciphertext;
+	out[0].bytes = 99;
+	assert(calico_encryptv(&x, out, 1, in, 1, overhead, sizeof(overhead)));
+	in[0].bytes = -1;
+	assert(calico_encryptv(&x, in, 1, in, 1, overhead, sizeof(overhead)));
+}
+
+/*
+ * Verify associated data is authenticated and does not change plain messages
+ */
+void AssociatedDataTest() {
+	static const int BYTES = 2000;
+
+	u8 plaintext[BYTES], ciphertext[BYTES], expected[BYTES];
+	u8 ad[64], expected_ad[64];
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	char key[32] = {6};
+	calico_state x, reference, y;
+
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&reference, sizeof(reference), CALICO_INITIATOR, key, sizeof(key)));
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	for (int trial = 0; trial < 500; ++trial) {
+		// Cover both the in-place check and the one-pass decryption path
+		const int bytes = prng.Next() % ((trial & 2) ? BYTES : 200);
+		const int ad_bytes = (trial % 10 == 0) ? 0 : 1 + prng.Next() % 40;
+		const int overhead_size = (trial & 1) ? CALICO_STREAM_OVERHEAD : CALICO_DATAGRAM_OVERHEAD;
+		char overhead[CALICO_DATAGRAM_OVERHEAD], expected_overhead[CALICO_DATAGRAM_OVERHEAD];
+
+		for (int ii = 0; ii < bytes; ++ii) {
+			plaintext[ii] = (u8)prng.Next();
+		}
+		for (int ii = 0; ii < ad_bytes; ++ii) {
+			ad[ii] = (u8)prng.Next();
+		}
+		memcpy(expected_ad, ad, sizeof(ad));
+
+		assert(!calico_encrypt_ad(&x, ciphertext, plaintext, bytes, ad, ad_bytes, overhead, overhead_size));
+		assert(!calico_encrypt(&reference, expected, plaintext, bytes, expected_overhead, overhead_size));
+
+		// The ciphertext never changes, and the tag only changes with AD
+		assert(!memcmp(ciphertext, expected, bytes));
+		if (ad_bytes == 0) {
+			assert(!memcmp(overhead, expected_overhead, overhead_size));
+		}
+
+		if (ad_bytes > 0) {
+			// Changed AD is rejected
+			ad[prng.Next() % ad_bytes] ^= 1;
+			assert(calico_decrypt_ad(&y, ciphertext, bytes, ad, ad_bytes, overhead, overhead_size));
+			memcpy(ad, expected_ad, sizeof(ad));
+
+			// AD extended with the zero padding is rejected
+			ad[ad_bytes] = 0;
+			assert(calico_decrypt_ad(&y, ciphertext, bytes, ad, ad_bytes + 1, overhead, overhead_size));
+			memcpy(ad, expected_ad, sizeof(ad));
+
+			// Missing AD is rejected
+			assert(calico_decrypt(&y, ciphertext, bytes, overhead, overhead_size));
+
+			// Moving the start of the ciphertext into the AD is rejected
+			if (bytes > 0) {
+				memcpy(ad + ad_bytes, ciphertext, 1);
+				assert(calico_decrypt_ad(&y, ciphertext + 1, bytes - 1, ad, ad_bytes + 1, overhead, overhead_size));
+				memcpy(ad, expected_ad, sizeof(ad));
+			}
+
+			assert(!memcmp(ciphertext, expected, bytes));
+		}
+
+		assert(!calico_decrypt_ad(&y, ciphertext, bytes, ad, ad_bytes, overhead, overhead_size));
+		assert(!memcmp(ciphertext, plaintext, bytes));
+	}
+
+	// A message without AD is rejected if AD is given
+	char overhead[CALICO_DATAGRAM_OVERHEAD];
+	assert(!calico_encrypt(&x, ciphertext, plaintext, 100, overhead, sizeof(overhead)));
+	assert(calico_decrypt_ad(&y, ciphertext, 100, ad, 8, overhead, sizeof(overhead)));
+	assert(!calico_decrypt(&y, ciphertext, 100, overhead, sizeof(overhead)));
+
+	// Invalid AD parameters are rejected
+	assert(calico_encrypt_ad(&x, ciphertext, plaintext, 100, 0, 8, overhead, sizeof(overhead)));
+	assert(calico_encrypt_ad(&x, ciphertext, plaintext, 100, ad, -1, overhead, sizeof(overhead)));
+}
+
+struct SessionReaderWork {
+	void *table;
+	u32 sessions;
+	volatile u32 stop;
+	u32 misses;
+	u64 lookups;
+};
+
+// Look up sessions that are never evicted while another thread churns the rest
+static void SessionReader(void *param)
+{
+	SessionReaderWork *w = reinterpret_cast<SessionReaderWork *>( param );
+
+	for (u32 ii = 0; !atomic_load_acquire(&w->stop); ii = (ii + 1) % w->sessions) {
+		if (!calico_sessions_lookup(w->table, SessionID(ii))) {
+			w->misses++;
+		}
+		w->lookups++;
+	}
+}
+
+/*
+ * Verify the session table maps IDs to keyed state objects
+ */
+void SessionTableTest() {
+	static const unsigned int CAPACITY = 1000;
+	static const int SHARDS = 4;
+
+	static void *states[CAPACITY];
+	static bool live[CAPACITY];
+
+	assert(!calico_sessions_bytes(0, SHARDS));
+	assert(!calico_sessions_bytes(CAPACITY, 0));
+
+	const unsigned long long bytes = calico_sessions_bytes(CAPACITY, SHARDS);
+	assert(bytes > CAPACITY * sizeof(calico_state));
+
+	u8 *memory = new u8[bytes];
+	assert(calico_sessions_init(memory, bytes - 1, CAPACITY, SHARDS));
+	assert(!calico_sessions_init(memory, bytes, CAPACITY, SHARDS));
+
+	Abyssinian prng;
+	prng.Initialize(m_clock.msec(), Clock::cycles());
+
+	char key[32] = {7};
+	calico_state x;
+	assert(!calico_key(&x, sizeof(x), CALICO_INITIATOR, key, sizeof(key)));
+
+	// Fill the table
+	for (u32 ii = 0; ii < CAPACITY; ++ii) {
+		states[ii] = calico_sessions_insert(memory, SessionID(ii), CALICO_RESPONDER, key, sizeof(key));
+		assert(states[ii]);
+		live[ii] = true;
+
+		const int shard = calico_sessions_shard(memory, SessionID(ii));
+		assert(shard >= 0 && shard < SHARDS);
+	}
+
+	// Duplicates and bad keys are rejected
+	assert(!calico_sessions_insert(memory, SessionID(0), CALICO_RESPONDER, key, sizeof(key)));
+	assert(!calico_sessions_insert(memory, 12345, CALICO_RESPONDER, key, 5));
+	assert(!calico_sessions_lookup(memory, 12345));
+
+	// Each session has its own keyed state object
+	for (u32 ii = 0; ii < CAPACITY; ++ii) {
+		assert(calico_sessions_lookup(memory, SessionID(ii)) == states[ii]);
+
+		char data[32] = {1}, orig[32] = {1};
+		char overhead[CALICO_DATAGRAM_OVERHEAD];
+		assert(!calico_encrypt(&x, data, data, sizeof(data), overhead, sizeof(overhead)));
+		assert(!calico_decrypt(states[ii], data, sizeof(data), overhead, sizeof(overhead)));
+		assert(!memcmp(data, orig, sizeof(data)));
+	}
+
+	// Churn the table, which leaves tombstones behind in full buckets
+	for (int step = 0; step < 20000; ++step) {
+		const u32 ii = prng.Next() % CAPACITY;
+
+		if (live[ii]) {
+			assert(!calico_sessions_evict(memory, SessionID(ii)));
+			assert(calico_sessions_evict(memory, SessionID(ii)));
+			assert(!calico_sessions_lookup(memory, SessionID(ii)));
+			live[ii] = false;
+		} else {
+			states[ii] = calico_sessions_insert(memory, SessionID(ii), CALICO_RESPONDER, key, sizeof(key));
+			assert(states[ii]);
+			live[ii] = true;
+		}
+	}
+
+	for (u32 ii = 0; ii < CAPACITY; ++ii) {
+		assert(calico_sessions_lookup(memory, SessionID(ii)) == (live[ii] ? states[ii] : 0));
+	}
+
+	// Lookups on another thread always find the first half of the sessions
+	// while the second half is evicted and inserted again
+	for (u32 ii = 0; ii < CAPACITY / 2; ++ii) {
+		if (!live[ii]) {
+			assert(calico_sessions_insert(memory, SessionID(ii), CALICO_RESPONDER, key, sizeof(key)));
+			live[ii] = true;
+		}
+	}
+
+	SessionReaderWork w;
+	w.table = memory;
+	w.sessions = CAPACITY / 2;
+	w.stop = 0;
+	w.misses = 0;
+	w.lookups = 0;
+
+	thread_handle reader;
+	assert(thread_start(&reader, SessionReader, &w));
+
+	for (int step = 0; step < 20000 || w.lookups < 100000; ++step) {
+		const u32 ii = CAPACITY / 2 + prng.Next() % (CAPACITY / 2);
+
+		if (live[ii]) {
+			assert(!calico_sessions_evict(memory, SessionID(ii)));
+		} else {
+			assert(calico_sessions_insert(memory, SessionID(ii), CALICO_RESPONDER, key, sizeof(key)));
+		}
+		live[ii] = !live[ii];
+
+		if (step % 256 == 0) {
+			thread_yield();
+		}
+	}
+
+	atomic_store_release(&w.stop, 1);
+	thread_join(&reader);
+
+	assert(w.misses == 0);
+
+	calico_sessions_cleanup(memory);
+	assert(!calico_sessions_lookup(memory, SessionID(0)));
+
+	delete []memory;
+}
+
+struct PoolThreadWork {
+	calico_pool *pool;
+	void **objects;
+	int count;
+};
+
+// Allocate and free objects through a cache of this thread's own
+static void PoolThread(void *param)
+{
+	PoolThreadWork *w = reinterpret_cast<PoolThreadWork *>( param );
+
+	calico_pool_cache cache;
+	assert(!calico_pool_cache_init(w->pool, &cache));
+
+	char key[32] = {10};
+
+	for (int round = 0; round < 20; ++round) {
+		for (int ii = 0; ii < w->count; ++ii) {
+			w->objects[ii] = calico_pool_alloc(&cache);
+			assert(w->objects[ii]);
+			assert(!calico_key(w->objects[ii], sizeof(calico_state), CALICO_INITIATOR, key, sizeof(key)));
+		}
+
+		// Keep the last round for the main thread to check and free
+		if (round == 19) {
+			break;
+		}
+
+		for (int ii = 0; ii < w->count; ++ii) {
+			calico_pool_free(&cache, w->objects[ii]);
+		}
+	}
+
+	calico_pool_cache_cleanup(&cache);
+}
+
+/*
+ * Verify pooled state objects are aligned, distinct and erased when freed
+ */
+void StatePoolTest() {
+	static const int COUNT = 5000;
+	static const int THREADS = 4;
+
+	static void *objects[THREADS][COUNT];
+
+	calico_pool pool;
+	calico_pool_cache cache;
+
+	assert(calico_pool_init(&pool, 100));
+	assert(!calico_pool_init(&pool, sizeof(calico_state)));
+	assert(!calico_pool_cache_init(&pool, &cache));
+
+	char key[32] = {10};
+	calico_state y;
+	assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+
+	// Freed objects are erased, and reused first
+	void *S = calico_pool_alloc(&cache);
+	assert(S);
+	assert(((size_t)S & 63) == 0);
+	assert(!calico_key(S, sizeof(calico_state), CALICO_INITIATOR, key, sizeof(key)));
+	calico_pool_free(&cache, S);
+	assert(calico_pool_alloc(&cache) == S);
+	for (int ii = 0; ii < (int)sizeof(calico_state); ++ii) {
+		assert(((u8 *)S)[ii] == 0);
 	}
+	calico_pool_free(&cache, S);
+
+	// Several threads share the pool through their own caches
+	PoolThreadWork work[THREADS];
+	thread_handle threads[THREADS];
+
+	for (int tt = 0; tt < THREADS; ++tt) {
+		work[tt].pool = &pool;
+		work[tt].objects = objects[tt];
+		work[tt].count = COUNT;
+		assert(thread_start(&threads[tt], PoolThread, &work[tt]));
+	}
+	for (int tt = 0; tt < THREADS; ++tt) {
+		thread_join(&threads[tt]);
+	}
+
+	// Every object is aligned, distinct and usable
+	static void *all[THREADS * COUNT];
+	for (int tt = 0; tt < THREADS; ++tt) {
+		for (int ii = 0; ii < COUNT; ++ii) {
+			assert(((size_t)objects[tt][ii] & 63) == 0);
+			all[tt * COUNT + ii] = objects[tt][ii];
+		}
+	}
+	sort(all, all + THREADS * COUNT);
+	for (int ii = 1; ii < THREADS * COUNT; ++ii) {
+		assert((u8 *)all[ii] - (u8 *)all[ii - 1] >= (int)sizeof(calico_state));
+	}
+
+	for (int tt = 0; tt < THREADS; ++tt) {
+		for (int ii = 0; ii < COUNT; ii += 97) {
+			char data[40] = {3}, orig[40] = {3};
+			char overhead[CALICO_DATAGRAM_OVERHEAD];
+			assert(!calico_encrypt(objects[tt][ii], data, data, sizeof(data), overhead, sizeof(overhead)));
+			assert(!calico_decrypt(&y, data, sizeof(data), overhead, sizeof(overhead)));
+			assert(!memcmp(data, orig, sizeof(data)));
+
+			// The remote side only accepts each IV once
+			calico_cleanup(&y);
+			assert(!calico_key(&y, sizeof(y), CALICO_RESPONDER, key, sizeof(key)));
+		}
+	}
+
+	// Objects may be freed through a different cache than they came from
+	for (int tt = 0; tt < THREADS; ++tt) {
+		for (int ii = 0; ii < COUNT; ++ii) {
+			calico_pool_free(&cache, objects[tt][ii]);
+		}
+	}
+
+	calico_pool_cache_cleanup(&cache);
+	calico_pool_cleanup(&pool);
 }
 
 /*
@@ -537,20 +3716,62 @@ TestDescriptor TEST_FUNCTIONS[] = {
 	// Tests to run:
 
 	{ UninitializedTest, "Uninitialized" },
+	{ MisalignedStateTest, "Misaligned state objects" },
 
+	{ ChaChaKernelTest, "ChaCha Kernel Test" },
+	{ Blake2bKernelTest, "BLAKE2b Kernel Test" },
 	{ DataIntegrityTest, "Data Integrity" },
 	{ StreamModeTest, "Stream API Test" },
+	{ BatchEncryptTest, "Batch Encryption Test" },
+	{ BatchDecryptTest, "Batch Decryption Test" },
+	{ DecryptToTest, "Decrypt To Separate Buffer Test" },
+	{ SecureEraseTest, "Secure Erase Test" },
 
 	{ WrongKeyTest, "Wrong Key" },
 	{ ReplayAttackTest, "Replay Attack" },
 	{ ReplayWindowTest, "Replay Window" },
+	{ AntiReplayModelTest, "Anti-Replay Window Model Test" },
 	{ ReplayMACTest, "Replay MAC+Ciphertext with new IV test" },
+	{ TimestampRatchetTest, "Ratchet with caller timestamps test" },
+	{ StreamRatchetTest, "Stream key ratchet test" },
+	{ FullDuplexThreadTest, "Full-duplex threads test" },
+	{ ConcurrentDecryptTest, "Concurrent decryption test" },
+	{ ConcurrentRatchetStressTest, "Concurrent ratchet stress test" },
+	{ MultiSenderTest, "Multiple sender threads test" },
+	{ LargeMessageTest, "Large message test" },
+	{ LargeMessageRoundsTest, "Large message rounds test" },
+	{ ThreadPoolIdleTest, "Thread pool idle helpers test" },
+	{ IncrementalStreamTest, "Incremental stream test" },
+	{ ScatterGatherTest, "Scatter-gather test" },
+	{ AssociatedDataTest, "Associated data test" },
+	{ SessionTableTest, "Session table test" },
+	{ StatePoolTest, "State pool test" },
 	{ RatchetKeyTest, "Ratchet key test" },
 
+	{ BenchmarkClock, "Benchmark Clock" },
+	{ BenchmarkAntiReplay, "Benchmark Anti-Replay Window" },
+	{ BenchmarkReorderDrops, "Benchmark Reorder Drop Rate" },
+	{ BenchmarkBlake2b, "Benchmark BLAKE2b key ratchet" },
 	{ BenchmarkInitialize, "Benchmark Initialize()" },
 	{ BenchmarkEncrypt, "Benchmark Encrypt()" },
+	{ BenchmarkEncryptBatch, "Benchmark calico_encrypt_batch()" },
+	{ BenchmarkEncryptBulk, "Benchmark Encrypt() Bulk Data" },
+	{ BenchmarkChaChaBulk, "Benchmark ChaCha Kernels Bulk Data" },
 	{ BenchmarkDecryptFail, "Benchmark Decrypt() Rejection" },
 	{ BenchmarkDecryptSuccess, "Benchmark Decrypt() Accept" },
+	{ BenchmarkDecryptBulk, "Benchmark Decrypt() Bulk Data" },
+	{ BenchmarkDecryptBatch, "Benchmark calico_decrypt_batch()" },
+	{ BenchmarkFullDuplex, "Benchmark full-duplex threads" },
+	{ BenchmarkConcurrentDecrypt, "Benchmark calico_decrypt_concurrent()" },
+	{ BenchmarkMultiSender, "Benchmark calico_encrypt_sender()" },
+	{ BenchmarkLargeMessage, "Benchmark calico_encrypt_large()" },
+	{ BenchmarkIncrementalStream, "Benchmark calico_stream_update()" },
+	{ BenchmarkScatterGather, "Benchmark calico_encryptv()" },
+	{ BenchmarkAssociatedData, "Benchmark calico_encrypt_ad()" },
+	{ BenchmarkSessionTable, "Benchmark calico_sessions_lookup()" },
+	{ BenchmarkStatePool, "Benchmark calico_pool_alloc()" },
+	{ BenchmarkRatchetLatency, "Benchmark ratchet tail latency" },
+	{ BenchmarkSessionMemory, "Benchmark session memory and cache misses" },
 
 	{ StressTest, "2 Million Random Message Stress Test" },
 
@@ -570,6 +3791,8 @@ int main()
 
 	assert(!calico_init());
 
+	cout << "Selected kernels: " << calico_kernels() << endl << endl;
+
 	for (TestDescriptor *td = TEST_FUNCTIONS; td->function; ++td, ++index)
 	{
 		cout << "Running test " << index << " : " << td->description << endl;
@@ -2,12 +2,20 @@
 // Run the tester with `make mactest`
 
 #include "SipHash.hpp"
+#include "SipHashLanes.hpp"
+#include "SipHashState.hpp"
 #include "EndianNeutral.hpp"
+#include "Clock.hpp"
 using namespace cat;
 
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 using namespace std;
 
+static Clock m_clock;
+
 
 
 int crypto_auth_wrap_siphash( unsigned char *out, const unsigned char *in, unsigned long long inlen, const unsigned char *k )
@@ -242,17 +250,246 @@ int test_vectors()
 
 
 
+int test_lanes()
+{
+  u8 in[MAXLEN], k[16];
+  u8 out[8];
+  siphash_lane lanes[MAXLEN];
+  u64 tags[MAXLEN];
+  int i, j;
+  int ok = 1;
+
+  for( i = 0; i < 16; ++i ) k[i] = i;
+  for( i = 0; i < MAXLEN; ++i ) in[i] = i;
+
+  /* official vectors, all lengths in one call */
+  for( i = 0; i < MAXLEN; ++i )
+  {
+    lanes[i].key = (const char *)k;
+    lanes[i].data = in;
+    lanes[i].bytes = i;
+    lanes[i].ad = 0;
+  }
+
+  siphash24_lanes( lanes, MAXLEN, tags );
+
+  for( i = 0; i < MAXLEN; ++i )
+  {
+    U64TO8_LE( out, tags[i] );
+
+    if ( memcmp( out, vectors[i], 8 ) )
+    {
+      printf( "lane test vector failed for %d bytes\n", i );
+      ok = 0;
+    }
+  }
+
+  /* random keys, lengths, bytes above 0x7f and additional data */
+  static u8 keys[MAXLEN][16];
+  static u8 data[MAXLEN][256];
+
+  for( int trial = 0; trial < 1000; ++trial )
+  {
+    const int count = rand() % MAXLEN + 1;
+
+    for( i = 0; i < count; ++i )
+    {
+      for( j = 0; j < 16; ++j ) keys[i][j] = (u8)rand();
+      for( j = 0; j < 256; ++j ) data[i][j] = (u8)rand();
+
+      lanes[i].key = (const char *)keys[i];
+      lanes[i].data = data[i];
+      lanes[i].bytes = rand() % 257;
+      lanes[i].ad = ((u64)rand() << 32) ^ (u64)rand();
+    }
+
+    siphash24_lanes( lanes, count, tags );
+
+    for( i = 0; i < count; ++i )
+    {
+      if ( tags[i] != siphash24( lanes[i].key, lanes[i].data, lanes[i].bytes, lanes[i].ad ) )
+      {
+        printf( "lane mismatch for %d bytes\n", lanes[i].bytes );
+        ok = 0;
+      }
+    }
+  }
+
+  return ok;
+}
+
+int test_incremental()
+{
+  static u8 data[1024];
+  u8 k[16];
+  int i, len, split;
+  int ok = 1;
+
+  for( i = 0; i < 16; ++i ) k[i] = (u8)rand();
+  for( i = 0; i < 1024; ++i ) data[i] = (u8)rand();
+
+  for( len = 0; len < 1024; len += 1 + rand() % 16 )
+  {
+    const u64 ad = ((u64)rand() << 32) ^ (u64)rand();
+    const u64 expected = siphash24( (const char *)k, data, len, ad );
+
+    /* split the message into word-aligned pieces plus a final piece */
+    for( split = 0; split <= len; split += 8 * (1 + rand() % 8) )
+    {
+      siphash_state state;
+      siphash24_begin( &state, (const char *)k, ad );
+      siphash24_words( &state, data, split / 8 );
+
+      if ( siphash24_end( &state, data + split, len - split ) != expected )
+      {
+        printf( "incremental mismatch for %d bytes split at %d\n", len, split );
+        ok = 0;
+      }
+    }
+  }
+
+  return ok;
+}
+
+int test_stream()
+{
+  static u8 data[1024];
+  u8 k[16];
+  int i, len, offset;
+  int ok = 1;
+
+  for( i = 0; i < 16; ++i ) k[i] = (u8)rand();
+  for( i = 0; i < 1024; ++i ) data[i] = (u8)rand();
+
+  siphash_state prepared;
+  siphash24_begin( &prepared, (const char *)k );
+
+  for( len = 0; len < 1024; len += 1 + rand() % 16 )
+  {
+    const u64 ad = ((u64)rand() << 32) ^ (u64)rand();
+    const u64 expected = siphash24( (const char *)k, data, len, ad );
+
+    /* split the message into pieces of any length, including empty ones */
+    for( int trial = 0; trial < 8; ++trial )
+    {
+      siphash_stream stream;
+      siphash24_stream_begin( &stream, &prepared, ad );
+
+      for( offset = 0; offset < len; )
+      {
+        int piece = rand() % 20;
+        if ( piece > len - offset ) piece = len - offset;
+
+        siphash24_update( &stream, data + offset, piece );
+        offset += piece;
+      }
+
+      if ( siphash24_final( &stream ) != expected )
+      {
+        printf( "stream mismatch for %d bytes\n", len );
+        ok = 0;
+      }
+    }
+  }
+
+  return ok;
+}
+
+void benchmark_lanes()
+{
+	static const int BATCH = 32;
+	static const int ROUNDS = 100000;
+	static const int SIZES[3] = { 64, 256, 1400 };
+
+	static char data[BATCH][1400];
+	char key[16] = {0};
+	siphash_lane lanes[BATCH];
+	u64 tags[BATCH];
+	u64 sum = 0;
+
+	for (int kk = 0; kk < 3; ++kk) {
+		const int bytes = SIZES[kk];
+
+		for (int ii = 0; ii < BATCH; ++ii) {
+			lanes[ii].key = key;
+			lanes[ii].data = data[ii];
+			lanes[ii].bytes = bytes;
+			lanes[ii].ad = ii;
+		}
+
+		double t0 = m_clock.usec();
+
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			for (int jj = 0; jj < BATCH; ++jj) {
+				sum += siphash24(key, data[jj], bytes, jj);
+			}
+		}
 
+		double t1 = m_clock.usec();
+
+		for (int ii = 0; ii < ROUNDS; ++ii) {
+			siphash24_lanes(lanes, BATCH, tags);
+			sum += tags[0];
+		}
+
+		double t2 = m_clock.usec();
+
+		double single_mbps = bytes * (double)ROUNDS * BATCH / (t1 - t0);
+		double lanes_mbps = bytes * (double)ROUNDS * BATCH / (t2 - t1);
+
+		cout << "siphash24_lanes: " << bytes << " bytes at " << lanes_mbps << " MBPS (siphash24: " << single_mbps << " MBPS)" << endl;
+	}
+
+	// Keep the results live
+	if (sum == 0) {
+		cout << "(ignore)" << endl;
+	}
+}
 
 
 int main() {
 	cout << "SipHash unit tester" << endl;
 
+	m_clock.OnInitialize();
+
 	if (test_vectors() != 1) {
 		cout << "FAILURE" << endl;
 		return 1;
 	}
 
+	// Check every lane kernel that this CPU supports
+	const u32 features = cpu_features();
+	for (const cpu_kernel<siphash24_lanes_fn> *kernel = siphash24_lanes_kernels;; ++kernel) {
+		if ((kernel->required & features) == kernel->required) {
+			siphash24_lanes_select(kernel->required);
+
+			if (test_lanes() != 1) {
+				cout << "FAILURE in " << kernel->name << " lanes" << endl;
+				return 1;
+			}
+		}
+
+		if (!kernel->required) {
+			break;
+		}
+	}
+
+	siphash24_lanes_select(features);
+
+	if (test_incremental() != 1) {
+		cout << "FAILURE" << endl;
+		return 1;
+	}
+
+	if (test_stream() != 1) {
+		cout << "FAILURE" << endl;
+		return 1;
+	}
+
+	benchmark_lanes();
+
+	m_clock.OnFinalize();
+
 	cout << "SUCCESS" << endl;
 	return 0;
 }